@@ -30,6 +30,7 @@
 #include "../../MMDevice/DeviceBase.h"
 #include "../../MMDevice/DeviceUtils.h"
 #include "../../MMDevice/DeviceThreads.h"
+#include "../../MMDevice/SerialPipeline.h"
 #include <algorithm>
 #include <string>
 #include <vector>
@@ -170,6 +171,39 @@ int ASIHub::QueryCommandVerify(const char *command, const char *expectedReplyPre
    return DEVICE_OK;
 }
 
+int ASIHub::QueryCommandsVerify(const vector<string> &commands, const char *expectedReplyPrefix, vector<string> &answers)
+{
+   MMThreadGuard g(threadLock_);
+   RETURN_ON_MM_ERROR ( ClearComPort() );
+   CSerialPipeline pipeline(this, GetCoreCallback(), port_.c_str());
+   for (unsigned int i = 0; i < commands.size(); ++i)
+   {
+      pipeline.Queue(commands[i].c_str(), "\r", g_SerialTerminatorDefault);
+      serialCommand_ = commands[i];
+   }
+   int ret = pipeline.Execute();
+   answers.clear();
+   for (unsigned int i = 0; i < commands.size(); ++i)
+      answers.push_back(pipeline.GetAnswer(i));
+   if (ret != DEVICE_OK)
+   {
+      ClearComPort();  // don't leave late responses for the next query
+      return ret;
+   }
+   // if one doesn't match expected prefix, then look for ASI error code
+   size_t len = strlen(expectedReplyPrefix);
+   for (unsigned int i = 0; i < answers.size(); ++i)
+   {
+      serialAnswer_ = answers[i];
+      if (serialAnswer_.length() < len ||
+            serialAnswer_.substr(0, len).compare(expectedReplyPrefix) != 0)
+      {
+         return ParseErrorReply();
+      }
+   }
+   return DEVICE_OK;
+}
+
 int ASIHub::ParseErrorReply() const
 {
    if (serialAnswer_.length() > 3 && serialAnswer_.substr(0, 2).compare(":N") == 0)
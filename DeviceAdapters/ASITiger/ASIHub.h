@@ -86,6 +86,11 @@ public:
    int QueryCommandVerify(const string &command, const string &expectedReplyPrefix, const string &replyTerminator, const long delayMs)
       { return QueryCommandVerify(command.c_str(), expectedReplyPrefix.c_str(), replyTerminator.c_str(), delayMs); }
 
+   // QueryCommandsVerify sends all the commands before reading any response, so that they take about one round trip
+   // instead of one each, and makes sure each response starts with expectedReplyPrefix
+   // afterwards LastSerialAnswer() is the first response that didn't match, or else the last one
+   int QueryCommandsVerify(const vector<string> &commands, const char *expectedReplyPrefix, vector<string> &answers);
+
    // accessing serial commands and answers
    string LastSerialAnswer() const { return serialAnswer_; } // use with caution!; crashes to access something that doesn't exist!
    string LastSerialCommand() const { return serialCommand_; }
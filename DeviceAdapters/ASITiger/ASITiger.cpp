@@ -62,6 +62,9 @@ using namespace std;
 MODULE_API void InitializeModuleData()
 {
    RegisterDevice(g_TigerCommHubName, MM::HubDevice, g_TigerCommHubDescription);
+   // peripherals share the hub's serial state (e.g. the last answer), so
+   // they are locked with their hub; separate controllers run in parallel
+   SetDeviceLockGranularity(MM::LockPerHub);
 }
 
 
@@ -495,15 +495,17 @@ int CXYStage::getMinMaxSpeed(string axisLetter, double& minSpeed, double& maxSpe
 
 int CXYStage::GetPositionSteps(long& x, long& y)
 {
-   ostringstream command; command.str("");
-   command << "W " << axisLetterX_;
-   RETURN_ON_MM_ERROR ( hub_->QueryCommandVerify(command.str(),":A") );
+   // query both axes in one round trip; replies come back in order even if the axes are on different cards
+   vector<string> commands;
+   commands.push_back("W " + axisLetterX_);
+   commands.push_back("W " + axisLetterY_);
+   vector<string> answers;
+   RETURN_ON_MM_ERROR ( hub_->QueryCommandsVerify(commands, ":A", answers) );
    double tmp;
+   hub_->SetLastSerialAnswer(answers[0]);
    RETURN_ON_MM_ERROR ( hub_->ParseAnswerAfterPosition2(tmp) );
    x = (long)(tmp/unitMultX_/stepSizeXUm_);
-   command.str("");
-   command << "W " << axisLetterY_;
-   RETURN_ON_MM_ERROR ( hub_->QueryCommandVerify(command.str(),":A") );
+   hub_->SetLastSerialAnswer(answers[1]);
    RETURN_ON_MM_ERROR ( hub_->ParseAnswerAfterPosition2(tmp) );
    y = (long)(tmp/unitMultY_/stepSizeYUm_);
    return DEVICE_OK;
@@ -601,21 +603,23 @@ bool CXYStage::Busy()
    ostringstream command; command.str("");
    if (FirmwareVersionAtLeast(2.7)) // can use more accurate RS <axis>?
    {
-      command << "RS " << axisLetterX_ << "?";
-      if (hub_->QueryCommandVerify(command.str(),":A") != DEVICE_OK)  // say we aren't busy if we can't communicate
+      // query both axes in one round trip
+      vector<string> commands;
+      commands.push_back("RS " + axisLetterX_ + "?");
+      commands.push_back("RS " + axisLetterY_ + "?");
+      vector<string> answers;
+      if (hub_->QueryCommandsVerify(commands, ":A", answers) != DEVICE_OK)  // say we aren't busy if we can't communicate
          return false;
       char c;
-      if (hub_->GetAnswerCharAtPosition3(c) != DEVICE_OK)
-         return false;
-      if (c == 'B')
-         return true;
-      command.str("");
-      command << "RS " << axisLetterY_ << "?";
-      if (hub_->QueryCommandVerify(command.str(),":A") != DEVICE_OK)  // say we aren't busy if we can't communicate
-         return false;
-      if (hub_->GetAnswerCharAtPosition3(c) != DEVICE_OK)
-         return false;
-      return (c == 'B');
+      for (unsigned int i = 0; i < answers.size(); ++i)
+      {
+         hub_->SetLastSerialAnswer(answers[i]);
+         if (hub_->GetAnswerCharAtPosition3(c) != DEVICE_OK)
+            return false;
+         if (c == 'B')
+            return true;
+      }
+      return false;
    }
    else  // use LSB of the status byte as approximate status, not quite equivalent
    {
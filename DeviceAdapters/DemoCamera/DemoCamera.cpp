@@ -36,7 +36,9 @@
 
 using namespace std;
 const double CDemoCamera::nominalPixelSizeUm_ = 1.0;
+// Set by the demo stage, read by the camera; guarded by g_IntensityFactorLock_
 double g_IntensityFactor_ = 1.0;
+MMThreadLock g_IntensityFactorLock_;
 
 // External names used used by the rest of the system
 // to load particular device from the "DemoCamera.dll" library
@@ -93,6 +95,10 @@ MODULE_API void InitializeModuleData()
    RegisterDevice("ImageFlipY", MM::ImageProcessorDevice, "ImageFlipY");
    RegisterDevice("MedianFilter", MM::ImageProcessorDevice, "MedianFilter");
    RegisterDevice(g_HubDeviceName, MM::HubDevice, "DHub");
+   // The demo devices share only the focus-dependent intensity and the
+   // galvo's image callback, both of which have locks of their own, so e.g.
+   // moving the filter wheel need not hold up snapping an image
+   SetDeviceLockGranularity(MM::LockPerDevice);
 }
 
 MODULE_API MM::Device* CreateDevice(const char* deviceName)
@@ -1085,8 +1091,8 @@ int CDemoCamera::InsertImage()
    md.put("Camera", label);
    md.put(MM::g_Keyword_Metadata_StartTime, CDeviceUtils::ConvertToString(sequenceStartTime_.getMsec()));
    md.put(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((timeStamp - sequenceStartTime_).getMsec()));
-   md.put(MM::g_Keyword_Metadata_ROI_X, CDeviceUtils::ConvertToString( (long) roiX_)); 
-   md.put(MM::g_Keyword_Metadata_ROI_Y, CDeviceUtils::ConvertToString( (long) roiY_)); 
+   md.put(MM::g_Keyword_Metadata_ROI_X, (long) roiX_);
+   md.put(MM::g_Keyword_Metadata_ROI_Y, (long) roiY_);
 
    imageCounter_++;
 
@@ -1103,13 +1109,13 @@ int CDemoCamera::InsertImage()
    unsigned int h = GetImageHeight();
    unsigned int b = GetImageBytesPerPixel();
 
-   int ret = GetCoreCallback()->InsertImage(this, pI, w, h, b, nComponents_, md.Serialize().c_str());
+   int ret = GetCoreCallback()->InsertImage(this, pI, w, h, b, nComponents_, &md);
    if (!stopOnOverflow_ && ret == DEVICE_BUFFER_OVERFLOW)
    {
       // do not stop on overflow - just reset the buffer
       GetCoreCallback()->ClearImageBuffer(this);
       // don't process this same image again...
-      return GetCoreCallback()->InsertImage(this, pI, w, h, b, nComponents_, md.Serialize().c_str(), false);
+      return GetCoreCallback()->InsertImage(this, pI, w, h, b, nComponents_, &md, false);
    }
    else
    {
@@ -2068,6 +2074,12 @@ void CDemoCamera::GenerateSyntheticImage(ImgBuffer& img, double exp)
  
 
 	// for integer images: bitDepth_ is 8, 10, 12, 16 i.e. it is depth per component
+   double intensityFactor;
+   {
+      MMThreadGuard g(g_IntensityFactorLock_);
+      intensityFactor = g_IntensityFactor_;
+   }
+
    long maxValue = (1L << bitDepth_)-1;
 
 	long pixelsToDrop = 0;
@@ -2087,7 +2099,7 @@ void CDemoCamera::GenerateSyntheticImage(ImgBuffer& img, double exp)
          for (k=0; k<imgWidth; k++)
          {
             long lIndex = imgWidth*j + k;
-            unsigned char val = (unsigned char) (g_IntensityFactor_ * min(255.0, (pedestal + dAmp * sin(dPhase_ + dLinePhase + (2.0 * lSinePeriod * k) / lPeriod))));
+            unsigned char val = (unsigned char) (intensityFactor * min(255.0, (pedestal + dAmp * sin(dPhase_ + dLinePhase + (2.0 * lSinePeriod * k) / lPeriod))));
             if (val > maxDrawnVal) {
                 maxDrawnVal = val;
             }
@@ -2120,7 +2132,7 @@ void CDemoCamera::GenerateSyntheticImage(ImgBuffer& img, double exp)
          for (k=0; k<imgWidth; k++)
          {
             long lIndex = imgWidth*j + k;
-            unsigned short val = (unsigned short) (g_IntensityFactor_ * min((double)maxValue, pedestal + dAmp16 * sin(dPhase_ + dLinePhase + (2.0 * lSinePeriod * k) / lPeriod)));
+            unsigned short val = (unsigned short) (intensityFactor * min((double)maxValue, pedestal + dAmp16 * sin(dPhase_ + dLinePhase + (2.0 * lSinePeriod * k) / lPeriod)));
             if (val > maxDrawnVal) {
                 maxDrawnVal = val;
             }
@@ -2155,7 +2167,7 @@ void CDemoCamera::GenerateSyntheticImage(ImgBuffer& img, double exp)
          for (k=0; k<imgWidth; k++)
          {
             long lIndex = imgWidth*j + k;
-            double value =  (g_IntensityFactor_ * min(255.0, (pedestal + dAmp * sin(dPhase_ + dLinePhase + (2.0 * lSinePeriod * k) / lPeriod))));
+            double value =  (intensityFactor * min(255.0, (pedestal + dAmp * sin(dPhase_ + dLinePhase + (2.0 * lSinePeriod * k) / lPeriod))));
             if (value > maxDrawnVal) {
                 maxDrawnVal = value;
             }
@@ -3347,6 +3359,7 @@ int CDemoStage::SetPositionUm(double pos)
 void CDemoStage::SetIntensityFactor(double pos)
 {
    pos = fabs(pos);
+   MMThreadGuard g(g_IntensityFactorLock_);
    g_IntensityFactor_ = max(.1, min(1.0, 1.0 - .2 * log(pos)));
 }
 
@@ -4176,6 +4189,7 @@ int DemoGalvo::Initialize()
 
 int DemoGalvo::PointAndFire(double x, double y, double pulseTime_us) 
 {
+   MMThreadGuard g(stateLock_);
    SetPosition(x, y);
    MM::MMTime offset(pulseTime_us);
    pfExpirationTime_ = GetCurrentMMTime() + offset;
@@ -4193,6 +4207,7 @@ int DemoGalvo::SetSpotInterval(double /* pulseInterval_us */)
 
 int DemoGalvo::SetPosition(double x, double y) 
 {
+   MMThreadGuard g(stateLock_);
    currentX_ = x;
    currentY_ = y;
    return DEVICE_OK;
@@ -4200,6 +4215,7 @@ int DemoGalvo::SetPosition(double x, double y)
 
 int DemoGalvo::GetPosition(double& x, double& y) 
 {
+   MMThreadGuard g(stateLock_);
    x = currentX_;
    y = currentY_;
    return DEVICE_OK;
@@ -4207,12 +4223,14 @@ int DemoGalvo::GetPosition(double& x, double& y)
 
 int DemoGalvo::SetIlluminationState(bool on) 
 {
+   MMThreadGuard g(stateLock_);
    illuminationState_ = on;
    return DEVICE_OK;
 }
 
 int DemoGalvo::AddPolygonVertex(int polygonIndex, double x, double y) 
 {
+   MMThreadGuard g(stateLock_);
    std::vector<PointD> vertex = vertices_[polygonIndex];
    vertices_[polygonIndex].push_back(PointD(x, y));
    //std::ostringstream os;
@@ -4225,6 +4243,7 @@ int DemoGalvo::AddPolygonVertex(int polygonIndex, double x, double y)
 
 int DemoGalvo::DeletePolygons()
 {
+   MMThreadGuard g(stateLock_);
    vertices_.clear();
    return DEVICE_OK;
 }
@@ -4255,6 +4274,7 @@ int DemoGalvo::RunPolygons()
    }
    LogMessage(os.str().c_str());
    */
+   MMThreadGuard g(stateLock_);
    runROIS_ = true;
    return DEVICE_OK;
 }
@@ -4298,6 +4318,8 @@ double DemoGalvo::GetYRange()
  */
 int DemoGalvo::ChangePixels(ImgBuffer& img) 
 {
+   // Called on the camera's thread, while the galvo's own calls may run
+   MMThreadGuard g(stateLock_);
    if (!illuminationState_ && !pointAndFire_ && !runROIS_)
    {
       //std::ostringstream os;
@@ -4596,67 +4618,41 @@ int TransposeProcessor::OnInPlaceAlgorithm(MM::PropertyBase* pProp, MM::ActionTy
 
 int TransposeProcessor::Process(unsigned char *pBuffer, unsigned int width, unsigned int height, unsigned int byteDepth)
 {
-   int ret = DEVICE_OK;
-   // 
-   if( width != height)
-      return DEVICE_NOT_SUPPORTED; // problem with tranposing non-square images is that the image buffer
-   // will need to be modified by the image processor.
    if(busy_)
       return DEVICE_ERR;
- 
-   busy_ = true;
 
-   if( inPlace_)
+   busy_ = true;
+   int ret;
+   switch (byteDepth)
    {
-      if(  sizeof(unsigned char) == byteDepth)
-      {
-         TransposeSquareInPlace( (unsigned char*)pBuffer, width);
-      }
-      else if( sizeof(unsigned short) == byteDepth)
-      {
-         TransposeSquareInPlace( (unsigned short*)pBuffer, width);
-      }
-      else if( sizeof(unsigned long) == byteDepth)
-      {
-         TransposeSquareInPlace( (unsigned long*)pBuffer, width);
-      }
-      else if( sizeof(unsigned long long) == byteDepth)
-      {
-         TransposeSquareInPlace( (unsigned long long*)pBuffer, width);
-      }
-      else 
-      {
+      case 1:
+         ret = Transpose((uint8_t*)pBuffer, width, height);
+         break;
+      case 2:
+         ret = Transpose((uint16_t*)pBuffer, width, height);
+         break;
+      case 4:
+         ret = Transpose((uint32_t*)pBuffer, width, height);
+         break;
+      case 8:
+         ret = Transpose((uint64_t*)pBuffer, width, height);
+         break;
+      default:
          ret = DEVICE_NOT_SUPPORTED;
-      }
-   }
-   else
-   {
-      if( sizeof(unsigned char) == byteDepth)
-      {
-         ret = TransposeRectangleOutOfPlace( (unsigned char*)pBuffer, width, height);
-      }
-      else if( sizeof(unsigned short) == byteDepth)
-      {
-         ret = TransposeRectangleOutOfPlace( (unsigned short*)pBuffer, width, height);
-      }
-      else if( sizeof(unsigned long) == byteDepth)
-      {
-         ret = TransposeRectangleOutOfPlace( (unsigned long*)pBuffer, width, height);
-      }
-      else if( sizeof(unsigned long long) == byteDepth)
-      {
-         ret =  TransposeRectangleOutOfPlace( (unsigned long long*)pBuffer, width, height);
-      }
-      else
-      {
-         ret =  DEVICE_NOT_SUPPORTED;
-      }
    }
    busy_ = false;
 
    return ret;
 }
 
+int TransposeProcessor::GetOutputImageSize(unsigned width, unsigned height,
+      unsigned /* byteDepth */, unsigned& outWidth, unsigned& outHeight)
+{
+   outWidth = height;
+   outHeight = width;
+   return DEVICE_OK;
+}
+
 
 
 
@@ -4745,6 +4741,7 @@ int ImageFlipX::OnPerformanceTiming(MM::PropertyBase* pProp, MM::ActionType eAct
 
    if (eAct == MM::BeforeGet)
    {
+      MMThreadGuard g(stateLock_);
       pProp->Set( performanceTiming_.getUsec());
    }
    else if (eAct == MM::AfterSet)
@@ -4758,13 +4755,14 @@ int ImageFlipX::OnPerformanceTiming(MM::PropertyBase* pProp, MM::ActionType eAct
 
 int ImageFlipX::Process(unsigned char *pBuffer, unsigned int width, unsigned int height, unsigned int byteDepth)
 {
-   if(busy_)
-      return DEVICE_ERR;
-
+   // No busy check: being band-safe, this may be called concurrently on
+   // bands of the same image (the timing is then that of the last band)
    int ret = DEVICE_OK;
- 
-   busy_ = true;
-   performanceTiming_ = MM::MMTime(0.);
+
+   {
+      MMThreadGuard g(stateLock_);
+      ++activeCalls_;
+   }
    MM::MMTime  s0 = GetCurrentMMTime();
 
 
@@ -4789,8 +4787,12 @@ int ImageFlipX::Process(unsigned char *pBuffer, unsigned int width, unsigned int
       ret =  DEVICE_NOT_SUPPORTED;
    }
 
-   performanceTiming_ = GetCurrentMMTime() - s0;
-   busy_ = false;
+   MM::MMTime elapsed = GetCurrentMMTime() - s0;
+   {
+      MMThreadGuard g(stateLock_);
+      performanceTiming_ = elapsed;
+      --activeCalls_;
+   }
 
    return ret;
 }
@@ -4800,7 +4802,29 @@ int MedianFilter::Initialize()
 {
     CPropertyAction* pAct = new CPropertyAction (this, &MedianFilter::OnPerformanceTiming);
     (void)CreateFloatProperty("PeformanceTiming (microseconds)", 0, true, pAct);
-    (void)CreateStringProperty("BEWARE", "THIS FILTER MODIFIES DATA, EACH PIXEL IS REPLACED BY 3X3 NEIGHBORHOOD MEDIAN", true);
+    (void)CreateStringProperty("BEWARE", "THIS FILTER MODIFIES DATA, EACH PIXEL IS REPLACED BY ITS NEIGHBORHOOD MEDIAN", true);
+    pAct = new CPropertyAction (this, &MedianFilter::OnKernelSize);
+    (void)CreateIntegerProperty("KernelSize", kernelSize_, false, pAct);
+    for (long size = 3; size <= 15; size += 2)
+    {
+       std::ostringstream os;
+       os << size;
+       AddAllowedValue("KernelSize", os.str().c_str());
+    }
+   return DEVICE_OK;
+}
+
+int MedianFilter::OnKernelSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(kernelSize_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(kernelSize_);
+   }
+
    return DEVICE_OK;
 }
 
@@ -33,6 +33,8 @@
 #include "../../MMDevice/DeviceBase.h"
 #include "../../MMDevice/ImgBuffer.h"
 #include "../../MMDevice/DeviceThreads.h"
+#include "MedianKernels.h"
+#include "TransposeKernels.h"
 #include <string>
 #include <map>
 #include <algorithm>
@@ -752,11 +754,17 @@ public:
 
    bool Busy(void) { return busy_;};
 
-    // really primative image transpose algorithm which will work fine for non-square images... 
+   // Images that are not square are transposed through a temporary buffer,
+   // even when the in-place algorithm is selected (see TransposeKernels.h)
    template <typename PixelType>
-   int TransposeRectangleOutOfPlace(PixelType* pI, unsigned int width, unsigned int height)
+   int Transpose(PixelType* pI, unsigned int width, unsigned int height)
    {
-      int ret = DEVICE_OK;
+      if (inPlace_ && width == height)
+      {
+         TransposeSquareInPlace(pI, width);
+         return DEVICE_OK;
+      }
+
       unsigned long tsize = width*height*sizeof(PixelType);
       if( this->tempSize_ != tsize)
       {
@@ -764,49 +772,21 @@ public:
          {
             free(pTemp_);
             pTemp_ = NULL;
+            tempSize_ = 0;
          }
-         pTemp_ = (PixelType *)malloc(tsize);
-      }
-      if( NULL != pTemp_)
-      {
-         PixelType* pTmpImage = (PixelType *) pTemp_;
+         pTemp_ = malloc(tsize);
+         if( NULL == pTemp_)
+            return DEVICE_OUT_OF_MEMORY;
          tempSize_ = tsize;
-         for( unsigned long ix = 0; ix < width; ++ix)
-         {
-            for( unsigned long iy = 0; iy < height; ++iy)
-            {
-               pTmpImage[iy + ix*width] = pI[ ix + iy*height];
-            }
-         }
-         memcpy( pI, pTmpImage, tsize);
-      }
-      else
-      {
-         ret = DEVICE_ERR;
-      }
-
-      return ret;
-   }
-
-   
-   template <typename PixelType>
-   void TransposeSquareInPlace(PixelType* pI, unsigned int dim)
-   { 
-      PixelType tmp;
-      for( unsigned long ix = 0; ix < dim; ++ix)
-      {
-         for( unsigned long iy = ix; iy < dim; ++iy)
-         {
-            tmp = pI[iy*dim + ix];
-            pI[iy*dim +ix] = pI[ix*dim + iy];
-            pI[ix*dim +iy] = tmp; 
-         }
       }
-
-      return;
+      TransposeOutOfPlace(pI, (PixelType*)pTemp_, width, height);
+      memcpy(pI, pTemp_, tsize);
+      return DEVICE_OK;
    }
 
    int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+   int GetOutputImageSize(unsigned width, unsigned height, unsigned byteDepth,
+         unsigned& outWidth, unsigned& outHeight);
 
    // action interface
    // ----------------
@@ -829,14 +809,16 @@ private:
 class ImageFlipX : public CImageProcessorBase<ImageFlipX>
 {
 public:
-   ImageFlipX () :  busy_(false) {}
+   ImageFlipX () : activeCalls_(0), performanceTiming_(0.) {}
    ~ImageFlipX () {  }
 
    int Shutdown() {return DEVICE_OK;}
    void GetName(char* name) const {strcpy(name,"ImageFlipX");}
 
    int Initialize();
-   bool Busy(void) { return busy_;};
+   bool Busy(void) { MMThreadGuard g(stateLock_); return activeCalls_ > 0; }
+   // each row is flipped on its own
+   bool IsBandSafe() { return true; }
 
    template <typename PixelType>
    int Flip(PixelType* pI, unsigned int width, unsigned int height)
@@ -860,7 +842,9 @@ public:
    int OnPerformanceTiming(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
-   bool busy_;
+   // Guards the state below, which the bands of an image update concurrently
+   MMThreadLock stateLock_;
+   unsigned activeCalls_;
    MM::MMTime performanceTiming_;
 };
 
@@ -922,7 +906,7 @@ private:
 class MedianFilter : public CImageProcessorBase<MedianFilter>
 {
 public:
-   MedianFilter () : busy_(false), performanceTiming_(0.),pSmoothedIm_(0), sizeOfSmoothedIm_(0)
+   MedianFilter () : busy_(false), performanceTiming_(0.),pSmoothedIm_(0), sizeOfSmoothedIm_(0), kernelSize_(3)
    {
       // parent ID display
       CreateHubIDProperty();
@@ -935,20 +919,9 @@ public:
    int Initialize();
    bool Busy(void) { return busy_;};
 
-   // NOTE: this utility MODIFIES the argument, make a copy yourself if you want the original data preserved
-   template <class U> U FindMedian(std::vector<U>& values ) {
-      std::sort(values.begin(), values.end());
-      return values[(values.size())>>1];
-   };
-
-
    template <typename PixelType>
    int Filter(PixelType* pI, unsigned int width, unsigned int height)
    {
-      int ret = DEVICE_OK;
-      int x[9];
-      int y[9];
-
       const unsigned long thisSize = sizeof(*pI)*width*height;
       if( thisSize != sizeOfSmoothedIm_)
       {
@@ -966,71 +939,28 @@ public:
       }
 
       PixelType* pSmooth = (PixelType*) pSmoothedIm_;
+      if(NULL == pSmooth)
+         return DEVICE_ERR;
 
-      if(NULL != pSmooth)
-      {
-      /*Apply 3x3 median filter to reduce shot noise*/
-      for (unsigned int i=0; i<width; i++) {
-         for (unsigned int j=0; j<height; j++) {
-            x[0]=i-1;
-            y[0]=(j-1);
-            x[1]=i;
-            y[1]=(j-1);
-            x[2]=i+1;
-            y[2]=(j-1);
-            x[3]=i-1;
-            y[3]=(j);
-            x[4]=i;
-            y[4]=(j);
-            x[5]=i+1;
-            y[5]=(j);
-            x[6]=i-1;
-            y[6]=(j+1);
-            x[7]=i;
-            y[7]=(j+1);
-            x[8]=i+1;
-            y[8]=(j+1);
-            // truncate the median filter window  -- duplicate edge points
-            // this could be more efficient, we could fill in the interior image [1,w0-1]x[1,h0-1] then explicitly fill in the edge pixels.
-            // also the temporary image could be as small as 2 rasters of the image
-            for(int ij =0; ij < 9; ++ij)
-            {
-               if( x[ij] < 0)
-                  x[ij] = 0;
-               else if( int(width-1) < x[ij])
-                  x[ij] = int(width-1);
-               if( y[ij] < 0)
-                  y[ij] = 0;
-               else if( int(height-1) < y[ij])
-                  y[ij] = (int)(height-1);
-            }
-            std::vector<PixelType> windo;
-            for(int ij = 0; ij < 9; ++ij)
-            {
-               windo.push_back(pI[ x[ij] + width*y[ij]]);
-            }
-            pSmooth[i + j*width] = FindMedian(windo);
-         }
-      }
-
+      // Sorting network for 3x3, histograms for larger kernels; bands of
+      // rows are filtered in parallel (see MedianKernels.h)
+      RunMedianFilter(pI, pSmooth, (int)width, (int)height, (int)kernelSize_);
       memcpy( pI, pSmoothedIm_, thisSize);
-      }
-      else
-         ret = DEVICE_ERR;
-
-      return ret;
+      return DEVICE_OK;
    }
    int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
 
    // action interface
    // ----------------
    int OnPerformanceTiming(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnKernelSize(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
    bool busy_;
    MM::MMTime performanceTiming_;
    void*  pSmoothedIm_;
    unsigned long sizeOfSmoothedIm_;
+   long kernelSize_;
    
 
 
@@ -1159,6 +1089,8 @@ private:
    void GetBoundingBox(std::vector<Point>& vertex, std::vector<Point>& bBox);
    bool InBoundingBox(std::vector<Point> boundingBox, Point testPoint);
 
+   // Guards the state below that ChangePixels() reads
+   MMThreadLock stateLock_;
    std::map<int, std::vector<PointD> > vertices_;
    MM::MMTime pfExpirationTime_;
    bool initialized_;
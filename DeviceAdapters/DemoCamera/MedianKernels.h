@@ -0,0 +1,453 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MedianKernels.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Median filters used by the DemoCamera MedianFilter processor
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _MEDIANKERNELS_H_
+#define _MEDIANKERNELS_H_
+
+#include "../../MMDevice/RowBands.h"
+
+#include <algorithm>
+#include <vector>
+
+// All filters treat pixels outside the image as copies of the nearest edge
+// pixel, and take element (n*n)/2 of the sorted n x n window as the median.
+
+inline int ClampIndex(int i, int size)
+{
+   return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// 3x3 median
+// Each column of three pixels is sorted once, with a three-element sorting
+// network, and shared by the three windows that contain it. The median of a
+// window is then the median of the largest of the column minima, the median
+// of the column middles and the smallest of the column maxima.
+//////////////////////////////////////////////////////////////////////////////
+template <typename T>
+class Median3x3Task : public RowBandTask
+{
+public:
+   Median3x3Task(const T* in, T* out, int width, int height) :
+      in_(in), out_(out), width_(width), height_(height)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      for (int y = (int)beginRow; y < (int)endRow; ++y)
+      {
+         // The edge rows stand in for the rows outside the image
+         const T* above = in_ + ClampIndex(y - 1, height_) * width_;
+         const T* row = in_ + y * width_;
+         const T* below = in_ + ClampIndex(y + 1, height_) * width_;
+         T* out = out_ + y * width_;
+
+         Column left = SortColumn(above, row, below, 0);
+         Column center = left;
+         Column right = SortColumn(above, row, below, width_ > 1 ? 1 : 0);
+         int x = 0;
+         for (; x + 2 < width_; ++x)
+         {
+            out[x] = Median(left, center, right);
+            left = center;
+            center = right;
+            right = SortColumn(above, row, below, x + 2);
+         }
+         // The last column stands in for the one past the edge
+         for (; x < width_; ++x)
+         {
+            out[x] = Median(left, center, right);
+            left = center;
+            center = right;
+         }
+      }
+   }
+
+private:
+   struct Column
+   {
+      T lo, mid, hi;
+   };
+
+   static void SortPair(T& a, T& b)
+   {
+      T lo = std::min(a, b);
+      b = std::max(a, b);
+      a = lo;
+   }
+
+   static T Median3(T a, T b, T c)
+   {
+      return std::max(std::min(a, b), std::min(std::max(a, b), c));
+   }
+
+   static Column SortColumn(const T* above, const T* row, const T* below, int x)
+   {
+      Column c;
+      c.lo = above[x];
+      c.mid = row[x];
+      c.hi = below[x];
+      SortPair(c.lo, c.mid);
+      SortPair(c.mid, c.hi);
+      SortPair(c.lo, c.mid);
+      return c;
+   }
+
+   static T Median(const Column& a, const Column& b, const Column& c)
+   {
+      return Median3(std::max(std::max(a.lo, b.lo), c.lo),
+            Median3(a.mid, b.mid, c.mid),
+            std::min(std::min(a.hi, b.hi), c.hi));
+   }
+
+   const T* in_;
+   T* out_;
+   int width_;
+   int height_;
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Constant-time median for 8-bit images
+// S. Perreault and P. Hebert, "Median Filtering in Constant Time", IEEE
+// Trans. Image Processing 16(9), 2007. Each band keeps a histogram of every
+// image column over the height of the window, and the window histogram is
+// moved along a row by adding one column histogram and removing another, so
+// that the cost per pixel does not depend on the kernel size. Histograms have
+// 16 coarse bins and 256 fine bins; the fine bins of the window are only
+// brought up to date for the coarse bin that holds the median.
+//////////////////////////////////////////////////////////////////////////////
+class ConstantTimeMedianTask : public RowBandTask
+{
+public:
+   ConstantTimeMedianTask(const unsigned char* in, unsigned char* out,
+         int width, int height, int radius) :
+      in_(in), out_(out), width_(width), height_(height), radius_(radius)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      if (beginRow >= endRow)
+         return;
+      std::vector<unsigned short> columnCoarse(width_ * coarseBins, 0);
+      std::vector<unsigned short> columnFine(width_ * fineBins, 0);
+      for (int dy = -radius_; dy <= radius_; ++dy)
+         UpdateColumns(columnCoarse, columnFine, (int)beginRow + dy, 1);
+
+      for (int y = (int)beginRow; y < (int)endRow; ++y)
+      {
+         if (y > (int)beginRow)
+         {
+            UpdateColumns(columnCoarse, columnFine, y - 1 - radius_, -1);
+            UpdateColumns(columnCoarse, columnFine, y + radius_, 1);
+         }
+         FilterRow(&columnCoarse[0], &columnFine[0], out_ + y * width_);
+      }
+   }
+
+private:
+   enum { coarseBins = 16, fineBins = 256, fineBinsPerCoarse = 16 };
+
+   void UpdateColumns(std::vector<unsigned short>& columnCoarse,
+         std::vector<unsigned short>& columnFine, int y, int delta)
+   {
+      const unsigned char* row = in_ + ClampIndex(y, height_) * width_;
+      for (int x = 0; x < width_; ++x)
+      {
+         columnCoarse[x * coarseBins + (row[x] >> 4)] += (unsigned short)delta;
+         columnFine[x * fineBins + row[x]] += (unsigned short)delta;
+      }
+   }
+
+   void FilterRow(const unsigned short* columnCoarse,
+         const unsigned short* columnFine, unsigned char* out)
+   {
+      const int size = 2 * radius_ + 1;
+      const int medianRank = (size * size) / 2;
+
+      unsigned short coarse[coarseBins];
+      unsigned short fine[fineBins];
+      // Position at which the fine bins of each coarse bin were last updated
+      int fineX[coarseBins];
+      std::fill(coarse, coarse + coarseBins, (unsigned short)0);
+      std::fill(fineX, fineX + coarseBins, -1);
+      for (int dx = -radius_; dx <= radius_; ++dx)
+         AddBins(coarse, columnCoarse + ClampIndex(dx, width_) * coarseBins,
+               coarseBins, 1);
+
+      for (int x = 0; x < width_; ++x)
+      {
+         if (x > 0)
+         {
+            AddBins(coarse, columnCoarse +
+                  ClampIndex(x + radius_, width_) * coarseBins, coarseBins, 1);
+            AddBins(coarse, columnCoarse +
+                  ClampIndex(x - 1 - radius_, width_) * coarseBins, coarseBins, -1);
+         }
+
+         int count = 0;
+         int b = 0;
+         while (count + coarse[b] <= medianRank)
+            count += coarse[b++];
+
+         UpdateFine(fine, fineX, columnFine, b, x);
+         int i = b * fineBinsPerCoarse;
+         while (count + fine[i] <= medianRank)
+            count += fine[i++];
+         out[x] = (unsigned char)i;
+      }
+   }
+
+   void UpdateFine(unsigned short* fine, int* fineX,
+         const unsigned short* columnFine, int b, int x)
+   {
+      unsigned short* bins = fine + b * fineBinsPerCoarse;
+      const int offset = b * fineBinsPerCoarse;
+      const int size = 2 * radius_ + 1;
+      if (fineX[b] < 0 || 2 * (x - fineX[b]) > size)
+      {
+         // Cheaper to rebuild from the columns of the window
+         std::fill(bins, bins + fineBinsPerCoarse, (unsigned short)0);
+         for (int dx = -radius_; dx <= radius_; ++dx)
+            AddBins(bins, columnFine + ClampIndex(x + dx, width_) * fineBins +
+                  offset, fineBinsPerCoarse, 1);
+      }
+      else
+      {
+         for (int p = fineX[b] + 1; p <= x; ++p)
+         {
+            AddBins(bins, columnFine + ClampIndex(p + radius_, width_) *
+                  fineBins + offset, fineBinsPerCoarse, 1);
+            AddBins(bins, columnFine + ClampIndex(p - 1 - radius_, width_) *
+                  fineBins + offset, fineBinsPerCoarse, -1);
+         }
+      }
+      fineX[b] = x;
+   }
+
+   static void AddBins(unsigned short* bins, const unsigned short* column,
+         int count, int sign)
+   {
+      if (sign > 0)
+         for (int i = 0; i < count; ++i)
+            bins[i] = (unsigned short)(bins[i] + column[i]);
+      else
+         for (int i = 0; i < count; ++i)
+            bins[i] = (unsigned short)(bins[i] - column[i]);
+   }
+
+   const unsigned char* in_;
+   unsigned char* out_;
+   int width_;
+   int height_;
+   int radius_;
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Sliding histogram median for 16-bit images
+// T. Huang, G. Yang and G. Tang, "A fast two-dimensional median filtering
+// algorithm", IEEE Trans. ASSP 27(1), 1979. Column histograms as above would
+// take 128 kB per image column at this depth, so the window histogram is
+// moved along each row by adding and removing one column of pixels. A coarse
+// level of 256 bins tracks the median from pixel to pixel, and at most 256
+// fine bins are searched for each pixel.
+//////////////////////////////////////////////////////////////////////////////
+class SlidingHistogramMedianTask : public RowBandTask
+{
+public:
+   SlidingHistogramMedianTask(const unsigned short* in, unsigned short* out,
+         int width, int height, int radius) :
+      in_(in), out_(out), width_(width), height_(height), radius_(radius)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      const int size = 2 * radius_ + 1;
+      const int medianRank = (size * size) / 2;
+      // Emptied at the end of each row, which is cheaper than clearing them
+      std::vector<unsigned short> coarse(coarseBins, 0);
+      std::vector<unsigned short> fine(fineBins, 0);
+      std::vector<const unsigned short*> rows(size);
+
+      for (int y = (int)beginRow; y < (int)endRow; ++y)
+      {
+         for (int dy = -radius_; dy <= radius_; ++dy)
+            rows[dy + radius_] = in_ + ClampIndex(y + dy, height_) * width_;
+
+         // Coarse bin of the median, and number of pixels in lower bins
+         int b = 0;
+         int below = 0;
+         for (int dx = -radius_; dx <= radius_; ++dx)
+            AddColumn(rows, ClampIndex(dx, width_), coarse, fine, b, below);
+
+         unsigned short* out = out_ + y * width_;
+         for (int x = 0; x < width_; ++x)
+         {
+            if (x > 0)
+            {
+               AddColumn(rows, ClampIndex(x + radius_, width_), coarse, fine,
+                     b, below);
+               RemoveColumn(rows, ClampIndex(x - 1 - radius_, width_), coarse,
+                     fine, b, below);
+            }
+
+            while (below > medianRank)
+               below -= coarse[--b];
+            while (below + coarse[b] <= medianRank)
+               below += coarse[b++];
+
+            int count = below;
+            int i = b * fineBinsPerCoarse;
+            while (count + fine[i] <= medianRank)
+               count += fine[i++];
+            out[x] = (unsigned short)i;
+         }
+
+         for (int dx = -radius_; dx <= radius_; ++dx)
+            RemoveColumn(rows, ClampIndex(width_ - 1 + dx, width_), coarse,
+                  fine, b, below);
+      }
+   }
+
+private:
+   enum { coarseBins = 256, fineBins = 65536, fineBinsPerCoarse = 256 };
+
+   void AddColumn(const std::vector<const unsigned short*>& rows, int x,
+         std::vector<unsigned short>& coarse, std::vector<unsigned short>& fine,
+         int b, int& below)
+   {
+      for (std::size_t r = 0; r < rows.size(); ++r)
+      {
+         unsigned short v = rows[r][x];
+         ++coarse[v >> 8];
+         ++fine[v];
+         if ((v >> 8) < b)
+            ++below;
+      }
+   }
+
+   void RemoveColumn(const std::vector<const unsigned short*>& rows, int x,
+         std::vector<unsigned short>& coarse, std::vector<unsigned short>& fine,
+         int b, int& below)
+   {
+      for (std::size_t r = 0; r < rows.size(); ++r)
+      {
+         unsigned short v = rows[r][x];
+         --coarse[v >> 8];
+         --fine[v];
+         if ((v >> 8) < b)
+            --below;
+      }
+   }
+
+   const unsigned short* in_;
+   unsigned short* out_;
+   int width_;
+   int height_;
+   int radius_;
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Median by selection, for pixel types too wide for a histogram
+//////////////////////////////////////////////////////////////////////////////
+template <typename T>
+class SelectionMedianTask : public RowBandTask
+{
+public:
+   SelectionMedianTask(const T* in, T* out, int width, int height, int radius) :
+      in_(in), out_(out), width_(width), height_(height), radius_(radius)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      const int size = 2 * radius_ + 1;
+      std::vector<T> window(size * size);
+      const typename std::vector<T>::iterator median =
+         window.begin() + (size * size) / 2;
+      for (int y = (int)beginRow; y < (int)endRow; ++y)
+      {
+         for (int x = 0; x < width_; ++x)
+         {
+            typename std::vector<T>::iterator w = window.begin();
+            for (int dy = -radius_; dy <= radius_; ++dy)
+            {
+               const T* row = in_ + ClampIndex(y + dy, height_) * width_;
+               for (int dx = -radius_; dx <= radius_; ++dx)
+                  *w++ = row[ClampIndex(x + dx, width_)];
+            }
+            std::nth_element(window.begin(), median, window.end());
+            out_[y * width_ + x] = *median;
+         }
+      }
+   }
+
+private:
+   const T* in_;
+   T* out_;
+   int width_;
+   int height_;
+   int radius_;
+};
+
+
+template <typename T>
+inline void RunLargeMedianFilter(const T* in, T* out, int width, int height,
+      int radius)
+{
+   SelectionMedianTask<T> task(in, out, width, height, radius);
+   CRowBands::Run(task, height);
+}
+
+inline void RunLargeMedianFilter(const unsigned char* in, unsigned char* out,
+      int width, int height, int radius)
+{
+   ConstantTimeMedianTask task(in, out, width, height, radius);
+   CRowBands::Run(task, height);
+}
+
+inline void RunLargeMedianFilter(const unsigned short* in, unsigned short* out,
+      int width, int height, int radius)
+{
+   SlidingHistogramMedianTask task(in, out, width, height, radius);
+   CRowBands::Run(task, height);
+}
+
+/**
+ * Writes the kernelSize x kernelSize median of in to out (which must not
+ * overlap in), processing bands of rows in parallel. kernelSize is odd.
+ */
+template <typename T>
+void RunMedianFilter(const T* in, T* out, int width, int height, int kernelSize)
+{
+   if (kernelSize <= 3)
+   {
+      Median3x3Task<T> task(in, out, width, height);
+      CRowBands::Run(task, height);
+   }
+   else
+   {
+      RunLargeMedianFilter(in, out, width, height, kernelSize / 2);
+   }
+}
+
+#endif // _MEDIANKERNELS_H_
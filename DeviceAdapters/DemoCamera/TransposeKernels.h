@@ -0,0 +1,131 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          TransposeKernels.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Image transposes used by the DemoCamera TransposeProcessor
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _TRANSPOSEKERNELS_H_
+#define _TRANSPOSEKERNELS_H_
+
+#include <algorithm>
+
+// Both transposes are cache-oblivious: the image is halved along its longer
+// side until the blocks are small enough that a block of the source and a
+// block of the destination fit in the L1 cache together, whatever its size.
+// A naive transpose instead reads or writes one pixel per cache line on one
+// side, which makes it several times slower on images larger than the cache.
+
+const unsigned TransposeLeafSize = 32;
+
+
+// Writes the transpose of the width x height image in (rows beginRow to
+// endRow - 1, columns beginCol to endCol - 1 of it) to out, a height x width
+// image.
+template <typename T>
+void TransposeBlock(const T* in, T* out, unsigned width, unsigned height,
+      unsigned beginRow, unsigned endRow, unsigned beginCol, unsigned endCol)
+{
+   unsigned rows = endRow - beginRow;
+   unsigned cols = endCol - beginCol;
+   if (rows <= TransposeLeafSize && cols <= TransposeLeafSize)
+   {
+      for (unsigned c = beginCol; c < endCol; ++c)
+      {
+         T* outRow = out + c * height;
+         for (unsigned r = beginRow; r < endRow; ++r)
+            outRow[r] = in[r * width + c];
+      }
+   }
+   else if (rows >= cols)
+   {
+      unsigned mid = beginRow + rows / 2;
+      TransposeBlock(in, out, width, height, beginRow, mid, beginCol, endCol);
+      TransposeBlock(in, out, width, height, mid, endRow, beginCol, endCol);
+   }
+   else
+   {
+      unsigned mid = beginCol + cols / 2;
+      TransposeBlock(in, out, width, height, beginRow, endRow, beginCol, mid);
+      TransposeBlock(in, out, width, height, beginRow, endRow, mid, endCol);
+   }
+}
+
+// Transposes the width x height image in into the height x width image out,
+// which must not overlap it.
+template <typename T>
+void TransposeOutOfPlace(const T* in, T* out, unsigned width, unsigned height)
+{
+   TransposeBlock(in, out, width, height, 0, height, 0, width);
+}
+
+
+// Swaps the block at rows beginRow to endRow - 1, columns beginCol to
+// endCol - 1 of the dim x dim image p with its mirror image across the
+// diagonal, which it must not overlap.
+template <typename T>
+void SwapTransposedBlocks(T* p, unsigned dim,
+      unsigned beginRow, unsigned endRow, unsigned beginCol, unsigned endCol)
+{
+   unsigned rows = endRow - beginRow;
+   unsigned cols = endCol - beginCol;
+   if (rows <= TransposeLeafSize && cols <= TransposeLeafSize)
+   {
+      for (unsigned r = beginRow; r < endRow; ++r)
+         for (unsigned c = beginCol; c < endCol; ++c)
+            std::swap(p[r * dim + c], p[c * dim + r]);
+   }
+   else if (rows >= cols)
+   {
+      unsigned mid = beginRow + rows / 2;
+      SwapTransposedBlocks(p, dim, beginRow, mid, beginCol, endCol);
+      SwapTransposedBlocks(p, dim, mid, endRow, beginCol, endCol);
+   }
+   else
+   {
+      unsigned mid = beginCol + cols / 2;
+      SwapTransposedBlocks(p, dim, beginRow, endRow, beginCol, mid);
+      SwapTransposedBlocks(p, dim, beginRow, endRow, mid, endCol);
+   }
+}
+
+// Transposes the square block on the diagonal of the dim x dim image p that
+// covers rows and columns begin to end - 1.
+template <typename T>
+void TransposeDiagonalBlock(T* p, unsigned dim, unsigned begin, unsigned end)
+{
+   if (end - begin <= TransposeLeafSize)
+   {
+      for (unsigned r = begin; r < end; ++r)
+         for (unsigned c = r + 1; c < end; ++c)
+            std::swap(p[r * dim + c], p[c * dim + r]);
+      return;
+   }
+
+   unsigned mid = begin + (end - begin) / 2;
+   TransposeDiagonalBlock(p, dim, begin, mid);
+   TransposeDiagonalBlock(p, dim, mid, end);
+   SwapTransposedBlocks(p, dim, begin, mid, mid, end);
+}
+
+// Transposes the dim x dim image p in place.
+template <typename T>
+void TransposeSquareInPlace(T* p, unsigned dim)
+{
+   TransposeDiagonalBlock(p, dim, 0, dim);
+}
+
+#endif // _TRANSPOSEKERNELS_H_
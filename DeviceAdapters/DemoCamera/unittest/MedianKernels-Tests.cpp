@@ -0,0 +1,179 @@
+#include <gtest/gtest.h>
+
+#include "MedianKernels.h"
+
+#include <algorithm>
+#include <vector>
+
+
+namespace {
+
+// The definition: element (n*n)/2 of the sorted n x n window, with the
+// pixels outside the image taken from the nearest edge
+template <typename T>
+std::vector<T> BruteForceMedian(const std::vector<T>& in, int width,
+      int height, int kernelSize)
+{
+   const int radius = kernelSize / 2;
+   std::vector<T> out(in.size());
+   std::vector<T> window;
+   for (int y = 0; y < height; ++y)
+   {
+      for (int x = 0; x < width; ++x)
+      {
+         window.clear();
+         for (int dy = -radius; dy <= radius; ++dy)
+            for (int dx = -radius; dx <= radius; ++dx)
+               window.push_back(in[ClampIndex(y + dy, height) * width +
+                     ClampIndex(x + dx, width)]);
+         std::sort(window.begin(), window.end());
+         out[y * width + x] = window[window.size() / 2];
+      }
+   }
+   return out;
+}
+
+// Deterministic pixel values; with few distinct values, windows have ties
+template <typename T>
+std::vector<T> MakeImage(int width, int height, unsigned distinctValues,
+      unsigned seed)
+{
+   std::vector<T> image(width * height);
+   unsigned state = seed;
+   for (std::size_t i = 0; i < image.size(); ++i)
+   {
+      state = state * 1103515245u + 12345u;
+      unsigned value = (state >> 8) ^ (state << 13);
+      image[i] = distinctValues > 0 ?
+         static_cast<T>(value % distinctValues) : static_cast<T>(value);
+   }
+   return image;
+}
+
+template <typename T>
+void ExpectMatchesBruteForce(int width, int height, int kernelSize,
+      unsigned distinctValues)
+{
+   std::vector<T> in = MakeImage<T>(width, height, distinctValues,
+         width * 131 + height * 17 + kernelSize);
+   std::vector<T> out(in.size());
+   RunMedianFilter(&in[0], &out[0], width, height, kernelSize);
+   std::vector<T> expected = BruteForceMedian(in, width, height, kernelSize);
+   for (int i = 0; i < width * height; ++i)
+   {
+      ASSERT_EQ(expected[i], out[i]) << "pixel (" << i % width << ", " <<
+         i / width << ") of " << width << "x" << height << ", kernel " <<
+         kernelSize << ", " << distinctValues << " values";
+   }
+}
+
+template <typename T>
+void ExpectAllMatchBruteForce(unsigned distinctValues)
+{
+   // Single pixels, rows and columns, images smaller than the kernel, odd
+   // sizes, and images tall enough to be split into several bands
+   const int sizes[][2] = {
+      {1, 1}, {1, 9}, {9, 1}, {2, 2}, {3, 5}, {7, 4}, {17, 13}, {31, 64},
+   };
+   for (int kernelSize = 3; kernelSize <= 15; kernelSize += 2)
+   {
+      for (std::size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+      {
+         ExpectMatchesBruteForce<T>(sizes[s][0], sizes[s][1], kernelSize,
+               distinctValues);
+         if (::testing::Test::HasFatalFailure())
+            return;
+      }
+   }
+}
+
+} // anonymous namespace
+
+
+TEST(MedianKernelsTests, EightBit)
+{
+   ExpectAllMatchBruteForce<unsigned char>(0);
+}
+
+TEST(MedianKernelsTests, EightBitWithTies)
+{
+   ExpectAllMatchBruteForce<unsigned char>(3);
+}
+
+TEST(MedianKernelsTests, SixteenBit)
+{
+   ExpectAllMatchBruteForce<unsigned short>(0);
+}
+
+TEST(MedianKernelsTests, SixteenBitWithTies)
+{
+   // Values in neighbouring coarse bins
+   ExpectAllMatchBruteForce<unsigned short>(600);
+}
+
+TEST(MedianKernelsTests, ThirtyTwoBit)
+{
+   ExpectAllMatchBruteForce<unsigned int>(0);
+}
+
+TEST(MedianKernelsTests, ThirtyTwoBitWithTies)
+{
+   ExpectAllMatchBruteForce<unsigned int>(5);
+}
+
+// Each band starts its histograms or windows afresh; rows are split into
+// bands of a few rows, whatever the number of processors
+template <typename Task, typename T>
+void ExpectBandsMatchBruteForce(int kernelSize, unsigned distinctValues)
+{
+   const int width = 23;
+   const int height = 19;
+   std::vector<T> in = MakeImage<T>(width, height, distinctValues, 7);
+   std::vector<T> out(in.size());
+   Task task(&in[0], &out[0], width, height, kernelSize / 2);
+   CRowBands::Run(task, height, 5, 1);
+   ASSERT_TRUE(BruteForceMedian(in, width, height, kernelSize) == out) <<
+      "kernel " << kernelSize;
+}
+
+template <typename T>
+class Median3x3Adapter : public Median3x3Task<T>
+{
+public:
+   Median3x3Adapter(const T* in, T* out, int width, int height, int) :
+      Median3x3Task<T>(in, out, width, height)
+   {}
+};
+
+TEST(MedianKernelsTests, Bands)
+{
+   ExpectBandsMatchBruteForce<Median3x3Adapter<unsigned char>, unsigned char>(3, 0);
+   ExpectBandsMatchBruteForce<Median3x3Adapter<unsigned int>, unsigned int>(3, 0);
+   for (int kernelSize = 5; kernelSize <= 15; kernelSize += 2)
+   {
+      ExpectBandsMatchBruteForce<ConstantTimeMedianTask, unsigned char>(kernelSize, 0);
+      ExpectBandsMatchBruteForce<SlidingHistogramMedianTask, unsigned short>(kernelSize, 0);
+      ExpectBandsMatchBruteForce<SelectionMedianTask<unsigned int>, unsigned int>(kernelSize, 0);
+   }
+}
+
+TEST(MedianKernelsTests, ExtremeValues)
+{
+   // All pixels at the top of the range
+   std::vector<unsigned short> in(9 * 7, 65535);
+   std::vector<unsigned short> out(in.size());
+   RunMedianFilter(&in[0], &out[0], 9, 7, 5);
+   ASSERT_TRUE(out == in);
+
+   std::vector<unsigned char> in8(9 * 7, 255);
+   std::vector<unsigned char> out8(in8.size());
+   RunMedianFilter(&in8[0], &out8[0], 9, 7, 15);
+   ASSERT_TRUE(out8 == in8);
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -0,0 +1,137 @@
+#include <gtest/gtest.h>
+
+#include "TransposeKernels.h"
+
+#include <vector>
+
+
+namespace {
+
+// Pixels hold their index, truncated to the pixel type
+template <typename T>
+std::vector<T> MakeImage(unsigned width, unsigned height)
+{
+   std::vector<T> image(width * height);
+   for (std::size_t i = 0; i < image.size(); ++i)
+      image[i] = static_cast<T>(i * 2654435761u + 1);
+   return image;
+}
+
+template <typename T>
+void ExpectIsTranspose(const std::vector<T>& in, const std::vector<T>& out,
+      unsigned width, unsigned height)
+{
+   for (unsigned r = 0; r < height; ++r)
+      for (unsigned c = 0; c < width; ++c)
+         ASSERT_EQ(in[r * width + c], out[c * height + r]) << "pixel (" <<
+            c << ", " << r << ") of " << width << "x" << height;
+}
+
+// Sizes around the leaf size and its multiples, so that blocks are split
+// unevenly, and images much longer than they are wide
+const unsigned sizes[] = {
+   1, 2, 3, 31, 32, 33, 63, 64, 65, 97, 130,
+};
+const std::size_t sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+
+template <typename T>
+void ExpectOutOfPlaceMatchesDefinition()
+{
+   for (std::size_t w = 0; w < sizeCount; ++w)
+   {
+      for (std::size_t h = 0; h < sizeCount; ++h)
+      {
+         std::vector<T> in = MakeImage<T>(sizes[w], sizes[h]);
+         std::vector<T> out(in.size());
+         TransposeOutOfPlace(&in[0], &out[0], sizes[w], sizes[h]);
+         ExpectIsTranspose(in, out, sizes[w], sizes[h]);
+         if (::testing::Test::HasFatalFailure())
+            return;
+      }
+   }
+}
+
+template <typename T>
+void ExpectInPlaceMatchesDefinition()
+{
+   for (std::size_t d = 0; d < sizeCount; ++d)
+   {
+      std::vector<T> in = MakeImage<T>(sizes[d], sizes[d]);
+      std::vector<T> out(in);
+      TransposeSquareInPlace(&out[0], sizes[d]);
+      ExpectIsTranspose(in, out, sizes[d], sizes[d]);
+      if (::testing::Test::HasFatalFailure())
+         return;
+   }
+}
+
+} // anonymous namespace
+
+
+TEST(TransposeKernelsTests, OutOfPlace8Bit)
+{
+   ExpectOutOfPlaceMatchesDefinition<unsigned char>();
+}
+
+TEST(TransposeKernelsTests, OutOfPlace16Bit)
+{
+   ExpectOutOfPlaceMatchesDefinition<unsigned short>();
+}
+
+TEST(TransposeKernelsTests, OutOfPlace32Bit)
+{
+   ExpectOutOfPlaceMatchesDefinition<unsigned int>();
+}
+
+TEST(TransposeKernelsTests, OutOfPlace64Bit)
+{
+   ExpectOutOfPlaceMatchesDefinition<unsigned long long>();
+}
+
+TEST(TransposeKernelsTests, InPlace8Bit)
+{
+   ExpectInPlaceMatchesDefinition<unsigned char>();
+}
+
+TEST(TransposeKernelsTests, InPlace16Bit)
+{
+   ExpectInPlaceMatchesDefinition<unsigned short>();
+}
+
+TEST(TransposeKernelsTests, InPlace32Bit)
+{
+   ExpectInPlaceMatchesDefinition<unsigned int>();
+}
+
+TEST(TransposeKernelsTests, InPlace64Bit)
+{
+   ExpectInPlaceMatchesDefinition<unsigned long long>();
+}
+
+TEST(TransposeKernelsTests, OutOfPlaceWritesOnlyTheImage)
+{
+   const unsigned width = 45;
+   const unsigned height = 70;
+   std::vector<unsigned short> in = MakeImage<unsigned short>(width, height);
+   std::vector<unsigned short> out(width * height + 2, 0xABCD);
+   TransposeOutOfPlace(&in[0], &out[1], width, height);
+   ASSERT_EQ(0xABCD, out.front());
+   ASSERT_EQ(0xABCD, out.back());
+}
+
+TEST(TransposeKernelsTests, InPlaceTwiceIsIdentity)
+{
+   const unsigned dim = 77;
+   std::vector<unsigned int> in = MakeImage<unsigned int>(dim, dim);
+   std::vector<unsigned int> out(in);
+   TransposeSquareInPlace(&out[0], dim);
+   TransposeSquareInPlace(&out[0], dim);
+   ASSERT_TRUE(in == out);
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
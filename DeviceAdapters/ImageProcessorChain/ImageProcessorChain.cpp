@@ -26,6 +26,7 @@
 #include <string>
 #include <math.h>
 #include "../../MMDevice/ModuleInterface.h"
+#include "../../MMDevice/RowBands.h"
 #include <sstream>
 #include <algorithm>
 
@@ -61,6 +62,72 @@ MODULE_API void DeleteDevice(MM::Device* pDevice)
 }
 
 
+namespace {
+
+// Runs a band-safe processor on a band of rows
+class ProcessorBandTask : public RowBandTask
+{
+public:
+   ProcessorBandTask(MM::ImageProcessor* pP, unsigned char* pBuffer,
+         unsigned width, unsigned byteDepth) :
+      pP_(pP), pBuffer_(pBuffer), width_(width), byteDepth_(byteDepth),
+      result_(DEVICE_OK)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      int ret;
+      try
+      {
+         ret = pP_->Process(pBuffer_ + beginRow * width_ * byteDepth_, width_,
+               endRow - beginRow, byteDepth_);
+      }
+      catch(...)
+      {
+         ret = DEVICE_ERR;
+      }
+      if (ret != DEVICE_OK)
+      {
+         MMThreadGuard g(resultLock_);
+         if (result_ == DEVICE_OK)
+            result_ = ret;
+      }
+   }
+
+   // Returns the first error reported by a band, or DEVICE_OK
+   int GetResult()
+   {
+      MMThreadGuard g(resultLock_);
+      return result_;
+   }
+
+private:
+   MM::ImageProcessor* pP_;
+   unsigned char* pBuffer_;
+   unsigned width_;
+   unsigned byteDepth_;
+   MMThreadLock resultLock_;
+   int result_;
+};
+
+// Replaces width and height with the dimensions of the images produced by
+// the processor, if it changes them without changing their size
+void ApplyOutputImageSize(MM::ImageProcessor* pP, unsigned& width,
+      unsigned& height, unsigned byteDepth)
+{
+   unsigned outWidth = width;
+   unsigned outHeight = height;
+   if (pP->GetOutputImageSize(width, height, byteDepth, outWidth, outHeight) ==
+         DEVICE_OK && outWidth * outHeight == width * height)
+   {
+      width = outWidth;
+      height = outHeight;
+   }
+}
+
+} // anonymous namespace
+
+
 int ImageProcessorChain::Initialize()
 {
 
@@ -95,8 +162,20 @@ int ImageProcessorChain::Initialize()
       for (std::vector<std::string>::iterator iap = availableProcessors.begin();  iap != availableProcessors.end(); ++iap)
          AddAllowedValue(processorSlotName.str().c_str(), iap->c_str());
 
+      std::ostringstream timingName;
+      timingName << "ProcessorSlot" << ip << "-PerformanceTiming (microseconds)";
+      pAct = new CPropertyActionEx (this, &ImageProcessorChain::OnSlotTiming, ip);
+      (void)CreateFloatProperty(timingName.str().c_str(), 0, true, pAct);
    }
 
+   CPropertyAction* pTimingAct = new CPropertyAction (this, &ImageProcessorChain::OnPerformanceTiming);
+   (void)CreateFloatProperty("PerformanceTiming (microseconds)", 0, true, pTimingAct);
+
+   // Band-safe processors are run on bands of rows in parallel
+   CPropertyAction* pBandAct = new CPropertyAction (this, &ImageProcessorChain::OnBandThreads);
+   (void)CreateIntegerProperty("BandThreads (0 for automatic)", bandThreads_, false, pBandAct);
+   SetPropertyLimits("BandThreads (0 for automatic)", 0, 64);
+
    return DEVICE_OK;
 }
 
@@ -135,38 +214,139 @@ int ImageProcessorChain::OnProcessor(MM::PropertyBase* pProp, MM::ActionType eAc
    return DEVICE_OK;
 }
 
+int ImageProcessorChain::OnBandThreads(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(bandThreads_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(bandThreads_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ImageProcessorChain::OnSlotTiming(MM::PropertyBase* pProp, MM::ActionType eAct, long indexx)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard g(timingLock_);
+      pProp->Set(slotTimings_[indexx].getUsec());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      // -- it's read only!
+   }
+
+   return DEVICE_OK;
+}
+
+int ImageProcessorChain::OnPerformanceTiming(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard g(timingLock_);
+      pProp->Set(performanceTiming_.getUsec());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      // -- it's read only!
+   }
+
+   return DEVICE_OK;
+}
+
 
 int ImageProcessorChain::Process(unsigned char *pBuffer, unsigned int width, unsigned int height, unsigned int byteDepth)
 {
    int ret = DEVICE_OK;
    busy_ = true;
-
+   MM::MMTime start = GetCurrentMMTime();
 
    for( int islot = 0; islot < this->nSlots_; ++islot)
    {
+      {
+         MMThreadGuard g(timingLock_);
+         slotTimings_[islot] = MM::MMTime(0.);
+      }
       if( processors_.end() != processors_.find(islot))
       {
 
          MM::ImageProcessor* pP = processors_[islot];
          if( NULL != pP)
          {
+            MM::MMTime s0 = GetCurrentMMTime();
+            int result = DEVICE_OK;
             try
             {
-               pP->Process(pBuffer, width, height,byteDepth);
+               // Each processor sees the image as left by the one before it
+               unsigned outWidth = width;
+               unsigned outHeight = height;
+               ApplyOutputImageSize(pP, outWidth, outHeight, byteDepth);
+               if (pP->IsBandSafe())
+               {
+                  ProcessorBandTask task(pP, pBuffer, width, byteDepth);
+                  CRowBands::Run(task, height, (unsigned)bandThreads_);
+                  result = task.GetResult();
+               }
+               else
+               {
+                  result = pP->Process(pBuffer, width, height,byteDepth);
+               }
+               // A processor that fails leaves the image as it was
+               if (result == DEVICE_OK)
+               {
+                  width = outWidth;
+                  height = outHeight;
+               }
             }
             catch(...)
+            {
+               result = DEVICE_ERR;
+            }
+            MM::MMTime elapsed = GetCurrentMMTime() - s0;
+            {
+               MMThreadGuard g(timingLock_);
+               slotTimings_[islot] = elapsed;
+            }
+
+            if (result != DEVICE_OK)
             {
                std::ostringstream m;
                char name[MM::MaxStrLength];
                pP->GetName(name);
-               m << "Error in processor " << name;
+               m << "Error " << result << " in processor " << name;
                LogMessage(m.str().c_str(), false);
+               if (ret == DEVICE_OK)
+                  ret = result;
             }
          }
       }
    }
 
+   MM::MMTime elapsed = GetCurrentMMTime() - start;
+   {
+      MMThreadGuard g(timingLock_);
+      performanceTiming_ = elapsed;
+   }
    busy_ = false;
 
    return ret;
 }
+
+
+int ImageProcessorChain::GetOutputImageSize(unsigned width, unsigned height,
+      unsigned byteDepth, unsigned& outWidth, unsigned& outHeight)
+{
+   for( int islot = 0; islot < this->nSlots_; ++islot)
+   {
+      std::map< int, MM::ImageProcessor*>::iterator it = processors_.find(islot);
+      if( processors_.end() != it && NULL != it->second)
+         ApplyOutputImageSize(it->second, width, height, byteDepth);
+   }
+   outWidth = width;
+   outHeight = height;
+   return DEVICE_OK;
+}
@@ -31,6 +31,7 @@
 #include "../../MMDevice/DeviceThreads.h"
 #include <string>
 #include <map>
+#include <vector>
 
 
 
@@ -41,7 +42,8 @@
 class ImageProcessorChain : public CImageProcessorBase<ImageProcessorChain>
 {
 public:
-   ImageProcessorChain () : nSlots_(10), busy_(false) {}
+   ImageProcessorChain () : nSlots_(10), busy_(false), bandThreads_(0),
+      slotTimings_(nSlots_, MM::MMTime(0.)), performanceTiming_(0.) {}
    ~ImageProcessorChain () { }
 
    int Shutdown() {return DEVICE_OK;}
@@ -52,16 +54,28 @@ public:
    bool Busy(void) { return busy_;};
 
    int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+   int GetOutputImageSize(unsigned width, unsigned height, unsigned byteDepth,
+         unsigned& outWidth, unsigned& outHeight);
 
    // action interface
    // ----------------
    int OnProcessor(MM::PropertyBase* pProp, MM::ActionType eAct, long indexx);
+   int OnBandThreads(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSlotTiming(MM::PropertyBase* pProp, MM::ActionType eAct, long indexx);
+   int OnPerformanceTiming(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
    const int nSlots_;
    bool busy_;
    std::map< int, std::string> processorNames_;
    std::map< int, MM::ImageProcessor*> processors_;
+   // number of threads for band-safe processors, 0 for one per processor
+   long bandThreads_;
+   // Guards the timings, which Process() writes while the property getters
+   // read them on other threads
+   MMThreadLock timingLock_;
+   std::vector<MM::MMTime> slotTimings_;
+   MM::MMTime performanceTiming_;
 
    ImageProcessorChain& operator=( const ImageProcessorChain& ){ 
       return *this;
@@ -28,7 +28,10 @@
 #include <boost/asio.hpp>
 #include <boost/asio/serial_port.hpp>
 #include <boost/bind.hpp>
+#include <boost/chrono.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <deque>
 #include <exception>
@@ -286,7 +289,7 @@ public:
    {
       // clear read buffer;
       {
-         MMThreadGuard g(readBufferLock_);
+         boost::mutex::scoped_lock g(readBufferLock_);
          data_read_.clear();
       }
 
@@ -298,18 +301,43 @@ public:
    }
 
 
-   // read one character, ret. is false if no characters are available.
-   bool ReadOneCharacter(char& msg)
+   // Move up to len received characters to buf without waiting; returns the
+   // number of characters moved.
+   size_t ReadCharacters(char* buf, size_t len)
    {
-      bool retval = false;
-      MMThreadGuard g(readBufferLock_);
-      if (0 < data_read_.size())
+      boost::mutex::scoped_lock g(readBufferLock_);
+      size_t n = (std::min)(len, data_read_.size());
+      std::copy(data_read_.begin(), data_read_.begin() + n, buf);
+      data_read_.erase(data_read_.begin(), data_read_.begin() + n);
+      return n;
+   }
+
+   // Move received characters to answer[offset], advancing offset, until
+   // the terminator (if termLen is not 0) has been moved or offset reaches
+   // len. Characters after the terminator stay in the read buffer. If no
+   // characters have been received, wait for some until the deadline.
+   // Returns true if the terminator was found; it is matched against the
+   // end of the answer, so that it can span several calls.
+   bool ReadUntilTerminator(char* answer, size_t len, size_t& offset,
+         const char* term, size_t termLen,
+         const boost::chrono::steady_clock::time_point& deadline)
+   {
+      boost::mutex::scoped_lock g(readBufferLock_);
+      while (data_read_.empty())
+      {
+         if (dataReceived_.wait_until(g, deadline) == boost::cv_status::timeout)
+            break;
+      }
+      while (offset < len && !data_read_.empty())
       {
-         retval = true;
-         msg = data_read_.front();
+         char ch = data_read_.front();
          data_read_.pop_front();
+         answer[offset++] = ch;
+         if (termLen > 0 && offset >= termLen && ch == term[termLen - 1] &&
+               memcmp(answer + offset - termLen, term, termLen) == 0)
+            return true;
       }
-      return retval;
+      return false;
    }
 
    void ShutDownInProgress(const bool v){ shutDownInProgress_ = v;};
@@ -345,13 +373,10 @@ private:
       if (!error)
       { // read completed, so process the data
          {
-            MMThreadGuard g(readBufferLock_);
-            for(unsigned int ib = 0; ib < bytes_transferred; ++ib)
-            {
-               data_read_.push_back(read_msg_[ib]);
-            }
+            boost::mutex::scoped_lock g(readBufferLock_);
+            data_read_.insert(data_read_.end(), read_msg_, read_msg_ + bytes_transferred);
          }
-         CDeviceUtils::SleepMs(1);
+         dataReceived_.notify_all();
          ReadStart(); // start waiting for another asynchronous read again
       }
       else
@@ -448,7 +473,9 @@ private:
    SerialPort* pSerialPortAdapter_;
    std::string device_;
 
-   MMThreadLock readBufferLock_;
+   boost::mutex readBufferLock_;
+   // signaled when characters are added to data_read_
+   boost::condition_variable dataReceived_;
    MMThreadLock writeBufferLock_;
    MMThreadLock implementationLock_;
    bool shutDownInProgress_;
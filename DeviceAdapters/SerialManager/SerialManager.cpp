@@ -21,6 +21,7 @@
 //                Karl Hoover - Mark II - use boost, also simplify handling of terminators
 
 #include "SerialManager.h"
+#include "SerialReplay.h"
 
 #include "AsioClient.h"
 
@@ -283,15 +284,24 @@ MODULE_API void InitializeModuleData()
       it++;
    }
 
+   RegisterDevice(g_SerialReplayDeviceName, MM::SerialDevice,
+         "Serial port replaying recorded traffic");
 }
 
 MODULE_API MM::Device* CreateDevice(const char* deviceName)
 {
+   if (deviceName && strcmp(deviceName, g_SerialReplayDeviceName) == 0)
+      return new SerialReplay();
    return g_serialManager.CreatePort(deviceName);
 }
 
 MODULE_API void DeleteDevice(MM::Device* pDevice)
 {
+   if (dynamic_cast<SerialReplay*>(pDevice))
+   {
+      delete pDevice;
+      return;
+   }
    g_serialManager.DestroyPort(pDevice);
 }
 
@@ -766,66 +776,65 @@ int SerialPort::GetAnswer(char* answer, unsigned bufLen, const char* term)
       LogMessage("BUFFER_OVERRUN error occured!");
       return ERR_BUFFER_OVERRUN;
    }
-   std::ostringstream logMsg;
-   unsigned long answerOffset = 0;
    memset(answer,0,bufLen);
-   char theData = 0;
-
-   MM::MMTime startTime = GetCurrentMMTime();
-   MM::MMTime answerTimeout(answerTimeoutMs_ * 1000.0);
-   MM::MMTime nonTerminatedAnswerTimeout(5.0 * 1000.0); // For bug-compatibility
-   while ((GetCurrentMMTime() - startTime)  < answerTimeout)
-   {
-      bool anyRead =  pPort_->ReadOneCharacter(theData);
-      if (anyRead)
+   // leave room for the null character
+   const size_t capacity = bufLen - 1;
+   size_t answerOffset = 0;
+   const size_t termLen = term ? strlen(term) : 0;
+
+   // The reader sleeps until characters arrive, takes all of them up to the
+   // terminator at once, and checks only the end of the answer for the
+   // terminator
+   // The deadlines are on a monotonic clock, so that changes to the system
+   // time do not affect the timeout
+   using boost::chrono::steady_clock;
+   steady_clock::time_point startTime = steady_clock::now();
+   steady_clock::time_point deadline = startTime +
+      boost::chrono::microseconds(static_cast<long>(answerTimeoutMs_ * 1000.0));
+   // For bug-compatibility
+   steady_clock::time_point nonTerminatedDeadline = startTime + boost::chrono::seconds(5);
+   bool nonTerminated = (termLen == 0);
+   if (nonTerminated && nonTerminatedDeadline < deadline)
+      deadline = nonTerminatedDeadline;
+
+   for (;;)
+   {
+      if (pPort_->ReadUntilTerminator(answer, capacity, answerOffset,
+               term, termLen, deadline))
       {
-         if (bufLen <= answerOffset)
-         {
-            answer[answerOffset] = '\0';
-            LogMessage("BUFFER_OVERRUN error occured!");
-            return ERR_BUFFER_OVERRUN;
-         }
-         answer[answerOffset++] = theData;
+         LogAsciiCommunication("GetAnswer", true, answer);
+
+         // erase the terminator from the answer:
+         answer[answerOffset - termLen] = '\0';
+
+         return DEVICE_OK;
       }
-      else
+      if (answerOffset >= capacity)
       {
-         //Yield to other threads:
-         CDeviceUtils::SleepMs(1);
+         LogMessage("BUFFER_OVERRUN error occured!");
+         return ERR_BUFFER_OVERRUN;
       }
 
-      // look for the terminator, if any
-      if (term && term[0])
-      {
-         // check for terminating sequence
-         char* termPos = strstr(answer, term);
-         if (termPos != 0) // found the terminator
-         {
-            LogAsciiCommunication("GetAnswer", true, answer);
+      steady_clock::time_point now = steady_clock::now();
+      if (now < deadline)
+         continue;
 
-            // erase the terminator from the answer:
-            *termPos = '\0';
-
-            return DEVICE_OK;
-         }
-      }
-      else
+      if (nonTerminated && now >= nonTerminatedDeadline)
       {
          // XXX Shouldn't it be an error to not have a terminator?
          // TODO Make it a precondition check (immediate error) once we've made
          // sure that no device adapter calls us without a terminator. For now,
          // keep the behavior for the sake of bug-compatibility.
-
-         MM::MMTime elapsed = GetCurrentMMTime() - startTime;
-         if (elapsed > nonTerminatedAnswerTimeout)
-         {
-            LogAsciiCommunication("GetAnswer", true, answer);
-            long millisecs = static_cast<long>(elapsed.getMsec());
-            LogMessage(("GetAnswer without terminator returning after " +
-                     boost::lexical_cast<std::string>(millisecs) +
-                     "msec").c_str(), true);
-            return DEVICE_OK;
-         }
+         LogAsciiCommunication("GetAnswer", true, answer);
+         long millisecs = static_cast<long>(
+               boost::chrono::duration_cast<boost::chrono::milliseconds>(
+                  now - startTime).count());
+         LogMessage(("GetAnswer without terminator returning after " +
+                  boost::lexical_cast<std::string>(millisecs) +
+                  "msec").c_str(), true);
+         return DEVICE_OK;
       }
+      break;
    }
 
    LogMessage("TERM_TIMEOUT error occured!");
@@ -875,26 +884,8 @@ int SerialPort::Read(unsigned char* buf, unsigned long bufLen, unsigned long& ch
       memset(buf, 0, bufLen);
       charsRead = 0;
 
-      bool anyRead = false;
-      char theData = 0;
-      for (;;)
-      {
-         anyRead = pPort_->ReadOneCharacter(theData);
-         if (anyRead)
-         {
-            buf[charsRead] = (unsigned char)theData;
-            if (bufLen <= ++charsRead)
-            {
-               // buffer is full
-               break;
-            }
-         }
-         else
-         {
-            // no data was available
-            break;
-         }
-      }
+      charsRead = static_cast<unsigned long>(
+            pPort_->ReadCharacters(reinterpret_cast<char*>(buf), bufLen));
       if (0 < charsRead)
       {
          if (verbose_)
@@ -0,0 +1,738 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SerialReplay.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Serial port that plays back traffic recorded in a CoreLog,
+//                for running device adapters without the instrument
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "SerialReplay.h"
+#include "SerialManager.h"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+const char* g_SerialReplayDeviceName = "SerialReplay";
+
+namespace {
+
+boost::posix_time::ptime Now()
+{
+   return boost::posix_time::microsec_clock::universal_time();
+}
+
+int HexValue(char c)
+{
+   if (c >= '0' && c <= '9')
+      return c - '0';
+   if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+   if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+   return -1;
+}
+
+// Inverse of the escaping done by SerialPort::LogAsciiCommunication()
+std::string UnescapeAscii(const std::string& text)
+{
+   std::string data;
+   for (size_t i = 0; i < text.size(); ++i)
+   {
+      if (text[i] != '\\' || i + 1 >= text.size())
+      {
+         data += text[i];
+         continue;
+      }
+      char c = text[++i];
+      switch (c)
+      {
+         case 'n': data += '\n'; break;
+         case 'r': data += '\r'; break;
+         case 't': data += '\t'; break;
+         case '0': data += '\0'; break;
+         case 'x':
+            if (i + 2 < text.size() && HexValue(text[i + 1]) >= 0 &&
+                  HexValue(text[i + 2]) >= 0)
+            {
+               data += static_cast<char>(HexValue(text[i + 1]) * 16 +
+                     HexValue(text[i + 2]));
+               i += 2;
+            }
+            break;
+         default: data += c; break;
+      }
+   }
+   return data;
+}
+
+// Inverse of SerialPort::LogBinaryCommunication(): "(hex) 0a 1b ..."
+std::string UnescapeBinary(const std::string& text)
+{
+   std::string data;
+   std::istringstream iss(text.substr(text.find(')') + 1));
+   std::string byte;
+   while (iss >> byte)
+      data += static_cast<char>(strtol(byte.c_str(), 0, 16));
+   return data;
+}
+
+struct TrafficKind
+{
+   const char* prefix;
+   bool isInput;
+   bool isBinary;
+};
+
+const TrafficKind g_TrafficKinds[] = {
+   { "SetCommand -> ", false, false },
+   { "GetAnswer <- ", true, false },
+   { "Write -> ", false, true },
+   { "Read <- ", true, true },
+};
+
+} // anonymous namespace
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SerialRecording
+///////////////////////////////////////////////////////////////////////////////
+
+bool SerialRecording::LoadCoreLog(std::istream& log, const std::string& portLabel)
+{
+   if (!log)
+      return false;
+
+   events_.clear();
+   // Lines look like
+   // 2017-01-02T03:04:05.678901 tid1234 [dbg,dev:COM1] SetCommand -> W X\r
+   const std::string component = ",dev:" + portLabel + "] ";
+   std::string line;
+   while (std::getline(log, line))
+   {
+      size_t pos = line.find(component);
+      if (pos == std::string::npos)
+         continue;
+      if (!line.empty() && line[line.size() - 1] == '\r')
+         line.erase(line.size() - 1);
+      std::string text = line.substr(pos + component.size());
+
+      const TrafficKind* kind = 0;
+      for (size_t i = 0; i < sizeof(g_TrafficKinds) / sizeof(g_TrafficKinds[0]); ++i)
+      {
+         if (text.compare(0, strlen(g_TrafficKinds[i].prefix), g_TrafficKinds[i].prefix) == 0)
+         {
+            kind = &g_TrafficKinds[i];
+            break;
+         }
+      }
+      if (!kind)
+         continue;
+
+      Event event;
+      std::string stamp = line.substr(0, line.find(' '));
+      std::replace(stamp.begin(), stamp.end(), 'T', ' ');
+      try
+      {
+         event.time = boost::posix_time::time_from_string(stamp);
+      }
+      catch (const std::exception&)
+      {
+         continue;
+      }
+      if (event.time.is_not_a_date_time())
+         continue;
+
+      event.isInput = kind->isInput;
+      text.erase(0, strlen(kind->prefix));
+      event.data = kind->isBinary ? UnescapeBinary(text) : UnescapeAscii(text);
+      if (!event.data.empty())
+         events_.push_back(event);
+   }
+   return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// LatencyHistogram
+///////////////////////////////////////////////////////////////////////////////
+
+LatencyHistogram::LatencyHistogram() :
+   count_(0),
+   sumUs_(0.0)
+{
+   std::fill(bins_, bins_ + BinCount, 0);
+}
+
+void LatencyHistogram::Add(long us)
+{
+   // Bin i holds latencies below 2^i us
+   int bin = 0;
+   while (bin < BinCount - 1 && us >= (1L << bin))
+      ++bin;
+   ++bins_[bin];
+   ++count_;
+   sumUs_ += us;
+}
+
+long LatencyHistogram::PercentileUs(double fraction) const
+{
+   unsigned long target = static_cast<unsigned long>(fraction * count_ + 0.5);
+   unsigned long seen = 0;
+   for (int i = 0; i < BinCount; ++i)
+   {
+      seen += bins_[i];
+      if (seen >= target && seen > 0)
+         return 1L << i;
+   }
+   return 1L << (BinCount - 1);
+}
+
+std::string LatencyHistogram::Format() const
+{
+   std::ostringstream oss;
+   oss << "n=" << count_ << " mean=" << static_cast<long>(MeanUs()) << "us" <<
+      " p50<" << PercentileUs(0.5) << "us p99<" << PercentileUs(0.99) << "us [";
+   bool first = true;
+   for (int i = 0; i < BinCount; ++i)
+   {
+      if (bins_[i] == 0)
+         continue;
+      if (!first)
+         oss << ' ';
+      oss << '<' << (1L << i) << "us:" << bins_[i];
+      first = false;
+   }
+   oss << ']';
+   return oss.str();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SerialReplay
+///////////////////////////////////////////////////////////////////////////////
+
+SerialReplay::SerialReplay() :
+   initialized_(false),
+   timingScale_(1.0),
+   answerTimeoutMs_(500),
+   cursor_(0),
+   receivedTotal_(0),
+   readTotal_(0),
+   mismatches_(0),
+   writeCount_(0)
+{
+   InitializeDefaultErrorMessages();
+   SetErrorText(ERR_TERM_TIMEOUT, "The recording has no answer to the command");
+   SetErrorText(ERR_BUFFER_OVERRUN, "The recorded answer is longer than the buffer");
+   SetErrorText(ERR_PORT_NOTINITIALIZED, "The replay port is not initialized");
+   SetErrorText(ERR_RECORDING_OPEN_FAILED, "Cannot read the recording file");
+   SetErrorText(ERR_RECORDING_EMPTY, "The recording has no traffic for the port");
+
+   CreateProperty(MM::g_Keyword_Name, g_SerialReplayDeviceName, MM::String, true);
+   CreateProperty(MM::g_Keyword_Description,
+         "Serial port replaying traffic recorded in a CoreLog", MM::String, true);
+
+   CPropertyAction* pAct = new CPropertyAction(this, &SerialReplay::OnRecordingFile);
+   CreateProperty("RecordingFile", "", MM::String, false, pAct, true);
+
+   // Empty for the label of this port
+   pAct = new CPropertyAction(this, &SerialReplay::OnRecordedPort);
+   CreateProperty("RecordedPort", "", MM::String, false, pAct, true);
+
+   // 1 for the recorded timing, 0.1 for ten times faster, 0 for no delay
+   pAct = new CPropertyAction(this, &SerialReplay::OnTimingScale);
+   CreateFloatProperty("TimingScale", timingScale_, false, pAct);
+   SetPropertyLimits("TimingScale", 0.0, 100.0);
+
+   pAct = new CPropertyAction(this, &SerialReplay::OnTimeout);
+   CreateFloatProperty("AnswerTimeout", answerTimeoutMs_, false, pAct, true);
+
+   // Written at shutdown if set
+   CreateProperty("LatencyReportFile", "", MM::String, false);
+
+   // Accepted and ignored, so that configurations written for a serial port
+   // load unchanged
+   CreateProperty(MM::g_Keyword_BaudRate, "9600", MM::String, false, 0, true);
+   CreateProperty(MM::g_Keyword_DataBits, "8", MM::String, false, 0, true);
+   CreateProperty(MM::g_Keyword_StopBits, "1", MM::String, false, 0, true);
+   CreateProperty(MM::g_Keyword_Parity, "None", MM::String, false, 0, true);
+   CreateProperty(MM::g_Keyword_Handshaking, "Off", MM::String, false, 0, true);
+   CreateProperty("DelayBetweenCharsMs", "0", MM::Float, false, 0, true);
+   CreateProperty("Verbose", "1", MM::Integer, false, 0, true);
+}
+
+SerialReplay::~SerialReplay()
+{
+   Shutdown();
+}
+
+void SerialReplay::GetName(char* pszName) const
+{
+   CDeviceUtils::CopyLimitedString(pszName, g_SerialReplayDeviceName);
+}
+
+int SerialReplay::Initialize()
+{
+   if (initialized_)
+      return DEVICE_OK;
+
+   std::string port = recordedPort_;
+   if (port.empty())
+   {
+      char label[MM::MaxStrLength];
+      GetLabel(label);
+      port = label;
+   }
+
+   std::ifstream file(recordingFile_.c_str());
+   SerialRecording recording;
+   if (!file || !recording.LoadCoreLog(file, port))
+      return ERR_RECORDING_OPEN_FAILED;
+   if (recording.Events().empty())
+      return ERR_RECORDING_EMPTY;
+   events_ = recording.Events();
+
+   // Already there if the port was shut down and is initialized again
+   if (!HasProperty("MismatchCount"))
+   {
+      CPropertyAction* pAct = new CPropertyAction(this, &SerialReplay::OnMismatchCount);
+      CreateIntegerProperty("MismatchCount", 0, true, pAct);
+      pAct = new CPropertyAction(this, &SerialReplay::OnLatencyReport);
+      CreateProperty("LatencyReport", "", MM::String, true, pAct);
+   }
+
+   MMThreadGuard g(lock_);
+   cursor_ = 0;
+   written_.clear();
+   pending_.clear();
+   received_.clear();
+   marks_.clear();
+   receivedTotal_ = readTotal_ = 0;
+   mismatches_ = 0;
+   latencies_.clear();
+   // Anything the device sent before the first command
+   ScheduleInputs(events_[0].time, "");
+
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int SerialReplay::Shutdown()
+{
+   if (!initialized_)
+      return DEVICE_OK;
+   initialized_ = false;
+
+   std::string report = LatencyReport();
+   Log("Round trips per command:\n" + report);
+
+   char reportFile[MM::MaxStrLength];
+   if (GetProperty("LatencyReportFile", reportFile) == DEVICE_OK &&
+         strlen(reportFile) > 0)
+   {
+      std::ofstream out(reportFile);
+      out << report;
+   }
+   return DEVICE_OK;
+}
+
+int SerialReplay::SetCommand(const char* command, const char* term)
+{
+   if (!initialized_)
+      return ERR_PORT_NOTINITIALIZED;
+
+   std::string data(command);
+   if (term)
+      data += term;
+   MMThreadGuard g(lock_);
+   HandleOutput(data);
+   WakeReaders();
+   return DEVICE_OK;
+}
+
+int SerialReplay::Write(const unsigned char* buf, unsigned long bufLen)
+{
+   if (!initialized_)
+      return ERR_PORT_NOTINITIALIZED;
+
+   MMThreadGuard g(lock_);
+   HandleOutput(std::string(reinterpret_cast<const char*>(buf), bufLen));
+   WakeReaders();
+   return DEVICE_OK;
+}
+
+int SerialReplay::GetAnswer(char* answer, unsigned bufLen, const char* term)
+{
+   if (!initialized_)
+      return ERR_PORT_NOTINITIALIZED;
+   if (bufLen < 1)
+      return ERR_BUFFER_OVERRUN;
+
+   memset(answer, 0, bufLen);
+   const size_t capacity = bufLen - 1;
+   const std::string terminator(term ? term : "");
+
+   // Not scaled by TimingScale, unlike the replayed delays: at a scale of 0
+   // the answers are due at once, but must not time out at once
+   boost::posix_time::ptime deadline;
+   {
+      MMThreadGuard g(lock_);
+      deadline = Now() + boost::posix_time::microseconds(
+            static_cast<long>(answerTimeoutMs_ * 1000.0));
+   }
+   for (;;)
+   {
+      boost::posix_time::ptime wakeUp = deadline;
+      unsigned long writesSeen;
+      {
+         MMThreadGuard g(lock_);
+         {
+            boost::lock_guard<boost::mutex> w(wakeMutex_);
+            writesSeen = writeCount_;
+         }
+         DeliverDueInputs();
+         if (!terminator.empty())
+         {
+            size_t pos = received_.find(terminator);
+            if (pos != std::string::npos)
+            {
+               if (pos > capacity)
+                  return ERR_BUFFER_OVERRUN;
+               std::string text = TakeReceived(pos + terminator.size());
+               memcpy(answer, text.data(), pos);
+               return DEVICE_OK;
+            }
+         }
+         if (received_.size() > capacity)
+            return ERR_BUFFER_OVERRUN;
+
+         if (Now() >= deadline)
+         {
+            // Without a terminator, SerialPort returns what it has at the
+            // timeout
+            if (terminator.empty() && !received_.empty())
+            {
+               std::string text = TakeReceived(received_.size());
+               memcpy(answer, text.data(), text.size());
+               return DEVICE_OK;
+            }
+            return ERR_TERM_TIMEOUT;
+         }
+         if (!pending_.empty() && pending_.front().due < deadline)
+            wakeUp = pending_.front().due;
+      }
+      // Wait without the lock, so that other threads can write commands in
+      // the meantime (and have their answers scheduled)
+      WaitUntil(wakeUp, writesSeen);
+   }
+}
+
+int SerialReplay::Read(unsigned char* buf, unsigned long bufLen, unsigned long& charsRead)
+{
+   if (!initialized_)
+      return ERR_PORT_NOTINITIALIZED;
+   if (bufLen == 0)
+      return ERR_BUFFER_OVERRUN;
+
+   memset(buf, 0, bufLen);
+   MMThreadGuard g(lock_);
+   DeliverDueInputs();
+   std::string text = TakeReceived(std::min<size_t>(bufLen, received_.size()));
+   memcpy(buf, text.data(), text.size());
+   charsRead = static_cast<unsigned long>(text.size());
+   return DEVICE_OK;
+}
+
+int SerialReplay::Purge()
+{
+   if (!initialized_)
+      return ERR_PORT_NOTINITIALIZED;
+
+   // Answers still on their way arrive after the purge, as with a device
+   MMThreadGuard g(lock_);
+   DeliverDueInputs();
+   received_.clear();
+   readTotal_ = receivedTotal_;
+   marks_.clear();
+   return DEVICE_OK;
+}
+
+std::string SerialReplay::LatencyReport() const
+{
+   std::ostringstream oss;
+   for (std::map<std::string, LatencyHistogram>::const_iterator it =
+         latencies_.begin(); it != latencies_.end(); ++it)
+   {
+      oss << it->first << ": " << it->second.Format() << '\n';
+   }
+   return oss.str();
+}
+
+// Matches what was written to the next command in the recording, skipping
+// recorded commands the adapter did not send
+void SerialReplay::HandleOutput(const std::string& data)
+{
+   written_ += data;
+   while (!written_.empty())
+   {
+      size_t match = cursor_;
+      for (; match < events_.size(); ++match)
+      {
+         if (events_[match].isInput)
+            continue;
+         const std::string& recorded = events_[match].data;
+         if (written_.compare(0, recorded.size(), recorded) == 0)
+            break;
+         if (written_.size() < recorded.size() &&
+               recorded.compare(0, written_.size(), written_) == 0)
+            return; // Rest of the command still to come
+      }
+      if (match == events_.size())
+      {
+         ++mismatches_;
+         Log("Command not in the recording: " + CommandKey(written_));
+         written_.clear();
+         return;
+      }
+
+      const std::string& command = events_[match].data;
+      written_.erase(0, command.size());
+      cursor_ = match + 1;
+      ScheduleInputs(events_[match].time, CommandKey(command));
+   }
+}
+
+// Schedules the recorded inputs at the cursor, keeping their delay after
+// the recorded command
+void SerialReplay::ScheduleInputs(const boost::posix_time::ptime& recordedTime,
+      const std::string& command)
+{
+   boost::posix_time::ptime now = Now();
+   while (cursor_ < events_.size() && events_[cursor_].isInput)
+   {
+      const SerialRecording::Event& event = events_[cursor_++];
+      PendingInput input;
+      long delayUs = static_cast<long>(
+            (event.time - recordedTime).total_microseconds() * timingScale_);
+      input.due = now + boost::posix_time::microseconds(std::max(0L, delayUs));
+      // The device answers in order
+      if (!pending_.empty() && input.due < pending_.back().due)
+         input.due = pending_.back().due;
+      input.data = event.data;
+      input.command = command;
+      input.commandTime = now;
+      input.lastOfCommand = !command.empty() &&
+         (cursor_ == events_.size() || !events_[cursor_].isInput);
+      pending_.push_back(input);
+   }
+}
+
+void SerialReplay::DeliverDueInputs()
+{
+   boost::posix_time::ptime now = Now();
+   while (!pending_.empty() && pending_.front().due <= now)
+   {
+      const PendingInput& input = pending_.front();
+      received_ += input.data;
+      receivedTotal_ += input.data.size();
+      if (input.lastOfCommand)
+      {
+         LatencyMark mark;
+         mark.end = receivedTotal_;
+         mark.command = input.command;
+         mark.commandTime = input.commandTime;
+         marks_.push_back(mark);
+      }
+      pending_.pop_front();
+   }
+}
+
+std::string SerialReplay::TakeReceived(size_t count)
+{
+   std::string text = received_.substr(0, count);
+   received_.erase(0, count);
+   readTotal_ += count;
+
+   boost::posix_time::ptime now = Now();
+   while (!marks_.empty() && marks_.front().end <= readTotal_)
+   {
+      latencies_[marks_.front().command].Add(static_cast<long>(
+               (now - marks_.front().commandTime).total_microseconds()));
+      marks_.pop_front();
+   }
+   return text;
+}
+
+// Called with lock_ held, after a write
+void SerialReplay::WakeReaders()
+{
+   {
+      boost::lock_guard<boost::mutex> w(wakeMutex_);
+      ++writeCount_;
+   }
+   writeDone_.notify_all();
+}
+
+// Waits until t, or until a write after the writesSeen-th one
+void SerialReplay::WaitUntil(const boost::posix_time::ptime& t,
+      unsigned long writesSeen)
+{
+   boost::unique_lock<boost::mutex> w(wakeMutex_);
+   for (;;)
+   {
+      boost::posix_time::ptime now = Now();
+      if (writeCount_ != writesSeen || now >= t)
+         return;
+      writeDone_.timed_wait(w, t - now);
+   }
+}
+
+void SerialReplay::Log(const std::string& message)
+{
+   if (IsCallbackRegistered())
+      LogMessage(message, true);
+}
+
+// Command text up to its first numeric argument, so that for instance all
+// "M X=..." moves share a histogram
+std::string SerialReplay::CommandKey(const std::string& data)
+{
+   std::istringstream iss(data);
+   std::string key;
+   std::string token;
+   while (iss >> token)
+   {
+      if (isdigit(static_cast<unsigned char>(token[0])) ||
+            token[0] == '-' || token[0] == '+' || token[0] == '.')
+         break;
+      size_t equals = token.find('=');
+      if (!key.empty())
+         key += ' ';
+      key += token.substr(0, equals);
+      if (equals != std::string::npos)
+         break;
+   }
+   if (key.empty())
+      key = data;
+
+   std::string printable;
+   for (size_t i = 0; i < key.size(); ++i)
+   {
+      unsigned char c = static_cast<unsigned char>(key[i]);
+      if (isprint(c))
+         printable += key[i];
+      else
+         printable += (boost::format("\\x%02x") % static_cast<unsigned int>(c)).str();
+   }
+   return printable;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Action interface
+//
+
+int SerialReplay::OnRecordingFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(recordingFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (initialized_)
+      {
+         pProp->Set(recordingFile_.c_str());
+         return ERR_PORT_CHANGE_FORBIDDEN;
+      }
+      pProp->Get(recordingFile_);
+   }
+   return DEVICE_OK;
+}
+
+int SerialReplay::OnRecordedPort(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(recordedPort_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (initialized_)
+      {
+         pProp->Set(recordedPort_.c_str());
+         return ERR_PORT_CHANGE_FORBIDDEN;
+      }
+      pProp->Get(recordedPort_);
+   }
+   return DEVICE_OK;
+}
+
+int SerialReplay::OnTimingScale(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(timingScale_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      MMThreadGuard g(lock_);
+      pProp->Get(timingScale_);
+   }
+   return DEVICE_OK;
+}
+
+int SerialReplay::OnTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(answerTimeoutMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(answerTimeoutMs_);
+   }
+   return DEVICE_OK;
+}
+
+int SerialReplay::OnMismatchCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(mismatches_);
+   }
+   return DEVICE_OK;
+}
+
+int SerialReplay::OnLatencyReport(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard g(lock_);
+      std::string report = LatencyReport();
+      // One line for the property
+      size_t pos;
+      while ((pos = report.find('\n')) != std::string::npos)
+         report.replace(pos, 1, "; ");
+      pProp->Set(report.c_str());
+   }
+   return DEVICE_OK;
+}
@@ -0,0 +1,185 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SerialReplay.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Serial port that plays back traffic recorded in a CoreLog,
+//                for running device adapters without the instrument
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#pragma once
+
+#include "DeviceBase.h"
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+
+
+#define ERR_RECORDING_OPEN_FAILED 112
+#define ERR_RECORDING_EMPTY 113
+
+extern const char* g_SerialReplayDeviceName;
+
+
+// Serial traffic of one port, as logged by SerialPort with debug logging on:
+// the "SetCommand ->", "GetAnswer <-", "Write ->" and "Read <-" lines.
+class SerialRecording
+{
+public:
+   struct Event
+   {
+      boost::posix_time::ptime time;
+      bool isInput; // received from the device
+      std::string data;
+   };
+
+   // Reads the traffic of the port labeled portLabel from a CoreLog. Returns
+   // false if the file cannot be read.
+   bool LoadCoreLog(std::istream& log, const std::string& portLabel);
+
+   const std::vector<Event>& Events() const { return events_; }
+
+private:
+   std::vector<Event> events_;
+};
+
+
+// Round-trip times of one command, binned by powers of two of microseconds
+class LatencyHistogram
+{
+public:
+   enum { BinCount = 24 };
+
+   LatencyHistogram();
+
+   void Add(long us);
+   unsigned long Count() const { return count_; }
+   double MeanUs() const { return count_ ? sumUs_ / count_ : 0.0; }
+   // Upper bound of the bin holding the given fraction of the samples
+   long PercentileUs(double fraction) const;
+   std::string Format() const;
+
+private:
+   unsigned long bins_[BinCount];
+   unsigned long count_;
+   double sumUs_;
+};
+
+
+// Serial port answering from a recording. Each command written is matched
+// to the next recorded command, and the answers recorded after it are
+// delivered with the recorded delay, scaled by TimingScale. Commands the
+// recording does not have go unanswered, so that the adapter sees a
+// timeout.
+//
+// The time from each command to the end of its answers being read is
+// collected per command, to measure changes in an adapter's protocol
+// handling without the instrument.
+class SerialReplay : public CSerialBase<SerialReplay>
+{
+public:
+   SerialReplay();
+   ~SerialReplay();
+
+   // MMDevice API
+   // ------------
+   int Initialize();
+   int Shutdown();
+
+   void GetName(char* pszName) const;
+   bool Busy() { return false; }
+
+   int SetCommand(const char* command, const char* term);
+   int GetAnswer(char* answer, unsigned bufLength, const char* term);
+   int Write(const unsigned char* buf, unsigned long bufLen);
+   int Read(unsigned char* buf, unsigned long bufLen, unsigned long& charsRead);
+   MM::PortType GetPortType() const { return MM::SerialPort; }
+   int Purge();
+
+   // Number of commands written that the recording did not have
+   long MismatchCount() const { return mismatches_; }
+   // One line per command: count, mean, median, 99th percentile and bins
+   std::string LatencyReport() const;
+
+   // action interface
+   // ----------------
+   int OnRecordingFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRecordedPort(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTimingScale(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMismatchCount(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLatencyReport(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+   // Answer bytes due at a given time, in reply to command
+   struct PendingInput
+   {
+      boost::posix_time::ptime due;
+      std::string data;
+      std::string command;
+      boost::posix_time::ptime commandTime;
+      bool lastOfCommand;
+   };
+
+   // Position in the received stream at which the answers to command
+   // have been read in full
+   struct LatencyMark
+   {
+      unsigned long long end;
+      std::string command;
+      boost::posix_time::ptime commandTime;
+   };
+
+   void HandleOutput(const std::string& data);
+   void ScheduleInputs(const boost::posix_time::ptime& recordedTime,
+         const std::string& command);
+   void DeliverDueInputs();
+   std::string TakeReceived(size_t count);
+   void WakeReaders();
+   void WaitUntil(const boost::posix_time::ptime& t, unsigned long writesSeen);
+   void Log(const std::string& message);
+   static std::string CommandKey(const std::string& data);
+
+   bool initialized_;
+   std::string recordingFile_;
+   std::string recordedPort_;
+   double timingScale_;
+   double answerTimeoutMs_;
+
+   std::vector<SerialRecording::Event> events_;
+   size_t cursor_;
+   std::string written_; // written, not yet matched to the recording
+   std::deque<PendingInput> pending_;
+   std::string received_; // delivered, not yet read
+   unsigned long long receivedTotal_;
+   unsigned long long readTotal_;
+   std::deque<LatencyMark> marks_;
+   long mismatches_;
+   std::map<std::string, LatencyHistogram> latencies_;
+
+   MMThreadLock lock_;
+
+   // Wakes GetAnswer() when a command written meanwhile may have answers
+   // due sooner than it was waiting for
+   boost::mutex wakeMutex_;
+   boost::condition_variable writeDone_;
+   unsigned long writeCount_; // guarded by wakeMutex_
+};
@@ -0,0 +1,161 @@
+// DESCRIPTION:   Tests and round-trip benchmark for SerialManager, run against
+//                a pseudo-terminal that stands in for the device
+//
+// COPYRIGHT:     University of California, San Francisco, 2010
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include <gtest/gtest.h>
+
+#include "PtyDevice.h"
+#include "SerialManager.h"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+// Answers "SPLIT" with "AB\r" and "\n" in separate writes, "TWO" with two
+// replies in one write, "QUIET" not at all, and echoes anything else
+class ScriptedDevice : public PtyDevice
+{
+protected:
+   std::vector<std::string> Reply(const std::string& command)
+   {
+      std::vector<std::string> chunks;
+      if (command == "SPLIT")
+      {
+         chunks.push_back("AB\r");
+         chunks.push_back("\n");
+      }
+      else if (command == "TWO")
+         chunks.push_back("ONE\r\nTWO\r\n");
+      else if (command != "QUIET")
+         chunks.push_back(command + "\r");
+      return chunks;
+   }
+};
+
+class SerialLoopbackTest : public ::testing::Test
+{
+protected:
+   virtual void SetUp()
+   {
+      ASSERT_FALSE(device_.SlaveName().empty());
+      device_.SetChunkDelayMs(20);
+      device_.Start();
+      port_ = new SerialPort(device_.SlaveName().c_str());
+      port_->SetProperty("Verbose", "0");
+      port_->SetProperty("AnswerTimeout", "200");
+      ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   }
+
+   virtual void TearDown()
+   {
+      delete port_;
+      device_.Stop();
+   }
+
+   ScriptedDevice device_;
+   SerialPort* port_;
+};
+
+} // anonymous namespace
+
+
+TEST_F(SerialLoopbackTest, AnswerIsReturnedWithoutTerminator)
+{
+   char answer[64];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("HELLO", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r"));
+   ASSERT_STREQ("HELLO", answer);
+}
+
+TEST_F(SerialLoopbackTest, TerminatorSplitAcrossReads)
+{
+   char answer[64];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("SPLIT", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ("AB", answer);
+}
+
+TEST_F(SerialLoopbackTest, CharactersAfterTerminatorAreKept)
+{
+   char answer[64];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("TWO", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ("ONE", answer);
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ("TWO", answer);
+}
+
+TEST_F(SerialLoopbackTest, MissingAnswerTimesOut)
+{
+   char answer[64];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("QUIET", "\r"));
+   ASSERT_EQ(ERR_TERM_TIMEOUT, port_->GetAnswer(answer, sizeof(answer), "\r"));
+}
+
+TEST_F(SerialLoopbackTest, AnswerLongerThanBufferOverruns)
+{
+   char answer[4];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("TOOLONG", "\r"));
+   ASSERT_EQ(ERR_BUFFER_OVERRUN, port_->GetAnswer(answer, sizeof(answer), "\r"));
+}
+
+TEST_F(SerialLoopbackTest, ReadReturnsAllAvailableCharacters)
+{
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("TWO", "\r"));
+   boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+   unsigned char buf[64];
+   unsigned long read = 0;
+   ASSERT_EQ(DEVICE_OK, port_->Read(buf, sizeof(buf), read));
+   ASSERT_EQ(10u, read);
+   ASSERT_EQ(0, memcmp(buf, "ONE\r\nTWO\r\n", 10));
+}
+
+// Run with --gtest_also_run_disabled_tests
+TEST_F(SerialLoopbackTest, DISABLED_RoundTripLatency)
+{
+   const int n = 500;
+   std::vector<double> us;
+   char answer[64];
+   for (int i = 0; i < n; ++i)
+   {
+      boost::posix_time::ptime start =
+         boost::posix_time::microsec_clock::universal_time();
+      ASSERT_EQ(DEVICE_OK, port_->SetCommand("WHERE X Y Z", "\r"));
+      ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r"));
+      us.push_back((double)(boost::posix_time::microsec_clock::universal_time()
+               - start).total_microseconds());
+   }
+   std::sort(us.begin(), us.end());
+   double sum = 0.0;
+   for (size_t i = 0; i < us.size(); ++i)
+      sum += us[i];
+   std::cout << n << " round trips: mean " << (long)(sum / n) <<
+      " us, median " << (long)us[n / 2] << " us, 99th percentile " <<
+      (long)us[n * 99 / 100] << " us" << std::endl;
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
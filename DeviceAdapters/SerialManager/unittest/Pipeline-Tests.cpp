@@ -0,0 +1,201 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          Pipeline-Tests.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Tests and benchmark for CSerialPipeline on SerialManager,
+//                run against a pseudo-terminal that emulates a controller
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include <gtest/gtest.h>
+
+#include "PtyDevice.h"
+#include "SerialManager.h"
+#include "SerialPipeline.h"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+// Answers in the manner of an ASI Tiger controller: "W <axis>" with a
+// position, "RS <axis>?" with a status, "QUIET" not at all, and anything
+// else with an error
+class ControllerEmulator : public PtyDevice
+{
+protected:
+   std::vector<std::string> Reply(const std::string& command)
+   {
+      std::vector<std::string> chunks;
+      if (command.compare(0, 2, "W ") == 0)
+         chunks.push_back(":A " + command.substr(2) + "=1234\r\n");
+      else if (command.compare(0, 3, "RS ") == 0)
+         chunks.push_back(":A N\r\n");
+      else if (command != "QUIET")
+         chunks.push_back(":N-1\r\n");
+      return chunks;
+   }
+};
+
+class SerialPipelineTest : public ::testing::Test
+{
+protected:
+   virtual void SetUp()
+   {
+      ASSERT_FALSE(device_.SlaveName().empty());
+      device_.Start();
+      port_ = new SerialPort(device_.SlaveName().c_str());
+      port_->SetProperty("Verbose", "0");
+      port_->SetProperty("AnswerTimeout", "200");
+      ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   }
+
+   virtual void TearDown()
+   {
+      delete port_;
+      device_.Stop();
+   }
+
+   // Runs the queries in the way of ASIHub::QueryCommand(), one round
+   // trip each, and returns the time taken in microseconds
+   long QueryOneByOne(const std::vector<std::string>& commands)
+   {
+      boost::posix_time::ptime start =
+         boost::posix_time::microsec_clock::universal_time();
+      char answer[64];
+      for (size_t i = 0; i < commands.size(); ++i)
+      {
+         EXPECT_EQ(DEVICE_OK, port_->SetCommand(commands[i].c_str(), "\r"));
+         EXPECT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+      }
+      return (long)(boost::posix_time::microsec_clock::universal_time() -
+            start).total_microseconds();
+   }
+
+   long QueryPipelined(const std::vector<std::string>& commands)
+   {
+      boost::posix_time::ptime start =
+         boost::posix_time::microsec_clock::universal_time();
+      CSerialPipeline pipeline(port_);
+      for (size_t i = 0; i < commands.size(); ++i)
+         pipeline.Queue(commands[i].c_str(), "\r", "\r\n");
+      EXPECT_EQ(DEVICE_OK, pipeline.Execute());
+      return (long)(boost::posix_time::microsec_clock::universal_time() -
+            start).total_microseconds();
+   }
+
+   ControllerEmulator device_;
+   SerialPort* port_;
+};
+
+} // anonymous namespace
+
+
+TEST_F(SerialPipelineTest, AnswersMatchCommandsInOrder)
+{
+   CSerialPipeline pipeline(port_);
+   unsigned x = pipeline.Queue("W X", "\r", "\r\n");
+   unsigned bad = pipeline.Queue("XYZZY", "\r", "\r\n");
+   unsigned y = pipeline.Queue("W Y", "\r", "\r\n");
+   unsigned status = pipeline.Queue("RS X?", "\r", "\r\n");
+   ASSERT_EQ(DEVICE_OK, pipeline.Execute());
+   ASSERT_EQ(4u, pipeline.GetCount());
+   ASSERT_EQ(":A X=1234", pipeline.GetAnswer(x));
+   ASSERT_EQ(":N-1", pipeline.GetAnswer(bad));
+   ASSERT_EQ(":A Y=1234", pipeline.GetAnswer(y));
+   ASSERT_EQ(":A N", pipeline.GetAnswer(status));
+   ASSERT_EQ(DEVICE_OK, pipeline.GetStatus(status));
+}
+
+TEST_F(SerialPipelineTest, CommandsQueuedLaterAreExecutedLater)
+{
+   CSerialPipeline pipeline(port_);
+   unsigned x = pipeline.Queue("W X", "\r", "\r\n");
+   ASSERT_EQ(DEVICE_OK, pipeline.Execute());
+   unsigned z = pipeline.Queue("W Z", "\r", "\r\n");
+   ASSERT_EQ(DEVICE_ERR, pipeline.GetStatus(z));
+   ASSERT_EQ(DEVICE_OK, pipeline.Execute());
+   ASSERT_EQ(":A X=1234", pipeline.GetAnswer(x));
+   ASSERT_EQ(":A Z=1234", pipeline.GetAnswer(z));
+   ASSERT_EQ(2, device_.CommandCount());
+
+   pipeline.Clear();
+   ASSERT_EQ(0u, pipeline.GetCount());
+   ASSERT_EQ(0u, pipeline.Queue("W F", "\r", "\r\n"));
+}
+
+TEST_F(SerialPipelineTest, LimitedInFlightAnswersAll)
+{
+   device_.SetReplyTiming(2000, 0);
+   CSerialPipeline pipeline(port_);
+   pipeline.SetMaxInFlight(2);
+   for (int i = 0; i < 6; ++i)
+      pipeline.Queue("W X", "\r", "\r\n");
+   ASSERT_EQ(DEVICE_OK, pipeline.Execute());
+   for (unsigned i = 0; i < 6; ++i)
+      ASSERT_EQ(":A X=1234", pipeline.GetAnswer(i));
+}
+
+TEST_F(SerialPipelineTest, MissingAnswerFailsTheRest)
+{
+   CSerialPipeline pipeline(port_);
+   pipeline.SetMaxInFlight(1);
+   unsigned x = pipeline.Queue("W X", "\r", "\r\n");
+   unsigned quiet = pipeline.Queue("QUIET", "\r", "\r\n");
+   unsigned y = pipeline.Queue("W Y", "\r", "\r\n");
+   ASSERT_EQ(ERR_TERM_TIMEOUT, pipeline.Execute());
+   ASSERT_EQ(DEVICE_OK, pipeline.GetStatus(x));
+   ASSERT_EQ(":A X=1234", pipeline.GetAnswer(x));
+   ASSERT_EQ(ERR_TERM_TIMEOUT, pipeline.GetStatus(quiet));
+   ASSERT_EQ(ERR_TERM_TIMEOUT, pipeline.GetStatus(y));
+   ASSERT_EQ("", pipeline.GetAnswer(y));
+   ASSERT_EQ(2, device_.CommandCount());
+}
+
+// Run with --gtest_also_run_disabled_tests
+TEST_F(SerialPipelineTest, DISABLED_BatchedQueryLatency)
+{
+   // A USB serial adapter delivering replies 1 ms late, and a controller
+   // taking 100 us per command
+   device_.SetReplyTiming(1000, 100);
+   std::vector<std::string> commands;
+   commands.push_back("W X");
+   commands.push_back("W Y");
+   commands.push_back("RS X?");
+   commands.push_back("RS Y?");
+
+   const int n = 50;
+   long oneByOne = 0;
+   long pipelined = 0;
+   for (int i = 0; i < n; ++i)
+   {
+      oneByOne += QueryOneByOne(commands);
+      pipelined += QueryPipelined(commands);
+   }
+   std::cout << commands.size() << " queries: one by one " <<
+      oneByOne / n << " us, pipelined " << pipelined / n << " us" <<
+      std::endl;
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -0,0 +1,196 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PtyDevice.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Device side of a pseudo-terminal, standing in for a serial
+//                controller in SerialManager tests
+//
+// COPYRIGHT:     University of California, San Francisco, 2010
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _PTYDEVICE_H_
+#define _PTYDEVICE_H_
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <deque>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// The device side of a pseudo-terminal. Each command, terminated by a
+// carriage return, is answered with the chunks returned by Reply(), written
+// chunkDelayMs apart so that the port receives them in separate reads.
+//
+// By default replies are written as soon as the command is read. With
+// SetReplyTiming(), the device instead works through commands one at a
+// time, taking processingUs for each, and its replies arrive latencyUs after
+// they are ready, as with the latency of a USB serial adapter.
+class PtyDevice
+{
+public:
+   PtyDevice() :
+      master_(-1),
+      chunkDelayMs_(0),
+      latencyUs_(0),
+      processingUs_(0),
+      commandCount_(0),
+      stop_(false),
+      thread_(0)
+   {
+      master_ = posix_openpt(O_RDWR | O_NOCTTY);
+      if (master_ >= 0 && grantpt(master_) == 0 && unlockpt(master_) == 0)
+         slaveName_ = ptsname(master_);
+   }
+
+   virtual ~PtyDevice()
+   {
+      Stop();
+      if (master_ >= 0)
+         close(master_);
+   }
+
+   const std::string& SlaveName() const { return slaveName_; }
+   void SetChunkDelayMs(long ms) { chunkDelayMs_ = ms; }
+   void SetReplyTiming(long latencyUs, long processingUs)
+   {
+      latencyUs_ = latencyUs;
+      processingUs_ = processingUs;
+   }
+
+   // Number of commands received so far
+   long CommandCount() const { return commandCount_; }
+
+   void Start()
+   {
+      thread_ = new boost::thread(boost::bind(&PtyDevice::Run, this));
+   }
+
+   void Stop()
+   {
+      if (thread_)
+      {
+         stop_ = true;
+         thread_->join();
+         delete thread_;
+         thread_ = 0;
+      }
+   }
+
+protected:
+   virtual std::vector<std::string> Reply(const std::string& command)
+   {
+      return std::vector<std::string>(1, command + "\r");
+   }
+
+private:
+   struct PendingReply
+   {
+      boost::posix_time::ptime due;
+      std::vector<std::string> chunks;
+   };
+
+   static boost::posix_time::ptime Now()
+   {
+      return boost::posix_time::microsec_clock::universal_time();
+   }
+
+   void Run()
+   {
+      std::string command;
+      boost::posix_time::ptime busyUntil = Now();
+      while (!stop_)
+      {
+         int timeoutMs = 10;
+         if (!pending_.empty())
+         {
+            long us = (long)(pending_.front().due - Now()).total_microseconds();
+            timeoutMs = us <= 0 ? 0 : (int)(us / 1000);
+         }
+
+         pollfd pfd;
+         pfd.fd = master_;
+         pfd.events = POLLIN;
+         if (poll(&pfd, 1, timeoutMs) > 0)
+         {
+            char buf[256];
+            ssize_t n = read(master_, buf, sizeof(buf));
+            for (ssize_t i = 0; i < n; ++i)
+            {
+               if (buf[i] != '\r')
+               {
+                  command += buf[i];
+                  continue;
+               }
+               ++commandCount_;
+               PendingReply reply;
+               reply.chunks = Reply(command);
+               command.clear();
+               if (latencyUs_ == 0 && processingUs_ == 0)
+               {
+                  if (!WriteChunks(reply.chunks))
+                     return;
+                  continue;
+               }
+               boost::posix_time::ptime now = Now();
+               if (busyUntil < now)
+                  busyUntil = now;
+               busyUntil += boost::posix_time::microseconds(processingUs_);
+               reply.due = busyUntil + boost::posix_time::microseconds(latencyUs_);
+               pending_.push_back(reply);
+            }
+         }
+
+         // Sub-millisecond remainders are waited for here rather than
+         // rounded up by poll()
+         while (!pending_.empty() && pending_.front().due <=
+               Now() + boost::posix_time::microseconds(1000))
+         {
+            while (Now() < pending_.front().due)
+               ;
+            if (!WriteChunks(pending_.front().chunks))
+               return;
+            pending_.pop_front();
+         }
+      }
+   }
+
+   bool WriteChunks(const std::vector<std::string>& chunks)
+   {
+      for (size_t j = 0; j < chunks.size(); ++j)
+      {
+         if (j > 0 && chunkDelayMs_ > 0)
+            boost::this_thread::sleep(boost::posix_time::milliseconds(chunkDelayMs_));
+         if (write(master_, chunks[j].data(), chunks[j].size()) < 0)
+            return false;
+      }
+      return true;
+   }
+
+   int master_;
+   std::string slaveName_;
+   long chunkDelayMs_;
+   long latencyUs_;
+   long processingUs_;
+   volatile long commandCount_;
+   volatile bool stop_;
+   boost::thread* thread_;
+   std::deque<PendingReply> pending_;
+};
+
+#endif // _PTYDEVICE_H_
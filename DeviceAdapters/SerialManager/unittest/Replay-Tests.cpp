@@ -0,0 +1,270 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          Replay-Tests.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Tests for SerialReplay, the port playing back recorded
+//                serial traffic
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include <gtest/gtest.h>
+
+#include "SerialManager.h"
+#include "SerialReplay.h"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+
+
+namespace {
+
+// A session with an ASI-style controller on COM1, and traffic of another
+// port interleaved
+const char* g_Recording =
+   "2017-03-01T10:00:00.000000 tid100 [IFO,Core] Did update system state cache\n"
+   "2017-03-01T10:00:00.100000 tid100 [dbg,dev:COM1] SetCommand -> W X\\r\n"
+   "2017-03-01T10:00:00.120000 tid100 [dbg,dev:COM1] GetAnswer <- :A 1234\\r\\n\n"
+   "2017-03-01T10:00:00.130000 tid100 [dbg,dev:COM2] SetCommand -> W X\\r\n"
+   "2017-03-01T10:00:00.140000 tid100 [dbg,dev:COM2] GetAnswer <- :A 9999\\r\\n\n"
+   "2017-03-01T10:00:00.200000 tid100 [dbg,dev:COM1] SetCommand -> W Y\\r\n"
+   "2017-03-01T10:00:00.220000 tid100 [dbg,dev:COM1] GetAnswer <- :A 5678\\r\\n\n"
+   "2017-03-01T10:00:00.300000 tid100 [dbg,dev:COM1] SetCommand -> M X=1.5\\r\n"
+   "2017-03-01T10:00:00.310000 tid100 [dbg,dev:COM1] GetAnswer <- :A\\r\\n\n"
+   "2017-03-01T10:00:00.400000 tid100 [dbg,dev:COM1] Write -> (hex) 01 02 ff\n"
+   "2017-03-01T10:00:00.405000 tid100 [dbg,dev:COM1] Read <- (hex) 06 00\n"
+   "2017-03-01T10:00:00.500000 tid100 [dbg,dev:COM1] SetCommand -> \\x20W Z\\r\n"
+   "2017-03-01T10:00:00.520000 tid100 [dbg,dev:COM1] GetAnswer <- :A -3\\r\\n\n";
+
+class SerialReplayTest : public ::testing::Test
+{
+protected:
+   virtual void SetUp()
+   {
+      char path[] = "/tmp/SerialReplayXXXXXX";
+      int fd = mkstemp(path);
+      ASSERT_GE(fd, 0);
+      close(fd);
+      path_ = path;
+      std::ofstream(path_.c_str()) << g_Recording;
+
+      port_ = new SerialReplay();
+      ASSERT_EQ(DEVICE_OK, port_->SetProperty("RecordingFile", path_.c_str()));
+      ASSERT_EQ(DEVICE_OK, port_->SetProperty("RecordedPort", "COM1"));
+   }
+
+   virtual void TearDown()
+   {
+      delete port_;
+      remove(path_.c_str());
+   }
+
+   long ElapsedMs(const boost::posix_time::ptime& start)
+   {
+      return static_cast<long>((boost::posix_time::microsec_clock::universal_time()
+               - start).total_milliseconds());
+   }
+
+   std::string path_;
+   SerialReplay* port_;
+};
+
+void GetAnswerOnThread(SerialReplay* port, char* answer, unsigned bufLen,
+      int* ret)
+{
+   *ret = port->GetAnswer(answer, bufLen, "\r\n");
+}
+
+} // anonymous namespace
+
+
+TEST(SerialRecordingTest, ReadsTrafficOfOnePort)
+{
+   std::istringstream log(g_Recording);
+   SerialRecording recording;
+   ASSERT_TRUE(recording.LoadCoreLog(log, "COM1"));
+   const std::vector<SerialRecording::Event>& events = recording.Events();
+   ASSERT_EQ(10u, events.size());
+   ASSERT_FALSE(events[0].isInput);
+   ASSERT_EQ("W X\r", events[0].data);
+   ASSERT_TRUE(events[1].isInput);
+   ASSERT_EQ(":A 1234\r\n", events[1].data);
+   ASSERT_EQ(20, (events[1].time - events[0].time).total_milliseconds());
+   ASSERT_EQ(std::string("\x01\x02\xff", 3), events[6].data);
+   ASSERT_EQ(std::string("\x06\x00", 2), events[7].data);
+   ASSERT_EQ(" W Z\r", events[8].data);
+}
+
+TEST_F(SerialReplayTest, AnswersWithRecordedDelay)
+{
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W X", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ(":A 1234", answer);
+   ASSERT_GE(ElapsedMs(start), 19);
+}
+
+TEST_F(SerialReplayTest, TimingScaleShortensDelay)
+{
+   ASSERT_EQ(DEVICE_OK, port_->SetProperty("TimingScale", "0"));
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W X", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W Y", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ(":A 1234", answer);
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ(":A 5678", answer);
+   ASSERT_LT(ElapsedMs(start), 19);
+}
+
+TEST_F(SerialReplayTest, TimingScaleDoesNotShortenTimeout)
+{
+   ASSERT_EQ(DEVICE_OK, port_->SetProperty("TimingScale", "0"));
+   ASSERT_EQ(DEVICE_OK, port_->SetProperty("AnswerTimeout", "50"));
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("XYZZY", "\r"));
+   ASSERT_EQ(ERR_TERM_TIMEOUT, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_GE(ElapsedMs(start), 49);
+}
+
+TEST_F(SerialReplayTest, CanBeInitializedAgain)
+{
+   ASSERT_EQ(DEVICE_OK, port_->SetProperty("TimingScale", "0"));
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W Y", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_EQ(DEVICE_OK, port_->Shutdown());
+
+   // Replays from the start of the recording again
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   ASSERT_TRUE(port_->HasProperty("MismatchCount"));
+   ASSERT_TRUE(port_->HasProperty("LatencyReport"));
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W X", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ(":A 1234", answer);
+   ASSERT_EQ(0, port_->MismatchCount());
+}
+
+TEST_F(SerialReplayTest, PipelinedCommandsAreAnsweredInOrder)
+{
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W X", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W Y", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ(":A 1234", answer);
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ(":A 5678", answer);
+   ASSERT_GE(ElapsedMs(start), 19);
+}
+
+TEST_F(SerialReplayTest, CommandCanBeSentWhileWaitingForAnswer)
+{
+   ASSERT_EQ(DEVICE_OK, port_->SetProperty("AnswerTimeout", "5000"));
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   int ret = DEVICE_ERR;
+   boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+   boost::thread reader(GetAnswerOnThread, port_, answer,
+         (unsigned)sizeof(answer), &ret);
+   boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W X", "\r"));
+   reader.join();
+   ASSERT_EQ(DEVICE_OK, ret);
+   ASSERT_STREQ(":A 1234", answer);
+   // Answered with the recorded delay, not at the timeout
+   ASSERT_LT(ElapsedMs(start), 2500);
+}
+
+TEST_F(SerialReplayTest, SkippedCommandsAreSkippedInRecording)
+{
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W Y", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ(":A 5678", answer);
+   ASSERT_EQ(0, port_->MismatchCount());
+}
+
+TEST_F(SerialReplayTest, UnknownCommandTimesOut)
+{
+   ASSERT_EQ(DEVICE_OK, port_->SetProperty("AnswerTimeout", "50"));
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("XYZZY", "\r"));
+   ASSERT_EQ(ERR_TERM_TIMEOUT, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_EQ(1, port_->MismatchCount());
+
+   // The recording is still followed after the unknown command
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W X", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_STREQ(":A 1234", answer);
+}
+
+TEST_F(SerialReplayTest, BinaryWriteIsAnswered)
+{
+   ASSERT_EQ(DEVICE_OK, port_->SetProperty("TimingScale", "0"));
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   // Written in two parts
+   const unsigned char command[] = { 0x01, 0x02, 0xff };
+   ASSERT_EQ(DEVICE_OK, port_->Write(command, 1));
+   ASSERT_EQ(DEVICE_OK, port_->Write(command + 1, 2));
+   unsigned char buf[8];
+   unsigned long read = 0;
+   ASSERT_EQ(DEVICE_OK, port_->Read(buf, sizeof(buf), read));
+   ASSERT_EQ(2u, read);
+   ASSERT_EQ(0x06, buf[0]);
+   ASSERT_EQ(0x00, buf[1]);
+}
+
+TEST_F(SerialReplayTest, LatencyIsCollectedPerCommand)
+{
+   ASSERT_EQ(DEVICE_OK, port_->Initialize());
+   char answer[64];
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W X", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("W Y", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+   ASSERT_EQ(DEVICE_OK, port_->SetCommand("M X=1.5", "\r"));
+   ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+
+   std::string report = port_->LatencyReport();
+   ASSERT_NE(std::string::npos, report.find("W X: n=1 "));
+   ASSERT_NE(std::string::npos, report.find("W Y: n=1 "));
+   ASSERT_NE(std::string::npos, report.find("M X: n=1 "));
+   // 20 ms recorded delay
+   ASSERT_NE(std::string::npos, report.find("<32768us:1"));
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -38,6 +38,7 @@
 #include <cmath>
 #include <sstream>
 #include <ctime>
+#include <algorithm>
 
 
 using namespace std;
@@ -49,18 +50,44 @@ const char* g_PropertyThreshold = "Threshold";
 const char* g_PropertyDelaySec = "Delay_sec";
 const char* g_PropertyOnOff = "Track";
 const char* g_PropertyCorrect = "Correct";
+const char* g_PropertyMode = "Mode";
+const char* g_PropertySampleRate = "SampleRate_Hz";
+const char* g_PropertyCorrectionStep = "CorrectionStep_um";
+const char* g_PropertyTolerance = "Tolerance";
+const char* g_PropertyCropFactor = "CropFactor";
+const char* g_PropertyScoreTrend = "AFScoreTrend_per_sec";
+const char* g_PropertyCorrectionCount = "CorrectionCount";
+
+// scores the frames passing through Process()
+const char* g_ModeProcess = "Process";
+// samples the newest frames in the circular buffer on a background thread
+const char* g_ModeBackground = "Background";
 
 
 const char* g_ON = "ON";
 const char* g_OFF = "OFF";
 
+const double FocusMonitor::TRACK_SMOOTHING = 0.3;
+
 FocusMonitor::FocusMonitor() : 
    initialized_(false),
-   delayThd_(0)
+   delayThd_(0),
+   trackThd_(0),
+   track_(false),
+   background_(false),
+   correct_(false),
+   sampleRateHz_(2.0),
+   correctionStepUm_(0.2),
+   tolerance_(0.05),
+   cropFactor_(0.5),
+   correctionCount_(0)
 {
    // call the base class method to set-up default error codes/messages
    InitializeDefaultErrorMessages();
 
+   ResetTracking();
+   // tracking should not compete with the acquisition for processors
+   scorer_.SetThreadCount(1);
 }
 
 FocusMonitor::~FocusMonitor()
@@ -97,6 +124,7 @@ int FocusMonitor::Initialize()
       return DEVICE_OK;
 
    delayThd_ = new AFThread(this);
+   trackThd_ = new TrackThread(this);
 
    // set property list
    // -----------------   
@@ -114,13 +142,15 @@ int FocusMonitor::Initialize()
    nRet = CreateProperty(g_PropertyDelaySec, "1", MM::Integer, false);
    assert(nRet == DEVICE_OK);
 
-   nRet = CreateProperty(g_PropertyScore, "0.0", MM::Float, true);
+   CPropertyAction *pAct = new CPropertyAction(this, &FocusMonitor::OnScore);
+   nRet = CreateProperty(g_PropertyScore, "0.0", MM::Float, true, pAct);
    assert(nRet == DEVICE_OK);
 
    nRet = CreateProperty(g_PropertyThreshold, "0.0", MM::Float, false);
    assert(nRet == DEVICE_OK);
 
-   nRet = CreateProperty(g_PropertyOnOff, g_OFF, MM::String, false);
+   pAct = new CPropertyAction(this, &FocusMonitor::OnTrack);
+   nRet = CreateProperty(g_PropertyOnOff, g_OFF, MM::String, false, pAct);
    assert(nRet == DEVICE_OK);
 
    vector<string> vals;
@@ -130,13 +160,47 @@ int FocusMonitor::Initialize()
    if (nRet != DEVICE_OK)
       return nRet;
 
-   //CPropertyAction *pAct = new CPropertyAction(this, &FocusMonitor::OnCorrect);
-   nRet = CreateProperty(g_PropertyCorrect, g_OFF, MM::String, false);
+   pAct = new CPropertyAction(this, &FocusMonitor::OnCorrect);
+   nRet = CreateProperty(g_PropertyCorrect, g_OFF, MM::String, false, pAct);
    assert(nRet == DEVICE_OK);
    int ret = SetAllowedValues(g_PropertyCorrect, vals);
    if (ret != DEVICE_OK)
       return ret;
 
+   // background tracking
+   pAct = new CPropertyAction(this, &FocusMonitor::OnMode);
+   nRet = CreateProperty(g_PropertyMode, g_ModeProcess, MM::String, false, pAct);
+   assert(nRet == DEVICE_OK);
+   AddAllowedValue(g_PropertyMode, g_ModeProcess);
+   AddAllowedValue(g_PropertyMode, g_ModeBackground);
+
+   pAct = new CPropertyAction(this, &FocusMonitor::OnSampleRate);
+   nRet = CreateProperty(g_PropertySampleRate, CDeviceUtils::ConvertToString(sampleRateHz_), MM::Float, false, pAct);
+   assert(nRet == DEVICE_OK);
+   SetPropertyLimits(g_PropertySampleRate, 0.1, 50.0);
+
+   pAct = new CPropertyAction(this, &FocusMonitor::OnCorrectionStep);
+   nRet = CreateProperty(g_PropertyCorrectionStep, CDeviceUtils::ConvertToString(correctionStepUm_), MM::Float, false, pAct);
+   assert(nRet == DEVICE_OK);
+
+   pAct = new CPropertyAction(this, &FocusMonitor::OnTolerance);
+   nRet = CreateProperty(g_PropertyTolerance, CDeviceUtils::ConvertToString(tolerance_), MM::Float, false, pAct);
+   assert(nRet == DEVICE_OK);
+   SetPropertyLimits(g_PropertyTolerance, 0.0, 1.0);
+
+   pAct = new CPropertyAction(this, &FocusMonitor::OnCropFactor);
+   nRet = CreateProperty(g_PropertyCropFactor, CDeviceUtils::ConvertToString(cropFactor_), MM::Float, false, pAct);
+   assert(nRet == DEVICE_OK);
+   SetPropertyLimits(g_PropertyCropFactor, 0.1, 1.0);
+
+   pAct = new CPropertyAction(this, &FocusMonitor::OnScoreTrend);
+   nRet = CreateProperty(g_PropertyScoreTrend, "0.0", MM::Float, true, pAct);
+   assert(nRet == DEVICE_OK);
+
+   pAct = new CPropertyAction(this, &FocusMonitor::OnCorrectionCount);
+   nRet = CreateProperty(g_PropertyCorrectionCount, "0", MM::Integer, true, pAct);
+   assert(nRet == DEVICE_OK);
+
    // synchronize all properties
    // --------------------------
    nRet = UpdateStatus();
@@ -153,6 +217,12 @@ int FocusMonitor::Initialize()
  */
 int FocusMonitor::Shutdown()
 {
+   if (trackThd_)
+   {
+      trackThd_->Stop();
+      delete trackThd_;
+      trackThd_ = 0;
+   }
    delete delayThd_;
    initialized_ = false;
    return DEVICE_OK;
@@ -162,6 +232,8 @@ int FocusMonitor::Process(unsigned char* /* buffer */, unsigned /*width*/, unsig
 {
    if (!IsPropertyEqualTo(g_PropertyOnOff, g_ON))
       return DEVICE_OK; // processor inactive
+   if (IsPropertyEqualTo(g_PropertyMode, g_ModeBackground))
+      return DEVICE_OK; // the tracking thread samples the frames
 
    MM::AutoFocus* afDev = GetCoreCallback()->GetAutoFocus(this);
 
@@ -187,19 +259,324 @@ int FocusMonitor::Process(unsigned char* /* buffer */, unsigned /*width*/, unsig
 }
 
 
-int FocusMonitor::OnCorrect(MM::PropertyBase* /* pProp */, MM::ActionType eAct)
+int FocusMonitor::OnCorrect(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
    if (eAct == MM::AfterSet)
    {
-      
+      std::string value;
+      pProp->Get(value);
+      MMThreadGuard g(trackLock_);
+      correct_ = (value == g_ON);
    }
    else if (eAct == MM::BeforeGet)
    {
+      MMThreadGuard g(trackLock_);
+      pProp->Set(correct_ ? g_ON : g_OFF);
    }
 
    return DEVICE_OK; 
 }
 
+int FocusMonitor::OnTrack(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      track_ = (value == g_ON);
+      UpdateTracking();
+   }
+   else if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(track_ ? g_ON : g_OFF);
+   }
+   return DEVICE_OK;
+}
+
+int FocusMonitor::OnMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      background_ = (value == g_ModeBackground);
+      UpdateTracking();
+   }
+   else if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(background_ ? g_ModeBackground : g_ModeProcess);
+   }
+   return DEVICE_OK;
+}
+
+int FocusMonitor::OnSampleRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   MMThreadGuard g(trackLock_);
+   if (eAct == MM::AfterSet)
+      pProp->Get(sampleRateHz_);
+   else if (eAct == MM::BeforeGet)
+      pProp->Set(sampleRateHz_);
+   return DEVICE_OK;
+}
+
+int FocusMonitor::OnCorrectionStep(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   MMThreadGuard g(trackLock_);
+   if (eAct == MM::AfterSet)
+      pProp->Get(correctionStepUm_);
+   else if (eAct == MM::BeforeGet)
+      pProp->Set(correctionStepUm_);
+   return DEVICE_OK;
+}
+
+int FocusMonitor::OnTolerance(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   MMThreadGuard g(trackLock_);
+   if (eAct == MM::AfterSet)
+      pProp->Get(tolerance_);
+   else if (eAct == MM::BeforeGet)
+      pProp->Set(tolerance_);
+   return DEVICE_OK;
+}
+
+int FocusMonitor::OnCropFactor(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   MMThreadGuard g(trackLock_);
+   if (eAct == MM::AfterSet)
+      pProp->Get(cropFactor_);
+   else if (eAct == MM::BeforeGet)
+      pProp->Set(cropFactor_);
+   return DEVICE_OK;
+}
+
+int FocusMonitor::OnScore(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard g(trackLock_);
+      pProp->Set(score_);
+   }
+   return DEVICE_OK;
+}
+
+int FocusMonitor::OnScoreTrend(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard g(trackLock_);
+      pProp->Set(trend_);
+   }
+   return DEVICE_OK;
+}
+
+int FocusMonitor::OnCorrectionCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard g(trackLock_);
+      pProp->Set(correctionCount_);
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * Starts the tracking thread when tracking is on in background mode, and
+ * stops it otherwise.
+ */
+void FocusMonitor::UpdateTracking()
+{
+   if (!trackThd_)
+      return;
+   if (track_ && background_)
+   {
+      if (trackThd_->IsStopped())
+      {
+         MMThreadGuard g(trackLock_);
+         ResetTracking();
+      }
+      trackThd_->Start();
+   }
+   else
+   {
+      trackThd_->Stop();
+   }
+}
+
+/**
+ * Forgets the frames sampled so far; the next frame found in the buffer
+ * starts a new running score. Must be called with trackLock_ held.
+ */
+void FocusMonitor::ResetTracking()
+{
+   lastImageNumber_ = -1;
+   settledAfter_ = -1;
+   haveScore_ = false;
+   moved_ = false;
+   score_ = 0.0;
+   trend_ = 0.0;
+   referenceScore_ = 0.0;
+   probing_ = false;
+   scoreBeforeMove_ = 0.0;
+   direction_ = 1;
+   failedProbes_ = 0;
+}
+
+double FocusMonitor::GetSampleRate()
+{
+   MMThreadGuard g(trackLock_);
+   return sampleRateHz_;
+}
+
+/**
+ * Scores the newest frame in the circular buffer, if it is new, and updates
+ * the running score and its trend. With Correct ON, keeps focus by hill
+ * climbing: when the score drops more than the tolerance below the best
+ * score seen, the stage is moved one step; if the next frame scores lower,
+ * the move is undone and the next attempt goes the other way. When both
+ * directions fail, the drop is taken to be a change of the sample rather
+ * than of focus, and the current score becomes the reference.
+ *
+ * Called on the tracking thread.
+ */
+int FocusMonitor::TrackFrame()
+{
+   double cropFactor, step, tolerance;
+   bool correct;
+   long long lastImageNumber, settledAfter;
+   {
+      MMThreadGuard g(trackLock_);
+      cropFactor = cropFactor_;
+      step = correctionStepUm_;
+      tolerance = tolerance_;
+      correct = correct_;
+      lastImageNumber = lastImageNumber_;
+      settledAfter = settledAfter_;
+   }
+
+   MM::Core* core = GetCoreCallback();
+   unsigned width, height, depth;
+   long long number;
+   int ret = core->CopyNewestImage(this, frame_.empty() ? 0 : &frame_[0],
+         (unsigned long)frame_.size(), width, height, depth, number);
+   if (ret == DEVICE_BUFFER_OVERFLOW)
+   {
+      frame_.resize(width * height * depth);
+      ret = core->CopyNewestImage(this, &frame_[0],
+            (unsigned long)frame_.size(), width, height, depth, number);
+   }
+   if (ret != DEVICE_OK)
+      return ret;
+   if (number < 0 || number == lastImageNumber)
+      return DEVICE_OK; // no new frame
+
+   if (number < lastImageNumber)
+   {
+      // the buffer was initialized for a new acquisition
+      MMThreadGuard g(trackLock_);
+      ResetTracking();
+      settledAfter = -1;
+   }
+   if (number <= settledAfter)
+   {
+      MMThreadGuard g(trackLock_);
+      lastImageNumber_ = number;
+      return DEVICE_OK;
+   }
+
+   int roiWidth = (int)(cropFactor * width);
+   int roiHeight = (int)(cropFactor * height);
+   SharpnessResult result;
+   if (!scorer_.Score(&frame_[0], width, height, depth,
+         (width - roiWidth) / 2, (height - roiHeight) / 2, roiWidth, roiHeight,
+         result))
+      return DEVICE_UNSUPPORTED_DATA_FORMAT;
+   const double s = result.score;
+   MM::MMTime now = GetCurrentMMTime();
+
+   double moveBy = 0.0;
+   {
+      MMThreadGuard g(trackLock_);
+      lastImageNumber_ = number;
+      if (!haveScore_)
+      {
+         score_ = s;
+         haveScore_ = true;
+      }
+      else
+      {
+         double previous = score_;
+         double dt = (now - lastSampleTime_).getMsec() / 1000.0;
+         // a frame taken after a move starts the running score afresh
+         if (moved_)
+            score_ = s;
+         else
+         {
+            score_ += TRACK_SMOOTHING * (s - score_);
+            if (dt > 0.0)
+               trend_ += TRACK_SMOOTHING * ((score_ - previous) / dt - trend_);
+         }
+      }
+      moved_ = false;
+      lastSampleTime_ = now;
+
+      if (probing_)
+      {
+         probing_ = false;
+         if (s < scoreBeforeMove_)
+         {
+            // the move made it worse: undo it, and try the other way next
+            moveBy = -direction_ * step;
+            direction_ = -direction_;
+            if (++failedProbes_ >= 2)
+            {
+               referenceScore_ = scoreBeforeMove_;
+               failedProbes_ = 0;
+            }
+         }
+         else
+         {
+            failedProbes_ = 0;
+            referenceScore_ = std::max(referenceScore_, s);
+         }
+      }
+      else if (correct && score_ < referenceScore_ * (1.0 - tolerance))
+      {
+         scoreBeforeMove_ = score_;
+         moveBy = direction_ * step;
+         probing_ = true;
+      }
+      else
+      {
+         referenceScore_ = std::max(referenceScore_, score_);
+      }
+   }
+
+   if (moveBy == 0.0)
+      return DEVICE_OK;
+
+   double z;
+   ret = core->GetFocusPosition(z);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = core->SetFocusPosition(z + moveBy);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // The frame being exposed now may have started during the move; with a
+   // buffer size of 0, only the number of the newest frame is returned
+   long long newest;
+   core->CopyNewestImage(this, 0, 0, width, height, depth, newest);
+   std::ostringstream txt;
+   txt << "Focus tracking moved " << moveBy << " um, score " << s;
+   LogMessage(txt.str().c_str(), true);
+
+   MMThreadGuard g(trackLock_);
+   settledAfter_ = newest + 1;
+   moved_ = true;
+   ++correctionCount_;
+   return DEVICE_OK;
+}
+
 int FocusMonitor::DoAF()
 {
    MM::AutoFocus* afDev = GetCoreCallback()->GetAutoFocus(this);
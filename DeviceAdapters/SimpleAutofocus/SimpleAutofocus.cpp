@@ -184,10 +184,9 @@ SimpleAutofocus::SimpleAutofocus(const char* name) :
    busy_(false),
    latestSharpness_(0.), 
    enableAutoShuttering_(1),
-   sizeOfTempShortBuffer_(0), 
-   pSmoothedIm_(NULL), 
-   sizeOfSmoothedIm_(0), 
-   pShort_(NULL),
+   fftBandLow_(0.1),
+   fftBandHigh_(0.4),
+   scoringTiming_(0.),
    recalculate_(0), 
    mean_(0.), 
    standardDeviationOverMean_(0.),
@@ -206,10 +205,6 @@ int SimpleAutofocus::Shutdown()
 SimpleAutofocus::~SimpleAutofocus()
 {
    delete pPoints_;
-   if( NULL!=pShort_)
-      free(pShort_);
-   if(NULL!=pSmoothedIm_)
-      free(pSmoothedIm_);
    Shutdown();
 }
 
@@ -309,7 +304,23 @@ int SimpleAutofocus::Initialize()
    CreateProperty("SearchAlgorithm","Brent",MM::String, false, pAct);
    AddAllowedValue("SearchAlgorithm","Brent");
    AddAllowedValue("SearchAlgorithm","BruteForce");
+   AddAllowedValue("SearchAlgorithm","Sweep");
    searchAlgorithm_ = "Brent";
+   // the measure of image sharpness
+   pAct = new CPropertyAction(this, &SimpleAutofocus::OnSharpnessMetric);
+   CreateProperty("SharpnessMetric", GetSharpnessMetricName(SharpnessHighPass), MM::String, false, pAct);
+   for (int i = 0; i < SharpnessMetricCount; ++i)
+      AddAllowedValue("SharpnessMetric", GetSharpnessMetricName((SharpnessMetric)i));
+   // band of spatial frequencies for FFTBandPass, as fractions of the Nyquist frequency
+   pAct = new CPropertyAction(this, &SimpleAutofocus::OnFFTBandLow);
+   CreateProperty("FFTBandLow","0.1",MM::Float, false, pAct);
+   SetPropertyLimits("FFTBandLow",0., 1.0);
+   pAct = new CPropertyAction(this, &SimpleAutofocus::OnFFTBandHigh);
+   CreateProperty("FFTBandHigh","0.4",MM::Float, false, pAct);
+   SetPropertyLimits("FFTBandHigh",0., 1.0);
+   scorer_.SetFFTBand(fftBandLow_, fftBandHigh_);
+   pAct = new CPropertyAction(this, &SimpleAutofocus::OnPerformanceTiming);
+   CreateProperty("PerformanceTiming (microseconds)","0",MM::Float, true, pAct);
    UpdateStatus();
    return DEVICE_OK;
 }
@@ -405,6 +416,10 @@ int SimpleAutofocus::FullFocus()
    {
       retval =  BruteForceSearch();
    }
+   else if( searchAlgorithm_ == "Sweep")
+   {
+      retval =  SweepSearch();
+   }
    int tret = pCore_->SetDeviceProperty(shutterDeviceName, MM::g_Keyword_State, previousShutterState); 
    if( DEVICE_OK != tret)
       LogMessage("Error closing shutter upon exiting FullFocus",false);
@@ -610,6 +625,69 @@ int SimpleAutofocus::OnSearchAlgorithm(MM::PropertyBase* pProp, MM::ActionType e
 }
 
 
+int SimpleAutofocus::OnSharpnessMetric(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(GetSharpnessMetricName(scorer_.GetMetric()));
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string name;
+      pProp->Get(name);
+      SharpnessMetric metric;
+      if (!GetSharpnessMetric(name, metric))
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      scorer_.SetMetric(metric);
+   }
+   return DEVICE_OK;
+}
+
+
+int SimpleAutofocus::OnFFTBandLow(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(fftBandLow_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(fftBandLow_);
+      scorer_.SetFFTBand(fftBandLow_, fftBandHigh_);
+   }
+   return DEVICE_OK;
+}
+
+
+int SimpleAutofocus::OnFFTBandHigh(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(fftBandHigh_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(fftBandHigh_);
+      scorer_.SetFFTBand(fftBandLow_, fftBandHigh_);
+   }
+   return DEVICE_OK;
+}
+
+
+int SimpleAutofocus::OnPerformanceTiming(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(scoringTiming_.getUsec());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      // never do anything for a read-only property
+   }
+   return DEVICE_OK;
+}
+
+
 int SimpleAutofocus::OnChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
    if (eAct == MM::BeforeGet)
@@ -705,210 +783,42 @@ double SimpleAutofocus::SharpnessAtZ(const double z)
    MMThreadGuard g(busyLock_);
    busy_ = true;
    Z(z);
-   min1_ = 1.e8;
-   min2_ = 1.e8;
-   max1_ = -1.e8;
-   max2_ = -1.e8;
    // the crop factor, median filter and 3x3 high-pass process follows the java implementation from Pakpoom Subsoontorn & Hernan Garcia  -- KH
    int w0 = 0, h0 = 0, d0 = 0;
-   double sharpness = 0;
    pCore_->GetImageDimensions(w0, h0, d0);
+   //snap an image
+   const unsigned char* pI = reinterpret_cast<const unsigned char*>(pCore_->GetImage());
+   double sharpness = ScoreImage(pI, w0, h0, d0, z);
+   busy_ = false;
+   return sharpness;
+}
+
+
+// scores an image taken at z and adds it to the performance table
+double SimpleAutofocus::ScoreImage(const unsigned char* pI, int w0, int h0, int d0, const double z)
+{
+   double sharpness = 0;
    int width =  (int)(cropFactor_*w0);
    int height = (int)(cropFactor_*h0);
    int ow = (int)(((1-cropFactor_)/2)*w0);
    int oh = (int)(((1-cropFactor_)/2)*h0);
-   const unsigned long thisSize = sizeof(*pSmoothedIm_)*width*height;
-   if( thisSize != sizeOfSmoothedIm_)
-   {
-      if(NULL!=pSmoothedIm_)
-         free(pSmoothedIm_);
-      // malloc is faster than new...
-      pSmoothedIm_ = (float*)malloc(thisSize);
-      if(NULL!=pSmoothedIm_)
-      {
-         sizeOfSmoothedIm_ = thisSize;
-      }
-      else // todo throw out of here...
-      {
-         busy_=false;
-         return sharpness;
-      }
-   }
-   // copy from MM image to the working buffer
-   ImgBuffer image(w0,h0,d0);
-   //snap an image
-   const unsigned char* pI = reinterpret_cast<const unsigned char*>(pCore_->GetImage());
-   const unsigned short* pSInput = reinterpret_cast<const unsigned short*>(pI);
-   int iindex;
-   bool legalFormat = false;
-   // to keep it simple always copy to a short array
-   if( 0 != pSInput)
-   {
-      switch( d0)
-      {
-      case 1:
-         legalFormat = true;
-         if( sizeOfTempShortBuffer_ != sizeof(unsigned short)*w0*h0)
-         {
-            if( NULL != pShort_)
-               free(pShort_);
-            // malloc is faster than new...
-            pShort_ = (unsigned short*)malloc( sizeof(unsigned short)*w0*h0);
-            if( NULL!=pShort_)
-            {
-               sizeOfTempShortBuffer_ = sizeof(unsigned short)*w0*h0;
-            }
-         }
-         for(iindex = 0; iindex < w0*h0; ++iindex)
-         {
-            pShort_[iindex] = pI[iindex];
-         }
-         break;
-      case 2:
-         legalFormat = true;
-         if( sizeOfTempShortBuffer_ != sizeof(unsigned short)*w0*h0)
-         {
-            if( NULL != pShort_)
-               free(pShort_);
-            pShort_ = (unsigned short*)malloc( sizeof(unsigned short)*w0*h0);
-            if( NULL!=pShort_)
-            {
-               sizeOfTempShortBuffer_ = sizeof(unsigned short)*w0*h0;
-            }
-         }
-         for(iindex = 0; iindex < w0*h0; ++iindex)
-         {
-            pShort_[iindex] = pSInput[iindex];
-         }
-         break;
-      default:
-         break;
-      }
-   }
+   // the scorer works on the cropped region only, and takes 8 and 16 bit images as they are
+   SharpnessResult result;
+   MM::MMTime startTime = GetCurrentMMTime();
+   bool legalFormat = scorer_.Score(pI, w0, h0, d0, ow, oh, width, height, result);
+   scoringTiming_ = GetCurrentMMTime() - startTime;
+   double dynamicRange = 0.;
    if(legalFormat)
    {
-      // calculate the standard deviation & mean
-      long nPts = 0;
-      mean_ = 0;
-      double M2 = 0;
-      double delta;
-      // one-pass algorithm for mean and std from Welford / Knuth  - KH
-      for (int i=0; i<width; i++)
-      {
-         for (int j=0; j<height; j++)
-         {
-            ++nPts;
-            long value = pShort_[ow+i+ width*(oh+j)];
-            delta = value - mean_;
-            mean_ = mean_ + delta/nPts;
-            M2 = M2 + delta*(value - mean_); // #This expression uses the new value of mean_
-         }
-      }
-      //double variance_n = M2/nPts;
-      double variance = M2/(nPts - 1);
-      standardDeviationOverMean_ = 0.;
-      double meanScaling = 1.;
-      if( 0. != mean_)
-      {
-         standardDeviationOverMean_ = pow(variance,0.5)/mean_;
-         meanScaling = 1./mean_;
-      }
-      LogMessage("N " + boost::lexical_cast<std::string,long>(nPts) + " mean " +  boost::lexical_cast<std::string,float>((float)mean_) + " nrmlzd std " +  boost::lexical_cast<std::string,float>((float)standardDeviationOverMean_) );
-      // ToDO -- eliminate copy above.
-      int x[9];
-      int y[9];
-      /*Apply 3x3 median filter to reduce shot noise*/
-      for (int i=0; i<width; i++) {
-         for (int j=0; j<height; j++) {
-            float theValue;
-            x[0]=ow+i-1;
-            y[0]= (oh+j-1);
-            x[1]=ow+i;
-            y[1]= (oh+j-1);
-            x[2]=ow+i+1;
-            y[2]= (oh+j-1);
-            x[3]=ow+i-1;
-            y[3]=(oh+j);
-            x[4]=ow+i;
-            y[4]=(oh+j);
-            x[5]=ow+i+1;
-            y[5]=(oh+j);
-            x[6]=ow+i-1;
-            y[6]=(oh+j+1);
-            x[7]=ow+i;
-            y[7]=(oh+j+1);
-            x[8]=ow+i+1;
-            y[8]=(oh+j+1);
-            // truncate the median filter window  -- duplicate edge points
-            // this could be more efficient, we could fill in the interior image [1,w0-1]x[1,h0-1] then explicitly fill in the edge pixels.
-            for(int ij =0; ij < 9; ++ij)
-            {
-               if( x[ij] < 0)
-                  x[ij] = 0;
-               else if( w0-1 < x[ij])
-                  x[ij] = w0-1;
-               if( y[ij] < 0)
-                  y[ij] = 0;
-               else if( h0-1 < y[ij])
-                  y[ij] = h0-1;
-            }
-            std::vector<unsigned short> windo;
-            for(int ij = 0; ij < 9; ++ij)
-            {
-               windo.push_back(pShort_[ x[ij] + w0*y[ij]]);
-            }
-            // N.B. this window filler as ported from java needs to have a pad guaranteed around the cropped image!!!! KH
-            //windo[0] = pShort_[ow+i-1 + width*(oh+j-1)];
-            //windo[1] = pShort_[ow+i+ width*(oh+j-1)];
-            //windo[2] = pShort_[ow+i+1+ width*(oh+j-1)];
-            //windo[3] = pShort_[ow+i-1+ width*(oh+j)];
-            //windo[4] = pShort_[ow+i+ width*(oh+j)];
-            //windo[5] = pShort_[ow+i+1+ width*(oh+j)];
-            //windo[6] = pShort_[ow+i-1+ width*(oh+j+1)];
-            //windo[7] = pShort_[ow+i+ width*(oh+j+1)];
-            //windo[8] = pShort_[ow+i+1+ width*(oh+j+1)];
-            // to reduce effect of bleaching on the high-pass sharpness measurement, i use the image normalized by the mean - KH.
-            theValue = (float)((double)FindMedian(windo)*meanScaling);
-            pSmoothedIm_[i + j*width] = theValue;
-            // the dynamic range of the normalized image is a very strong function of the image sharpness, also  - KH
-            // here I'm using dynamic range of the median-filter image
-            // a faster measure could skip the median filter, but use the sum of the 5 - 10 highest and 5 - 10 lowest normalized pixels
-            // average over a couple of points to lessen effect of fluctuations & noise
-            // todo - make the active measure of image sharpness user-selectable
-            // save the  max points and the min points
-            if( theValue < min1_ )
-            {
-               min2_ = min1_;
-               min1_ = theValue;
-            }
-            else if (theValue < min2_)
-            {
-               min2_=theValue;
-            }
-            if( max1_ < theValue)
-            {
-               max2_ = max1_;
-               max1_ = theValue;
-            }
-            else if (max2_ < theValue )
-            {
-               max2_=theValue;
-            }
-         }
-      }
-      /*Edge detection using a 3x3 filter: [-2 -1 0; -1 0 1; 0 1 2]. Then sum all pixel values. Ideally, the sum is large if most edges are sharp*/
-      for (int k=1; k<width-1; k++) {
-         for (int l=1; l<height-1; l++)
-         {
-            double convolvedValue = -2.0*pSmoothedIm_[k-1 + width*(l-1)] - pSmoothedIm_[k+ width*(l-1)]-pSmoothedIm_[k-1 + width*l]+pSmoothedIm_[k+1 + width*l]+pSmoothedIm_[k+ width*(l+1)]+2.0*pSmoothedIm_[k+1+ width*(l+1)];
-            sharpness = sharpness + convolvedValue*convolvedValue;
-         }
-      }
-      //free(pShort);
+      mean_ = result.mean;
+      standardDeviationOverMean_ = result.stdOverMean;
+      // the dynamic range of the normalized, median-filtered image is a very strong function of the image sharpness, also  - KH
+      dynamicRange = result.dynamicRange;
+      sharpness = result.score;
+      LogMessage("N " + boost::lexical_cast<std::string,long>((long)width*height) + " mean " +  boost::lexical_cast<std::string,float>((float)mean_) + " nrmlzd std " +  boost::lexical_cast<std::string,float>((float)standardDeviationOverMean_) );
    }
-   busy_ = false;
    latestSharpness_ = sharpness;
-   pPoints_->InsertPoint(acquisitionSequenceNumber_++,(float)z,(float)mean_,(float)standardDeviationOverMean_,latestSharpness_,(float)( 0.5*((max1_+max2_)-(min1_+min2_))));
+   pPoints_->InsertPoint(acquisitionSequenceNumber_++,(float)z,(float)mean_,(float)standardDeviationOverMean_,latestSharpness_,(float)dynamicRange);
    return sharpness;
 }
 
@@ -1006,6 +916,147 @@ int SimpleAutofocus::BruteForceSearch( )
 
 
 
+// the coarse and fine scans of BruteForceSearch, with each scan a single hardware-sequenced
+// sweep of the focus stage while the camera streams: the stage settles, the camera exposes
+// and reads out, and the frames are scored as they arrive, all at the same time.
+// falls back to BruteForceSearch if the focus stage cannot run sequences.
+int SimpleAutofocus::SweepSearch( )
+{
+   char focusDeviceName[MM::MaxStrLength];
+   char coreCameraDeviceName[MM::MaxStrLength];
+   pCore_->GetDeviceProperty(MM::g_Keyword_CoreDevice, MM::g_Keyword_CoreFocus, focusDeviceName);
+   pCore_->GetDeviceProperty(MM::g_Keyword_CoreDevice, MM::g_Keyword_CoreCamera, coreCameraDeviceName);
+   MM::Stage* pStage = (MM::Stage*)pCore_->GetDevice(this, focusDeviceName);
+   MM::Camera* pCamera = (MM::Camera*)pCore_->GetDevice(this, coreCameraDeviceName);
+   bool sequenceable = false;
+   bool linearSequenceable = false;
+   long maxLength = 0;
+   if( NULL != pStage && NULL != pCamera)
+   {
+      pStage->IsStageSequenceable(sequenceable);
+      pStage->IsStageLinearSequenceable(linearSequenceable);
+      if( sequenceable)
+         pStage->GetStageSequenceMaxLength(maxLength);
+   }
+   const long coarseLength = 2 * coarseSteps_ + 1;
+   const long fineLength = 2 * fineSteps_ + 1;
+   if( !linearSequenceable && (!sequenceable || maxLength < std::max(coarseLength, fineLength)))
+   {
+      LogMessage("AF focus stage " + std::string(focusDeviceName) + " cannot run the sweep as a sequence, using BruteForce", false);
+      return BruteForceSearch();
+   }
+
+   double bestDist = Z();
+   double bestSh = 0.;
+   double baseDist = bestDist - coarseStepSize_ * coarseSteps_;
+   LogMessage("AF start coarse sweep range is  " + boost::lexical_cast<std::string,double>(baseDist) + " to " + boost::lexical_cast<std::string,double>(baseDist + coarseStepSize_*(2 * coarseSteps_)), messageDebug);
+   int ret = SequencedSweep(pStage, pCamera, linearSequenceable, baseDist, coarseStepSize_, coarseLength, bestDist, bestSh);
+   if( DEVICE_OK != ret)
+      return ret;
+   baseDist = bestDist - fineStepSize_ * fineSteps_;
+   LogMessage("AF start fine sweep range is  " + boost::lexical_cast<std::string,double>(baseDist)+" to " + boost::lexical_cast<std::string,double>( baseDist+(2*fineSteps_)*fineStepSize_),  messageDebug);
+   ret = SequencedSweep(pStage, pCamera, linearSequenceable, baseDist, fineStepSize_, fineLength, bestDist, bestSh);
+   if( DEVICE_OK != ret)
+      return ret;
+   LogMessage("AF best position is " + boost::lexical_cast<std::string,double>(bestDist),  messageDebug);
+   LogMessage("AF Performance Table:\n" + pPoints_->Table(), messageDebug);
+   Z(bestDist);
+   latestSharpness_ = bestSh;
+   return DEVICE_OK;
+}
+
+
+// one sweep of nSteps positions from start; the stage is expected to advance on each camera
+// frame, as in any hardware-sequenced Z stack. updates bestDist and bestSh, and stops as
+// soon as the peak is bracketed, i.e. the score has dropped by the threshold from the best one
+int SimpleAutofocus::SequencedSweep(MM::Stage* pStage, MM::Camera* pCamera, bool linear, double start, double stepSize, long nSteps, double& bestDist, double& bestSh)
+{
+   // both kinds of sequence start from where the stage is
+   Z(start);
+   int ret;
+   if( linear)
+   {
+      ret = pStage->SetStageLinearSequence(stepSize, nSteps);
+   }
+   else
+   {
+      ret = pStage->ClearStageSequence();
+      for (long i = 0; i < nSteps && DEVICE_OK == ret; ++i)
+         ret = pStage->AddToStageSequence(start + i * stepSize);
+      if( DEVICE_OK == ret)
+         ret = pStage->SendStageSequence();
+   }
+   if( DEVICE_OK != ret)
+      return ret;
+   ret = pStage->StartStageSequence();
+   if( DEVICE_OK != ret)
+      return ret;
+   ret = pCore_->StartSequenceAcquisition(this, nSteps, 0.);
+   if( DEVICE_OK != ret)
+   {
+      pStage->StopStageSequence();
+      return ret;
+   }
+
+   {
+      MMThreadGuard g(busyLock_);
+      busy_ = true;
+   }
+   double exposure = 0.;
+   pCore_->GetExposure(exposure);
+   // give up if no frame arrives in this time
+   const MM::MMTime timeout((long)(5. + exposure / 1000.), 0);
+   MM::MMTime lastFrame = GetCurrentMMTime();
+   long i = 0;
+   while( i < nSteps)
+   {
+      const unsigned char* pixels;
+      unsigned width, height, depth;
+      // wakes as soon as the frame arrives; the wait is bounded only to notice a camera that stopped
+      long long leaseId = pCore_->LeaseNextImage(this, &pixels, width, height, depth, 100);
+      if( leaseId < 0)
+      {
+         // a camera that has stopped may still have put its last frame in the buffer
+         bool capturing = pCamera->IsCapturing();
+         leaseId = pCore_->LeaseNextImage(this, &pixels, width, height, depth, 0);
+         if( leaseId < 0)
+         {
+            if( !capturing || GetCurrentMMTime() - lastFrame > timeout)
+            {
+               LogMessage("AF sweep ended after " + boost::lexical_cast<std::string,long>(i) + " of " + boost::lexical_cast<std::string,long>(nSteps) + " frames", false);
+               ret = DEVICE_ERR;
+               break;
+            }
+            continue;
+         }
+      }
+      lastFrame = GetCurrentMMTime();
+      const double curDist = start + i * stepSize;
+      ++i;
+      double curSh = ScoreImage(pixels, width, height, depth, curDist);
+      pCore_->ReleaseImage(this, leaseId);
+      LogMessage("AF evaluation @ " + boost::lexical_cast<std::string,double>(curDist) + " AF metric is: " + boost::lexical_cast<std::string,double>(curSh), messageDebug);
+      if (curSh > bestSh)
+      {
+         bestSh = curSh;
+         bestDist = curDist;
+      } else if (bestSh - curSh > threshold_ * bestSh)
+      {
+         break;
+      }
+   }
+   // also ends our reading of the frames, which stay in the buffer for the application, however
+   // early we stopped
+   pCore_->StopSequenceAcquisition(this);
+   pStage->StopStageSequence();
+   {
+      MMThreadGuard g(busyLock_);
+      busy_ = false;
+   }
+   return ret;
+}
+
+
 int SimpleAutofocus::BrentSearch( )
 {
    int ret = DEVICE_OK;
@@ -26,6 +26,7 @@
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
 #include "../../MMDevice/ImgBuffer.h"
+#include "score.h"
 
 #include <string>
 //#include <iostream>
@@ -40,10 +41,6 @@
 // data for AF performance report table
 class SAFData;
 
-// computational utility functions
-
-double GetScore(short* img, int w0, int h0, double cropFactor);
-
 class SimpleAutofocus : public CAutoFocusBase<SimpleAutofocus>
 {
 public:
@@ -83,6 +80,7 @@ public:
 
    int BruteForceSearch();
    int BrentSearch();
+   int SweepSearch();
 
    // action interface
    // ---------------
@@ -104,6 +102,10 @@ public:
    int OnStandardDeviationOverMean(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnChannel(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnSearchAlgorithm(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSharpnessMetric(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFFTBandLow(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFFTBandHigh(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPerformanceTiming(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 
 private:
@@ -125,13 +127,9 @@ private:
       return *this;
    };
 
-   // N.B  (note well) this utility MODIFIES the argument, make a copy yourself if you want the original data preserved
-   template <class U> U FindMedian(std::vector<U>& values ) {
-      std::sort(values.begin(), values.end());
-      return values[(values.size())>>1];
-   };
-
    double SharpnessAtZ(const double zvalue);
+   double ScoreImage(const unsigned char* pixels, int width, int height, int bytesPerPixel, const double z);
+   int SequencedSweep(MM::Stage* pStage, MM::Camera* pCamera, bool linear, double start, double stepSize, long nSteps, double& bestDist, double& bestSh);
    double DoubleFunctionOfDouble(const double zvalue);
 
    MM::Core* pCore_;
@@ -142,12 +140,13 @@ private:
    double latestSharpness_;
 
    long enableAutoShuttering_;
-   unsigned long sizeOfTempShortBuffer_;
 
-   float* pSmoothedIm_;
-   unsigned long sizeOfSmoothedIm_;
+   SharpnessScorer scorer_;
+   double fftBandLow_;
+   double fftBandHigh_;
+   // time taken by the last sharpness evaluation
+   MM::MMTime scoringTiming_;
 
-   unsigned short* pShort_;
    // a flag to trigger recalculation
    long recalculate_;
    double mean_;
@@ -163,15 +162,6 @@ private:
    long binningForAutofocusAcquisition_; // over-ride the camera setting if this is non-0
 
 
-   //std::multiset<float> mins_;
-   //std::mulitset<float> maxs_;
-   //const int nExtrema_ = 5;
-
-   float min1_;
-   float min2_;
-   float max1_;
-   float max2_;
-
    // this defines member functions that operate on evaluator DoubleFunctionOfDouble
 #include "../../Util/Brent.h"
 
@@ -206,11 +196,23 @@ public:
    // action interface
    // ----------------
    int OnCorrect(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTrack(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSampleRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCorrectionStep(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTolerance(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCropFactor(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnScore(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnScoreTrend(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnCorrectionCount(MM::PropertyBase* pProp, MM::ActionType eAct);
 
    friend class AFThread;
+   friend class TrackThread;
 
 private:
    static const int QUEUE_SIZE = 5;
+   // weight of a new sample in the running score and trend
+   static const double TRACK_SMOOTHING;
    bool initialized_;
    //ImageSharpnessScorer scorer_;
    std::queue<double> scoreQueue_;
@@ -259,6 +261,111 @@ private:
 
    AFThread* delayThd_;
    int DoAF();
+
+   // Samples the newest frame in the circular buffer at the sample rate, so
+   // that tracking neither adds snaps nor slows down the acquisition
+   class TrackThread : public MMDeviceThreadBase
+   {
+   public:
+      TrackThread(FocusMonitor* fm) :
+         fm_(fm),
+         stop_(true)
+      {}
+      ~TrackThread() {}
+
+      int svc (void)
+      {
+         while (!IsStopped())
+         {
+            MM::MMTime start = fm_->GetCurrentMMTime();
+            int ret = fm_->TrackFrame();
+            if (ret != DEVICE_OK)
+            {
+               std::ostringstream txt;
+               txt << "Focus tracking failed with code " << ret;
+               fm_->GetCoreCallback()->LogMessage(fm_, txt.str().c_str(), false);
+            }
+            // sleep in short steps, so that Stop() does not wait for a
+            // whole sample period
+            double periodMs = 1000.0 / fm_->GetSampleRate();
+            while (!IsStopped() &&
+                  (fm_->GetCurrentMMTime() - start).getMsec() < periodMs)
+               CDeviceUtils::SleepMs(10);
+         }
+         return 0;
+      }
+
+      void Start()
+      {
+         MMThreadGuard g(lock_);
+         if (!stop_)
+            return;
+         stop_ = false;
+         activate();
+      }
+
+      void Stop()
+      {
+         {
+            MMThreadGuard g(lock_);
+            if (stop_)
+               return;
+            stop_ = true;
+         }
+         wait();
+      }
+
+      bool IsStopped()
+      {
+         MMThreadGuard g(lock_);
+         return stop_;
+      }
+
+   private:
+      FocusMonitor* fm_;
+      MMThreadLock lock_;
+      bool stop_;
+   };
+
+   TrackThread* trackThd_;
+   void UpdateTracking();
+   void ResetTracking();
+   double GetSampleRate();
+   int TrackFrame();
+
+   // settings, and the tracking state read by the properties, are guarded
+   // by trackLock_
+   MMThreadLock trackLock_;
+   bool track_;
+   bool background_;
+   bool correct_;
+   double sampleRateHz_;
+   double correctionStepUm_;
+   double tolerance_;
+   double cropFactor_;
+
+   // number of the last frame sampled; frames up to settledAfter_ may have
+   // been exposed while the stage moved and are skipped
+   long long lastImageNumber_;
+   long long settledAfter_;
+   bool moved_;
+   bool haveScore_;
+   double score_;
+   double trend_; // per second
+   MM::MMTime lastSampleTime_;
+   // the best score seen at the current focus; a correction is attempted
+   // when the score falls more than tolerance_ below it
+   double referenceScore_;
+   // a corrective move is being evaluated against scoreBeforeMove_
+   bool probing_;
+   double scoreBeforeMove_;
+   int direction_;
+   int failedProbes_;
+   long correctionCount_;
+
+   // used by the tracking thread only
+   SharpnessScorer scorer_;
+   std::vector<unsigned char> frame_;
 };
 
 #endif // _SIMPLEAUTOFOCUS_H_
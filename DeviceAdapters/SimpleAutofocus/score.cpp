@@ -1,157 +1,595 @@
-#include "SimpleAutofocus.h"
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          score.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Image sharpness measures used by SimpleAutofocus
+// COPYRIGHT:     University of California, San Francisco, 2009
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
 
-unsigned short FindMedian(unsigned short* arr, const int lengthMinusOne)
+#include "score.h"
+
+#include "../../MMDevice/DeviceThreads.h"
+#include "../../MMDevice/RowBands.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const char* const g_MetricNames[SharpnessMetricCount] = {
+   "HighPass",
+   "NormalizedVariance",
+   "Tenengrad",
+   "Brenner",
+   "FFTBandPass"
+};
+
+const double pi = 3.14159265358979323846;
+
+// Sum shared by the bands of a task
+class BandSum
+{
+public:
+   BandSum() : sum_(0.) {}
+   void Add(double value) { MMThreadGuard g(lock_); sum_ += value; }
+   double Get() const { return sum_; }
+
+private:
+   MMThreadLock lock_;
+   double sum_;
+};
+
+
+// Copies the region to a float image and sums its pixels
+template <typename T>
+class CropTask : public RowBandTask
 {
-   unsigned short tmp;
-   // n.b. this was ported from java, looks like a bubble sort....
-   // todo use qsort
-   for(int i=0; i<lengthMinusOne; ++i)
+public:
+   CropTask(const T* pixels, int width, int roiX, int roiY, int roiWidth,
+         float* region) :
+      pixels_(pixels), width_(width), roiX_(roiX), roiY_(roiY),
+      roiWidth_(roiWidth), region_(region)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
    {
-      for(int j=0; j<lengthMinusOne-i; ++j)
+      double sum = 0.;
+      for (int y = (int)beginRow; y < (int)endRow; ++y)
       {
-         if (arr[j+1]<arr[j])
+         const T* in = pixels_ + (roiY_ + y) * width_ + roiX_;
+         float* out = region_ + y * roiWidth_;
+         float rowSum = 0.f;
+         for (int x = 0; x < roiWidth_; ++x)
          {
-            tmp = arr[j];
-            arr[j]=arr[j+1];
-            arr[j+1]=tmp;
+            out[x] = in[x];
+            rowSum += out[x];
          }
+         sum += rowSum;
       }
+      sum_.Add(sum);
    }
-   return arr[lengthMinusOne/2 +1];
+
+   double Sum() const { return sum_.Get(); }
+
+private:
+   const T* pixels_;
+   int width_;
+   int roiX_;
+   int roiY_;
+   int roiWidth_;
+   float* region_;
+   BandSum sum_;
+};
+
+
+inline float Min3(float a, float b, float c)
+{
+   return std::min(a, std::min(b, c));
 }
 
+inline float Max3(float a, float b, float c)
+{
+   return std::max(a, std::max(b, c));
+}
 
-double GetScore(unsigned short* img, int w0, int h0, double cropFactor)
+inline float Median3(float a, float b, float c)
 {
-   unsigned short windo[9];
-   int width =  (int)(cropFactor * w0);
-   int height = (int)(cropFactor * h0);
-   int ow = (int)(((1-cropFactor)/2)*w0);
-   int oh = (int)(((1-cropFactor)/2)*h0);
-   unsigned short* smoothedImage = new unsigned short[width*height];
-   // calculate the standard deviation & mean
-   long nPts = 0;
-   double mean = 0;
-   double M2 = 0;
-   double delta;
-   // one-pass algorithm for mean and std from Welford / Knuth  - KH
-   for (int i=0; i<width; i++)
-   {
-      for (int j=0; j<height; j++)
-      {
-         ++nPts;
-         long value = img[ow+i+ width*(oh+j)];
-         delta = value - mean;
-         mean = mean + delta/nPts;
-         M2 = M2 + delta*(value - mean); // #This expression uses the new value of mean_
-      }
-   }
-   //double variance_n = M2/nPts;
-   double variance = M2/(nPts - 1);
-   double stdOverMean = 0.;
-   double meanScaling = 1.;
-   if( 0. != mean)
+   return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
+
+// 3x3 median filter of the region, scaled by the given factor. Also sums
+// the squared deviations of the raw pixels from their mean, and finds the
+// two highest and two lowest filtered pixels.
+//
+// Each column of three pixels is sorted once and shared by the three windows
+// containing it; the median of a window is then the median of the largest
+// column minimum, the median of the column medians and the smallest column
+// maximum.
+class MedianTask : public RowBandTask
+{
+public:
+   MedianTask(const float* region, int width, int height, float mean,
+         float scale, float* smoothed) :
+      region_(region), width_(width), height_(height), mean_(mean),
+      scale_(scale), smoothed_(smoothed), squares_(0.)
    {
-      stdOverMean = pow(variance,0.5)/mean;
-      meanScaling = 1./mean;
+      lowest_[0] = lowest_[1] = 1.e30f;
+      highest_[0] = highest_[1] = -1.e30f;
    }
-   //LogMessage("N " + boost::lexical_cast<std::string,long>(nPts) + " mean " +  boost::lexical_cast<std::string,float>((float)mean_) + " nrmlzd std " +  boost::lexical_cast<std::string,float>((float)standardDeviationOverMean_) );
-   // ToDO -- eliminate copy above.
-   int x[9];
-   int y[9];
-   /*Apply 3x3 median filter to reduce shot noise*/
-   for (int i=0; i<width; i++)
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
    {
-      for (int j=0; j<height; j++)
+      // Sorted columns, with a copy of the edge column at each end
+      std::vector<float> lo(width_ + 2), mid(width_ + 2), hi(width_ + 2);
+      float lowest[2] = { 1.e30f, 1.e30f };
+      float highest[2] = { -1.e30f, -1.e30f };
+      double squares = 0.;
+      for (int y = (int)beginRow; y < (int)endRow; ++y)
       {
-         float theValue;
-         x[0]=ow+i-1;
-         y[0]= (oh+j-1);
-         x[1]=ow+i;
-         y[1]= (oh+j-1);
-         x[2]=ow+i+1;
-         y[2]= (oh+j-1);
-         x[3]=ow+i-1;
-         y[3]=(oh+j);
-         x[4]=ow+i;
-         y[4]=(oh+j);
-         x[5]=ow+i+1;
-         y[5]=(oh+j);
-         x[6]=ow+i-1;
-         y[6]=(oh+j+1);
-         x[7]=ow+i;
-         y[7]=(oh+j+1);
-         x[8]=ow+i+1;
-         y[8]=(oh+j+1);
-         // truncate the median filter window  -- duplicate edge points
-         // this could be more efficient, we could fill in the interior image [1,w0-1]x[1,h0-1] then explicitly fill in the edge pixels.
-         for(int ij =0; ij < 9; ++ij)
+         const float* above = region_ + std::max(y - 1, 0) * width_;
+         const float* row = region_ + y * width_;
+         const float* below = region_ + std::min(y + 1, height_ - 1) * width_;
+         for (int x = 0; x < width_; ++x)
          {
-            if( x[ij] < 0)
-               x[ij] = 0;
-            else if( w0-1 < x[ij])
-               x[ij] = w0-1;
-            if( y[ij] < 0)
-               y[ij] = 0;
-            else if( h0-1 < y[ij])
-               y[ij] = h0-1;
+            lo[x + 1] = Min3(above[x], row[x], below[x]);
+            mid[x + 1] = Median3(above[x], row[x], below[x]);
+            hi[x + 1] = Max3(above[x], row[x], below[x]);
          }
-         for(int ij = 0; ij < 9; ++ij)
+         lo[0] = lo[1]; mid[0] = mid[1]; hi[0] = hi[1];
+         lo[width_ + 1] = lo[width_];
+         mid[width_ + 1] = mid[width_];
+         hi[width_ + 1] = hi[width_];
+
+         float* out = smoothed_ + y * width_;
+         float rowSquares = 0.f;
+         for (int x = 0; x < width_; ++x)
          {
-            windo[ij] = img[x[ij] + w0*y[ij]];
+            float maxLo = Max3(lo[x], lo[x + 1], lo[x + 2]);
+            float medMid = Median3(mid[x], mid[x + 1], mid[x + 2]);
+            float minHi = Min3(hi[x], hi[x + 1], hi[x + 2]);
+            out[x] = Median3(maxLo, medMid, minHi) * scale_;
+            float d = row[x] - mean_;
+            rowSquares += d * d;
          }
-         // N.B. this window filler as ported from java needs to have a pad guaranteed around the cropped image!!!! KH
-         //windo[0] = pShort_[ow+i-1 + width*(oh+j-1)];
-         //windo[1] = pShort_[ow+i+ width*(oh+j-1)];
-         //windo[2] = pShort_[ow+i+1+ width*(oh+j-1)];
-         //windo[3] = pShort_[ow+i-1+ width*(oh+j)];
-         //windo[4] = pShort_[ow+i+ width*(oh+j)];
-         //windo[5] = pShort_[ow+i+1+ width*(oh+j)];
-         //windo[6] = pShort_[ow+i-1+ width*(oh+j+1)];
-         //windo[7] = pShort_[ow+i+ width*(oh+j+1)];
-         //windo[8] = pShort_[ow+i+1+ width*(oh+j+1)];
-         // to reduce effect of bleaching on the high-pass sharpness measurement, i use the image normalized by the mean - KH.
-         theValue = (float)((double)FindMedian(windo,8)*meanScaling);
-         smoothedImage[i + j*width] = (unsigned short)theValue;
-         // the dynamic range of the normalized image is a very strong function of the image sharpness, also  - KH
-         // here I'm using dynamic range of the median-filter image
-         // a faster measure could skip the median filter, but use the sum of the 5 - 10 highest and 5 - 10 lowest normalized pixels
-         // average over a couple of points to lessen effect of fluctuations & noise
-         // todo - make the active measure of image sharpness user-selectable
-         // save the  max points and the min points
-         double min1 = 1.e8;
-         double min2 = 1.e8;
-         double max1 = -1.e8;
-         double max2 = -1.e8;
-         if( theValue < min1 )
+         squares += rowSquares;
+
+         for (int x = 0; x < width_; ++x)
          {
-            min2 = min1;
-            min1 = theValue;
+            if (out[x] < lowest[1])
+            {
+               lowest[1] = std::max(out[x], lowest[0]);
+               lowest[0] = std::min(out[x], lowest[0]);
+            }
+            if (out[x] > highest[1])
+            {
+               highest[1] = std::min(out[x], highest[0]);
+               highest[0] = std::max(out[x], highest[0]);
+            }
          }
-         else if (theValue < min2)
+      }
+
+      MMThreadGuard g(lock_);
+      squares_ += squares;
+      for (int i = 0; i < 2; ++i)
+      {
+         InsertLowest(lowest[i]);
+         InsertHighest(highest[i]);
+      }
+   }
+
+   double SquaredDeviations() const { return squares_; }
+   double DynamicRange() const
+   {
+      if (lowest_[1] > highest_[1])
+         return 0.;
+      return 0.5 * ((highest_[0] + highest_[1]) - (lowest_[0] + lowest_[1]));
+   }
+
+private:
+   void InsertLowest(float v)
+   {
+      if (v < lowest_[1])
+      {
+         lowest_[1] = std::max(v, lowest_[0]);
+         lowest_[0] = std::min(v, lowest_[0]);
+      }
+   }
+
+   void InsertHighest(float v)
+   {
+      if (v > highest_[1])
+      {
+         highest_[1] = std::min(v, highest_[0]);
+         highest_[0] = std::max(v, highest_[0]);
+      }
+   }
+
+   const float* region_;
+   int width_;
+   int height_;
+   float mean_;
+   float scale_;
+   float* smoothed_;
+   MMThreadLock lock_;
+   double squares_;
+   float lowest_[2];
+   float highest_[2];
+};
+
+
+// Gradient measures of the smoothed image
+class GradientTask : public RowBandTask
+{
+public:
+   GradientTask(SharpnessMetric metric, const float* image, int width,
+         int height) :
+      metric_(metric), image_(image), width_(width), height_(height)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      double sum = 0.;
+      if (metric_ == SharpnessBrenner)
+      {
+         for (int y = (int)beginRow; y < (int)endRow; ++y)
+            sum += BrennerRow(image_ + y * width_);
+      }
+      else
+      {
+         // The 3x3 filters are taken where they fit in the image
+         int begin = std::max((int)beginRow, 1);
+         int end = std::min((int)endRow, height_ - 1);
+         for (int y = begin; y < end; ++y)
          {
-            min2 = theValue;
+            const float* a = image_ + (y - 1) * width_;
+            const float* b = image_ + y * width_;
+            const float* c = image_ + (y + 1) * width_;
+            sum += (metric_ == SharpnessTenengrad) ?
+               TenengradRow(a, b, c) : HighPassRow(a, b, c);
          }
-         if( max1 < theValue)
+      }
+      sum_.Add(sum);
+   }
+
+   double Sum() const { return sum_.Get(); }
+
+private:
+   float HighPassRow(const float* a, const float* b, const float* c) const
+   {
+      float sum = 0.f;
+      for (int x = 1; x < width_ - 1; ++x)
+      {
+         float v = -2.f * a[x - 1] - a[x] - b[x - 1] + b[x + 1] + c[x] +
+            2.f * c[x + 1];
+         sum += v * v;
+      }
+      return sum;
+   }
+
+   float TenengradRow(const float* a, const float* b, const float* c) const
+   {
+      float sum = 0.f;
+      for (int x = 1; x < width_ - 1; ++x)
+      {
+         float gx = (a[x + 1] + 2.f * b[x + 1] + c[x + 1]) -
+            (a[x - 1] + 2.f * b[x - 1] + c[x - 1]);
+         float gy = (c[x - 1] + 2.f * c[x] + c[x + 1]) -
+            (a[x - 1] + 2.f * a[x] + a[x + 1]);
+         sum += gx * gx + gy * gy;
+      }
+      return sum;
+   }
+
+   float BrennerRow(const float* b) const
+   {
+      float sum = 0.f;
+      for (int x = 0; x < width_ - 2; ++x)
+      {
+         float d = b[x + 2] - b[x];
+         sum += d * d;
+      }
+      return sum;
+   }
+
+   SharpnessMetric metric_;
+   const float* image_;
+   int width_;
+   int height_;
+   BandSum sum_;
+};
+
+
+// In-place radix-2 FFT of n (a power of 2) values, given twiddles[k] =
+// exp(-2 pi i k / n) for k < n / 2
+void FFT(std::complex<float>* data, int n,
+      const std::vector< std::complex<float> >& twiddles)
+{
+   for (int i = 1, j = 0; i < n; ++i)
+   {
+      int bit = n >> 1;
+      for (; j & bit; bit >>= 1)
+         j ^= bit;
+      j ^= bit;
+      if (i < j)
+         std::swap(data[i], data[j]);
+   }
+   for (int len = 2; len <= n; len <<= 1)
+   {
+      const int half = len >> 1;
+      const int step = n / len;
+      for (int i = 0; i < n; i += len)
+      {
+         for (int k = 0; k < half; ++k)
          {
-            max2 = max1;
-            max1 = theValue;
+            std::complex<float> t = data[i + k + half] * twiddles[k * step];
+            data[i + k + half] = data[i + k] - t;
+            data[i + k] += t;
          }
-         else if (max2 < theValue )
+      }
+   }
+}
+
+std::vector< std::complex<float> > Twiddles(int n)
+{
+   std::vector< std::complex<float> > twiddles(n / 2);
+   for (int k = 0; k < n / 2; ++k)
+      twiddles[k] = std::polar(1.f, (float)(-2. * pi * k / n));
+   return twiddles;
+}
+
+std::vector<float> HannWindow(int n)
+{
+   std::vector<float> window(n);
+   for (int i = 0; i < n; ++i)
+      window[i] = (float)(0.5 - 0.5 * std::cos(2. * pi * i / n));
+   return window;
+}
+
+int LargestPowerOf2(int n)
+{
+   int p = 1;
+   while (p * 2 <= n)
+      p *= 2;
+   return p;
+}
+
+// Windows the central nx x ny part of the smoothed image and transforms its
+// rows
+class RowFFTTask : public RowBandTask
+{
+public:
+   RowFFTTask(const float* image, int width, int x0, int y0, int nx,
+         const std::vector<float>& windowX, const std::vector<float>& windowY,
+         const std::vector< std::complex<float> >& twiddles,
+         std::complex<float>* spectrum) :
+      image_(image), width_(width), x0_(x0), y0_(y0), nx_(nx),
+      windowX_(windowX), windowY_(windowY), twiddles_(twiddles),
+      spectrum_(spectrum)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      for (int y = (int)beginRow; y < (int)endRow; ++y)
+      {
+         const float* in = image_ + (y0_ + y) * width_ + x0_;
+         std::complex<float>* out = spectrum_ + y * nx_;
+         // The image is normalized by its mean; removing it leaves less
+         // power to leak out of the zero frequency
+         for (int x = 0; x < nx_; ++x)
+            out[x] = (in[x] - 1.f) * windowX_[x] * windowY_[y];
+         FFT(out, nx_, twiddles_);
+      }
+   }
+
+private:
+   const float* image_;
+   int width_;
+   int x0_;
+   int y0_;
+   int nx_;
+   const std::vector<float>& windowX_;
+   const std::vector<float>& windowY_;
+   const std::vector< std::complex<float> >& twiddles_;
+   std::complex<float>* spectrum_;
+};
+
+// Transforms the columns of the spectrum (the "rows" of this task) and sums
+// the power in the band
+class ColumnFFTTask : public RowBandTask
+{
+public:
+   ColumnFFTTask(std::complex<float>* spectrum, int nx, int ny, double low,
+         double high, const std::vector< std::complex<float> >& twiddles) :
+      spectrum_(spectrum), nx_(nx), ny_(ny), low_(low), high_(high),
+      twiddles_(twiddles)
+   {}
+
+   void ProcessRows(unsigned beginColumn, unsigned endColumn)
+   {
+      std::vector< std::complex<float> > column(ny_);
+      double sum = 0.;
+      for (int x = (int)beginColumn; x < (int)endColumn; ++x)
+      {
+         for (int y = 0; y < ny_; ++y)
+            column[y] = spectrum_[y * nx_ + x];
+         FFT(&column[0], ny_, twiddles_);
+
+         // Frequencies as fractions of the Nyquist frequency
+         double fx = 2. * std::min(x, nx_ - x) / nx_;
+         for (int y = 0; y < ny_; ++y)
          {
-            max2 = theValue;
+            double fy = 2. * std::min(y, ny_ - y) / ny_;
+            double f = std::sqrt(fx * fx + fy * fy);
+            if (f >= low_ && f <= high_ && (x != 0 || y != 0))
+               sum += std::norm(column[y]);
          }
       }
+      sum_.Add(sum);
    }
-   /*Edge detection using a 3x3 filter: [-2 -1 0; -1 0 1; 0 1 2]. Then sum all pixel values. Ideally, the sum is large if most edges are sharp*/
-   double sharpness(0.0);
-   for (int k=1; k<width-1; k++) {
-      for (int l=1; l<height-1; l++)
+
+   double Sum() const { return sum_.Get(); }
+
+private:
+   std::complex<float>* spectrum_;
+   int nx_;
+   int ny_;
+   double low_;
+   double high_;
+   const std::vector< std::complex<float> >& twiddles_;
+   BandSum sum_;
+};
+
+} // anonymous namespace
+
+
+const char* GetSharpnessMetricName(SharpnessMetric metric)
+{
+   if (metric < 0 || metric >= SharpnessMetricCount)
+      return "";
+   return g_MetricNames[metric];
+}
+
+bool GetSharpnessMetric(const std::string& name, SharpnessMetric& metric)
+{
+   for (int i = 0; i < SharpnessMetricCount; ++i)
+   {
+      if (name == g_MetricNames[i])
       {
-         double convolvedValue = -2.0*smoothedImage[k-1 + width*(l-1)] - smoothedImage[k+ width*(l-1)]-smoothedImage[k-1 + width*l]+smoothedImage[k+1 + width*l]+smoothedImage[k+ width*(l+1)]+2.0*smoothedImage[k+1+ width*(l+1)];
-         sharpness = sharpness + convolvedValue*convolvedValue;
+         metric = (SharpnessMetric)i;
+         return true;
       }
    }
-   delete[] smoothedImage;
-   return sharpness;
+   return false;
+}
+
+
+SharpnessScorer::SharpnessScorer() :
+   metric_(SharpnessHighPass),
+   fftLow_(0.1),
+   fftHigh_(0.4),
+   threadCount_(0)
+{
+}
+
+void SharpnessScorer::SetFFTBand(double low, double high)
+{
+   fftLow_ = std::max(0., std::min(low, high));
+   fftHigh_ = std::max(low, high);
+}
+
+bool SharpnessScorer::Score(const unsigned char* pixels, int width, int height,
+      int bytesPerPixel, int roiX, int roiY, int roiWidth, int roiHeight,
+      SharpnessResult& result)
+{
+   result.score = 0.;
+   result.mean = 0.;
+   result.stdOverMean = 0.;
+   result.dynamicRange = 0.;
+   if (pixels == 0 || roiWidth <= 0 || roiHeight <= 0 || roiX < 0 ||
+         roiY < 0 || roiX + roiWidth > width || roiY + roiHeight > height)
+      return false;
+
+   const std::size_t n = (std::size_t)roiWidth * roiHeight;
+   region_.resize(n);
+   smoothed_.resize(n);
+
+   double sum;
+   if (bytesPerPixel == 1)
+   {
+      CropTask<unsigned char> crop(pixels, width, roiX, roiY, roiWidth,
+            &region_[0]);
+      CRowBands::Run(crop, roiHeight, threadCount_);
+      sum = crop.Sum();
+   }
+   else if (bytesPerPixel == 2)
+   {
+      CropTask<unsigned short> crop(
+            reinterpret_cast<const unsigned short*>(pixels), width, roiX,
+            roiY, roiWidth, &region_[0]);
+      CRowBands::Run(crop, roiHeight, threadCount_);
+      sum = crop.Sum();
+   }
+   else
+      return false;
+
+   result.mean = sum / n;
+   // Normalizing by the mean reduces the effect of bleaching
+   const float scale = result.mean != 0. ? (float)(1. / result.mean) : 1.f;
+   MedianTask median(&region_[0], roiWidth, roiHeight, (float)result.mean,
+         scale, &smoothed_[0]);
+   CRowBands::Run(median, roiHeight, threadCount_);
+   const double variance = n > 1 ? median.SquaredDeviations() / (n - 1) : 0.;
+   if (result.mean != 0.)
+      result.stdOverMean = std::sqrt(variance) / result.mean;
+   result.dynamicRange = median.DynamicRange();
+
+   switch (metric_)
+   {
+      case SharpnessNormalizedVariance:
+         result.score = result.mean != 0. ? variance / result.mean : 0.;
+         break;
+      case SharpnessFFTBandPass:
+         result.score = FFTBandPower(roiWidth, roiHeight);
+         break;
+      default:
+      {
+         GradientTask gradient(metric_, &smoothed_[0], roiWidth, roiHeight);
+         CRowBands::Run(gradient, roiHeight, threadCount_);
+         result.score = gradient.Sum();
+         break;
+      }
+   }
+   return true;
+}
+
+// Power in the band, per pixel, of the largest power-of-2 sized central part
+// of the smoothed image, windowed to suppress the edges
+double SharpnessScorer::FFTBandPower(int width, int height)
+{
+   const int nx = LargestPowerOf2(width);
+   const int ny = LargestPowerOf2(height);
+   if (nx < 2 || ny < 2)
+      return 0.;
+   spectrum_.resize((std::size_t)nx * ny);
+
+   std::vector<float> windowX = HannWindow(nx);
+   std::vector<float> windowY = HannWindow(ny);
+   std::vector< std::complex<float> > twiddlesX = Twiddles(nx);
+   std::vector< std::complex<float> > twiddlesY = Twiddles(ny);
+
+   RowFFTTask rows(&smoothed_[0], width, (width - nx) / 2, (height - ny) / 2,
+         nx, windowX, windowY, twiddlesX, &spectrum_[0]);
+   CRowBands::Run(rows, ny, threadCount_);
+   ColumnFFTTask columns(&spectrum_[0], nx, ny, fftLow_, fftHigh_,
+         twiddlesY);
+   CRowBands::Run(columns, nx, threadCount_);
+
+   const double pixels = (double)nx * ny;
+   return columns.Sum() / (pixels * pixels);
+}
+
+
+double GetScore(unsigned short* img, int w0, int h0, double cropFactor)
+{
+   int width =  (int)(cropFactor * w0);
+   int height = (int)(cropFactor * h0);
+   int ow = (int)(((1-cropFactor)/2)*w0);
+   int oh = (int)(((1-cropFactor)/2)*h0);
+
+   SharpnessScorer scorer;
+   SharpnessResult result;
+   scorer.Score(reinterpret_cast<const unsigned char*>(img), w0, h0, 2,
+         ow, oh, width, height, result);
+   return result.score;
 }
@@ -0,0 +1,104 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          score.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Image sharpness measures used by SimpleAutofocus
+// COPYRIGHT:     University of California, San Francisco, 2009
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _SCORE_H_
+#define _SCORE_H_
+
+#include <complex>
+#include <string>
+#include <vector>
+
+enum SharpnessMetric
+{
+   // Sum of the squared response of the diagonal edge filter
+   // [-2 -1 0; -1 0 1; 0 1 2] (the original SimpleAutofocus measure)
+   SharpnessHighPass,
+   // Variance of the raw pixels divided by their mean
+   SharpnessNormalizedVariance,
+   // Sum of the squared Sobel gradient magnitude
+   SharpnessTenengrad,
+   // Sum of the squared differences of pixels two columns apart
+   SharpnessBrenner,
+   // Power in a band of spatial frequencies (see SetFFTBand())
+   SharpnessFFTBandPass,
+   SharpnessMetricCount
+};
+
+const char* GetSharpnessMetricName(SharpnessMetric metric);
+bool GetSharpnessMetric(const std::string& name, SharpnessMetric& metric);
+
+struct SharpnessResult
+{
+   double score;
+   // Of the raw pixels of the region scored
+   double mean;
+   double stdOverMean;
+   // Difference between the two highest and two lowest pixels of the
+   // filtered image, normalized by the mean
+   double dynamicRange;
+};
+
+/**
+ * Scores the sharpness of a region of an image.
+ *
+ * The region is cropped out of the image first, then smoothed with a 3x3
+ * median filter (which treats pixels outside the region as copies of the
+ * nearest edge pixel) and normalized by its mean, so that bleaching does not
+ * change the score. Except for the normalized variance, which uses the raw
+ * pixels, the measures are taken on the smoothed image.
+ *
+ * All passes run over whole rows, in bands of rows on several threads (see
+ * CRowBands), with branch-free inner loops that the compiler can vectorize.
+ * The working buffers are kept between calls.
+ */
+class SharpnessScorer
+{
+public:
+   SharpnessScorer();
+
+   void SetMetric(SharpnessMetric metric) { metric_ = metric; }
+   SharpnessMetric GetMetric() const { return metric_; }
+   // Band for SharpnessFFTBandPass, as fractions of the Nyquist frequency
+   void SetFFTBand(double low, double high);
+   // 0 for one thread per processor
+   void SetThreadCount(unsigned threadCount) { threadCount_ = threadCount; }
+
+   // Scores the roiWidth x roiHeight region at (roiX, roiY) of an image of
+   // 1 or 2 bytes per pixel. Returns false if the pixel type is not
+   // supported or the region is empty or not within the image.
+   bool Score(const unsigned char* pixels, int width, int height,
+         int bytesPerPixel, int roiX, int roiY, int roiWidth, int roiHeight,
+         SharpnessResult& result);
+
+private:
+   double FFTBandPower(int width, int height);
+
+   SharpnessMetric metric_;
+   double fftLow_;
+   double fftHigh_;
+   unsigned threadCount_;
+   std::vector<float> region_;
+   std::vector<float> smoothed_;
+   std::vector< std::complex<float> > spectrum_;
+};
+
+// Scores the sharpness of the central cropFactor part of a 16-bit image
+double GetScore(unsigned short* img, int w0, int h0, double cropFactor);
+
+#endif // _SCORE_H_
@@ -0,0 +1,190 @@
+#include <gtest/gtest.h>
+
+#include "score.h"
+
+#include <algorithm>
+#include <vector>
+
+
+namespace {
+
+const int width = 96;
+const int height = 80;
+
+// Blocks of 4x4 pixels of pseudo-random brightness: edges in all directions
+// and at many spatial frequencies, which the 3x3 median smoothing keeps
+template <typename T>
+std::vector<T> MakeSharpImage(double maxValue)
+{
+   std::vector<T> image(width * height);
+   for (int y = 0; y < height; ++y)
+   {
+      for (int x = 0; x < width; ++x)
+      {
+         unsigned block = (unsigned)((y / 4) * 1009 + (x / 4) * 7919);
+         block = block * 2654435761u;
+         image[y * width + x] = static_cast<T>(maxValue *
+               (0.2 + 0.6 * ((block >> 16) % 1000) / 1000.));
+      }
+   }
+   return image;
+}
+
+// Repeated 3x3 box filter, as a defocused image
+template <typename T>
+std::vector<T> Blur(const std::vector<T>& image, int passes)
+{
+   std::vector<T> in(image);
+   std::vector<T> out(image.size());
+   for (int p = 0; p < passes; ++p)
+   {
+      for (int y = 0; y < height; ++y)
+      {
+         for (int x = 0; x < width; ++x)
+         {
+            double sum = 0.;
+            for (int dy = -1; dy <= 1; ++dy)
+               for (int dx = -1; dx <= 1; ++dx)
+                  sum += in[std::min(std::max(y + dy, 0), height - 1) * width +
+                     std::min(std::max(x + dx, 0), width - 1)];
+            out[y * width + x] = static_cast<T>(sum / 9. + 0.5);
+         }
+      }
+      in.swap(out);
+   }
+   return in;
+}
+
+template <typename T>
+double Score(SharpnessScorer& scorer, const std::vector<T>& image,
+      int roiX, int roiY, int roiWidth, int roiHeight)
+{
+   SharpnessResult result;
+   EXPECT_TRUE(scorer.Score(reinterpret_cast<const unsigned char*>(&image[0]),
+            width, height, sizeof(T), roiX, roiY, roiWidth, roiHeight, result));
+   return result.score;
+}
+
+template <typename T>
+void ExpectSharpScoresHigher(double maxValue, unsigned threadCount)
+{
+   std::vector<T> sharp = MakeSharpImage<T>(maxValue);
+   std::vector<T> blurred = Blur(sharp, 3);
+   for (int m = 0; m < SharpnessMetricCount; ++m)
+   {
+      SharpnessScorer scorer;
+      scorer.SetMetric((SharpnessMetric)m);
+      scorer.SetThreadCount(threadCount);
+      const double sharpScore = Score(scorer, sharp, 8, 4, 64, 64);
+      const double blurredScore = Score(scorer, blurred, 8, 4, 64, 64);
+      EXPECT_GT(sharpScore, blurredScore) << GetSharpnessMetricName(
+            (SharpnessMetric)m);
+      EXPECT_GT(blurredScore, 0.) << GetSharpnessMetricName(
+            (SharpnessMetric)m);
+   }
+}
+
+} // anonymous namespace
+
+
+TEST(ScoreTests, SharpScoresHigherThanBlurred8Bit)
+{
+   ExpectSharpScoresHigher<unsigned char>(255., 0);
+}
+
+TEST(ScoreTests, SharpScoresHigherThanBlurred16Bit)
+{
+   ExpectSharpScoresHigher<unsigned short>(4095., 0);
+}
+
+TEST(ScoreTests, SharpScoresHigherThanBlurredInBands)
+{
+   ExpectSharpScoresHigher<unsigned short>(65535., 3);
+}
+
+TEST(ScoreTests, ScoresDoNotDependOnBrightness)
+{
+   // The region is normalized by its mean, except for the normalized
+   // variance, which scales with it
+   std::vector<unsigned short> dim = MakeSharpImage<unsigned short>(1000.);
+   std::vector<unsigned short> bright(dim);
+   for (std::size_t i = 0; i < bright.size(); ++i)
+      bright[i] = (unsigned short)(dim[i] * 4);
+   SharpnessScorer scorer;
+   scorer.SetMetric(SharpnessTenengrad);
+   const double dimScore = Score(scorer, dim, 0, 0, width, height);
+   ASSERT_NEAR(dimScore, Score(scorer, bright, 0, 0, width, height),
+         1e-3 * dimScore);
+}
+
+TEST(ScoreTests, TinyRegions)
+{
+   // Regions smaller than the filters score without reading outside them
+   std::vector<unsigned short> image = MakeSharpImage<unsigned short>(4095.);
+   const int sizes[][2] = {
+      {1, 1}, {1, 7}, {7, 1}, {2, 2}, {2, 3}, {3, 3}, {3, 64}, {64, 2},
+   };
+   for (int m = 0; m < SharpnessMetricCount; ++m)
+   {
+      SharpnessScorer scorer;
+      scorer.SetMetric((SharpnessMetric)m);
+      for (std::size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+      {
+         // At the far corner of the image
+         const double score = Score(scorer, image, width - sizes[s][0],
+               height - sizes[s][1], sizes[s][0], sizes[s][1]);
+         // Fails for NaN too
+         EXPECT_TRUE(score >= 0.) <<
+            GetSharpnessMetricName((SharpnessMetric)m) << " " <<
+            sizes[s][0] << "x" << sizes[s][1];
+      }
+   }
+}
+
+TEST(ScoreTests, UniformAndBlackImages)
+{
+   std::vector<unsigned char> uniform(width * height, 100);
+   std::vector<unsigned char> black(width * height, 0);
+   for (int m = 0; m < SharpnessMetricCount; ++m)
+   {
+      SharpnessScorer scorer;
+      scorer.SetMetric((SharpnessMetric)m);
+      EXPECT_NEAR(0., Score(scorer, uniform, 0, 0, width, height), 1e-9) <<
+         GetSharpnessMetricName((SharpnessMetric)m);
+      // No division by the zero mean
+      EXPECT_NEAR(0., Score(scorer, black, 0, 0, width, height), 1e-9) <<
+         GetSharpnessMetricName((SharpnessMetric)m);
+   }
+}
+
+TEST(ScoreTests, InvalidRegionsAreRejected)
+{
+   std::vector<unsigned short> image(width * height, 1);
+   const unsigned char* pixels =
+      reinterpret_cast<const unsigned char*>(&image[0]);
+   SharpnessScorer scorer;
+   SharpnessResult result;
+   ASSERT_FALSE(scorer.Score(pixels, width, height, 2, 0, 0, 0, 10, result));
+   ASSERT_FALSE(scorer.Score(pixels, width, height, 2, 0, 0, 10, 0, result));
+   ASSERT_FALSE(scorer.Score(pixels, width, height, 2, -1, 0, 10, 10, result));
+   ASSERT_FALSE(scorer.Score(pixels, width, height, 2, 0, -1, 10, 10, result));
+   ASSERT_FALSE(scorer.Score(pixels, width, height, 2, 90, 0, 10, 10, result));
+   ASSERT_FALSE(scorer.Score(pixels, width, height, 2, 0, 75, 10, 10, result));
+   ASSERT_FALSE(scorer.Score(pixels, width, height, 4, 0, 0, 10, 10, result));
+   ASSERT_FALSE(scorer.Score(0, width, height, 2, 0, 0, 10, 10, result));
+   ASSERT_EQ(0., result.score);
+}
+
+TEST(ScoreTests, TinyCropFactor)
+{
+   std::vector<unsigned short> image = MakeSharpImage<unsigned short>(4095.);
+   ASSERT_EQ(0., GetScore(&image[0], width, height, 0.001));
+   ASSERT_GT(GetScore(&image[0], width, height, 0.05), 0.);
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -23,9 +23,9 @@
 
 #include "TCPIPPort.h"
 
+#include "boost/bind.hpp"
 #include "boost/lexical_cast.hpp"
 #include "boost/format.hpp"
-#include "boost/lambda/bind.hpp"
 #include "boost/lambda/lambda.hpp"
 
 #include "Util.h"
@@ -36,13 +36,21 @@ const char* deviceName = "TCP/IP serial port adapter";
 
 int TCPIPPort::count_ = 0;
 
+// Initial capacity of the receive buffer; it grows if the data is not
+// collected fast enough
+static const size_t readBufferCapacity = 64 * 1024;
+
 TCPIPPort::TCPIPPort(int index) :
 	index_(index),
 	host_("127.0.0.1"),
 	port_(0),
 	initialized_(false),
 	sock_(ios_),
-	answerTimeoutMs_(500)
+	answerTimeoutMs_(500),
+	noDelay_(true),
+	keepAlive_(false),
+	strand_(ios_),
+	readBuffer_(readBufferCapacity)
 {
 	SetErrorText(ERR_BUFFER_OVERRUN, "Buffer overrun occured during read");
 	SetErrorText(ERR_TERM_TIMEOUT, "Timeout occured during init or read");
@@ -52,10 +60,20 @@ TCPIPPort::TCPIPPort(int index) :
 	CreateProperty("Host", "127.0.0.1", MM::String, false, new CPropertyAction(this, &TCPIPPort::OnHost), true);
 	CreateProperty("TCP Port", "0", MM::Integer, false, new CPropertyAction(this, &TCPIPPort::OnPort), true);
 	CreateProperty("Answer timeout", "500", MM::Integer, false, new CPropertyAction(this, &TCPIPPort::OnAnswerTimeout), false);
+
+	// Without TCP_NODELAY, a short command can be held back until the
+	// previous one is acknowledged, which costs a delayed ACK per query
+	CreateProperty("TCP_NODELAY", "Yes", MM::String, false, new CPropertyAction(this, &TCPIPPort::OnNoDelay), false);
+	AddAllowedValue("TCP_NODELAY", "Yes");
+	AddAllowedValue("TCP_NODELAY", "No");
+	CreateProperty("Keep alive", "No", MM::String, false, new CPropertyAction(this, &TCPIPPort::OnKeepAlive), false);
+	AddAllowedValue("Keep alive", "Yes");
+	AddAllowedValue("Keep alive", "No");
 }
 
 TCPIPPort::~TCPIPPort()
 {
+	Shutdown();
 }
 
 bool TCPIPPort::Busy()
@@ -68,6 +86,13 @@ void TCPIPPort::close_sock()
 	sock_.close();
 }
 
+void TCPIPPort::OnConnectDeadline(const boost::system::error_code& ec)
+{
+	// The deadline is cancelled once connected
+	if (!ec)
+		close_sock();
+}
+
 int TCPIPPort::Initialize()
 {
 ERRH_START
@@ -80,17 +105,38 @@ ERRH_START
 
 	boost::system::error_code ec = boost::asio::error::would_block;
 
+	ios_.reset();
+
 	boost::asio::deadline_timer deadline(ios_);
 	deadline.expires_from_now(boost::posix_time::millisec(answerTimeoutMs_));
-	deadline.async_wait(boost::lambda::bind(&TCPIPPort::close_sock, this));
+	deadline.async_wait(boost::bind(&TCPIPPort::OnConnectDeadline, this, boost::asio::placeholders::error));
 	
 	boost::asio::async_connect(sock_, it, boost::lambda::var(ec) = boost::lambda::_1);
 
 	do ios_.run_one(); while (ec == boost::asio::error::would_block);
 
+	// Let the cancelled deadline complete before ios_ is run on ioThread_
+	deadline.cancel();
+	ios_.reset();
+	ios_.poll();
+	ios_.reset();
+
 	if (ec || !sock_.is_open())
 		return ERR_TERM_TIMEOUT;
 
+	ApplySocketOptions(noDelay_, keepAlive_);
+
+	{
+		boost::mutex::scoped_lock g(readLock_);
+		readBuffer_.clear();
+		ioError_.clear();
+	}
+	writeQueue_.clear();
+
+	work_.reset(new boost::asio::io_service::work(ios_));
+	strand_.post(boost::bind(&TCPIPPort::ReadStart, this));
+	ioThread_.reset(new boost::thread(boost::bind(&boost::asio::io_service::run, &ios_)));
+
 	initialized_ = true;
 
 	if (index_ == GetCount())
@@ -104,10 +150,22 @@ ERRH_START
 	if (!initialized_)
 		return DEVICE_OK;
 
-	sock_.shutdown(tcp::socket::shutdown_both);
-	sock_.close();
-
 	initialized_ = false;
+
+	// Stop ioThread_ before touching the socket, then run the aborted
+	// handlers so that none are left for the next connection
+	work_.reset();
+	ios_.stop();
+	if (ioThread_)
+		ioThread_->join();
+	ioThread_.reset();
+
+	boost::system::error_code ec;
+	sock_.shutdown(tcp::socket::shutdown_both, ec);
+	sock_.close(ec);
+
+	ios_.reset();
+	ios_.poll();
 ERRH_END
 }
 
@@ -132,12 +190,16 @@ int TCPIPPort::SetCommand(const char* command, const char* term)
 		if (!initialized_)
 			return ERR_PORT_NOTINITIALIZED;
 
+	int ret = CheckIoError();
+	if (ret != DEVICE_OK)
+		return ret;
+
 	std::string cmd(command);
 
 	if (term != 0)
 		cmd += term;
 
-	boost::asio::write(sock_, boost::asio::buffer(cmd));
+	strand_.post(boost::bind(&TCPIPPort::DoWrite, this, std::vector<char>(cmd.begin(), cmd.end())));
 
 	LogAsciiCommunication("SetCommand", false, cmd);
 	ERRH_END
@@ -155,72 +217,83 @@ ERRH_START
 		LogMessage("BUFFER_OVERRUN error occured!");
 		return ERR_BUFFER_OVERRUN;
 	}
-	std::ostringstream logMsg;
-	unsigned long answerOffset = 0;
 	memset(txt, 0, maxChars);
-	char theData = 0;
-
-	MM::MMTime startTime = GetCurrentMMTime();
-	MM::MMTime answerTimeout(answerTimeoutMs_ * 1000.0);
-	MM::MMTime nonTerminatedAnswerTimeout(5.0 * 1000.0); // For bug-compatibility
-	while ((GetCurrentMMTime() - startTime) < answerTimeout)
+	// leave room for the null character
+	const size_t capacity = maxChars - 1;
+	size_t answerOffset = 0;
+	const size_t termLen = term ? strlen(term) : 0;
+
+	// The deadlines are on a monotonic clock, so that changes to the system
+	// time do not affect the timeout
+	using boost::chrono::steady_clock;
+	steady_clock::time_point startTime = steady_clock::now();
+	steady_clock::time_point deadline = startTime + boost::chrono::milliseconds(answerTimeoutMs_);
+	// For bug-compatibility
+	steady_clock::time_point nonTerminatedDeadline = startTime + boost::chrono::seconds(5);
+	bool nonTerminated = (termLen == 0);
+	if (nonTerminated && nonTerminatedDeadline < deadline)
+		deadline = nonTerminatedDeadline;
+
+	boost::mutex::scoped_lock g(readLock_);
+	for (;;)
 	{
-		boost::asio::socket_base::bytes_readable command(true);
-		sock_.io_control(command);
-		size_t bytes_readable = command.get();
-
-		if (bytes_readable > 0)
-		{
-			sock_.read_some(boost::asio::buffer(&theData, 1));
-
-			if (maxChars <= answerOffset)
-			{
-				txt[answerOffset] = '\0';
-				LogMessage("BUFFER_OVERRUN error occured!");
-				return ERR_BUFFER_OVERRUN;
-			}
-			txt[answerOffset++] = theData;
-		}
-		else
-		{
-			//Yield to other threads:
-			CDeviceUtils::SleepMs(1);
-		}
-
-		// look for the terminator, if any
-		if (term && term[0])
+		// Take everything received up to the terminator at once; only the
+		// newly appended characters are checked, against the end of the
+		// answer, so that a terminator split across reads is found
+		while (answerOffset < capacity && !readBuffer_.empty())
 		{
-			// check for terminating sequence
-			char* termPos = strstr(txt, term);
-			if (termPos != 0) // found the terminator
+			char ch = readBuffer_.front();
+			readBuffer_.pop_front();
+			txt[answerOffset++] = ch;
+			if (termLen > 0 && answerOffset >= termLen && ch == term[termLen - 1] &&
+				memcmp(txt + answerOffset - termLen, term, termLen) == 0)
 			{
+				g.unlock();
 				LogAsciiCommunication("GetAnswer", true, txt);
 
 				// erase the terminator from the answer:
-				*termPos = '\0';
+				txt[answerOffset - termLen] = '\0';
 
 				return DEVICE_OK;
 			}
 		}
-		else
+		if (answerOffset >= capacity)
 		{
+			g.unlock();
+			LogMessage("BUFFER_OVERRUN error occured!");
+			return ERR_BUFFER_OVERRUN;
+		}
+		if (!ioError_.empty())
+		{
+			std::string msg = ioError_;
+			g.unlock();
+			SetErrorText(BOOST_ERROR, msg.c_str());
+			return BOOST_ERROR;
+		}
+
+		if (readCond_.wait_until(g, deadline) == boost::cv_status::no_timeout ||
+				!readBuffer_.empty())
+			continue;
+
+		if (nonTerminated && steady_clock::now() >= nonTerminatedDeadline)
+		{
+			g.unlock();
 			// XXX Shouldn't it be an error to not have a terminator?
 			// TODO Make it a precondition check (immediate error) once we've made
 			// sure that no device adapter calls us without a terminator. For now,
 			// keep the behavior for the sake of bug-compatibility.
-
-			MM::MMTime elapsed = GetCurrentMMTime() - startTime;
-			if (elapsed > nonTerminatedAnswerTimeout)
-			{
-				LogAsciiCommunication("GetAnswer", true, txt);
-				long millisecs = static_cast<long>(elapsed.getMsec());
-				LogMessage(("GetAnswer without terminator returning after " +
-					boost::lexical_cast<std::string>(millisecs) +
-					"msec").c_str(), true);
-				return DEVICE_OK;
-			}
+			LogAsciiCommunication("GetAnswer", true, txt);
+			long millisecs = static_cast<long>(
+				boost::chrono::duration_cast<boost::chrono::milliseconds>(
+					steady_clock::now() - startTime).count());
+			LogMessage(("GetAnswer without terminator returning after " +
+				boost::lexical_cast<std::string>(millisecs) +
+				"msec").c_str(), true);
+			return DEVICE_OK;
 		}
+		break;
 	}
+	g.unlock();
 
 	LogMessage("TERM_TIMEOUT error occured!");
 	return ERR_TERM_TIMEOUT;
@@ -233,7 +306,11 @@ int TCPIPPort::Write(const unsigned char* buf, unsigned long bufLen)
 		if (!initialized_)
 			return ERR_PORT_NOTINITIALIZED;
 
-	boost::asio::write(sock_, boost::asio::buffer(buf, bufLen));
+	int ret = CheckIoError();
+	if (ret != DEVICE_OK)
+		return ret;
+
+	strand_.post(boost::bind(&TCPIPPort::DoWrite, this, std::vector<char>(buf, buf + bufLen)));
 
 	LogBinaryCommunication("Write", false, buf, bufLen);
 	ERRH_END
@@ -250,7 +327,13 @@ int TCPIPPort::Read(unsigned char* buf, unsigned long bufLen, unsigned long& cha
 
 	memset(buf, 0, bufLen);
 
-	charsRead = (unsigned long)boost::asio::read(sock_, boost::asio::buffer(buf, bufLen));
+	{
+		boost::mutex::scoped_lock g(readLock_);
+		size_t n = (std::min)(static_cast<size_t>(bufLen), readBuffer_.size());
+		std::copy(readBuffer_.begin(), readBuffer_.begin() + n, buf);
+		readBuffer_.erase_begin(n);
+		charsRead = static_cast<unsigned long>(n);
+	}
 
 	if (charsRead > 0)
 		LogBinaryCommunication("Read", true, buf, charsRead);
@@ -259,6 +342,8 @@ int TCPIPPort::Read(unsigned char* buf, unsigned long bufLen, unsigned long& cha
 
 int TCPIPPort::Purge()
 {
+	boost::mutex::scoped_lock g(readLock_);
+	readBuffer_.clear();
 	return DEVICE_OK;
 }
 
@@ -320,6 +405,146 @@ int TCPIPPort::OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
 	return DEVICE_OK;
 }
 
+int TCPIPPort::OnNoDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(noDelay_ ? "Yes" : "No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string s;
+		pProp->Get(s);
+		noDelay_ = (s == "Yes");
+		if (initialized_)
+			strand_.post(boost::bind(&TCPIPPort::ApplySocketOptions, this, noDelay_, keepAlive_));
+	}
+
+	return DEVICE_OK;
+}
+
+int TCPIPPort::OnKeepAlive(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(keepAlive_ ? "Yes" : "No");
+	}
+	else if (eAct == MM::AfterSet)
+	{
+		std::string s;
+		pProp->Get(s);
+		keepAlive_ = (s == "Yes");
+		if (initialized_)
+			strand_.post(boost::bind(&TCPIPPort::ApplySocketOptions, this, noDelay_, keepAlive_));
+	}
+
+	return DEVICE_OK;
+}
+
+// Runs on strand_ once ioThread_ is started, like every other socket
+// operation
+void TCPIPPort::ApplySocketOptions(bool noDelay, bool keepAlive)
+{
+	boost::system::error_code ec;
+	sock_.set_option(tcp::no_delay(noDelay), ec);
+	if (!ec)
+		sock_.set_option(boost::asio::socket_base::keep_alive(keepAlive), ec);
+	if (ec)
+		LogMessage(("Failed to set socket options: " + ec.message()).c_str());
+}
+
+// The following run on ioThread_, through strand_
+
+void TCPIPPort::ReadStart()
+{
+	sock_.async_read_some(boost::asio::buffer(readChunk_, readChunkSize),
+		strand_.wrap(boost::bind(&TCPIPPort::ReadComplete, this,
+			boost::asio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred)));
+}
+
+void TCPIPPort::ReadComplete(const boost::system::error_code& ec, std::size_t bytesTransferred)
+{
+	if (ec)
+	{
+		SetIoError(ec);
+		return;
+	}
+
+	{
+		boost::mutex::scoped_lock g(readLock_);
+		if (readBuffer_.reserve() < bytesTransferred)
+			readBuffer_.set_capacity((std::max)(2 * readBuffer_.capacity(),
+				readBuffer_.size() + bytesTransferred));
+		readBuffer_.insert(readBuffer_.end(), readChunk_, readChunk_ + bytesTransferred);
+	}
+	readCond_.notify_all();
+
+	if (sock_.is_open())
+		ReadStart();
+}
+
+void TCPIPPort::DoWrite(const std::vector<char>& data)
+{
+	if (data.empty())
+		return;
+	bool writeInProgress = !writeQueue_.empty();
+	writeQueue_.push_back(data);
+	if (!writeInProgress)
+		WriteStart();
+}
+
+void TCPIPPort::WriteStart()
+{
+	boost::asio::async_write(sock_,
+		boost::asio::buffer(&writeQueue_.front()[0], writeQueue_.front().size()),
+		strand_.wrap(boost::bind(&TCPIPPort::WriteComplete, this,
+			boost::asio::placeholders::error)));
+}
+
+void TCPIPPort::WriteComplete(const boost::system::error_code& ec)
+{
+	if (ec)
+	{
+		writeQueue_.clear();
+		SetIoError(ec);
+		return;
+	}
+
+	writeQueue_.pop_front();
+	if (!writeQueue_.empty())
+		WriteStart();
+}
+
+void TCPIPPort::SetIoError(const boost::system::error_code& ec)
+{
+	// Closing the port aborts the pending operations
+	if (ec == boost::asio::error::operation_aborted)
+		return;
+
+	std::string msg = ec == boost::asio::error::eof ?
+		std::string("Connection closed by the remote host") : ec.message();
+	{
+		boost::mutex::scoped_lock g(readLock_);
+		if (!ioError_.empty())
+			return;
+		ioError_ = msg;
+	}
+	readCond_.notify_all();
+	LogMessage(("TCP/IP connection error: " + msg).c_str(), false);
+}
+
+// Reports a failed read or write on the connection, which is only noticed
+// on ioThread_
+int TCPIPPort::CheckIoError()
+{
+	boost::mutex::scoped_lock g(readLock_);
+	if (ioError_.empty())
+		return DEVICE_OK;
+	SetErrorText(BOOST_ERROR, ioError_.c_str());
+	return BOOST_ERROR;
+}
+
 int TCPIPPort::GetCount()
 {
 	return count_;
@@ -24,8 +24,14 @@
 #pragma once
 
 #include "boost/asio.hpp"
+#include "boost/chrono.hpp"
+#include "boost/circular_buffer.hpp"
+#include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 
+#include <deque>
 #include <istream>
+#include <vector>
 
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
@@ -67,6 +73,8 @@ public:
 	int OnHost(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnPort(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnNoDelay(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnKeepAlive(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 	void close_sock();
 
@@ -84,6 +92,38 @@ private:
 	std::string host_;
 	unsigned short port_;
 	unsigned int answerTimeoutMs_;
+	bool noDelay_;
+	bool keepAlive_;
+
+	// Received data is read by ioThread_, which runs ios_ while the port is
+	// initialized. All socket operations after connecting go through
+	// strand_, so that reads and writes never run concurrently.
+	boost::asio::io_service::strand strand_;
+	boost::scoped_ptr<boost::asio::io_service::work> work_;
+	boost::scoped_ptr<boost::thread> ioThread_;
+
+	static const size_t readChunkSize = 4096;
+	char readChunk_[readChunkSize];
+
+	// Guards readBuffer_ and ioError_; readCond_ is signaled when
+	// characters are added or the connection fails
+	boost::mutex readLock_;
+	boost::condition_variable readCond_;
+	boost::circular_buffer<char> readBuffer_;
+	std::string ioError_;
+
+	// Only accessed on strand_
+	std::deque< std::vector<char> > writeQueue_;
+
+	void OnConnectDeadline(const boost::system::error_code& ec);
+	void ApplySocketOptions(bool noDelay, bool keepAlive);
+	void ReadStart();
+	void ReadComplete(const boost::system::error_code& ec, std::size_t bytesTransferred);
+	void DoWrite(const std::vector<char>& data);
+	void WriteStart();
+	void WriteComplete(const boost::system::error_code& ec);
+	void SetIoError(const boost::system::error_code& ec);
+	int CheckIoError();
 
 	void LogAsciiCommunication(const char * prefix, bool isInput, const std::string & data);
 	void LogBinaryCommunication(const char* prefix, bool isInput, const unsigned char* content, std::size_t length);
@@ -0,0 +1,254 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          Echo-Tests.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Tests and query rate benchmark for TCPIPPort, run against
+//                an echo server on localhost
+//
+// COPYRIGHT:     2017 Lukas Lang
+// LICENSE:       Licensed under the Apache License, Version 2.0 (the "License");
+//                you may not use this file except in compliance with the License.
+//                You may obtain a copy of the License at
+//
+//                http://www.apache.org/licenses/LICENSE-2.0
+//
+//                Unless required by applicable law or agreed to in writing, software
+//                distributed under the License is distributed on an "AS IS" BASIS,
+//                WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//                See the License for the specific language governing permissions and
+//                limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include "TCPIPPort.h"
+#include "Util.h"
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <iostream>
+#include <string>
+
+using boost::asio::ip::tcp;
+
+namespace {
+
+// Accepts one connection on a free localhost port and answers each line,
+// terminated by a carriage return: "SPLIT" with "AB\r" and "\n" in separate
+// writes, "TWO" with two replies in one write, "QUIET" not at all, and
+// anything else with the line itself, replyDelayUs after receiving it
+class EchoServer
+{
+public:
+	EchoServer() :
+		acceptor_(ios_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+		sock_(ios_),
+		replyDelayUs_(0),
+		thread_(0)
+	{
+	}
+
+	~EchoServer()
+	{
+		Stop();
+	}
+
+	unsigned short Port() const { return acceptor_.local_endpoint().port(); }
+	void SetReplyDelayUs(long us) { replyDelayUs_ = us; }
+
+	void Start()
+	{
+		thread_ = new boost::thread(boost::bind(&EchoServer::Run, this));
+	}
+
+	void Stop()
+	{
+		if (thread_)
+		{
+			boost::system::error_code ec;
+			acceptor_.close(ec);
+			sock_.shutdown(tcp::socket::shutdown_both, ec);
+			thread_->join();
+			delete thread_;
+			thread_ = 0;
+		}
+	}
+
+private:
+	void Run()
+	{
+		boost::system::error_code ec;
+		acceptor_.accept(sock_, ec);
+		if (ec)
+			return;
+		tcp::no_delay noDelay(true);
+		sock_.set_option(noDelay, ec);
+
+		std::string line;
+		char buf[1024];
+		for (;;)
+		{
+			size_t n = sock_.read_some(boost::asio::buffer(buf), ec);
+			if (ec)
+				return;
+			for (size_t i = 0; i < n; ++i)
+			{
+				if (buf[i] != '\r')
+				{
+					line += buf[i];
+					continue;
+				}
+				if (replyDelayUs_ > 0)
+					boost::this_thread::sleep(boost::posix_time::microseconds(replyDelayUs_));
+				if (line == "SPLIT")
+				{
+					boost::asio::write(sock_, boost::asio::buffer(std::string("AB\r")), ec);
+					boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+					boost::asio::write(sock_, boost::asio::buffer(std::string("\n")), ec);
+				}
+				else if (line == "TWO")
+					boost::asio::write(sock_, boost::asio::buffer(std::string("ONE\r\nTWO\r\n")), ec);
+				else if (line != "QUIET")
+					boost::asio::write(sock_, boost::asio::buffer(line + "\r"), ec);
+				line.clear();
+			}
+		}
+	}
+
+	boost::asio::io_service ios_;
+	tcp::acceptor acceptor_;
+	tcp::socket sock_;
+	volatile long replyDelayUs_;
+	boost::thread* thread_;
+};
+
+class TCPIPPortEchoTest : public ::testing::Test
+{
+protected:
+	TCPIPPortEchoTest() : port_(0) {}
+
+	virtual void SetUp()
+	{
+		server_.Start();
+		port_ = new TCPIPPort(1);
+		ASSERT_EQ(DEVICE_OK, port_->SetProperty("Host", "127.0.0.1"));
+		ASSERT_EQ(DEVICE_OK, port_->SetProperty("TCP Port", to_string(server_.Port()).c_str()));
+		ASSERT_EQ(DEVICE_OK, port_->SetProperty("Answer timeout", "200"));
+	}
+
+	virtual void TearDown()
+	{
+		delete port_;
+		server_.Stop();
+	}
+
+	double QueriesPerSecond(int n)
+	{
+		char answer[64];
+		boost::posix_time::ptime start =
+			boost::posix_time::microsec_clock::universal_time();
+		for (int i = 0; i < n; ++i)
+		{
+			EXPECT_EQ(DEVICE_OK, port_->SetCommand("WHERE X Y Z", "\r"));
+			EXPECT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r"));
+		}
+		return n / ((boost::posix_time::microsec_clock::universal_time() -
+			start).total_microseconds() / 1e6);
+	}
+
+	EchoServer server_;
+	TCPIPPort* port_;
+};
+
+} // anonymous namespace
+
+
+TEST_F(TCPIPPortEchoTest, AnswerIsReturnedWithoutTerminator)
+{
+	ASSERT_EQ(DEVICE_OK, port_->Initialize());
+	char answer[64];
+	ASSERT_EQ(DEVICE_OK, port_->SetCommand("HELLO", "\r"));
+	ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r"));
+	ASSERT_STREQ("HELLO", answer);
+}
+
+TEST_F(TCPIPPortEchoTest, TerminatorSplitAcrossReads)
+{
+	ASSERT_EQ(DEVICE_OK, port_->Initialize());
+	char answer[64];
+	ASSERT_EQ(DEVICE_OK, port_->SetCommand("SPLIT", "\r"));
+	ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+	ASSERT_STREQ("AB", answer);
+}
+
+TEST_F(TCPIPPortEchoTest, CharactersAfterTerminatorAreKept)
+{
+	ASSERT_EQ(DEVICE_OK, port_->Initialize());
+	char answer[64];
+	ASSERT_EQ(DEVICE_OK, port_->SetCommand("TWO", "\r"));
+	ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+	ASSERT_STREQ("ONE", answer);
+	ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r\n"));
+	ASSERT_STREQ("TWO", answer);
+}
+
+TEST_F(TCPIPPortEchoTest, MissingAnswerTimesOut)
+{
+	ASSERT_EQ(DEVICE_OK, port_->Initialize());
+	char answer[64];
+	ASSERT_EQ(DEVICE_OK, port_->SetCommand("QUIET", "\r"));
+	ASSERT_EQ(ERR_TERM_TIMEOUT, port_->GetAnswer(answer, sizeof(answer), "\r"));
+}
+
+TEST_F(TCPIPPortEchoTest, AnswerLongerThanBufferOverruns)
+{
+	ASSERT_EQ(DEVICE_OK, port_->Initialize());
+	char answer[4];
+	ASSERT_EQ(DEVICE_OK, port_->SetCommand("TOOLONG", "\r"));
+	ASSERT_EQ(ERR_BUFFER_OVERRUN, port_->GetAnswer(answer, sizeof(answer), "\r"));
+}
+
+TEST_F(TCPIPPortEchoTest, ReadReturnsAllAvailableCharacters)
+{
+	ASSERT_EQ(DEVICE_OK, port_->Initialize());
+	ASSERT_EQ(DEVICE_OK, port_->SetCommand("TWO", "\r"));
+	boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+	unsigned char buf[64];
+	unsigned long read = 0;
+	ASSERT_EQ(DEVICE_OK, port_->Read(buf, sizeof(buf), read));
+	ASSERT_EQ(10u, read);
+	ASSERT_EQ(0, memcmp(buf, "ONE\r\nTWO\r\n", 10));
+}
+
+TEST_F(TCPIPPortEchoTest, PurgeDiscardsReceivedCharacters)
+{
+	ASSERT_EQ(DEVICE_OK, port_->Initialize());
+	ASSERT_EQ(DEVICE_OK, port_->SetCommand("STALE", "\r"));
+	boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+	ASSERT_EQ(DEVICE_OK, port_->Purge());
+	char answer[64];
+	ASSERT_EQ(DEVICE_OK, port_->SetCommand("FRESH", "\r"));
+	ASSERT_EQ(DEVICE_OK, port_->GetAnswer(answer, sizeof(answer), "\r"));
+	ASSERT_STREQ("FRESH", answer);
+}
+
+// Run with --gtest_also_run_disabled_tests
+TEST_F(TCPIPPortEchoTest, DISABLED_QueriesPerSecond)
+{
+	ASSERT_EQ(DEVICE_OK, port_->Initialize());
+	std::cout << "Immediate answers: " << (long)QueriesPerSecond(2000) <<
+		" queries per second" << std::endl;
+	// Roughly the turnaround of a controller on the local network
+	server_.SetReplyDelayUs(200);
+	std::cout << "Answers after 200 us: " << (long)QueriesPerSecond(500) <<
+		" queries per second" << std::endl;
+}
+
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -218,7 +218,7 @@ void BFCamera::LogInterrupts() {
 	core_->LogMessage(caller_,message, true );
 }
 
-const unsigned char* BFCamera::GetImageCont() {
+const unsigned char* BFCamera::GetImageCont(bool nextFrame) {
 	//this function returns the location of the buffer that the bitflow boards are DMAing data into,
 	//The boards will continue to overwrite data at this location, so the only way to guarantee
 	//frames aren't lost is if copying data from this buffer is a lot faster than Bitflow can DMA
@@ -243,8 +243,14 @@ const unsigned char* BFCamera::GetImageCont() {
 		//core_->LogMessage(caller_,message, true );
 		//LogInterrupts();
 
+		//With nextFrame, frames that ended before the call are skipped: while streaming
+		//continuously, their data may already be partly overwritten
 		BFU32 numInterrupts;
-		BFRC ret = CiSignalWait(boards_[i], eofSignals_[i], timeoutMs_, &numInterrupts);
+		BFRC ret;
+		if (nextFrame)
+			ret = CiSignalNextWait(boards_[i], eofSignals_[i], timeoutMs_);
+		else
+			ret = CiSignalWait(boards_[i], eofSignals_[i], timeoutMs_, &numInterrupts);
 
 		char message2[200];
 		strcpy(message2,"Interrupts after wait for channel ");
@@ -56,7 +56,7 @@ public:
    int Shutdown();
    unsigned long GetBufferSize() {return (unsigned long)width_ * height_ * depth_ + 2 * MAX_FRAME_OFFSET;}
    unsigned GetNumberOfBuffers() {return (unsigned) boards_.size();}
-   const unsigned char* GetImageCont();
+   const unsigned char* GetImageCont(bool nextFrame = false);
    int StartContinuousAcq() {return StartAcquiring();};
    int StopContinuousAcq() {return StopAcquiring();};
    int StartSequence() {return StartAcquiring();};
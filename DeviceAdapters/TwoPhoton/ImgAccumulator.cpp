@@ -31,16 +31,137 @@
 #include "ImgAccumulator.h"
 #include <math.h>
 #include <assert.h>
+#include <limits.h>
+#include <string.h>
 #include <algorithm>
 #include <iostream>
 using namespace std;
 
+// SSE2 is part of every x64 target; AVX2 is used when the compiler is told
+// to target it (/arch:AVX2, -mavx2). Defining IMGACCUMULATOR_NO_SIMD selects
+// the scalar loops, so that the unit tests can check both.
+#ifndef IMGACCUMULATOR_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMGACCUMULATOR_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define IMGACCUMULATOR_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+namespace {
+
+#ifdef IMGACCUMULATOR_SSE2
+// Widens 16 8 bit pixels to 4 vectors of 32 bit integers
+inline void Widen(__m128i p, __m128i out[4])
+{
+   const __m128i zero = _mm_setzero_si128();
+   __m128i lo = _mm_unpacklo_epi8(p, zero);
+   __m128i hi = _mm_unpackhi_epi8(p, zero);
+   out[0] = _mm_unpacklo_epi16(lo, zero);
+   out[1] = _mm_unpackhi_epi16(lo, zero);
+   out[2] = _mm_unpacklo_epi16(hi, zero);
+   out[3] = _mm_unpackhi_epi16(hi, zero);
+}
+#endif
+
+// acc[j] += src[j]
+void AddRow(unsigned int* acc, const unsigned char* src, unsigned n)
+{
+   unsigned j = 0;
+#if defined(IMGACCUMULATOR_AVX2)
+   for (; j + 16 <= n; j += 16)
+   {
+      __m256i lo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + j)));
+      __m256i hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + j + 8)));
+      __m256i* a = (__m256i*)(acc + j);
+      _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), lo));
+      _mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1), hi));
+   }
+#elif defined(IMGACCUMULATOR_SSE2)
+   for (; j + 16 <= n; j += 16)
+   {
+      __m128i p[4];
+      Widen(_mm_loadu_si128((const __m128i*)(src + j)), p);
+      __m128i* a = (__m128i*)(acc + j);
+      for (int k = 0; k < 4; k++)
+         _mm_storeu_si128(a + k, _mm_add_epi32(_mm_loadu_si128(a + k), p[k]));
+   }
+#endif
+   for (; j < n; j++)
+      acc[j] += src[j];
+}
+
+// acc[j] += src[j] - old[j]; the sum stays exact in unsigned arithmetic
+void AddSubtractRow(unsigned int* acc, const unsigned char* src, const unsigned char* old, unsigned n)
+{
+   unsigned j = 0;
+#if defined(IMGACCUMULATOR_AVX2)
+   for (; j + 8 <= n; j += 8)
+   {
+      __m256i p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + j)));
+      __m256i o = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(old + j)));
+      __m256i* a = (__m256i*)(acc + j);
+      _mm256_storeu_si256(a, _mm256_sub_epi32(_mm256_add_epi32(_mm256_loadu_si256(a), p), o));
+   }
+#elif defined(IMGACCUMULATOR_SSE2)
+   for (; j + 16 <= n; j += 16)
+   {
+      __m128i p[4], o[4];
+      Widen(_mm_loadu_si128((const __m128i*)(src + j)), p);
+      Widen(_mm_loadu_si128((const __m128i*)(old + j)), o);
+      __m128i* a = (__m128i*)(acc + j);
+      for (int k = 0; k < 4; k++)
+         _mm_storeu_si128(a + k, _mm_sub_epi32(_mm_add_epi32(_mm_loadu_si128(a + k), p[k]), o[k]));
+   }
+#endif
+   for (; j < n; j++)
+      acc[j] += (unsigned int)src[j] - old[j];
+}
+
+// out[j] = min(acc[j] >> shift, 255)
+void ShiftToBytes(unsigned char* out, const unsigned int* acc, unsigned shift, long n)
+{
+   long j = 0;
+#ifdef IMGACCUMULATOR_SSE2
+   const __m128i count = _mm_cvtsi32_si128((int)shift);
+   for (; j + 16 <= n; j += 16)
+   {
+      const __m128i* a = (const __m128i*)(acc + j);
+      // the shifted sums are at most 2^31, so the signed pack to 16 bits
+      // saturates them correctly, and the unsigned pack clamps to 255
+      __m128i lo = _mm_packs_epi32(_mm_srl_epi32(_mm_loadu_si128(a), count),
+            _mm_srl_epi32(_mm_loadu_si128(a + 1), count));
+      __m128i hi = _mm_packs_epi32(_mm_srl_epi32(_mm_loadu_si128(a + 2), count),
+            _mm_srl_epi32(_mm_loadu_si128(a + 3), count));
+      _mm_storeu_si128((__m128i*)(out + j), _mm_packus_epi16(lo, hi));
+   }
+#endif
+   for (; j < n; j++)
+      out[j] = (unsigned char) min(acc[j] >> shift, (unsigned int)UCHAR_MAX);
+}
+
+// Returns the base 2 logarithm of n if n is a power of 2, -1 otherwise
+int Log2(unsigned n)
+{
+   if (n == 0 || (n & (n - 1)) != 0)
+      return -1;
+   int shift = 0;
+   while ((1u << shift) != n)
+      shift++;
+   return shift;
+}
+
+} // anonymous namespace
+
 ///////////////////////////////////////////////////////////////////////////////
 // ImgAccumulator class
 // byte depth of 2 does summation
 
 ImgAccumulator::ImgAccumulator() :
-pixels_(0), width_(0), height_(0), pixDepth_(0), length_(1) {
+pixels_(0), historyIndex_(0), rolling_(false), width_(0), height_(0), pixDepth_(0), length_(1) {
    frameIndex_ = 0;
 }
 
@@ -59,13 +180,26 @@ void ImgAccumulator::AddPixels(const void* pix, unsigned sourceWidth, unsigned,
 	//pixels coming in will always be 8 bit
 	const unsigned char* pixPtr = static_cast<const unsigned char*>(pix);
 
+	if (!rolling_) {
+		for (unsigned i=0; i<height_; i++)
+			AddRow(&accumulator_[i*width_], pixPtr + (offsetY+i)*sourceWidth, width_);
+		frameIndex_++;
+		return;
+	}
+
+	// replace the oldest frame of a full window
+	const unsigned frameSize = width_ * height_;
+	unsigned char* slot = &history_[historyIndex_ * frameSize];
 	for (unsigned i=0; i<height_; i++) {
-		for (unsigned j=0; j<width_; j++) {
-			int srcIdx = (offsetY+i)*sourceWidth+j;
-			int idx = i*width_+j;
-			accumulator_[idx] += pixPtr[srcIdx];
-		}
+		const unsigned char* src = pixPtr + (offsetY+i)*sourceWidth;
+		unsigned char* old = slot + i*width_;
+		if (frameIndex_ >= length_)
+			AddSubtractRow(&accumulator_[i*width_], src, old, width_);
+		else
+			AddRow(&accumulator_[i*width_], src, width_);
+		memcpy(old, src, width_);
 	}
+	historyIndex_ = (historyIndex_ + 1) % length_;
 	frameIndex_++;
 }
 
@@ -76,9 +210,9 @@ void ImgAccumulator::ResetPixels()
 		memset(pixels_, 0, width_ * height_ * pixDepth_);
 
 	// reset accumulator
-	accumulator_.clear();
 	accumulator_.assign(width_ * height_, 0);
 
+	historyIndex_ = 0;
 	frameIndex_ = 0;
 }
 
@@ -98,7 +232,6 @@ void ImgAccumulator::Resize(unsigned xSize, unsigned ySize, unsigned pixDepth)
    // initialize content
    memset(pixels_, 0, width_ * height_ * pixDepth_);
    SetupAccumulator();
-   frameIndex_ = 0;
 }
 
 void ImgAccumulator::Resize(unsigned xSize, unsigned ySize)
@@ -114,8 +247,7 @@ void ImgAccumulator::Resize(unsigned xSize, unsigned ySize)
    height_ = ySize;
 
    memset(pixels_, 0, width_ * height_ * pixDepth_);
-   accumulator_.resize(width_ * height_, 0.0);
-   frameIndex_ = 0;
+   SetupAccumulator();
 }
 
 void ImgAccumulator::SetLength(unsigned length)
@@ -124,29 +256,50 @@ void ImgAccumulator::SetLength(unsigned length)
    SetupAccumulator();
 }
 
+void ImgAccumulator::SetRolling(bool rolling)
+{
+   rolling_ = rolling;
+   SetupAccumulator();
+}
+
+/**
+ * Sizes the accumulator, and the window of past frames in rolling mode, and
+ * empties them.
+ */
 void ImgAccumulator::SetupAccumulator() 
 {
-	accumulator_.resize(width_ * height_, 0);
+	accumulator_.assign(width_ * height_, 0);
+	if (rolling_)
+		history_.resize(length_ * width_ * height_);
+	else
+		vector<unsigned char>().swap(history_);
+	historyIndex_ = 0;
+	frameIndex_ = 0;
 }
 
 void ImgAccumulator::CalculateOutputImage()
 {
-	//Do frame averaging
 	long size = width_ * height_;
 
 	if (pixDepth_ == 1) {
-		for (long i=0; i<size; i++) {
-			//divide by number of frames
-			accumulator_[i] *= (1.0/length_);
-			pixels_[i] = (unsigned char) min(accumulator_[i], (double)UCHAR_MAX);
+		//Do frame averaging; a rolling window that is not yet full holds
+		//fewer frames
+		unsigned frames = length_;
+		if (rolling_ && frameIndex_ < length_)
+			frames = max(frameIndex_, 1u);
+		int shift = Log2(frames);
+		if (shift >= 0) {
+			ShiftToBytes(pixels_, &accumulator_[0], shift, size);
+		} else {
+			for (long i=0; i<size; i++)
+				pixels_[i] = (unsigned char) min(accumulator_[i] / frames, (unsigned int)UCHAR_MAX);
 		}
 	} else {
 		//reinterperet as two bytes and write to pixels
 		unsigned short* bufPtr = reinterpret_cast<unsigned short*>(pixels_);
 		for (long i=0; i<size; i++)	{
-			bufPtr[i] = (unsigned short) min(accumulator_[i], (double)USHRT_MAX);
+			bufPtr[i] = (unsigned short) min(accumulator_[i], (unsigned int)USHRT_MAX);
 		}
 	}
 
 }
-
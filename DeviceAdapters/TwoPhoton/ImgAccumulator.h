@@ -42,6 +42,11 @@ public:
    void Resize(unsigned xSize, unsigned ySize, unsigned pixDepth);
    void Resize(unsigned xSize, unsigned ySize);
    void SetLength(unsigned length);
+   // In rolling mode the accumulator holds the sum of the last Length()
+   // frames: each new frame replaces the oldest one, so that a running
+   // average costs the same per frame whatever the length
+   void SetRolling(bool rolling);
+   bool IsRolling() const {return rolling_;}
    //Image accumulator for this channel enabled
    bool IsEnabled() const {return enabled_;}
    void SetEnable(bool s) {enabled_ = s;}
@@ -50,7 +55,12 @@ private:
 	void SetupAccumulator();
 
    unsigned char* pixels_;
-   std::vector<double> accumulator_;
+   // sums of 8 bit pixels; 32 bits hold up to 2^24 frames
+   std::vector<unsigned int> accumulator_;
+   // the frames in the rolling window, oldest at historyIndex_ once full
+   std::vector<unsigned char> history_;
+   unsigned int historyIndex_;
+   bool rolling_;
 
    unsigned int width_;
    unsigned int height_;
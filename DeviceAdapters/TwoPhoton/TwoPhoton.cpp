@@ -43,6 +43,7 @@ const char* g_On = "On";
 const char* g_Off = "Off";
 const char* g_OnWarp = "On+Unwarp";
 const char* g_FrameAverage = "FrameAverage";
+const char* g_RollingAverage = "RollingAverage";
 const char* g_RawFramesToCircularBuffer = "RawFramesToCircularBuffer";
 const char* g_PropertyDeinterlace = "Deinterlace";
 const char* g_PropertyIntegrationMethod = "IntegrationMethod";
@@ -116,6 +117,7 @@ BitFlowCamera::BitFlowCamera(bool dual) :
    cosineWarp_(false),
    channelsProcessed_(false),
    rawFramesToCircularBuffer_(false),
+   rollingAverage_(false),
    frameOffset_(0),
    channelOffsets_(0),
    bfDev_(dual),
@@ -227,6 +229,7 @@ int BitFlowCamera::Initialize()
 
    vector<string> rfValues;
    rfValues.push_back(g_FrameAverage);
+   rfValues.push_back(g_RollingAverage);
    rfValues.push_back(g_RawFramesToCircularBuffer);
    ret = SetAllowedValues(g_PropertyIntegrationMethod, rfValues);
    if (ret != DEVICE_OK)
@@ -325,12 +328,23 @@ int BitFlowCamera::Shutdown()
  */
 int BitFlowCamera::SnapImage()
 {
-	int numFrames = expNumFrames_;
+	return AcquireFrames(expNumFrames_, true, false);
+}
+
+/**
+ * Grabs numFrames frames from all channels into the accumulators, emptying
+ * them first if reset is set. With a rolling average, a sequence acquisition
+ * grabs a single frame per image once the window is full, and keeps the frame
+ * grabber streaming between images (keepStreaming) rather than restarting it
+ * for every frame.
+ */
+int BitFlowCamera::AcquireFrames(int numFrames, bool reset, bool keepStreaming)
+{
 	if (numFrames <= 0)
 		return DEVICE_OK;
 
 	// clear all accumulators (set to zero)
-	if (!rawFramesToCircularBuffer_) {
+	if (reset && !rawFramesToCircularBuffer_) {
 		for (unsigned j=0; j<img_.size(); j++) {
 			img_[j].ResetPixels();
 		}
@@ -338,7 +352,10 @@ int BitFlowCamera::SnapImage()
 
 	if (!bfDev_.isInitialized())
 		return ERR_HARDWARE_NOT_INITIALIZED;
-	bfDev_.StartSequence(); // start streaming mode
+	// the stream may have been left running for a rolling average
+	bool resumed = bfDev_.isAcquiring();
+	if (!resumed)
+		bfDev_.StartSequence(); // start streaming mode
 	for (int k=0; k < numFrames; k++) {
 
 		//char message[100];
@@ -346,7 +363,9 @@ int BitFlowCamera::SnapImage()
 		//strcat(message,CDeviceUtils::ConvertToString(k));
 		//GetCoreCallback()->LogMessage(this, message,true);
 
-		unsigned char* buf = const_cast<unsigned char*>(bfDev_.GetImageCont());      
+		// a frame that ended while the stream was left running may be partly
+		// overwritten by now, so wait for the next one
+		unsigned char* buf = const_cast<unsigned char*>(bfDev_.GetImageCont(resumed && k == 0));
 		if (buf == 0) {
 			ostringstream txt;
 			txt << "Bitflow board failed in streaming mode";
@@ -382,7 +401,8 @@ int BitFlowCamera::SnapImage()
 				img_[i].AddPixels(buf + i*bufLen + GetChannelOffset(i) + BFCamera::MAX_FRAME_OFFSET, bfDev_.Width(), roi_.x, roi_.y); // add image
 		}
 	}
-	bfDev_.StopSequence(); //stop streaming mode
+	if (!keepStreaming)
+		bfDev_.StopSequence(); //stop streaming mode
 
 	//mark that new image needs to be processed by rank filtering or frame averaging before core
 	//can grab it
@@ -759,15 +779,21 @@ int BitFlowCamera::OnFilterMethod(MM::PropertyBase* pProp, MM::ActionType eAct)
 	   pProp->Get(val);
 	   if (val.compare(g_RawFramesToCircularBuffer) == 0) {
 		   rawFramesToCircularBuffer_ = true;
+		   rollingAverage_ = false;
 	   } else {
 		   //frame averaging
 		   rawFramesToCircularBuffer_ = false;
+		   rollingAverage_ = (val.compare(g_RollingAverage) == 0);
 	   }
+	   for (unsigned i=0; i<img_.size(); i++)
+		   img_[i].SetRolling(rollingAverage_);
 	   //resize image accumulators to reflect new byte depth
 	   ResizeImageBuffer();
    } else if (eAct == MM::BeforeGet){
 	   if  (rawFramesToCircularBuffer_) {
 		   pProp->Set(g_RawFramesToCircularBuffer);	
+	   } else if (rollingAverage_) {
+		   pProp->Set(g_RollingAverage);
 	   } else {
 		   pProp->Set(g_FrameAverage);
 	   }
@@ -1004,7 +1030,15 @@ int BitFlowCamera::LiveThread::svc()
       if (stopRunning_)
          break;
 
-      int ret = cam_->SnapImage();
+      // a rolling average needs only the newest frame once the window is
+      // full, and the stream is kept running from one image to the next
+      int ret;
+      if (cam_->rollingAverage_ && imageCounter_ > 0)
+         ret = cam_->AcquireFrames(1, false, true);
+      else if (cam_->rollingAverage_)
+         ret = cam_->AcquireFrames(cam_->expNumFrames_, true, true);
+      else
+         ret = cam_->SnapImage();
 
       if (ret != DEVICE_OK) {
          char txt[1000];
@@ -1075,6 +1109,8 @@ int BitFlowCamera::LiveThread::svc()
          break;
       }
    }
+   // end a stream kept running for a rolling average
+   cam_->bfDev_.StopSequence();
    running_ = false;
    return 0;
 }
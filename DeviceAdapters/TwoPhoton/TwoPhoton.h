@@ -207,12 +207,14 @@ private:
    bool cosineWarp_;
    bool channelsProcessed_;
    bool rawFramesToCircularBuffer_;
+   bool rollingAverage_;
    int frameOffset_;
    std::vector<int> channelOffsets_;
    std::vector<int> pixelLookup_;
    std::vector<int> altPixelLookup_;
    
    int ResizeImageBuffer();
+   int AcquireFrames(int numFrames, bool reset, bool keepStreaming);
    void GenerateSyntheticImage(void* buffer, unsigned width, unsigned height, unsigned depth, double exp);
    int GetChannelOffset(int index);
 
@@ -0,0 +1,136 @@
+#include <gtest/gtest.h>
+
+#include "ImgAccumulator.h"
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+// Built twice: with the SSE2/AVX2 loops that the compiler targets, and with
+// IMGACCUMULATOR_NO_SIMD. Both must give the same images as plain sums.
+
+
+namespace {
+
+// Widths around the vector lengths, so that the scalar tails are exercised
+const unsigned widths[] = { 1, 7, 8, 15, 16, 17, 31, 33, 100 };
+const unsigned height = 3;
+const unsigned offsetY = 2;
+const unsigned sourceWidth = 128;
+const unsigned sourceHeight = offsetY + height;
+
+// Deterministic frames, with values covering the whole 8 bit range
+std::vector<unsigned char> MakeFrame(unsigned seed)
+{
+   std::vector<unsigned char> frame(sourceWidth * sourceHeight);
+   unsigned state = seed * 2654435761u + 1;
+   for (size_t i = 0; i < frame.size(); ++i)
+   {
+      state = state * 1103515245u + 12345u;
+      frame[i] = (unsigned char)(state >> 23);
+   }
+   return frame;
+}
+
+// Sum of the ROI pixels of frames first to last - 1
+std::vector<unsigned> ReferenceSum(unsigned width, unsigned first, unsigned last)
+{
+   std::vector<unsigned> sum(width * height, 0);
+   for (unsigned f = first; f < last; ++f)
+   {
+      std::vector<unsigned char> frame = MakeFrame(f);
+      for (unsigned y = 0; y < height; ++y)
+         for (unsigned x = 0; x < width; ++x)
+            sum[y * width + x] += frame[(offsetY + y) * sourceWidth + x];
+   }
+   return sum;
+}
+
+void ExpectAverage(const ImgAccumulator& acc, const std::vector<unsigned>& sum,
+      unsigned frames)
+{
+   const unsigned char* pixels = acc.GetPixels();
+   for (size_t i = 0; i < sum.size(); ++i)
+      ASSERT_EQ(std::min(sum[i] / frames, (unsigned)UCHAR_MAX), pixels[i]) <<
+         "pixel " << i << " of width " << acc.Width() << ", " << frames <<
+         " frames";
+}
+
+} // anonymous namespace
+
+
+TEST(ImgAccumulatorTests, AverageMatchesReference)
+{
+   const unsigned lengths[] = { 1, 2, 3, 4, 5, 8 };
+   for (unsigned w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w)
+   {
+      for (unsigned l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l)
+      {
+         ImgAccumulator acc;
+         acc.Resize(widths[w], height, 1);
+         acc.SetLength(lengths[l]);
+         acc.ResetPixels();
+         for (unsigned f = 0; f < lengths[l]; ++f)
+            acc.AddPixels(&MakeFrame(f)[0], sourceWidth, 0, offsetY);
+         acc.CalculateOutputImage();
+         ExpectAverage(acc, ReferenceSum(widths[w], 0, lengths[l]), lengths[l]);
+      }
+   }
+}
+
+
+TEST(ImgAccumulatorTests, SumIsClampedTo16Bits)
+{
+   const unsigned frames = 300;
+   for (unsigned w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w)
+   {
+      ImgAccumulator acc;
+      acc.Resize(widths[w], height, 2);
+      acc.SetLength(frames);
+      acc.ResetPixels();
+      for (unsigned f = 0; f < frames; ++f)
+         acc.AddPixels(&MakeFrame(f)[0], sourceWidth, 0, offsetY);
+      acc.CalculateOutputImage();
+
+      std::vector<unsigned> sum = ReferenceSum(widths[w], 0, frames);
+      const unsigned short* pixels =
+         reinterpret_cast<const unsigned short*>(acc.GetPixels());
+      for (size_t i = 0; i < sum.size(); ++i)
+         ASSERT_EQ(std::min(sum[i], (unsigned)USHRT_MAX), pixels[i]) <<
+            "pixel " << i << " of width " << widths[w];
+   }
+}
+
+
+TEST(ImgAccumulatorTests, RollingAverageMatchesReference)
+{
+   const unsigned lengths[] = { 1, 3, 4 };
+   for (unsigned w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w)
+   {
+      for (unsigned l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l)
+      {
+         const unsigned length = lengths[l];
+         ImgAccumulator acc;
+         acc.Resize(widths[w], height, 1);
+         acc.SetLength(length);
+         acc.SetRolling(true);
+         acc.ResetPixels();
+         // Until the window is full, the average is over the frames so far
+         for (unsigned f = 0; f < 3 * length + 2; ++f)
+         {
+            acc.AddPixels(&MakeFrame(f)[0], sourceWidth, 0, offsetY);
+            acc.CalculateOutputImage();
+            const unsigned first = f + 1 > length ? f + 1 - length : 0;
+            ExpectAverage(acc, ReferenceSum(widths[w], first, f + 1),
+                  f + 1 - first);
+         }
+      }
+   }
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -28,12 +28,27 @@
 
 #include "../MMDevice/DeviceUtils.h"
 
+#include <algorithm>
+
 
 const long long bytesInMB = 1 << 20;
-const long adjustThreshold = LONG_MAX / 2;
 const unsigned long maxCBSize = 100000;    //a reasonable limit to circular buffer size
+// Frames allocated in addition to the ring, so that this many slots can be
+// acquired (AcquireSlot()) at once
+const unsigned long spareFrameCount = 4;
+
+// An image processor or the geometric correction may have transposed an
+// image, which then fits in the same slot
+static bool IsSameOrTransposed(unsigned width, unsigned height,
+      unsigned slotWidth, unsigned slotHeight)
+{
+   return (width == slotWidth && height == slotHeight) ||
+      (width == slotHeight && height == slotWidth);
+}
 
 CircularBuffer::CircularBuffer(unsigned int memorySizeMB) :
+   lockFree_(false),
+   hugePages_(false),
    width_(0), 
    height_(0), 
    pixDepth_(0), 
@@ -41,20 +56,46 @@ CircularBuffer::CircularBuffer(unsigned int memorySizeMB) :
    insertIndex_(0), 
    saveIndex_(0), 
    memorySizeMB_(memorySizeMB), 
-   overflow_(false)
+   overflow_(false),
+   ringSize_(0),
+   serialBase_(0),
+   overflowPolicy_(OverflowStop),
+   defaultConsumerLossy_(false),
+   nonLossyCursorCount_(0),
+   imageWaiters_(0)
 {
-   facet = new boost::posix_time::time_facet("%Y-%m-%d %H:%M:%s");
-   tStream.imbue(std::locale(tStream.getloc(), facet));
+   for (int i = 0; i < OverflowPolicyCount; i++)
+      droppedImages_[i].store(0);
 }
 
-CircularBuffer::~CircularBuffer() {}
+CircularBuffer::~CircularBuffer()
+{
+   // Wait for the slots being written into to be committed or aborted
+   for (;;)
+   {
+      {
+         MMThreadGuard insertGuard(g_insertLock);
+         if (acquiredSlots_.empty())
+            break;
+      }
+      CDeviceUtils::SleepMs(1);
+   }
+}
 
 bool CircularBuffer::Initialize(unsigned channels, unsigned int w, unsigned int h, unsigned int pixDepth)
 {
+   MMThreadGuard insertGuard(g_insertLock);
    MMThreadGuard guard(g_bufferLock);
    imageNumbers_.clear();
-   boost::posix_time::ptime t = boost::posix_time::microsec_clock::local_time();
-   startTime_ = GetMMTimeNow(t);
+   startTime_ = GetMMTimeNow();
+   for (int i = 0; i < OverflowPolicyCount; i++)
+      droppedImages_[i].store(0);
+   {
+      MMThreadGuard cursorsGuard(cursorsLock_);
+      for (std::map< std::string, boost::shared_ptr<ReaderCursor> >::iterator
+            it = cursors_.begin(), end = cursors_.end(); it != end; ++it)
+         it->second->dropped.store(0);
+   }
 
    bool ret = true;
    try
@@ -63,17 +104,29 @@ bool CircularBuffer::Initialize(unsigned channels, unsigned int w, unsigned int
          return false; // does not make sense
 
       if (w == width_ && height_ == h && pixDepth_ == pixDepth && channels == numChannels_)
-         if (frameArray_.size() > 0)
+         if (ringSize_ > 0 && frameStore_.WereHugePagesRequested() == hugePages_)
             return true; // nothing to change
 
+      // The storage of acquired slots is still being written into, and that
+      // of leased images still being read
+      if (!acquiredSlots_.empty() || GetLeaseCount() > 0)
+         return false;
+
       width_ = w;
       height_ = h;
       pixDepth_ = pixDepth;
       numChannels_ = channels;
 
-      insertIndex_ = 0;
-      saveIndex_ = 0;
-      overflow_ = false;
+      serialBase_ += insertIndex_.load();
+      insertIndex_.store(0);
+      saveIndex_.store(0);
+      overflow_.store(false);
+      {
+         MMThreadGuard cursorsGuard(cursorsLock_);
+         for (std::map< std::string, boost::shared_ptr<ReaderCursor> >::iterator
+               it = cursors_.begin(), end = cursors_.end(); it != end; ++it)
+            it->second->position.store(0);
+      }
 
       // calculate the size of the entire buffer array once all images get allocated
       // the actual size at the time of the creation is going to be less, because
@@ -84,6 +137,7 @@ bool CircularBuffer::Initialize(unsigned channels, unsigned int w, unsigned int
       if (cbSize == 0) 
       {
          frameArray_.resize(0);
+         ringSize_ = 0;
          return false; // memory footprint too small
       }
 
@@ -91,23 +145,56 @@ bool CircularBuffer::Initialize(unsigned channels, unsigned int w, unsigned int
       if (cbSize > maxCBSize)
          cbSize = maxCBSize; 
 
-      // TODO: verify if we have enough RAM to satisfy this request
-
       for (unsigned long i=0; i<frameArray_.size(); i++)
          frameArray_[i].Clear();
 
+      leaseCounts_.reset();
+      frameSerials_.reset();
+
+      // Reserve the pixel storage for all frames, including the spares, in
+      // one block. This fails if the machine does not have enough RAM to
+      // satisfy the request.
+      const unsigned long frameCount = cbSize + spareFrameCount;
+      const std::size_t channelBytes =
+         mm::FrameStore::RoundUpToAlignment((std::size_t)w * h * pixDepth);
+      ringSize_ = 0;
+      if (!frameStore_.Allocate(frameCount, channelBytes * numChannels_, hugePages_))
+      {
+         frameArray_.resize(0);
+         return false;
+      }
+
       // allocate buffers  - could conceivably throw an out-of-memory exception
-      frameArray_.resize(cbSize);
+      frameArray_.resize(frameCount);
       for (unsigned long i=0; i<frameArray_.size(); i++)
       {
          frameArray_[i].Resize(w, h, pixDepth);
-         frameArray_[i].Preallocate(numChannels_);
+         frameArray_[i].Preallocate(numChannels_, frameStore_.GetSlot(i), channelBytes);
       }
+      leaseCounts_.reset(new boost::atomic<int>[frameCount]);
+      for (unsigned long i=0; i<frameCount; i++)
+         leaseCounts_[i].store(0);
+      frameSerials_.reset(new boost::atomic<long long>[frameCount]);
+      for (unsigned long i=0; i<frameCount; i++)
+         frameSerials_[i].store(-1);
+      ring_.reset(new boost::atomic<unsigned long>[cbSize]);
+      for (unsigned long i=0; i<cbSize; i++)
+         ring_[i].store(i);
+      spareFrames_.clear();
+      for (unsigned long i=cbSize; i<frameCount; i++)
+         spareFrames_.push_back(i);
+      ringSize_ = cbSize;
    }
 
    catch( ... /* std::bad_alloc& ex */)
    {
       frameArray_.resize(0);
+      ringSize_ = 0;
+      frameStore_.Release();
+      leaseCounts_.reset();
+      frameSerials_.reset();
+      ring_.reset();
+      spareFrames_.clear();
       ret = false;
    }
    return ret;
@@ -115,25 +202,436 @@ bool CircularBuffer::Initialize(unsigned channels, unsigned int w, unsigned int
 
 void CircularBuffer::Clear() 
 {
-   MMThreadGuard guard(g_bufferLock); 
-   insertIndex_=0; 
-   saveIndex_=0; 
-   overflow_ = false;
-   boost::posix_time::ptime t = boost::posix_time::microsec_clock::local_time();
-   startTime_ = GetMMTimeNow(t);
+   MMThreadGuard insertGuard(g_insertLock);
+   MMThreadGuard guard(ConsumerLock());
+   AdvanceReaders(insertIndex_.load(boost::memory_order_relaxed), true, false);
+   overflow_.store(false, boost::memory_order_relaxed);
+   startTime_ = GetMMTimeNow();
    imageNumbers_.clear();
 }
 
-unsigned long CircularBuffer::GetSize() const
+/**
+ * Same as Clear(), but counts the discarded images as dropped under
+ * OverflowClearAll. Used when a camera clears the buffer to recover from an
+ * overflow.
+ */
+void CircularBuffer::DropAll()
+{
+   MMThreadGuard insertGuard(g_insertLock);
+   MMThreadGuard guard(ConsumerLock());
+   droppedImages_[OverflowClearAll].fetch_add(
+         AdvanceReaders(insertIndex_.load(boost::memory_order_relaxed), true, true),
+         boost::memory_order_relaxed);
+   overflow_.store(false, boost::memory_order_relaxed);
+   startTime_ = GetMMTimeNow();
+   imageNumbers_.clear();
+}
+
+/**
+ * Moves saveIndex_ and the cursors that are behind target (only non-lossy
+ * ones unless includeLossy) up to target, discarding the frames they skip.
+ * Returns the number of frames discarded by the reader holding slots (see
+ * GetOldestReaderIndex()) that was furthest behind. Must be called with
+ * g_insertLock held.
+ */
+long long CircularBuffer::AdvanceReaders(long long target, bool includeLossy, bool countAsDropped)
+{
+   // Indices never decrease, so a consumer racing with us (in lock-free
+   // mode) fails its compare-and-swap and retries from the new position.
+   long long saveIndex = saveIndex_.load(boost::memory_order_acquire);
+   long long oldest = defaultConsumerLossy_.load(boost::memory_order_acquire) ?
+      target : saveIndex;
+   while (saveIndex < target && !saveIndex_.compare_exchange_weak(saveIndex,
+            target, boost::memory_order_acq_rel, boost::memory_order_acquire))
+      ;
+
+   MMThreadGuard guard(cursorsLock_);
+   for (std::map< std::string, boost::shared_ptr<ReaderCursor> >::iterator
+         it = cursors_.begin(), end = cursors_.end(); it != end; ++it)
+   {
+      ReaderCursor& cursor = *it->second;
+      if (cursor.lossy && !includeLossy)
+         continue;
+      long long position = cursor.position.load(boost::memory_order_acquire);
+      if (!cursor.lossy)
+         oldest = std::min(oldest, position);
+      while (position < target && !cursor.position.compare_exchange_weak(position,
+               target, boost::memory_order_acq_rel, boost::memory_order_acquire))
+         ;
+      if (countAsDropped && position < target)
+         cursor.dropped.fetch_add(target - position, boost::memory_order_relaxed);
+   }
+   return std::max(0LL, target - oldest);
+}
+
+/**
+ * Returns the index of the oldest frame still needed by a reader that holds
+ * slots: the default consumer (at saveIndex) unless it is lossy, and the
+ * non-lossy cursors. Returns insertIndex if no reader holds slots.
+ */
+long long CircularBuffer::GetOldestReaderIndex(long long saveIndex, long long insertIndex) const
+{
+   long long oldest = defaultConsumerLossy_.load(boost::memory_order_acquire) ?
+      insertIndex : saveIndex;
+   if (nonLossyCursorCount_.load(boost::memory_order_acquire) == 0)
+      return oldest;
+
+   MMThreadGuard guard(cursorsLock_);
+   for (std::map< std::string, boost::shared_ptr<ReaderCursor> >::const_iterator
+         it = cursors_.begin(), end = cursors_.end(); it != end; ++it)
+   {
+      if (!it->second->lossy)
+         oldest = std::min(oldest, it->second->position.load(boost::memory_order_acquire));
+   }
+   return oldest;
+}
+
+/**
+ * Makes the default consumer (GetNextImage() and friends) lossy or not. A
+ * lossy default consumer does not hold slots: the producer overwrites the
+ * frames it has not read, and it continues from the oldest frame still in
+ * the buffer. By default it holds slots, as it always has.
+ */
+void CircularBuffer::SetDefaultConsumerLossy(bool lossy)
 {
+   MMThreadGuard insertGuard(g_insertLock);
+   defaultConsumerLossy_.store(lossy, boost::memory_order_release);
+}
+
+/**
+ * Creates a reader cursor positioned after the last inserted frame, so that
+ * it reads the frames inserted from now on. Returns false if a cursor with
+ * the given name exists.
+ */
+bool CircularBuffer::AddCursor(const std::string& name, bool lossy)
+{
+   boost::shared_ptr<ReaderCursor> cursor(new ReaderCursor);
+   cursor->lossy = lossy;
+   cursor->position.store(insertIndex_.load(boost::memory_order_acquire));
+   cursor->dropped.store(0);
+
+   MMThreadGuard guard(cursorsLock_);
+   if (cursors_.count(name))
+      return false;
+   cursors_[name] = cursor;
+   if (!lossy)
+      nonLossyCursorCount_.fetch_add(1, boost::memory_order_release);
+   return true;
+}
+
+/**
+ * Removes a reader cursor, releasing the slots it was holding. Returns false
+ * if there is no cursor with the given name.
+ */
+bool CircularBuffer::RemoveCursor(const std::string& name)
+{
+   MMThreadGuard guard(cursorsLock_);
+   std::map< std::string, boost::shared_ptr<ReaderCursor> >::iterator it =
+      cursors_.find(name);
+   if (it == cursors_.end())
+      return false;
+   if (!it->second->lossy)
+      nonLossyCursorCount_.fetch_sub(1, boost::memory_order_release);
+   cursors_.erase(it);
+   return true;
+}
+
+bool CircularBuffer::HasCursor(const std::string& name) const
+{
+   return FindCursor(name).get() != 0;
+}
+
+/**
+ * Returns the names of the reader cursors, each with whether it is lossy.
+ */
+std::vector< std::pair<std::string, bool> > CircularBuffer::GetCursors() const
+{
+   std::vector< std::pair<std::string, bool> > result;
+   MMThreadGuard guard(cursorsLock_);
+   for (std::map< std::string, boost::shared_ptr<ReaderCursor> >::const_iterator
+         it = cursors_.begin(), end = cursors_.end(); it != end; ++it)
+      result.push_back(std::make_pair(it->first, it->second->lossy));
+   return result;
+}
+
+boost::shared_ptr<CircularBuffer::ReaderCursor>
+CircularBuffer::FindCursor(const std::string& name) const
+{
+   MMThreadGuard guard(cursorsLock_);
+   std::map< std::string, boost::shared_ptr<ReaderCursor> >::const_iterator it =
+      cursors_.find(name);
+   if (it == cursors_.end())
+      return boost::shared_ptr<ReaderCursor>();
+   return it->second;
+}
+
+/**
+* Returns the next frame for the given cursor and advances the cursor, or
+* returns null if the cursor has read all frames (or does not exist).
+*
+* Frames read through a lossy cursor may be overwritten by the producer at
+* any time after they are returned; copy them promptly.
+*/
+const mm::ImgBuffer* CircularBuffer::GetNextImageBuffer(const std::string& cursorName, unsigned channel)
+{
+   boost::shared_ptr<ReaderCursor> cursor = FindCursor(cursorName);
+   if (!cursor)
+      return 0;
+
+   MMThreadGuard guard(ConsumerLock());
+   const long long size = static_cast<long long>(ringSize_);
+   long long position = cursor->position.load(boost::memory_order_acquire);
+   for (;;)
+   {
+      long long insertIndex = insertIndex_.load(boost::memory_order_acquire);
+      if (insertIndex - position < 1)
+         return 0;
+
+      // A lossy cursor that has been overtaken by the producer skips ahead
+      // to the newest frame
+      long long next = position;
+      if (cursor->lossy && insertIndex - position > size)
+         next = insertIndex - 1;
+
+      // Resolved before claiming: once the slot is claimed, the producer
+      // may swap a newer frame into it
+      const mm::FrameBuffer& frame = FrameAt(next);
+      if (cursor->position.compare_exchange_weak(position, next + 1,
+               boost::memory_order_acq_rel, boost::memory_order_acquire))
+      {
+         if (next > position)
+            cursor->dropped.fetch_add(next - position, boost::memory_order_relaxed);
+         return frame.FindImage(channel);
+      }
+   }
+}
+
+/**
+* Leases the next frame of a non-lossy cursor, as LeaseNextImage() does for
+* the default consumer. Returns -1 if there is no frame to read, or no such
+* non-lossy cursor.
+*/
+long long CircularBuffer::LeaseNextImage(const std::string& cursorName)
+{
+   boost::shared_ptr<ReaderCursor> cursor = FindCursor(cursorName);
+   // The producer overwrites frames that lossy cursors have yet to read, so
+   // they cannot be leased
+   if (!cursor || cursor->lossy)
+      return -1;
+
+   MMThreadGuard guard(ConsumerLock());
+   long long position = cursor->position.load(boost::memory_order_acquire);
+   for (;;)
+   {
+      long long insertIndex = insertIndex_.load(boost::memory_order_acquire);
+      if (insertIndex - position < 1)
+         return -1;
+
+      // Pin before claiming, as in LeaseNextImage()
+      unsigned long frame = ring_[(size_t)(position % (long long)ringSize_)].load(
+            boost::memory_order_acquire);
+      leaseCounts_[frame].fetch_add(1, boost::memory_order_acq_rel);
+      if (cursor->position.compare_exchange_weak(position, position + 1,
+               boost::memory_order_acq_rel, boost::memory_order_acquire))
+      {
+         return serialBase_ + position;
+      }
+      leaseCounts_[frame].fetch_sub(1, boost::memory_order_release);
+   }
+}
+
+/**
+* Waits until the given cursor has a frame to read, or timeoutMs has
+* elapsed. Returns whether there is a frame to read (false if there is no
+* such cursor).
+*/
+bool CircularBuffer::WaitForImage(const std::string& cursorName, long timeoutMs)
+{
+   boost::shared_ptr<ReaderCursor> cursor = FindCursor(cursorName);
+   if (!cursor)
+      return false;
+
+   const boost::system_time deadline = boost::get_system_time() +
+      boost::posix_time::milliseconds(std::max(0L, timeoutMs));
+   boost::unique_lock<boost::mutex> lock(imageWaitMutex_);
+   // Seen by producers that store insertIndex_ after this (see
+   // NotifyImageWaiters())
+   imageWaiters_.fetch_add(1);
+   bool available;
+   for (;;)
+   {
+      available = insertIndex_.load() > cursor->position.load();
+      if (available || !imageInserted_.timed_wait(lock, deadline))
+         break;
+   }
+   imageWaiters_.fetch_sub(1);
+   return available || insertIndex_.load() > cursor->position.load();
+}
+
+/**
+* Wakes the threads in WaitForImage(). Called by producers after publishing a
+* frame; takes no lock unless a thread is waiting.
+*/
+void CircularBuffer::NotifyImageWaiters()
+{
+   // Orders the store to insertIndex_ before the load of imageWaiters_: a
+   // waiter either sees the new frame or is counted here
+   boost::atomic_thread_fence(boost::memory_order_seq_cst);
+   if (imageWaiters_.load(boost::memory_order_relaxed) > 0)
+   {
+      boost::lock_guard<boost::mutex> lock(imageWaitMutex_);
+      imageInserted_.notify_all();
+   }
+}
+
+/**
+* Returns the number of frames inserted but not yet read through the given
+* cursor, or -1 if there is no such cursor. For a lossy cursor, this may
+* exceed the capacity of the buffer.
+*/
+long long CircularBuffer::GetCursorLag(const std::string& cursorName) const
+{
+   boost::shared_ptr<ReaderCursor> cursor = FindCursor(cursorName);
+   if (!cursor)
+      return -1;
+   return insertIndex_.load(boost::memory_order_acquire) -
+      cursor->position.load(boost::memory_order_acquire);
+}
+
+/**
+* Returns the number of frames that the given cursor has skipped (if lossy)
+* or lost to the overflow policy, or -1 if there is no such cursor.
+*/
+long long CircularBuffer::GetCursorDroppedImageCount(const std::string& cursorName) const
+{
+   boost::shared_ptr<ReaderCursor> cursor = FindCursor(cursorName);
+   if (!cursor)
+      return -1;
+   return cursor->dropped.load(boost::memory_order_relaxed);
+}
+
+/**
+ * Selects what happens when an image is inserted while the buffer is full.
+ */
+void CircularBuffer::SetOverflowPolicy(OverflowPolicy policy)
+{
+   MMThreadGuard insertGuard(g_insertLock);
+   overflowPolicy_.store(policy);
+}
+
+/**
+ * Returns the number of images lost under the given policy since the buffer
+ * was last initialized. For OverflowStop, this is the number of rejected
+ * insertions.
+ */
+long long CircularBuffer::GetDroppedImageCount(OverflowPolicy policy) const
+{
+   if (policy < 0 || policy >= OverflowPolicyCount)
+      return 0;
+   return droppedImages_[policy].load(boost::memory_order_relaxed);
+}
+
+/**
+ * Selects between the locked (default) and lock-free modes of operation.
+ * Must not be called while images are being inserted or retrieved.
+ */
+void CircularBuffer::SetLockFree(bool lockFree)
+{
+   MMThreadGuard insertGuard(g_insertLock);
    MMThreadGuard guard(g_bufferLock);
-   return (unsigned long)frameArray_.size();
+   lockFree_ = lockFree;
 }
 
-unsigned long CircularBuffer::GetFreeSize() const
+bool CircularBuffer::IsUsingHugePages() const
 {
    MMThreadGuard guard(g_bufferLock);
-   long freeSize = (long)frameArray_.size() - (insertIndex_ - saveIndex_);
+   return frameStore_.IsUsingHugePages();
+}
+
+/**
+ * Returns the number of bytes of frame storage currently backed by physical
+ * memory. This grows towards GetReservedBytes() as the storage is pre-faulted
+ * in the background after Initialize().
+ */
+unsigned long long CircularBuffer::GetCommittedBytes() const
+{
+   MMThreadGuard guard(g_bufferLock);
+   return frameStore_.GetCommittedBytes();
+}
+
+/**
+ * Returns whether the given address lies within the frame storage.
+ */
+bool CircularBuffer::Contains(const void* pixels) const
+{
+   MMThreadGuard guard(ConsumerLock());
+   if (frameStore_.GetReservedBytes() == 0)
+      return false;
+   const unsigned char* p = static_cast<const unsigned char*>(pixels);
+   const unsigned char* begin = frameStore_.GetSlot(0);
+   return p >= begin && p < begin + frameStore_.GetReservedBytes();
+}
+
+/**
+ * Gets the dimensions of the stored image whose pixels include the given
+ * address, which may differ from the buffer's (e.g. for a transposed image).
+ * Returns false if the address is not in the buffer.
+ */
+bool CircularBuffer::GetImageDimensions(const void* pixels, unsigned& width,
+      unsigned& height, unsigned& byteDepth) const
+{
+   MMThreadGuard guard(ConsumerLock());
+   if (frameStore_.GetReservedBytes() == 0)
+      return false;
+   const unsigned char* p = static_cast<const unsigned char*>(pixels);
+   const unsigned char* begin = frameStore_.GetSlot(0);
+   if (p < begin || p >= begin + frameStore_.GetReservedBytes())
+      return false;
+
+   const std::size_t offset = p - begin;
+   const std::size_t slot = offset / frameStore_.GetSlotStride();
+   const std::size_t channelBytes = mm::FrameStore::RoundUpToAlignment(
+         (std::size_t)width_ * height_ * pixDepth_);
+   if (slot >= frameArray_.size() || channelBytes == 0)
+      return false;
+   const mm::ImgBuffer* img = frameArray_[slot].FindImage(
+         (unsigned)((offset % frameStore_.GetSlotStride()) / channelBytes));
+   if (!img)
+      return false;
+   width = img->Width();
+   height = img->Height();
+   byteDepth = img->Depth();
+   return true;
+}
+
+unsigned long long CircularBuffer::GetReservedBytes() const
+{
+   MMThreadGuard guard(g_bufferLock);
+   return frameStore_.GetReservedBytes();
+}
+
+/**
+ * Blocks until all frame storage has been pre-faulted.
+ */
+void CircularBuffer::WaitForPrefault()
+{
+   MMThreadGuard guard(g_bufferLock);
+   frameStore_.WaitForPrefault();
+}
+
+unsigned long CircularBuffer::GetSize() const
+{
+   MMThreadGuard guard(ConsumerLock());
+   return ringSize_;
+}
+
+unsigned long CircularBuffer::GetFreeSize() const
+{
+   MMThreadGuard guard(ConsumerLock());
+   long long insertIndex = insertIndex_.load(boost::memory_order_acquire);
+   long long oldest = GetOldestReaderIndex(
+         saveIndex_.load(boost::memory_order_acquire), insertIndex);
+   long long freeSize = (long long)ringSize_ - (insertIndex - oldest);
    if (freeSize < 0)
       return 0;
    else
@@ -142,8 +640,10 @@ unsigned long CircularBuffer::GetFreeSize() const
 
 unsigned long CircularBuffer::GetRemainingImageCount() const
 {
-   MMThreadGuard guard(g_bufferLock);
-   return (unsigned long)(insertIndex_ - saveIndex_);
+   MMThreadGuard guard(ConsumerLock());
+   long long saveIndex = saveIndex_.load(boost::memory_order_acquire);
+   long long insertIndex = insertIndex_.load(boost::memory_order_acquire);
+   return (unsigned long)(insertIndex - saveIndex);
 }
 
 /**
@@ -175,32 +675,30 @@ bool CircularBuffer::InsertImage(const unsigned char* pixArray, unsigned int wid
 */
 bool CircularBuffer::InsertMultiChannel(const unsigned char* pixArray, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, const Metadata* pMd) throw (CMMError)
 {
-    MMThreadGuard guard(g_insertLock);
+    MMThreadGuard insertGuard(g_insertLock);
  
     mm::ImgBuffer* pImg;
     unsigned long singleChannelSize = (unsigned long)width * height * byteDepth;
+
+    // Only the thread holding g_insertLock modifies insertIndex_
+    const long long insertIndex = insertIndex_.load(boost::memory_order_relaxed);
  
-    {
-       MMThreadGuard guard(g_bufferLock);
- 
-       // check image dimensions
-       if (width != width_ || height != height_ || byteDepth != pixDepth_)
-          throw CMMError("Incompatible image dimensions in the circular buffer", MMERR_CircularBufferIncompatibleImage);
- 
-       bool overflowed = (insertIndex_ - saveIndex_) >= static_cast<long>(frameArray_.size());
-       if (overflowed) {
-          overflow_ = true;
-          return false;
-       }
-    }
+    bool discard;
+    if (!CheckInsertable(width, height, byteDepth, insertIndex, discard))
+       return discard;
  
+    // Mark the frame as being written, for CopyNewestImage()
+    frameSerials_[ring_[(size_t)(insertIndex % ringSize_)].load(
+          boost::memory_order_relaxed)].store(-1, boost::memory_order_relaxed);
+    boost::atomic_thread_fence(boost::memory_order_release);
+
+    Metadata md;
     for (unsigned i=0; i<numChannels; i++)
     {
-       Metadata md;
        {
-          MMThreadGuard guard(g_bufferLock);
+          MMThreadGuard guard(ConsumerLock());
           // we assume that all buffers are pre-allocated
-          pImg = frameArray_[insertIndex_ % frameArray_.size()].FindImage(i);
+          pImg = FrameAt(insertIndex).FindImage(i);
           if (!pImg)
              return false;
  
@@ -210,66 +708,371 @@ bool CircularBuffer::InsertMultiChannel(const unsigned char* pixArray, unsigned
              // Perhaps we need to add specific tags to each channel
              md = *pMd;
           }
+      }
+
+      long long timestamp = AddCoreTags(md, width, height, byteDepth, nComponents);
 
-         std::string cameraName = md.GetSingleTag("Camera").GetValue();
-         if (imageNumbers_.end() == imageNumbers_.find(cameraName))
+      // The slot may hold a frame of other (e.g. transposed) dimensions
+      if (pImg->Width() != width || pImg->Height() != height)
+         pImg->Resize(width, height, byteDepth);
+      pImg->SetMetadata(md);
+      pImg->SetTimestamp(timestamp);
+      pImg->SetPixels(pixArray + i*singleChannelSize);
+   }
+
+   {
+      MMThreadGuard guard(ConsumerLock());
+
+      frameSerials_[ring_[(size_t)(insertIndex % ringSize_)].load(
+            boost::memory_order_relaxed)].store(serialBase_ + insertIndex,
+            boost::memory_order_release);
+      imageCounter_++;
+      // Release: publishes the pixels and metadata written above
+      insertIndex_.store(insertIndex + 1, boost::memory_order_release);
+   }
+   NotifyImageWaiters();
+
+   return true;
+}
+
+/**
+* Hands out a spare frame so that the caller can write a (single-channel)
+* image directly into it, avoiding a copy. No lock is held while the caller
+* writes the pixels.
+*
+* Returns a pointer to width * height * byteDepth writable bytes, or null if
+* the buffer is full and the overflow policy is OverflowStop (in which case
+* the overflow flag is set). If a pointer is returned, the caller must pass
+* it to CommitSlot() or AbortSlot() once it is done writing the pixels. The
+* overflow policy is applied again by CommitSlot(), which may discard the
+* image. Throws if GetSpareFrameCount() slots are already acquired, or if the
+* buffer holds multi-channel images.
+*/
+unsigned char* CircularBuffer::AcquireSlot(unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents) throw (CMMError)
+{
+   MMThreadGuard insertGuard(g_insertLock);
+
+   {
+      MMThreadGuard guard(ConsumerLock());
+      if (!IsSameOrTransposed(width, height, width_, height_) || byteDepth != pixDepth_)
+         throw CMMError("Incompatible image dimensions in the circular buffer", MMERR_CircularBufferIncompatibleImage);
+      // Only channel 0 would be written, leaving the other channels of the
+      // frame with the pixels of an older image
+      if (numChannels_ != 1)
+         throw CMMError("Slots cannot be acquired in a multi-channel circular buffer");
+   }
+   if (spareFrames_.empty())
+      throw CMMError("Too many circular buffer slots acquired at once");
+
+   // Reject early rather than have the caller write an image that is to be
+   // rejected by CommitSlot()
+   if (overflowPolicy_.load(boost::memory_order_relaxed) == OverflowStop &&
+         IsOccupied(insertIndex_.load(boost::memory_order_relaxed)))
+   {
+      overflow_.store(true, boost::memory_order_relaxed);
+      droppedImages_[OverflowStop].fetch_add(1, boost::memory_order_relaxed);
+      return 0;
+   }
+
+   AcquiredSlot acquired;
+   acquired.frame = spareFrames_.back();
+   acquired.nComponents = nComponents;
+   // The frame is not in the ring, so no consumer can be reading it
+   mm::ImgBuffer* img = frameArray_[acquired.frame].FindImage(0);
+   if (!img)
+      return 0;
+   // A frame displaced from the ring may still be being copied by
+   // CopyNewestImage(); mark it as being written
+   frameSerials_[acquired.frame].store(-1, boost::memory_order_relaxed);
+   boost::atomic_thread_fence(boost::memory_order_release);
+   if (img->Width() != width || img->Height() != height)
+      img->Resize(width, height, byteDepth);
+   spareFrames_.pop_back();
+   acquiredSlots_[img->GetPixels()] = acquired;
+   return img->GetPixelsRW();
+}
+
+/**
+* Removes slot from the acquired slots. Must be called with g_insertLock
+* held.
+*/
+bool CircularBuffer::TakeAcquiredSlot(const unsigned char* slot, AcquiredSlot& acquired)
+{
+   std::map<const unsigned char*, AcquiredSlot>::iterator it =
+      acquiredSlots_.find(slot);
+   if (it == acquiredSlots_.end())
+      return false;
+   acquired = it->second;
+   acquiredSlots_.erase(it);
+   return true;
+}
+
+/**
+* Makes the image written into a slot returned by AcquireSlot() available to
+* consumers, attaching the given metadata. Returns false if the image was
+* rejected by the overflow policy (or if slot was not acquired); returns
+* true if it was inserted or discarded by the policy.
+*/
+bool CircularBuffer::CommitSlot(unsigned char* slot, const Metadata* pMd) throw (CMMError)
+{
+   unsigned width, height, byteDepth;
+   if (!GetAcquiredSlot(slot, width, height, byteDepth))
+      return false;
+   return CommitSlot(slot, pMd, width, height);
+}
+
+/**
+* As CommitSlot(unsigned char*, const Metadata*), for an image whose
+* dimensions were changed (without changing its size) after AcquireSlot(),
+* e.g. by a transpose.
+*/
+bool CircularBuffer::CommitSlot(unsigned char* slot, const Metadata* pMd, unsigned int width, unsigned int height) throw (CMMError)
+{
+   MMThreadGuard insertGuard(g_insertLock);
+   AcquiredSlot acquired;
+   if (!TakeAcquiredSlot(slot, acquired))
+      return false;
+
+   mm::ImgBuffer* img = frameArray_[acquired.frame].FindImage(0);
+   const long long insertIndex = insertIndex_.load(boost::memory_order_relaxed);
+   long long timestamp;
+   Metadata md;
+   try
+   {
+      if (!IsSameOrTransposed(width, height, img->Width(), img->Height()))
+         throw CMMError("Incompatible image dimensions in the circular buffer", MMERR_CircularBufferIncompatibleImage);
+      bool discard;
+      if (!CheckInsertable(width, height, img->Depth(), insertIndex, discard))
+      {
+         spareFrames_.push_back(acquired.frame);
+         return discard;
+      }
+      if (width != img->Width() || height != img->Height())
+         img->Resize(width, height, img->Depth());
+      if (pMd)
+         md = *pMd;
+      timestamp = AddCoreTags(md, width, height, img->Depth(),
+            acquired.nComponents);
+   }
+   catch (...)
+   {
+      spareFrames_.push_back(acquired.frame);
+      throw;
+   }
+   img->SetMetadata(md);
+   img->SetTimestamp(timestamp);
+
+   {
+      MMThreadGuard guard(ConsumerLock());
+
+      // Swap the frame into the ring; the one it replaces (which no reader
+      // holds, see CheckInsertable()) becomes a spare
+      boost::atomic<unsigned long>& position = ring_[(size_t)(insertIndex % ringSize_)];
+      spareFrames_.push_back(position.load(boost::memory_order_relaxed));
+      frameSerials_[acquired.frame].store(serialBase_ + insertIndex,
+            boost::memory_order_release);
+      position.store(acquired.frame, boost::memory_order_release);
+
+      imageCounter_++;
+      insertIndex_.store(insertIndex + 1, boost::memory_order_release);
+   }
+   NotifyImageWaiters();
+   return true;
+}
+
+/**
+* Gets the dimensions of a slot returned by AcquireSlot(). Returns false if
+* slot is not an acquired slot.
+*/
+bool CircularBuffer::GetAcquiredSlot(const unsigned char* slot, unsigned& width, unsigned& height, unsigned& byteDepth) const
+{
+   MMThreadGuard insertGuard(g_insertLock);
+   std::map<const unsigned char*, AcquiredSlot>::const_iterator it =
+      acquiredSlots_.find(slot);
+   if (it == acquiredSlots_.end())
+      return false;
+   const mm::ImgBuffer* img = frameArray_[it->second.frame].FindImage(0);
+   width = img->Width();
+   height = img->Height();
+   byteDepth = img->Depth();
+   return true;
+}
+
+/**
+* Returns the number of slots acquired and not yet committed or aborted.
+*/
+unsigned long CircularBuffer::GetAcquiredSlotCount() const
+{
+   MMThreadGuard insertGuard(g_insertLock);
+   return (unsigned long)acquiredSlots_.size();
+}
+
+/**
+* Returns the number of slots that can be acquired at once.
+*/
+unsigned long CircularBuffer::GetSpareFrameCount() const
+{
+   return spareFrameCount;
+}
+
+/**
+* Gives up a slot returned by AcquireSlot() without inserting an image.
+*/
+void CircularBuffer::AbortSlot(unsigned char* slot)
+{
+   MMThreadGuard insertGuard(g_insertLock);
+   AcquiredSlot acquired;
+   if (TakeAcquiredSlot(slot, acquired))
+      spareFrames_.push_back(acquired.frame);
+}
+
+/**
+* Returns whether the frame at insertIndex cannot be overwritten, because
+* the buffer is full or the frame is leased. Must be called with
+* g_insertLock held.
+*/
+bool CircularBuffer::IsOccupied(long long insertIndex) const
+{
+   if (ringSize_ == 0)
+      return true;
+   // Acquire: consumers must be done claiming a slot before we reuse it
+   long long oldest = GetOldestReaderIndex(
+         saveIndex_.load(boost::memory_order_acquire), insertIndex);
+   if (insertIndex - oldest >= (long long)ringSize_)
+      return true;
+   // A leased slot is occupied even though its frame has been popped
+   unsigned long frame = ring_[(size_t)(insertIndex % ringSize_)].load(boost::memory_order_relaxed);
+   return leaseCounts_[frame].load(boost::memory_order_acquire) > 0;
+}
+
+/**
+* Returns the frame at the given index of the stream (modulo the size of the
+* ring).
+*/
+const mm::FrameBuffer& CircularBuffer::FrameAt(long long index) const
+{
+   return frameArray_[ring_[(size_t)(index % (long long)ringSize_)].load(boost::memory_order_acquire)];
+}
+
+/**
+* Checks whether an image can be inserted at insertIndex, making room
+* according to the overflow policy if the buffer is full. Must be called with
+* g_insertLock held.
+*
+* Returns false if the image must not be stored. In that case discard is set
+* if the policy drops the image (so that the insertion counts as successful),
+* and cleared if the insertion is rejected (in which case the overflow flag
+* is set).
+*/
+bool CircularBuffer::CheckInsertable(unsigned width, unsigned height, unsigned byteDepth, long long insertIndex, bool& discard) throw (CMMError)
+{
+   MMThreadGuard guard(ConsumerLock());
+   discard = false;
+
+   // check image dimensions
+   if (!IsSameOrTransposed(width, height, width_, height_) || byteDepth != pixDepth_)
+      throw CMMError("Incompatible image dimensions in the circular buffer", MMERR_CircularBufferIncompatibleImage);
+
+   const long long size = static_cast<long long>(ringSize_);
+   const OverflowPolicy policy = overflowPolicy_.load(boost::memory_order_relaxed);
+   for (;;)
+   {
+      // Acquire: consumers must be done claiming a slot before we reuse it
+      long long oldest = GetOldestReaderIndex(
+            saveIndex_.load(boost::memory_order_acquire), insertIndex);
+      bool full = (insertIndex - oldest) >= size;
+      // A leased slot is occupied even though its frame has been popped
+      bool leased = !full && leaseCounts_[ring_[(size_t)(insertIndex % size)].load(
+               boost::memory_order_relaxed)].load(boost::memory_order_acquire) > 0;
+      if (!full && !leased)
+      {
+         // A lossy default consumer does not hold slots; move it past the
+         // frame about to be overwritten
+         if (defaultConsumerLossy_.load(boost::memory_order_acquire))
          {
-            imageNumbers_[cameraName] = 0;
+            long long saveIndex = saveIndex_.load(boost::memory_order_acquire);
+            while (saveIndex < insertIndex - size + 1 &&
+                  !saveIndex_.compare_exchange_weak(saveIndex, insertIndex - size + 1,
+                     boost::memory_order_acq_rel, boost::memory_order_acquire))
+               ;
          }
-
-         // insert image number. 
-         md.put(MM::g_Keyword_Metadata_ImageNumber, CDeviceUtils::ConvertToString(imageNumbers_[cameraName]));
-         ++imageNumbers_[cameraName];
+         return true;
       }
 
-      boost::posix_time::ptime t = boost::posix_time::microsec_clock::local_time();
-      if (!md.HasTag(MM::g_Keyword_Elapsed_Time_ms))
+      if (policy == OverflowStop)
       {
-         // if time tag was not supplied by the camera insert current timestamp
-         MM::MMTime timestamp = GetMMTimeNow(t);
-         md.PutImageTag(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((timestamp - startTime_).getMsec()));
+         overflow_.store(true, boost::memory_order_relaxed);
+         droppedImages_[OverflowStop].fetch_add(1, boost::memory_order_relaxed);
+         return false;
       }
-      tStream << t;
-      md.PutImageTag(MM::g_Keyword_Metadata_TimeInCore, tStream.str().c_str());
-      tStream.str(std::string());
-      tStream.clear();
-
-      md.PutImageTag("Width",width);
-      md.PutImageTag("Height",height);
-      if (byteDepth == 1)
-         md.PutImageTag("PixelType","GRAY8");
-      else if (byteDepth == 2)
-         md.PutImageTag("PixelType","GRAY16");
-      else if (byteDepth == 4)
+      if (leased || policy == OverflowDropNewest)
       {
-         if (nComponents == 1)
-            md.PutImageTag("PixelType","GRAY32");
-         else
-            md.PutImageTag("PixelType","RGB32");
+         // Discarding queued frames would not free a leased slot
+         discard = true;
+         droppedImages_[OverflowDropNewest].fetch_add(1, boost::memory_order_relaxed);
+         return false;
       }
-      else if (byteDepth == 8)
-         md.PutImageTag("PixelType","RGB64");
-      else
-         md.PutImageTag("PixelType","Unknown"); 
 
-      pImg->SetMetadata(md);
-      pImg->SetPixels(pixArray + i*singleChannelSize);
+      // Make room by moving the readers that hold the oldest slot (the
+      // default consumer and non-lossy cursors; all readers for ClearAll).
+      // In lock-free mode, a consumer may claim the oldest frame first; then
+      // nothing is dropped on its behalf, and we check again.
+      long long target = (policy == OverflowClearAll) ? insertIndex : insertIndex - size + 1;
+      droppedImages_[policy].fetch_add(
+            AdvanceReaders(target, policy == OverflowClearAll, true),
+            boost::memory_order_relaxed);
+      // As with Clear()
+      if (policy == OverflowClearAll)
+         overflow_.store(false, boost::memory_order_relaxed);
+   }
+}
+
+/**
+* Adds the tags that the buffer supplies for every image (image number, time
+* stamps, dimensions and pixel type). Must be called with g_insertLock held.
+* Returns the time stamp of the image (mm::GetMonotonicTimeNs()), which is
+* formatted into the TimeReceivedByCore tag only when the metadata is read.
+*/
+long long CircularBuffer::AddCoreTags(Metadata& md, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents)
+{
+   // imageNumbers_ is protected by g_insertLock
+   std::string cameraName = md.GetSingleTag("Camera").GetValue();
+   if (imageNumbers_.end() == imageNumbers_.find(cameraName))
+   {
+      imageNumbers_[cameraName] = 0;
    }
 
+   // insert image number. 
+   md.put(MM::g_Keyword_Metadata_ImageNumber, imageNumbers_[cameraName]);
+   ++imageNumbers_[cameraName];
+
+   long long now = mm::GetMonotonicTimeNs();
+   if (!md.HasTag(MM::g_Keyword_Elapsed_Time_ms))
    {
-      MMThreadGuard guard(g_bufferLock);
+      // if time tag was not supplied by the camera insert current timestamp
+      MM::MMTime timestamp = mm::MonotonicTimeToMMTime(now);
+      md.PutImageTag(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((timestamp - startTime_).getMsec()));
+   }
 
-      imageCounter_++;
-      insertIndex_++;
-      if ((insertIndex_ - (long)frameArray_.size()) > adjustThreshold && (saveIndex_- (long)frameArray_.size()) > adjustThreshold)
-      {
-         // adjust buffer indices to avoid overflowing integer size
-         insertIndex_ -= adjustThreshold;
-         saveIndex_ -= adjustThreshold;
-      }
+   md.PutImageTag("Width",width);
+   md.PutImageTag("Height",height);
+   if (byteDepth == 1)
+      md.PutImageTag("PixelType","GRAY8");
+   else if (byteDepth == 2)
+      md.PutImageTag("PixelType","GRAY16");
+   else if (byteDepth == 4)
+   {
+      if (nComponents == 1)
+         md.PutImageTag("PixelType","GRAY32");
+      else
+         md.PutImageTag("PixelType","RGB32");
    }
+   else if (byteDepth == 8)
+      md.PutImageTag("PixelType","RGB64");
+   else
+      md.PutImageTag("PixelType","Unknown");
 
-   return true;
+   return now;
 }
  
 
@@ -294,18 +1097,73 @@ const mm::ImgBuffer* CircularBuffer::GetNthFromTopImageBuffer(unsigned long n) c
 const mm::ImgBuffer* CircularBuffer::GetNthFromTopImageBuffer(long n,
       unsigned channel) const
 {
-   MMThreadGuard guard(g_bufferLock);
+   MMThreadGuard guard(ConsumerLock());
 
-   long availableImages = insertIndex_ - saveIndex_;
+   long long saveIndex = saveIndex_.load(boost::memory_order_acquire);
+   long long insertIndex = insertIndex_.load(boost::memory_order_acquire);
+   long long availableImages = insertIndex - saveIndex;
    if (n + 1 > availableImages)
       return 0;
 
-   long targetIndex = insertIndex_ - n - 1L;
-   while (targetIndex < 0)
-      targetIndex += (long) frameArray_.size();
-   targetIndex %= frameArray_.size();
+   return FrameAt(insertIndex - n - 1LL).FindImage(channel);
+}
+
+/**
+* Copies channel 0 of the newest image inserted, whether or not it has been
+* retrieved, without removing it from the buffer. No insertion lock is
+* taken: the frame's serial number is checked after the copy (as in a
+* seqlock), and the copy is retried if a producer started overwriting the
+* frame meanwhile.
+* imageNumber receives the index of the image in the stream inserted since
+* Initialize(), so that a caller polling the buffer can tell new images from
+* old ones.
+* Returns false if no image has been inserted (imageNumber is then -1), if
+* bufferSize is too small (in that case width, height and depth are set to
+* those of the image), or if producers kept overwriting the newest frame
+* during every attempt (imageNumber is then -1).
+*/
+bool CircularBuffer::CopyNewestImage(unsigned char* buffer,
+      unsigned long bufferSize, unsigned& width, unsigned& height,
+      unsigned& depth, long long& imageNumber) const
+{
+   MMThreadGuard guard(ConsumerLock());
+
+   const int maxAttempts = 16;
+   for (int attempt = 0; attempt < maxAttempts; ++attempt)
+   {
+      imageNumber = insertIndex_.load(boost::memory_order_acquire) - 1;
+      if (imageNumber < 0 || ringSize_ == 0)
+      {
+         imageNumber = -1;
+         width = height = depth = 0;
+         return false;
+      }
+      const unsigned long frame = ring_[(size_t)(imageNumber %
+            (long long)ringSize_)].load(boost::memory_order_acquire);
+      const long long serial = serialBase_ + imageNumber;
+      // Acquire: the pixels read below are those published with serial
+      if (frameSerials_[frame].load(boost::memory_order_acquire) != serial)
+         continue; // overwritten or swapped out since we read insertIndex_
 
-   return frameArray_[targetIndex].FindImage(channel);
+      const mm::ImgBuffer* img = frameArray_[frame].FindImage(0);
+      if (!img)
+         break;
+      width = img->Width();
+      height = img->Height();
+      depth = img->Depth();
+      const unsigned long size = width * height * depth;
+      if (bufferSize >= size)
+         memcpy(buffer, img->GetPixels(), size);
+
+      // The pixels (and dimensions) are valid only if no producer started
+      // writing the frame while we were reading it
+      boost::atomic_thread_fence(boost::memory_order_acquire);
+      if (frameSerials_[frame].load(boost::memory_order_relaxed) == serial)
+         return bufferSize >= size;
+   }
+   imageNumber = -1;
+   width = height = depth = 0;
+   return false;
 }
 
 const unsigned char* CircularBuffer::GetNextImage()
@@ -318,13 +1176,117 @@ const unsigned char* CircularBuffer::GetNextImage()
 
 const mm::ImgBuffer* CircularBuffer::GetNextImageBuffer(unsigned channel)
 {
-   MMThreadGuard guard(g_bufferLock);
+   MMThreadGuard guard(ConsumerLock());
+
+   long long saveIndex = saveIndex_.load(boost::memory_order_acquire);
+   for (;;)
+   {
+      long long insertIndex = insertIndex_.load(boost::memory_order_acquire);
+      if (insertIndex - saveIndex < 1)
+         return 0;
+
+      // Claim the frame, resolved first (as in LeaseNextImage()): once it
+      // is claimed, the producer may swap a newer frame into its slot. On
+      // failure (in lock-free mode, because another consumer got there
+      // first or the buffer was cleared), saveIndex is reloaded and we
+      // retry.
+      const mm::FrameBuffer& frame = FrameAt(saveIndex);
+      if (saveIndex_.compare_exchange_weak(saveIndex, saveIndex + 1,
+               boost::memory_order_acq_rel, boost::memory_order_acquire))
+      {
+         return frame.FindImage(channel);
+      }
+   }
+}
+
+/**
+* Pops the next image, like GetNextImageBuffer(), but keeps its slot from
+* being overwritten until ReleaseImage() is called with the returned lease id.
+* Returns -1 if no image is available.
+*/
+long long CircularBuffer::LeaseNextImage()
+{
+   MMThreadGuard guard(ConsumerLock());
+
+   long long saveIndex = saveIndex_.load(boost::memory_order_acquire);
+   for (;;)
+   {
+      long long insertIndex = insertIndex_.load(boost::memory_order_acquire);
+      if (insertIndex - saveIndex < 1)
+         return -1;
+
+      // Pin before claiming, so that the producer (which loads saveIndex_
+      // with acquire semantics) sees the pin once it sees the frame consumed.
+      unsigned long frame = ring_[(size_t)(saveIndex % (long long)ringSize_)].load(
+            boost::memory_order_acquire);
+      leaseCounts_[frame].fetch_add(1, boost::memory_order_acq_rel);
+      if (saveIndex_.compare_exchange_weak(saveIndex, saveIndex + 1,
+               boost::memory_order_acq_rel, boost::memory_order_acquire))
+      {
+         return serialBase_ + saveIndex;
+      }
+      // Lost the race to another consumer; unpin and retry
+      leaseCounts_[frame].fetch_sub(1, boost::memory_order_release);
+   }
+}
 
-   long availableImages = insertIndex_ - saveIndex_;
-   if (availableImages < 1)
+/**
+* Finds the frame holding a leased image. Returns false if leaseId is not
+* the id of an outstanding lease: it was never handed out, was taken before
+* the buffer was reallocated, or was released (and its frame since reused).
+*/
+bool CircularBuffer::FindLeasedFrame(long long leaseId, unsigned long& frame) const
+{
+   const long long index = leaseId - serialBase_;
+   if (index < 0 || index >= insertIndex_.load(boost::memory_order_acquire))
+      return false;
+   frame = ring_[(size_t)(index % (long long)ringSize_)].load(boost::memory_order_acquire);
+   return frameSerials_[frame].load(boost::memory_order_acquire) == leaseId &&
+      leaseCounts_[frame].load(boost::memory_order_acquire) > 0;
+}
+
+/**
+* Returns the given channel of a leased image, or null if leaseId does not
+* refer to an outstanding lease.
+*/
+const mm::ImgBuffer* CircularBuffer::GetLeasedImageBuffer(long long leaseId, unsigned channel) const
+{
+   MMThreadGuard guard(ConsumerLock());
+   unsigned long frame;
+   if (!FindLeasedFrame(leaseId, frame))
       return 0;
+   return frameArray_[frame].FindImage(channel);
+}
+
+/**
+* Ends a lease obtained from LeaseNextImage(), allowing the producer to reuse
+* the slot. Returns false if leaseId does not refer to an outstanding lease.
+*/
+bool CircularBuffer::ReleaseImage(long long leaseId)
+{
+   MMThreadGuard guard(ConsumerLock());
+   unsigned long frame;
+   if (!FindLeasedFrame(leaseId, frame))
+      return false;
+
+   int count = leaseCounts_[frame].load(boost::memory_order_relaxed);
+   do
+   {
+      if (count < 1)
+         return false;
+   } while (!leaseCounts_[frame].compare_exchange_weak(count, count - 1,
+            boost::memory_order_release, boost::memory_order_relaxed));
+   return true;
+}
 
-   long targetIndex = saveIndex_ % frameArray_.size();
-   ++saveIndex_;
-   return frameArray_[targetIndex].FindImage(channel);
+/**
+* Returns the number of outstanding leases.
+*/
+unsigned long CircularBuffer::GetLeaseCount() const
+{
+   MMThreadGuard guard(ConsumerLock());
+   unsigned long count = 0;
+   for (unsigned long i = 0; i < frameArray_.size(); i++)
+      count += leaseCounts_[i].load(boost::memory_order_relaxed);
+   return count;
 }
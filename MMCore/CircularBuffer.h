@@ -27,10 +27,18 @@
 #include "Error.h"
 #include "ErrorCodes.h"
 #include "FrameBuffer.h"
+#include "FrameStore.h"
 
 #include "../MMDevice/DeviceThreads.h"
 #include "../MMDevice/MMDevice.h"
 
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+#include <map>
+#include <string>
 #include <vector>
 #include "boost/date_time/posix_time/posix_time.hpp"
 
@@ -38,10 +46,100 @@
 #pragma warning( disable : 4290 ) // exception declaration warning
 #endif
 
+// Assumed size of a cache line; used to keep the producer- and consumer-side
+// indices of the buffer from sharing a line.
+#define MMCORE_CACHE_LINE_SIZE 64
 
+
+/**
+ * Ring buffer of frames shared between camera (producer) threads and
+ * application (consumer) threads.
+ *
+ * The buffer has two modes, selected with SetLockFree():
+ *
+ * In the default (locked) mode, every access is serialized by g_bufferLock.
+ *
+ * In lock-free mode, consumers never take a lock. Insertion is still
+ * serialized between producers by g_insertLock (which is uncontended when
+ * there is a single camera), but does not block consumers. The contract is:
+ * - The producer fills the slot at insertIndex_ and then publishes it by
+ *   storing insertIndex_ + 1 with release semantics. Consumers load
+ *   insertIndex_ with acquire semantics, so they observe the pixels and
+ *   metadata of every frame they can see.
+ * - Consumers claim a frame by a compare-and-swap on saveIndex_, so each
+ *   frame is popped by exactly one consumer.
+ * - The producer loads saveIndex_ with acquire semantics before reusing a
+ *   slot.
+ * - Initialize() and SetLockFree() must not be called while images are being
+ *   inserted or retrieved.
+ * As in locked mode, a popped frame's slot may be reused by the producer once
+ * the consumer has claimed it, unless the frame was popped with
+ * LeaseNextImage().
+ *
+ * Zero-copy insertion: AcquireSlot() hands out a spare frame, outside the
+ * ring, for the caller to write into; no lock is held until the frame is
+ * committed with CommitSlot(), which swaps it into the ring at insertIndex_
+ * (the frame it replaces becoming a spare). Frames are therefore ordered by
+ * commit, several producers may hold acquired slots at once, and a slot that
+ * is never committed or aborted does not hold up other producers or
+ * consumers. Up to GetSpareFrameCount() slots can be acquired at once.
+ *
+ * Leases: LeaseNextImage() pops a frame and pins its slot, so that the
+ * producer treats the slot as occupied (overflowing rather than overwriting
+ * it) until ReleaseImage() is called. A consumer pins the slot before
+ * claiming the frame, so the producer cannot start rewriting a slot whose
+ * frame has just been leased. A lease id is the serial number of the leased
+ * image, which is never reused by the buffer (not even after Initialize()),
+ * so a stale lease id is rejected rather than taken for a later lease.
+ * Initialize() refuses to reallocate the buffer while images are leased.
+ *
+ * The pixels of all frames are stored in a single mm::FrameStore, whose
+ * pages are committed in the background after Initialize().
+ *
+ * What happens when an image arrives while the buffer is full is selected
+ * with SetOverflowPolicy():
+ * - OverflowStop (default): the image is rejected and the overflow flag is
+ *   set. The camera then stops the acquisition, or (if it was started with
+ *   stopOnOverflow = false) clears the buffer with DropAll() and retries.
+ * - OverflowClearAll: all queued frames are discarded to make room.
+ * - OverflowDropOldest: the oldest queued frame is discarded to make room,
+ *   by advancing saveIndex_ as a consumer would.
+ * - OverflowDropNewest: the arriving image is discarded.
+ * In no case is a leased slot overwritten; if the next slot is leased, the
+ * arriving image is rejected (OverflowStop) or discarded and counted under
+ * OverflowDropNewest (otherwise).
+ * The number of frames lost is counted separately for each policy (see
+ * GetDroppedImageCount()).
+ *
+ * Reader cursors: besides the default consumer position (saveIndex_, used
+ * by GetNextImageBuffer()), any number of named cursors can read the same
+ * stream of frames, each at its own position (AddCursor()). A slot is
+ * reclaimed by the producer once the default consumer and every non-lossy
+ * cursor have passed it; the overflow policy applies to all of them, and
+ * frames that a cursor loses to the policy are counted against that cursor.
+ * Lossy cursors do not hold back the producer: a lossy cursor that has been
+ * overtaken skips ahead to the newest frame, counting the frames skipped.
+ * The default consumer can be made lossy too (SetDefaultConsumerLossy()),
+ * for applications that read only through cursors; the producer then moves
+ * saveIndex_ past the frames it overwrites.
+ * Cursors claim frames by compare-and-swap, so several threads may share a
+ * cursor. Reading through a cursor does not take g_bufferLock in lock-free
+ * mode, but looking the cursor up by name takes cursorsLock_, so it is not
+ * lock-free. While non-lossy cursors are registered, the producer takes
+ * cursorsLock_ too.
+ */
 class CircularBuffer
 {
 public:
+   enum OverflowPolicy
+   {
+      OverflowStop,
+      OverflowClearAll,
+      OverflowDropOldest,
+      OverflowDropNewest,
+      OverflowPolicyCount
+   };
+
    CircularBuffer(unsigned int memorySizeMB);
    ~CircularBuffer();
 
@@ -55,25 +153,98 @@ public:
    unsigned int Width() const {MMThreadGuard guard(g_bufferLock); return width_;}
    unsigned int Height() const {MMThreadGuard guard(g_bufferLock); return height_;}
    unsigned int Depth() const {MMThreadGuard guard(g_bufferLock); return pixDepth_;}
+   unsigned int NumberOfChannels() const {MMThreadGuard guard(g_bufferLock); return numChannels_;}
 
    bool InsertImage(const unsigned char* pixArray, unsigned int width, unsigned int height, unsigned int byteDepth, const Metadata* pMd) throw (CMMError);
    bool InsertMultiChannel(const unsigned char* pixArray, unsigned int numChannels, unsigned int width, unsigned int height, unsigned int byteDepth, const Metadata* pMd) throw (CMMError);
     bool InsertImage(const unsigned char* pixArray, unsigned int width, unsigned int height, unsigned int byteDepth, unsigned int nComponents, const Metadata* pMd) throw (CMMError);
    bool InsertMultiChannel(const unsigned char* pixArray, unsigned int numChannels, unsigned int width, unsigned int height, unsigned int byteDepth, unsigned int nComponents, const Metadata* pMd) throw (CMMError);
+
+   // Zero-copy insertion: the caller writes the pixels directly into the slot
+   unsigned char* AcquireSlot(unsigned int width, unsigned int height, unsigned int byteDepth, unsigned int nComponents) throw (CMMError);
+   bool CommitSlot(unsigned char* slot, const Metadata* pMd) throw (CMMError);
+   bool CommitSlot(unsigned char* slot, const Metadata* pMd, unsigned int width, unsigned int height) throw (CMMError);
+   void AbortSlot(unsigned char* slot);
+   bool GetAcquiredSlot(const unsigned char* slot, unsigned& width, unsigned& height, unsigned& byteDepth) const;
+   unsigned long GetAcquiredSlotCount() const;
+   unsigned long GetSpareFrameCount() const;
    const unsigned char* GetTopImage() const;
    const unsigned char* GetNextImage();
    const mm::ImgBuffer* GetTopImageBuffer(unsigned channel) const;
    const mm::ImgBuffer* GetNthFromTopImageBuffer(unsigned long n) const;
    const mm::ImgBuffer* GetNthFromTopImageBuffer(long n, unsigned channel) const;
    const mm::ImgBuffer* GetNextImageBuffer(unsigned channel);
+
+   bool CopyNewestImage(unsigned char* buffer, unsigned long bufferSize, unsigned& width, unsigned& height, unsigned& depth, long long& imageNumber) const;
+
+   long long LeaseNextImage();
+   long long LeaseNextImage(const std::string& cursorName);
+   bool WaitForImage(const std::string& cursorName, long timeoutMs);
+   const mm::ImgBuffer* GetLeasedImageBuffer(long long leaseId, unsigned channel) const;
+   bool ReleaseImage(long long leaseId);
+   unsigned long GetLeaseCount() const;
    void Clear(); 
+   void DropAll();
+
+   void SetOverflowPolicy(OverflowPolicy policy);
+   OverflowPolicy GetOverflowPolicy() const { return overflowPolicy_.load(); }
+   long long GetDroppedImageCount(OverflowPolicy policy) const;
+
+   void SetDefaultConsumerLossy(bool lossy);
+   bool IsDefaultConsumerLossy() const { return defaultConsumerLossy_.load(); }
+   bool AddCursor(const std::string& name, bool lossy);
+   bool RemoveCursor(const std::string& name);
+   bool HasCursor(const std::string& name) const;
+   std::vector< std::pair<std::string, bool> > GetCursors() const;
+   const mm::ImgBuffer* GetNextImageBuffer(const std::string& cursorName, unsigned channel);
+   long long GetCursorLag(const std::string& cursorName) const;
+   long long GetCursorDroppedImageCount(const std::string& cursorName) const;
+
+   void SetLockFree(bool lockFree);
+   bool IsLockFree() const { return lockFree_; }
+
+   // Takes effect at the next reallocation by Initialize()
+   void SetUseHugePages(bool hugePages) { hugePages_ = hugePages; }
+   bool GetUseHugePages() const { return hugePages_; }
+   bool IsUsingHugePages() const;
+   unsigned long long GetCommittedBytes() const;
+   unsigned long long GetReservedBytes() const;
+   bool Contains(const void* pixels) const;
+   bool GetImageDimensions(const void* pixels, unsigned& width,
+         unsigned& height, unsigned& byteDepth) const;
+   void WaitForPrefault();
 
-   bool Overflow() {MMThreadGuard guard(g_bufferLock); return overflow_;}
+   bool Overflow() {MMThreadGuard guard(ConsumerLock()); return overflow_;}
 
    mutable MMThreadLock g_bufferLock;
    mutable MMThreadLock g_insertLock;
 
 private:
+   // Lock to be taken by consumers: none in lock-free mode
+   MMThreadLock* ConsumerLock() const { return lockFree_ ? 0 : &g_bufferLock; }
+
+   bool CheckInsertable(unsigned int width, unsigned int height, unsigned int byteDepth, long long insertIndex, bool& discard) throw (CMMError);
+   bool IsOccupied(long long insertIndex) const;
+   bool FindLeasedFrame(long long leaseId, unsigned long& frame) const;
+   const mm::FrameBuffer& FrameAt(long long index) const;
+
+   struct ReaderCursor
+   {
+      bool lossy;
+      // Index of the next frame to be read by the cursor
+      boost::atomic<long long> position;
+      // Frames skipped (lossy) or lost to the overflow policy (non-lossy)
+      boost::atomic<long long> dropped;
+   };
+   boost::shared_ptr<ReaderCursor> FindCursor(const std::string& name) const;
+   long long GetOldestReaderIndex(long long saveIndex, long long insertIndex) const;
+   long long AdvanceReaders(long long target, bool includeLossy, bool countAsDropped);
+   long long AddCoreTags(Metadata& md, unsigned int width, unsigned int height, unsigned int byteDepth, unsigned int nComponents);
+   void NotifyImageWaiters();
+
+   bool lockFree_;
+   bool hugePages_;
+
    unsigned int width_;
    unsigned int height_;
    unsigned int pixDepth_;
@@ -84,14 +255,62 @@ private:
    // Invariants:
    // 0 <= saveIndex_ <= insertIndex_
    // insertIndex_ - saveIndex_ <= frameArray_.size()
-   long insertIndex_;
-   long saveIndex_;
+   // The indices are 64-bit and only ever increase (until Initialize()), so
+   // they do not need to be adjusted against overflow.
+   // insertIndex_ is written only by the thread holding g_insertLock.
+   char padBeforeInsert_[MMCORE_CACHE_LINE_SIZE];
+   boost::atomic<long long> insertIndex_;
+   char padBetweenIndices_[MMCORE_CACHE_LINE_SIZE - sizeof(boost::atomic<long long>)];
+   boost::atomic<long long> saveIndex_;
+   char padAfterSave_[MMCORE_CACHE_LINE_SIZE - sizeof(boost::atomic<long long>)];
 
    unsigned long memorySizeMB_;
    unsigned int numChannels_;
-   bool overflow_;
+   boost::atomic<bool> overflow_;
+   mm::FrameStore frameStore_;
+   // The frames of the ring, followed by the spare frames
    std::vector<mm::FrameBuffer> frameArray_;
+   // Number of frames in the ring
+   unsigned long ringSize_;
+   // Index in frameArray_ of the frame at each position of the ring. A
+   // position is changed only by the thread holding g_insertLock, before it
+   // publishes the frame there.
+   boost::scoped_array< boost::atomic<unsigned long> > ring_;
+   // Number of leases on each frame of frameArray_
+   boost::scoped_array< boost::atomic<int> > leaseCounts_;
+   // Serial number of the image held by each frame of frameArray_ (-1 if
+   // none, or while a producer writes into the frame): serialBase_ plus its
+   // index in the stream inserted since Initialize(). serialBase_ grows at
+   // each reallocation, so that serial numbers are never reused.
+   boost::scoped_array< boost::atomic<long long> > frameSerials_;
+   long long serialBase_;
+
+   boost::atomic<OverflowPolicy> overflowPolicy_;
+
+   // Named reader cursors. cursorsLock_ protects the map (not the cursors'
+   // positions); no other lock is taken while it is held.
+   std::map< std::string, boost::shared_ptr<ReaderCursor> > cursors_;
+   mutable MMThreadLock cursorsLock_;
+   boost::atomic<bool> defaultConsumerLossy_;
+   boost::atomic<int> nonLossyCursorCount_;
+
+   // For WaitForImage(): producers signal imageInserted_ only while
+   // imageWaiters_ is non-zero, so that inserting takes no further lock
+   boost::mutex imageWaitMutex_;
+   boost::condition_variable imageInserted_;
+   boost::atomic<int> imageWaiters_;
+
+   // Images lost under each policy since Initialize()
+   boost::atomic<long long> droppedImages_[OverflowPolicyCount];
 
-   boost::posix_time::time_facet * facet;
-   std::ostringstream tStream;
+   // Frames outside the ring, either free (spareFrames_) or handed out by
+   // AcquireSlot() (acquiredSlots_). Protected by g_insertLock.
+   struct AcquiredSlot
+   {
+      unsigned long frame;
+      unsigned int nComponents;
+   };
+   std::vector<unsigned long> spareFrames_;
+   std::map<const unsigned char*, AcquiredSlot> acquiredSlots_;
+   bool TakeAcquiredSlot(const unsigned char* slot, AcquiredSlot& acquired);
 };
@@ -31,12 +31,21 @@
 #include "CircularBuffer.h"
 #include "CoreCallback.h"
 #include "DeviceManager.h"
+#include "ImageProcessingPipeline.h"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <string>
 #include <vector>
 
 
+namespace {
+
+// Tag of images corrected according to the camera's Transpose* properties
+const char* const g_GeometricCorrectionTag = "GeometricCorrectionApplied";
+
+} // anonymous namespace
+
+
 CoreCallback::CoreCallback(CMMCore* c) :
    core_(c),
    pValueChangeLock_(NULL)
@@ -206,6 +215,8 @@ CoreCallback::Sleep(const MM::Device*, double intervalMs)
 /**
  * Get the metadata tags attached to device caller, and merge them with metadata
  * in pMd (if not null). Returns a metadata object.
+ * The camera's tags are parsed only when they have changed (see
+ * CameraInstance::MergeTagsInto()).
  */
 Metadata
 CoreCallback::AddCameraMetadata(const MM::Device* caller, const Metadata* pMd)
@@ -223,23 +234,216 @@ CoreCallback::AddCameraMetadata(const MM::Device* caller, const Metadata* pMd)
    std::string label = camera->GetLabel();
    newMD.put("Camera", label);
 
-   std::string serializedMD;
    try
    {
-      serializedMD = camera->GetTags();
+      camera->MergeTagsInto(newMD);
    }
    catch (const CMMError&)
    {
-      return newMD;
    }
 
-   Metadata devMD;
-   devMD.Restore(serializedMD.c_str());
-   newMD.Merge(devMD);
-
    return newMD;
 }
 
+/**
+ * Returns the circular buffer for images from the caller: the camera's
+ * dedicated buffer if it has one, otherwise the shared buffer. A dedicated
+ * buffer is kept alive by holder.
+ */
+CircularBuffer*
+CoreCallback::GetImageBuffer(const MM::Device* caller,
+      boost::shared_ptr<CircularBuffer>& holder)
+{
+   {
+      MMThreadGuard g(core_->cameraBuffersLock_);
+      if (core_->cameraBuffers_.empty())
+         return core_->cbuf_;
+   }
+
+   try
+   {
+      boost::shared_ptr<DeviceInstance> device =
+         core_->deviceManager_->GetDevice(caller);
+      if (device)
+         return core_->resolveCameraCircularBuffer(device->GetLabel(), holder);
+   }
+   catch (const CMMError&)
+   {
+      // Not a registered device; use the shared buffer
+   }
+   return core_->cbuf_;
+}
+
+/**
+ * Returns the circular buffer receiving the images of the current camera:
+ * its dedicated buffer if it has one, otherwise the shared one.
+ */
+CircularBuffer*
+CoreCallback::GetCurrentCameraBuffer(boost::shared_ptr<CircularBuffer>& holder)
+{
+   boost::shared_ptr<CameraInstance> camera = core_->currentCameraDevice_.lock();
+   if (camera)
+      return core_->resolveCameraCircularBuffer(camera->GetLabel(), holder);
+   return core_->cbuf_;
+}
+
+/**
+ * Returns whether images from the caller that are to be processed go
+ * through the asynchronous processing pipeline.
+ */
+bool
+CoreCallback::IsProcessingAsync(const MM::Device* caller)
+{
+   return core_->imageProcessingPipeline_->IsRunning() &&
+      GetImageProcessor(caller) != 0;
+}
+
+/**
+ * Runs the image processor, if any, on an image in place. The processor may
+ * change the dimensions of the image (but not its size), in which case width
+ * and height are updated.
+ */
+void
+CoreCallback::ProcessImage(const MM::Device* caller, unsigned char* pixels,
+      unsigned& width, unsigned& height, unsigned byteDepth)
+{
+   MM::ImageProcessor* ip = GetImageProcessor(caller);
+   if (!ip)
+      return;
+
+   // The processing pipeline calls this from all its workers at once;
+   // processors that do not declare that they tolerate this are run one
+   // call at a time
+   MMThreadGuard g(ip->IsBandSafe() ? 0 : &imageProcessorLock_);
+
+   unsigned outWidth = width;
+   unsigned outHeight = height;
+   if (ip->GetOutputImageSize(width, height, byteDepth, outWidth, outHeight) != DEVICE_OK ||
+         outWidth * outHeight != width * height)
+   {
+      outWidth = width;
+      outHeight = height;
+   }
+   // A processor that fails leaves the image as it was
+   if (ip->Process(pixels, width, height, byteDepth) != DEVICE_OK)
+      return;
+   width = outWidth;
+   height = outHeight;
+}
+
+int
+CoreCallback::PublishImage(const MM::Device* caller,
+      const unsigned char* pixels, unsigned width, unsigned height,
+      unsigned byteDepth, unsigned nComponents, const Metadata& md)
+{
+   try
+   {
+      Metadata correctedMd(md);
+      return InsertIntoBuffer(caller, pixels, width, height, byteDepth,
+            nComponents, correctedMd);
+   }
+   catch (CMMError& /*e*/)
+   {
+      return DEVICE_INCOMPATIBLE_IMAGE;
+   }
+}
+
+/**
+ * Inserts an image into the caller's circular buffer. If the camera's images
+ * are to be corrected (see PrepareForAcq()), the correction is written
+ * directly into the slot and the image is tagged as corrected.
+ */
+int
+CoreCallback::InsertIntoBuffer(const MM::Device* caller,
+      const unsigned char* pixels, unsigned width, unsigned height,
+      unsigned byteDepth, unsigned nComponents, Metadata& md)
+{
+   boost::shared_ptr<CircularBuffer> holder;
+   CircularBuffer* cbuf = GetImageBuffer(caller, holder);
+
+   mm::GeometricCorrection correction = GetGeometricCorrection(caller);
+   if (correction.IsIdentity())
+   {
+      if (cbuf->InsertImage(pixels, width, height, byteDepth, nComponents, &md))
+         return DEVICE_OK;
+      else
+         return DEVICE_BUFFER_OVERFLOW;
+   }
+
+   unsigned outWidth, outHeight;
+   correction.GetOutputSize(width, height, outWidth, outHeight);
+   unsigned char* slot = cbuf->AcquireSlot(outWidth, outHeight, byteDepth,
+         nComponents);
+   if (!slot)
+      return DEVICE_BUFFER_OVERFLOW;
+   correction.Apply(pixels, slot, width, height, byteDepth);
+   md.put(g_GeometricCorrectionTag, "1");
+   if (cbuf->CommitSlot(slot, &md))
+      return DEVICE_OK;
+   else
+      return DEVICE_BUFFER_OVERFLOW;
+}
+
+void
+CoreCallback::ForgetDevice(const MM::Device* device)
+{
+   MMThreadGuard g(geometricCorrectionLock_);
+   geometricCorrections_.erase(device);
+}
+
+void
+CoreCallback::ForgetAllDevices()
+{
+   MMThreadGuard g(geometricCorrectionLock_);
+   geometricCorrections_.clear();
+}
+
+mm::GeometricCorrection
+CoreCallback::GetGeometricCorrection(const MM::Device* caller)
+{
+   MMThreadGuard g(geometricCorrectionLock_);
+   std::map<const MM::Device*, mm::GeometricCorrection>::const_iterator it =
+      geometricCorrections_.find(caller);
+   if (it == geometricCorrections_.end())
+      return mm::GeometricCorrection();
+   return it->second;
+}
+
+/**
+ * Applies the caller's geometric correction, if any, to an image in place,
+ * updating width and height. Returns whether the image was changed.
+ */
+bool
+CoreCallback::ApplyGeometricCorrection(const MM::Device* caller,
+      unsigned char* pixels, unsigned& width, unsigned& height,
+      unsigned byteDepth)
+{
+   mm::GeometricCorrection correction = GetGeometricCorrection(caller);
+   if (correction.IsIdentity())
+      return false;
+   CorrectionScratch scratch(*this);
+   correction.ApplyInPlace(pixels, width, height, byteDepth, scratch.Get());
+   return true;
+}
+
+CoreCallback::CorrectionScratch::CorrectionScratch(CoreCallback& owner) :
+   owner_(owner)
+{
+   MMThreadGuard g(owner_.correctionScratchLock_);
+   if (!owner_.correctionScratchPool_.empty())
+   {
+      buffer_.swap(owner_.correctionScratchPool_.back());
+      owner_.correctionScratchPool_.pop_back();
+   }
+}
+
+CoreCallback::CorrectionScratch::~CorrectionScratch()
+{
+   MMThreadGuard g(owner_.correctionScratchLock_);
+   owner_.correctionScratchPool_.push_back(std::vector<unsigned char>());
+   owner_.correctionScratchPool_.back().swap(buffer_);
+}
+
 int CoreCallback::InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const char* serializedMetadata, const bool doProcess)
 {
    Metadata md;
@@ -253,18 +457,12 @@ int CoreCallback::InsertImage(const MM::Device* caller, const unsigned char* buf
    {
       Metadata md = AddCameraMetadata(caller, pMd);
 
+      if (doProcess && IsProcessingAsync(caller))
+         return core_->imageProcessingPipeline_->Submit(caller, buf, width, height, byteDepth, 1, md);
+
       if(doProcess)
-      {
-         MM::ImageProcessor* ip = GetImageProcessor(caller);
-         if( NULL != ip)
-         {
-            ip->Process(const_cast<unsigned char*>(buf), width, height, byteDepth);
-         }
-      }
-      if (core_->cbuf_->InsertImage(buf, width, height, byteDepth, &md))
-         return DEVICE_OK;
-      else
-         return DEVICE_BUFFER_OVERFLOW;
+         ProcessImage(caller, const_cast<unsigned char*>(buf), width, height, byteDepth);
+      return InsertIntoBuffer(caller, buf, width, height, byteDepth, 1, md);
    }
    catch (CMMError& /*e*/)
    {
@@ -285,42 +483,167 @@ int CoreCallback::InsertImage(const MM::Device* caller, const unsigned char* buf
    {
       Metadata md = AddCameraMetadata(caller, pMd);
 
+      if (doProcess && IsProcessingAsync(caller))
+         return core_->imageProcessingPipeline_->Submit(caller, buf, width, height, byteDepth, nComponents, md);
+
       if(doProcess)
-      {
-         MM::ImageProcessor* ip = GetImageProcessor(caller);
-         if( NULL != ip)
-         {
-            ip->Process(const_cast<unsigned char*>(buf), width, height, byteDepth);
-         }
-      }
-      if (core_->cbuf_->InsertImage(buf, width, height, byteDepth, nComponents, &md))
+         ProcessImage(caller, const_cast<unsigned char*>(buf), width, height, byteDepth);
+      return InsertIntoBuffer(caller, buf, width, height, byteDepth, nComponents, md);
+   }
+   catch (CMMError& /*e*/)
+   {
+      return DEVICE_INCOMPATIBLE_IMAGE;
+   }
+}
+
+int CoreCallback::InsertImage(const MM::Device* caller, const ImgBuffer & imgBuf)
+{
+   Metadata md = imgBuf.GetMetadata();
+   // Processed by the overload called
+   return InsertImage(caller, imgBuf.GetPixels(), imgBuf.Width(), 
+      imgBuf.Height(), imgBuf.Depth(), &md);
+}
+
+int CoreCallback::AcquireImageSlot(const MM::Device* caller, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, unsigned char** pixels)
+{
+   *pixels = 0;
+
+   // A slot holds one channel; the camera inserts the image with
+   // InsertImage() instead, as for the other channels
+   {
+      boost::shared_ptr<CircularBuffer> holder;
+      if (GetImageBuffer(caller, holder)->NumberOfChannels() != 1)
+         return DEVICE_UNSUPPORTED_COMMAND;
+   }
+
+   // The frame is processed when committed, so hand out a buffer in the
+   // processing pipeline rather than the circular buffer slot
+   if (IsProcessingAsync(caller))
+   {
+      // As for InsertImage(), a frame that failed to be published is
+      // reported to the camera before it writes the next one
+      int error = core_->imageProcessingPipeline_->TakePublishError(caller);
+      if (error != DEVICE_OK)
+         return error;
+      *pixels = core_->imageProcessingPipeline_->AcquireBuffer(caller, width, height, byteDepth, nComponents);
+      if (*pixels)
+         return DEVICE_OK;
+   }
+
+   // A slot that the camera acquired and never committed is given up
+   AcquiredSlot slot;
+   if (TakeAcquiredSlot(caller, slot))
+      slot.buffer->AbortSlot(slot.pixels);
+
+   try
+   {
+      slot.buffer = GetImageBuffer(caller, slot.holder);
+      slot.pixels = slot.buffer->AcquireSlot(width, height, byteDepth, nComponents);
+      if (!slot.pixels)
+         return DEVICE_BUFFER_OVERFLOW;
+      *pixels = slot.pixels;
+      MMThreadGuard g(acquiredSlotsLock_);
+      acquiredSlots_[caller] = slot;
+      return DEVICE_OK;
+   }
+   catch (CMMError& e)
+   {
+      if (e.getCode() == MMERR_CircularBufferIncompatibleImage)
+         return DEVICE_INCOMPATIBLE_IMAGE;
+      return DEVICE_ERR;
+   }
+}
+
+/**
+ * Removes and returns the slot acquired by the caller, if any.
+ */
+bool CoreCallback::TakeAcquiredSlot(const MM::Device* caller, AcquiredSlot& slot)
+{
+   MMThreadGuard g(acquiredSlotsLock_);
+   std::map<const MM::Device*, AcquiredSlot>::iterator it =
+      acquiredSlots_.find(caller);
+   if (it == acquiredSlots_.end())
+      return false;
+   slot = it->second;
+   acquiredSlots_.erase(it);
+   return true;
+}
+
+int CoreCallback::CommitImageSlot(const MM::Device* caller, const char* serializedMetadata, const bool doProcess)
+{
+   Metadata md;
+   md.Restore(serializedMetadata);
+   return CommitImageSlot(caller, &md, doProcess);
+}
+
+int CoreCallback::CommitImageSlot(const MM::Device* caller, const Metadata* pMd, const bool doProcess)
+{
+   if (core_->imageProcessingPipeline_->HasAcquiredBuffer(caller))
+   {
+      Metadata md = AddCameraMetadata(caller, pMd);
+      return core_->imageProcessingPipeline_->CommitBuffer(caller, md, doProcess);
+   }
+
+   AcquiredSlot slot;
+   if (!TakeAcquiredSlot(caller, slot))
+      return DEVICE_ERR;
+   CircularBuffer* cbuf = slot.buffer;
+   unsigned char* pixels = slot.pixels;
+   unsigned width, height, byteDepth;
+   if (!cbuf->GetAcquiredSlot(pixels, width, height, byteDepth))
+      return DEVICE_ERR;
+
+   // The slot must be given back to the buffer whatever happens
+   try
+   {
+      Metadata md = AddCameraMetadata(caller, pMd);
+
+      if (doProcess)
+         ProcessImage(caller, pixels, width, height, byteDepth);
+      if (ApplyGeometricCorrection(caller, pixels, width, height, byteDepth))
+         md.put(g_GeometricCorrectionTag, "1");
+      if (cbuf->CommitSlot(pixels, &md, width, height))
          return DEVICE_OK;
       else
          return DEVICE_BUFFER_OVERFLOW;
    }
    catch (CMMError& /*e*/)
    {
+      cbuf->AbortSlot(pixels);
       return DEVICE_INCOMPATIBLE_IMAGE;
    }
+   catch (...)
+   {
+      cbuf->AbortSlot(pixels);
+      return DEVICE_ERR;
+   }
 }
 
-int CoreCallback::InsertImage(const MM::Device* caller, const ImgBuffer & imgBuf)
+void CoreCallback::AbortImageSlot(const MM::Device* caller)
 {
-   Metadata md = imgBuf.GetMetadata();
-   unsigned char* p = const_cast<unsigned char*>(imgBuf.GetPixels());
-   MM::ImageProcessor* ip = GetImageProcessor(caller);
-   if( NULL != ip)
+   if (core_->imageProcessingPipeline_->HasAcquiredBuffer(caller))
    {
-      ip->Process(p, imgBuf.Width(), imgBuf.Height(), imgBuf.Depth());
+      core_->imageProcessingPipeline_->AbortBuffer(caller);
+      return;
    }
 
-   return InsertImage(caller, imgBuf.GetPixels(), imgBuf.Width(), 
-      imgBuf.Height(), imgBuf.Depth(), &md);
+   AcquiredSlot slot;
+   if (TakeAcquiredSlot(caller, slot))
+      slot.buffer->AbortSlot(slot.pixels);
 }
 
-void CoreCallback::ClearImageBuffer(const MM::Device* /*caller*/)
+void CoreCallback::ClearImageBuffer(const MM::Device* caller)
 {
-   core_->cbuf_->Clear();
+   // Publish the frames still in the pipeline first, so that none of them
+   // reach the buffer after it is cleared. A buffer the camera acquired and
+   // has yet to commit is not waited for, as it can only be committed once
+   // this returns.
+   core_->imageProcessingPipeline_->Drain(caller);
+
+   // Cameras clear the buffer to recover from an overflow, so the discarded
+   // images are counted as dropped
+   boost::shared_ptr<CircularBuffer> holder;
+   GetImageBuffer(caller, holder)->DropAll();
 }
 
 bool CoreCallback::InitializeImageBuffer(unsigned channels, unsigned slices,
@@ -330,7 +653,10 @@ bool CoreCallback::InitializeImageBuffer(unsigned channels, unsigned slices,
    if (slices != 1)
       return false;
 
-   return core_->cbuf_->Initialize(channels, w, h, pixDepth);
+   // The caller is not passed in, so this is the buffer of the current
+   // camera, as for startSequenceAcquisition() without a label
+   boost::shared_ptr<CircularBuffer> holder;
+   return GetCurrentCameraBuffer(holder)->Initialize(channels, w, h, pixDepth);
 }
 
 int CoreCallback::InsertMultiChannel(const MM::Device* caller,
@@ -345,12 +671,42 @@ int CoreCallback::InsertMultiChannel(const MM::Device* caller,
    {
       Metadata md = AddCameraMetadata(caller, pMd);
 
-      MM::ImageProcessor* ip = GetImageProcessor(caller);
-      if( NULL != ip)
+      // Each channel is processed
+      const size_t channelSize = width * height * byteDepth;
+      unsigned procWidth = width;
+      unsigned procHeight = height;
+      for (unsigned i = 0; i < numChannels; ++i)
       {
-         ip->Process( const_cast<unsigned char*>(buf), width, height, byteDepth);
+         unsigned char* channel = const_cast<unsigned char*>(buf) + i * channelSize;
+         procWidth = width;
+         procHeight = height;
+         ProcessImage(caller, channel, procWidth, procHeight, byteDepth);
       }
-      if (core_->cbuf_->InsertMultiChannel(buf, numChannels, width, height, byteDepth, &md))
+
+      boost::shared_ptr<CircularBuffer> holder;
+      CircularBuffer* cbuf = GetImageBuffer(caller, holder);
+      mm::GeometricCorrection correction = GetGeometricCorrection(caller);
+      if (correction.IsIdentity())
+      {
+         if (cbuf->InsertMultiChannel(buf, numChannels, procWidth, procHeight, byteDepth, &md))
+            return DEVICE_OK;
+         else
+            return DEVICE_BUFFER_OVERFLOW;
+      }
+
+      // The camera's buffer is not ours to write; the channels are corrected
+      // into a scratch buffer
+      unsigned outWidth, outHeight;
+      correction.GetOutputSize(procWidth, procHeight, outWidth, outHeight);
+      CorrectionScratch scratch(*this);
+      std::vector<unsigned char>& corrected = scratch.Get();
+      corrected.resize(numChannels * channelSize);
+      for (unsigned i = 0; i < numChannels; ++i)
+         correction.Apply(buf + i * channelSize,
+               &corrected[0] + i * channelSize,
+               procWidth, procHeight, byteDepth);
+      md.put(g_GeometricCorrectionTag, "1");
+      if (cbuf->InsertMultiChannel(&corrected[0], numChannels, outWidth, outHeight, byteDepth, &md))
          return DEVICE_OK;
       else
          return DEVICE_BUFFER_OVERFLOW;
@@ -364,6 +720,33 @@ int CoreCallback::InsertMultiChannel(const MM::Device* caller,
 
 int CoreCallback::AcqFinished(const MM::Device* caller, int /*statusCode*/)
 {
+   // A slot still held by the camera will not be committed
+   AcquiredSlot slot;
+   if (TakeAcquiredSlot(caller, slot))
+   {
+      LOG_WARNING(core_->coreLogger_) << "Camera finished its acquisition "
+         "without committing its image slot; the slot is discarded";
+      slot.buffer->AbortSlot(slot.pixels);
+   }
+   if (core_->imageProcessingPipeline_->HasAcquiredBuffer(caller))
+   {
+      LOG_WARNING(core_->coreLogger_) << "Camera finished its acquisition "
+         "without committing its image buffer; the buffer is discarded";
+      core_->imageProcessingPipeline_->AbortBuffer(caller);
+   }
+
+   // Let the images still being processed reach the buffer, so that the end
+   // of the acquisition is seen after its last image
+   int publishError = core_->imageProcessingPipeline_->Drain(caller);
+   if (publishError != DEVICE_OK)
+   {
+      LOG_ERROR(core_->coreLogger_) << "Images processed asynchronously "
+         "could not all be inserted into the circular buffer (error " <<
+         publishError << "); " <<
+         core_->imageProcessingPipeline_->GetFailedImageCount() <<
+         " failed in total";
+   }
+
    boost::shared_ptr<DeviceInstance> camera;
    try
    {
@@ -385,23 +768,29 @@ int CoreCallback::AcqFinished(const MM::Device* caller, int /*statusCode*/)
          core_->currentShutterDevice_.lock();
       if (shutter)
       {
-         // We need to lock the shutter's module for thread safety, but there's
-         // a case where deadlock would result.
-         if (camera->GetAdapterModule() == shutter->GetAdapterModule())
+         // We need to take the shutter's lock for thread safety, but there's
+         // a case where deadlock would result. Modules that lock per device
+         // (or per hub, when the shutter and camera are on different hubs)
+         // never hit it. Otherwise (the shutter shares the camera's lock,
+         // e.g. in a module that keeps the default per-module lock), the
+         // shutter is still closed without its lock, as before; see
+         // SetDeviceLockGranularity().
+         if (camera->GetLock() == shutter->GetLock())
          {
             // This is a nasty hack to allow the case where the shutter and
-            // camera live in the same module. It is not safe, but this is how
-            // _all_ cases used to be implemented, and I can't immediately
-            // think of a fully safe fix that is reasonably simple.
+            // camera share a lock, because they live in the same module. It
+            // is not safe, but this is how _all_ cases used to be
+            // implemented, and I can't immediately think of a fully safe fix
+            // that is reasonably simple.
             shutter->SetOpen(false);
          }
-         else if (currentCamera && currentCamera->GetAdapterModule() ==
-               shutter->GetAdapterModule())
+         else if (currentCamera && currentCamera->GetLock() ==
+               shutter->GetLock())
          {
             // Likewise, we might be called as a result of a call to
             // StopSequenceAcquisition() on a virtual wrapper camera device
             // (such as Multi Camera), in which case we would get a deadlock if
-            // the shutter is in the same module as the virtual camera.
+            // the shutter shares the virtual camera's lock.
             // This is an even nastier hack in that it ignores the possibility
             // of StopSequenceAcquisition() being called on a camera other than
             // currentCamera, but such cases are rare.
@@ -409,8 +798,7 @@ int CoreCallback::AcqFinished(const MM::Device* caller, int /*statusCode*/)
          }
          else
          {
-            // If the shutter is in a different device adapter, it is safe to
-            // lock that adapter.
+            // If the shutter has a lock of its own, it is safe to take it.
             mm::DeviceModuleLockGuard g(shutter);
             shutter->SetOpen(false);
 
@@ -425,8 +813,29 @@ int CoreCallback::AcqFinished(const MM::Device* caller, int /*statusCode*/)
    return DEVICE_OK;
 }
 
-int CoreCallback::PrepareForAcq(const MM::Device* /*caller*/)
+int CoreCallback::PrepareForAcq(const MM::Device* caller)
 {
+   // The camera's Transpose* properties are read here, on the thread
+   // starting the acquisition, rather than for each image. A camera that
+   // sets TransposeCorrection corrects its images itself.
+   mm::GeometricCorrection correction;
+   try
+   {
+      correction = core_->getGeometricCorrection(
+            core_->deviceManager_->GetDevice(caller));
+   }
+   catch (const CMMError&)
+   {
+      // Not a registered device; its images are left as they are
+   }
+   {
+      MMThreadGuard g(geometricCorrectionLock_);
+      if (correction.IsIdentity())
+         geometricCorrections_.erase(caller);
+      else
+         geometricCorrections_[caller] = correction;
+   }
+
    if (core_->autoShutter_)
    {
       boost::shared_ptr<ShutterInstance> shutter =
@@ -985,6 +1394,111 @@ int CoreCallback::GetChannelConfig(char* channelConfigName, const unsigned int c
    return DEVICE_OK;
 }
 
+/**
+ * Returns the name of the reader cursor through which a device reads the
+ * sequence acquisition it started.
+ */
+std::string
+CoreCallback::GetSequenceCursorName(const MM::Device* caller)
+{
+   char label[MM::MaxStrLength];
+   caller->GetLabel(label);
+   return std::string("device:") + label;
+}
+
+int CoreCallback::StartSequenceAcquisition(const MM::Device* caller, long numImages, double intervalMs)
+{
+   boost::shared_ptr<CameraInstance> camera = core_->currentCameraDevice_.lock();
+   if (!camera)
+      return DEVICE_NOT_CONNECTED;
+
+   // The caller reads through a cursor of its own, leaving the frames to
+   // the application; it is created first so it misses none of them
+   const std::string cursorName = GetSequenceCursorName(caller);
+   boost::shared_ptr<CircularBuffer> holder;
+   CircularBuffer* cbuf = GetCurrentCameraBuffer(holder);
+   cbuf->RemoveCursor(cursorName);
+   cbuf->AddCursor(cursorName, false);
+   try
+   {
+      // The camera's own buffer, if it has one, is initialized by the
+      // labeled form; the shared buffer by the other
+      const std::string label = camera->GetLabel();
+      if (core_->hasCircularBuffer(label.c_str()))
+         core_->startSequenceAcquisition(label.c_str(), numImages, intervalMs, true);
+      else
+         core_->startSequenceAcquisition(numImages, intervalMs, true);
+   }
+   catch (CMMError& e)
+   {
+      // Nothing would read through the cursor, which would hold the frames
+      // of the application's next acquisitions
+      cbuf->RemoveCursor(cursorName);
+      return e.getCode();
+   }
+   return DEVICE_OK;
+}
+
+int CoreCallback::StopSequenceAcquisition(const MM::Device* caller)
+{
+   int ret = DEVICE_OK;
+   try
+   {
+      core_->stopSequenceAcquisition();
+   }
+   catch (CMMError& e)
+   {
+      ret = e.getCode();
+   }
+   // Frames the caller has not read are left to the application
+   boost::shared_ptr<CircularBuffer> holder;
+   GetCurrentCameraBuffer(holder)->RemoveCursor(GetSequenceCursorName(caller));
+   return ret;
+}
+
+long long CoreCallback::LeaseNextImage(const MM::Device* caller, const unsigned char** pixels, unsigned& width, unsigned& height, unsigned& byteDepth, long timeoutMs)
+{
+   *pixels = 0;
+   const std::string cursorName = GetSequenceCursorName(caller);
+   boost::shared_ptr<CircularBuffer> holder;
+   CircularBuffer* cbuf = GetCurrentCameraBuffer(holder);
+   if (!cbuf->WaitForImage(cursorName, timeoutMs))
+      return -1;
+   long long leaseId = cbuf->LeaseNextImage(cursorName);
+   if (leaseId < 0)
+      return -1;
+
+   const mm::ImgBuffer* pBuf = cbuf->GetLeasedImageBuffer(leaseId, 0);
+   if (pBuf == 0)
+   {
+      cbuf->ReleaseImage(leaseId);
+      return -1;
+   }
+   *pixels = pBuf->GetPixels();
+   width = pBuf->Width();
+   height = pBuf->Height();
+   byteDepth = pBuf->Depth();
+   return leaseId;
+}
+
+int CoreCallback::ReleaseImage(const MM::Device*, long long leaseId)
+{
+   boost::shared_ptr<CircularBuffer> holder;
+   if (!GetCurrentCameraBuffer(holder)->ReleaseImage(leaseId))
+      return DEVICE_INVALID_INPUT_PARAM;
+   return DEVICE_OK;
+}
+
+int CoreCallback::CopyNewestImage(const MM::Device*, unsigned char* buffer, unsigned long bufferSize, unsigned& width, unsigned& height, unsigned& byteDepth, long long& imageNumber)
+{
+   boost::shared_ptr<CircularBuffer> holder;
+   bool copied = GetCurrentCameraBuffer(holder)->CopyNewestImage(buffer,
+         bufferSize, width, height, byteDepth, imageNumber);
+   if (!copied && imageNumber >= 0)
+      return DEVICE_BUFFER_OVERFLOW;
+   return DEVICE_OK;
+}
+
 int CoreCallback::GetDeviceProperty(const char* deviceName, const char* propName, char* value)
 {
    try
@@ -1075,6 +1589,10 @@ unsigned long CoreCallback::GetClockTicksUs(const MM::Device* /*caller*/)
 	return (unsigned long) diff.total_microseconds();
 }
 
+/**
+ * Returns the current time from the monotonic clock (see GetMMTimeNow()).
+ * This is cheap enough to be called for every image.
+ */
 MM::MMTime CoreCallback::GetCurrentMMTime()
 {		
 	return GetMMTimeNow();
@@ -27,10 +27,14 @@
 
 #include "Devices/DeviceInstances.h"
 #include "CoreUtils.h"
+#include "GeometricCorrection.h"
 #include "MMCore.h"
 #include "MMEventCallback.h"
 #include "../MMDevice/DeviceUtils.h"
 
+#include <map>
+#include <vector>
+
 namespace mm
 {
    class DeviceManager;
@@ -89,10 +93,15 @@ public:
    int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const char* serializedMetadata, const bool doProcess = true);
    int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, const char* serializedMetadata, const bool doProcess = true);
 
-   /*Deprecated*/ int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* pMd = 0, const bool doProcess = true);
-   /*Deprecated*/ int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, const Metadata* pMd = 0, const bool doProcess = true);
+   int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* pMd = 0, const bool doProcess = true);
+   int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, const Metadata* pMd = 0, const bool doProcess = true);
 
    /*Deprecated*/ int InsertMultiChannel(const MM::Device* caller, const unsigned char* buf, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, Metadata* pMd = 0);
+   int AcquireImageSlot(const MM::Device* caller, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, unsigned char** pixels);
+   int CommitImageSlot(const MM::Device* caller, const Metadata* pMd, const bool doProcess = true);
+   int CommitImageSlot(const MM::Device* caller, const char* serializedMetadata, const bool doProcess = true);
+   void AbortImageSlot(const MM::Device* caller);
+
    void ClearImageBuffer(const MM::Device* caller);
    bool InitializeImageBuffer(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth);
 
@@ -114,6 +123,12 @@ public:
    int GetCurrentConfig(const char* group, int bufLen, char* name);
    int GetChannelConfig(char* channelConfigName, const unsigned int channelConfigIterator);
 
+   int StartSequenceAcquisition(const MM::Device* caller, long numImages, double intervalMs);
+   int StopSequenceAcquisition(const MM::Device* caller);
+   long long LeaseNextImage(const MM::Device* caller, const unsigned char** pixels, unsigned& width, unsigned& height, unsigned& byteDepth, long timeoutMs);
+   int ReleaseImage(const MM::Device* caller, long long leaseId);
+   int CopyNewestImage(const MM::Device* caller, unsigned char* buffer, unsigned long bufferSize, unsigned& width, unsigned& height, unsigned& byteDepth, long long& imageNumber);
+
    // notification handlers
    int OnPropertiesChanged(const MM::Device* caller);
    int OnPropertyChanged(const MM::Device* device, const char* propName, const char* value);
@@ -138,11 +153,76 @@ public:
    void GetLoadedDeviceOfType(const MM::Device* caller, MM::DeviceType devType,
          char* deviceName, const unsigned int deviceIterator);
 
+   // Stages of image processing (see ImageProcessingPipeline). ProcessImage()
+   // updates width and height to those of the processed image.
+   void ProcessImage(const MM::Device* caller, unsigned char* pixels,
+         unsigned& width, unsigned& height, unsigned byteDepth);
+   int PublishImage(const MM::Device* caller, const unsigned char* pixels,
+         unsigned width, unsigned height, unsigned byteDepth,
+         unsigned nComponents, const Metadata& md);
+
+   // Drop what is kept about devices that are being unloaded
+   void ForgetDevice(const MM::Device* device);
+   void ForgetAllDevices();
+
 private:
    CMMCore* core_;
    MMThreadLock* pValueChangeLock_;
 
    Metadata AddCameraMetadata(const MM::Device* caller, const Metadata* pMd);
+   CircularBuffer* GetImageBuffer(const MM::Device* caller,
+         boost::shared_ptr<CircularBuffer>& holder);
+   bool IsProcessingAsync(const MM::Device* caller);
+   // Serializes the calls to image processors that are not band-safe
+   MMThreadLock imageProcessorLock_;
+   CircularBuffer* GetCurrentCameraBuffer(
+         boost::shared_ptr<CircularBuffer>& holder);
+   std::string GetSequenceCursorName(const MM::Device* caller);
+   int InsertIntoBuffer(const MM::Device* caller, const unsigned char* pixels,
+         unsigned width, unsigned height, unsigned byteDepth,
+         unsigned nComponents, Metadata& md);
+
+   // The slot each camera acquired, and the buffer it came from, kept alive
+   // until the slot is committed or aborted even if the camera's buffer is
+   // replaced
+   struct AcquiredSlot
+   {
+      CircularBuffer* buffer;
+      boost::shared_ptr<CircularBuffer> holder;
+      unsigned char* pixels;
+   };
+   std::map<const MM::Device*, AcquiredSlot> acquiredSlots_;
+   MMThreadLock acquiredSlotsLock_;
+   bool TakeAcquiredSlot(const MM::Device* caller, AcquiredSlot& slot);
+
+   // Corrections to be applied to the images of each camera, as found at the
+   // start of its last sequence acquisition (see PrepareForAcq())
+   mm::GeometricCorrection GetGeometricCorrection(const MM::Device* caller);
+   bool ApplyGeometricCorrection(const MM::Device* caller,
+         unsigned char* pixels, unsigned& width, unsigned& height,
+         unsigned byteDepth);
+   std::map<const MM::Device*, mm::GeometricCorrection> geometricCorrections_;
+   MMThreadLock geometricCorrectionLock_;
+
+   // Scratch buffer for a correction, taken from a pool for as long as it
+   // is in scope: images (including those of one camera, from the
+   // processing pipeline's workers) are corrected concurrently, without a
+   // lock held, and without allocating in the steady state
+   class CorrectionScratch
+   {
+   public:
+      explicit CorrectionScratch(CoreCallback& owner);
+      ~CorrectionScratch();
+      std::vector<unsigned char>& Get() { return buffer_; }
+   private:
+      CorrectionScratch(const CorrectionScratch&);
+      CorrectionScratch& operator=(const CorrectionScratch&);
+      CoreCallback& owner_;
+      std::vector<unsigned char> buffer_;
+   };
+   friend class CorrectionScratch;
+   std::vector< std::vector<unsigned char> > correctionScratchPool_;
+   MMThreadLock correctionScratchLock_;
 
    int OnConfigGroupChanged(const char* groupName, const char* newConfigName);
    int OnPixelSizeChanged(double newPixelSizeUm);
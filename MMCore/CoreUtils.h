@@ -26,6 +26,7 @@
 #pragma once
 
 #include "../MMDevice/MMDevice.h"
+#include "MonotonicClock.h"
 
 // suppress hideous boost warnings
 #ifdef WIN32
@@ -106,8 +107,10 @@ inline MM::MMTime GetMMTimeNow(boost::posix_time::ptime t0)
 }
 
 //NB we are starting the 'epoch' on 2000 01 01
+// Based on the monotonic clock, so that time differences are not affected by
+// changes to the system time (see mm::MonotonicTimeToMMTime()).
 inline MM::MMTime GetMMTimeNow()
 {
-   return GetMMTimeNow(boost::posix_time::microsec_clock::local_time());
+   return mm::MonotonicTimeToMMTime(mm::GetMonotonicTimeNs());
 }
 
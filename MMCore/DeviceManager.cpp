@@ -293,8 +293,28 @@ DeviceManager::GetParentDevice(boost::shared_ptr<DeviceInstance> device) const
 
 
 DeviceModuleLockGuard::DeviceModuleLockGuard(boost::shared_ptr<DeviceInstance> device) :
-   g_(device->GetAdapterModule()->GetLock())
-{}
+   lock_(0)
+{
+   // The lock of a device changes when its hub is set; retry if it changed
+   // while we were waiting for it
+   for (;;)
+   {
+      MMThreadLock* lock = device->GetLock();
+      lock->Lock();
+      if (device->GetLock() == lock)
+      {
+         lock_ = lock;
+         return;
+      }
+      lock->Unlock();
+   }
+}
+
+
+DeviceModuleLockGuard::~DeviceModuleLockGuard()
+{
+   lock_->Unlock();
+}
 
 
 } // namespace mm
@@ -25,6 +25,7 @@
 #include "Logging/Logger.h"
 
 #include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
 #include <boost/weak_ptr.hpp>
 
 #include <map>
@@ -134,12 +135,15 @@ public:
 };
 
 
-// Scoped acquisition of a device's module's lock
-class DeviceModuleLockGuard
+// Scoped acquisition of the lock covering a device: its module's lock, or a
+// lock of its own or of its hub if the module allows (see
+// DeviceInstance::GetLock())
+class DeviceModuleLockGuard : boost::noncopyable
 {
-   MMThreadGuard g_;
+   MMThreadLock* lock_;
 public:
    explicit DeviceModuleLockGuard(boost::shared_ptr<DeviceInstance> device);
+   ~DeviceModuleLockGuard();
 };
 
 } // namespace mm
@@ -137,6 +137,27 @@ std::string CameraInstance::GetTags()
    return serializedMetadataBuf.Get();
 }
 
+/**
+ * Merges the camera's tags into md. The serialized tags are fetched and
+ * parsed only when the camera reports that they have changed since the
+ * last call.
+ */
+void CameraInstance::MergeTagsInto(Metadata& md)
+{
+   MMThreadGuard g(tagsLock_);
+   long revision = GetImpl()->GetTagsRevision();
+   if (!tagsCached_ || revision != tagsRevision_)
+   {
+      // If the tags change between the two calls, the newer tags are cached
+      // under the older revision and will be fetched again next time.
+      std::string serializedMD = GetTags();
+      tags_.Restore(serializedMD.c_str());
+      tagsRevision_ = revision;
+      tagsCached_ = true;
+   }
+   md.Merge(tags_);
+}
+
 void CameraInstance::AddTag(const char* key, const char* deviceLabel, const char* value) { return GetImpl()->AddTag(key, deviceLabel, value); }
 void CameraInstance::RemoveTag(const char* key) { return GetImpl()->RemoveTag(key); }
 int CameraInstance::IsExposureSequenceable(bool& isSequenceable) const { return GetImpl()->IsExposureSequenceable(isSequenceable); }
@@ -21,6 +21,9 @@
 
 #include "DeviceInstanceBase.h"
 
+#include "../../MMDevice/DeviceThreads.h"
+#include "../../MMDevice/ImageMetadata.h"
+
 
 class CameraInstance : public DeviceInstanceBase<MM::Camera>
 {
@@ -33,7 +36,9 @@ public:
          const std::string& label,
          mm::logging::Logger deviceLogger,
          mm::logging::Logger coreLogger) :
-      DeviceInstanceBase<MM::Camera>(core, adapter, name, pDevice, deleteFunction, label, deviceLogger, coreLogger)
+      DeviceInstanceBase<MM::Camera>(core, adapter, name, pDevice, deleteFunction, label, deviceLogger, coreLogger),
+      tagsRevision_(0),
+      tagsCached_(false)
    {}
 
    int SnapImage();
@@ -73,6 +78,7 @@ public:
    int PrepareSequenceAcqusition();
    bool IsCapturing();
    std::string GetTags();
+   void MergeTagsInto(Metadata& md);
    void AddTag(const char* key, const char* deviceLabel, const char* value);
    void RemoveTag(const char* key);
    int IsExposureSequenceable(bool& isSequenceable) const;
@@ -82,4 +88,12 @@ public:
    int ClearExposureSequence();
    int AddToExposureSequence(double exposureTime_ms);
    int SendExposureSequence() const;
+
+private:
+   // Parsed copy of the camera's tags, valid while the camera's tags
+   // revision equals tagsRevision_
+   MMThreadLock tagsLock_;
+   Metadata tags_;
+   long tagsRevision_;
+   bool tagsCached_;
 };
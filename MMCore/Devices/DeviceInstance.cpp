@@ -21,6 +21,7 @@
 
 #include "DeviceInstance.h"
 
+#include "../../MMDevice/DeviceThreads.h"
 #include "../../MMDevice/MMDevice.h"
 #include "../CoreUtils.h"
 #include "../Error.h"
@@ -28,6 +29,8 @@
 #include "../Logging/Logger.h"
 #include "../MMCore.h"
 
+#include <boost/make_shared.hpp>
+
 
 int
 DeviceInstance::LogMessage(const char* msg, bool debugOnly)
@@ -52,7 +55,8 @@ DeviceInstance::DeviceInstance(CMMCore* core,
    label_(label),
    deleteFunction_(deleteFunction),
    deviceLogger_(deviceLogger),
-   coreLogger_(coreLogger)
+   coreLogger_(coreLogger),
+   currentLock_(0)
 {
    const std::string actualName = GetName();
    if (actualName != name)
@@ -66,6 +70,52 @@ DeviceInstance::DeviceInstance(CMMCore* core,
    }
 
    pImpl_->SetLabel(label_.c_str());
+
+   switch (adapter_->GetLockGranularity())
+   {
+      case MM::LockPerDevice:
+         lock_ = boost::make_shared<MMThreadLock>();
+         break;
+      case MM::LockPerHub:
+         // Peripherals take their hub's lock once their parent is set, and
+         // share the module's lock until then
+         if (GetType() == MM::HubDevice)
+            lock_ = boost::make_shared<MMThreadLock>();
+         break;
+      default:
+         break;
+   }
+   currentLock_.store(lock_ ? lock_.get() : adapter_->GetLock());
+}
+
+MMThreadLock*
+DeviceInstance::GetLock() const
+{
+   return currentLock_.load(boost::memory_order_acquire);
+}
+
+void
+DeviceInstance::SetParentHubLock(boost::shared_ptr<DeviceInstance> hub)
+{
+   if (adapter_->GetLockGranularity() != MM::LockPerHub ||
+         GetType() == MM::HubDevice)
+      return;
+
+   // Switch while holding the previous lock, so that no call is in progress,
+   // initialized or not. Callers waiting for it see the change (see
+   // DeviceModuleLockGuard); it is kept alive for them.
+   MMThreadGuard g(GetLock());
+   boost::shared_ptr<MMThreadLock> next;
+   if (hub && hub->GetAdapterModule() == adapter_)
+      next = hub->lock_;
+   if (next == lock_)
+      return;
+
+   if (lock_)
+      retiredLocks_.push_back(lock_);
+   lock_ = next;
+   currentLock_.store(lock_ ? lock_.get() : adapter_->GetLock(),
+         boost::memory_order_release);
 }
 
 DeviceInstance::~DeviceInstance()
@@ -25,6 +25,7 @@
 
 #include <string>
 #include <vector>
+#include <boost/atomic.hpp>
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/utility.hpp>
@@ -32,6 +33,7 @@
 class CMMCore;
 class HubInstance;
 class LoadedDeviceAdapter;
+class MMThreadLock;
 namespace MM
 {
    class Core;
@@ -72,8 +74,24 @@ private:
    mm::logging::Logger deviceLogger_;
    mm::logging::Logger coreLogger_;
 
+   // Null if the device is covered by its module's lock
+   boost::shared_ptr<MMThreadLock> lock_;
+   // The lock that applies; changes (see SetParentHubLock()) only under the
+   // previous lock
+   boost::atomic<MMThreadLock*> currentLock_;
+   // Locks replaced by SetParentHubLock(), kept for the threads that may
+   // still be waiting for them
+   std::vector< boost::shared_ptr<MMThreadLock> > retiredLocks_;
+
 public:
    boost::shared_ptr<LoadedDeviceAdapter> GetAdapterModule() const /* final */ { return adapter_; }
+
+   // The lock held by the Core while it calls the device: the module's
+   // lock, unless the module has chosen a finer lock granularity
+   MMThreadLock* GetLock() const /* final */;
+   // Share the lock of the parent hub, if the module locks per hub (or the
+   // module's lock, if the hub is of another module or there is none)
+   void SetParentHubLock(boost::shared_ptr<DeviceInstance> hub) /* final */;
    std::string GetLabel() const /* final */ { return label_; }
    std::string GetDescription() const /* final */ { return description_; }
    void SetDescription(const std::string& description) /* final */ { description_ = description; }
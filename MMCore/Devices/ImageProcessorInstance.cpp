@@ -23,3 +23,4 @@
 
 
 int ImageProcessorInstance::Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth) { return GetImpl()->Process(buffer, width, height, byteDepth); }
+int ImageProcessorInstance::GetOutputImageSize(unsigned width, unsigned height, unsigned byteDepth, unsigned& outWidth, unsigned& outHeight) { return GetImpl()->GetOutputImageSize(width, height, byteDepth, outWidth, outHeight); }
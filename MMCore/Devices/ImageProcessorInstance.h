@@ -37,4 +37,5 @@ public:
    {}
 
    int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth);
+   int GetOutputImageSize(unsigned width, unsigned height, unsigned byteDepth, unsigned& outWidth, unsigned& outHeight);
 };
@@ -78,4 +78,8 @@
 #define MMERR_CreatePeripheralFailed   50
 #define MMERR_PropertyNotInCache       51
 #define MMERR_BadAffineTransform       52
+#define MMERR_InvalidImageLease        53
+#define MMERR_NoCameraCircularBuffer   54
+#define MMERR_InvalidOverflowPolicy    55
+#define MMERR_InvalidReaderCursor      56
 #endif //_ERRORCODES_H_
@@ -18,21 +18,37 @@
 
 #include "FrameBuffer.h"
 
+#include "MonotonicClock.h"
+#include "../MMDevice/MMDeviceConstants.h"
+
 #include <cmath>
 #include <cstring>
 
 namespace mm {
 
 ImgBuffer::ImgBuffer(unsigned xSize, unsigned ySize, unsigned pixDepth) :
-   pixels_(0), width_(xSize), height_(ySize), pixDepth_(pixDepth)
+   pixels_(0), width_(xSize), height_(ySize), pixDepth_(pixDepth),
+   ownsPixels_(true),
+   timestampNs_(0)
 {
    pixels_ = new unsigned char[xSize * ySize * pixDepth];
    memset(pixels_, 0, xSize * ySize * pixDepth);
 }
 
+ImgBuffer::ImgBuffer(unsigned xSize, unsigned ySize, unsigned pixDepth,
+      unsigned char* storage) :
+   pixels_(storage), width_(xSize), height_(ySize), pixDepth_(pixDepth),
+   ownsPixels_(false),
+   timestampNs_(0)
+{
+   // The storage is not cleared, so that its pages are not committed before
+   // they are needed.
+}
+
 ImgBuffer::~ImgBuffer()
 {
-   delete[] pixels_;
+   if (ownsPixels_)
+      delete[] pixels_;
 }
 
 const unsigned char* ImgBuffer::GetPixels() const
@@ -50,8 +66,10 @@ void ImgBuffer::Resize(unsigned xSize, unsigned ySize, unsigned pixDepth)
    // re-allocate internal buffer if it is not big enough
    if (width_ * height_ * pixDepth_ < xSize * ySize * pixDepth)
    {
-      delete[] pixels_;
+      if (ownsPixels_)
+         delete[] pixels_;
       pixels_ = new unsigned char [xSize * ySize * pixDepth];
+      ownsPixels_ = true;
    }
 
    width_ = xSize;
@@ -64,8 +82,10 @@ void ImgBuffer::Resize(unsigned xSize, unsigned ySize)
    // re-allocate internal buffer if it is not big enough
    if (width_ * height_ < xSize * ySize)
    {
-      delete[] pixels_;
+      if (ownsPixels_)
+         delete[] pixels_;
       pixels_ = new unsigned char[xSize * ySize * pixDepth_];
+      ownsPixels_ = true;
    }
 
    width_ = xSize;
@@ -76,11 +96,20 @@ void ImgBuffer::Resize(unsigned xSize, unsigned ySize)
 
 void ImgBuffer::SetMetadata(const Metadata& md)
 {
-   //metadata_ = md;
-   // Serialize/Restore instead of =operator used to avoid object new/delete
-   // issues across the DLL boundary (on Windows)
-   // TODO: this is inefficient and should be revised
-    metadata_.Restore(md.Serialize().c_str());
+   // Assignment copies the tags without calling into the module that
+   // created md, so it is safe across the DLL boundary, and reuses the
+   // storage of metadata_.
+   metadata_ = md;
+}
+
+void ImgBuffer::GetMetadata(Metadata& md) const
+{
+   md = metadata_;
+   // Formatting the time is comparatively slow, so it is done here rather
+   // than when the image is inserted.
+   if (timestampNs_ != 0)
+      md.PutImageTag(MM::g_Keyword_Metadata_TimeInCore,
+            mm::FormatMonotonicTime(timestampNs_));
 }
 
 
@@ -127,6 +156,20 @@ void FrameBuffer::Preallocate(unsigned channels)
    }
 }
 
+/**
+ * Allocates the given number of channels in externally owned storage, each
+ * channel starting channelStride bytes after the previous one.
+ */
+void FrameBuffer::Preallocate(unsigned channels, unsigned char* storage,
+      std::size_t channelStride)
+{
+   Clear();
+   channels_.resize(channels, 0);
+   for (unsigned i=0; i<channels; i++)
+      channels_[i] = new ImgBuffer(width_, height_, depth_,
+            storage + i * channelStride);
+}
+
 void FrameBuffer::Resize(unsigned xSize, unsigned ySize, unsigned byteDepth)
 {
    Clear();
@@ -20,6 +20,7 @@
 
 #include "../MMDevice/ImageMetadata.h"
 
+#include <cstddef>
 #include <string>
 #include <vector>
 #include <map>
@@ -32,10 +33,14 @@ class ImgBuffer
    unsigned int width_;
    unsigned int height_;
    unsigned int pixDepth_;
+   bool ownsPixels_;
    Metadata metadata_;
+   long long timestampNs_;
 
 public:
    ImgBuffer(unsigned xSize, unsigned ySize, unsigned pixDepth);
+   // Use externally owned storage, which must outlive this object
+   ImgBuffer(unsigned xSize, unsigned ySize, unsigned pixDepth, unsigned char* storage);
    ~ImgBuffer();
 
    unsigned int Width() const {return width_;}
@@ -43,12 +48,20 @@ public:
    unsigned int Depth() const {return pixDepth_;}
    void SetPixels(const void* pixArray);
    const unsigned char* GetPixels() const;
+   unsigned char* GetPixelsRW() { return pixels_; }
 
    void Resize(unsigned xSize, unsigned ySize, unsigned pixDepth);
    void Resize(unsigned xSize, unsigned ySize);
 
    void SetMetadata(const Metadata& md);
    const Metadata& GetMetadata() const {return metadata_;}
+   // Copies the metadata, adding the formatted time stamp
+   void GetMetadata(Metadata& md) const;
+
+   // Time the image was received by the Core (mm::GetMonotonicTimeNs()), or
+   // 0 if not set
+   void SetTimestamp(long long ns) {timestampNs_ = ns;}
+   long long GetTimestamp() const {return timestampNs_;}
 
 private:
    ImgBuffer& operator=(const ImgBuffer&);
@@ -71,6 +84,7 @@ public:
    void Resize(unsigned xSize, unsigned ySize, unsigned pixDepth);
    void Clear();
    void Preallocate(unsigned channels);
+   void Preallocate(unsigned channels, unsigned char* storage, std::size_t channelStride);
 
    ImgBuffer* FindImage(unsigned channel) const;
    const unsigned char* GetPixels(unsigned channel) const;
@@ -0,0 +1,305 @@
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//
+// DESCRIPTION:   Contiguous backing store for the circular buffer.
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "FrameStore.h"
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+namespace mm {
+
+namespace {
+
+// Upper limit on the number of threads used to pre-fault the store; more
+// threads do not help once the kernel's page allocator is saturated.
+const unsigned maxPrefaultThreads = 4;
+
+const std::size_t hugePageSize = 2 * 1024 * 1024;
+
+std::size_t RoundUp(std::size_t bytes, std::size_t multiple)
+{
+   return ((bytes + multiple - 1) / multiple) * multiple;
+}
+
+std::size_t SystemPageSize()
+{
+#ifdef _WIN32
+   SYSTEM_INFO info;
+   GetSystemInfo(&info);
+   return info.dwPageSize;
+#else
+   long pageSize = sysconf(_SC_PAGESIZE);
+   return pageSize > 0 ? static_cast<std::size_t>(pageSize) : 4096;
+#endif
+}
+
+// Make sure the page containing p is committed, without changing the memory
+// contents (which may be concurrently written by the camera thread).
+inline void TouchPage(unsigned char* p)
+{
+#ifdef _WIN32
+   InterlockedExchangeAdd(reinterpret_cast<volatile LONG*>(p), 0);
+#else
+   __sync_fetch_and_or(reinterpret_cast<int*>(p), 0);
+#endif
+}
+
+} // anonymous namespace
+
+
+FrameStore::FrameStore() :
+   base_(0),
+   size_(0),
+   slotCount_(0),
+   slotStride_(0),
+   pageSize_(SystemPageSize()),
+   usingHugePages_(false),
+   hugePagesRequested_(false),
+   stopPrefault_(false)
+{
+}
+
+FrameStore::~FrameStore()
+{
+   Release();
+}
+
+std::size_t FrameStore::RoundUpToAlignment(std::size_t bytes)
+{
+   return RoundUp(bytes, SlotAlignment);
+}
+
+/**
+ * Returns the amount of physical memory installed in the machine, or 0 if
+ * it cannot be determined.
+ */
+unsigned long long FrameStore::GetPhysicalMemoryBytes()
+{
+#ifdef _WIN32
+   MEMORYSTATUSEX status;
+   status.dwLength = sizeof(status);
+   if (!GlobalMemoryStatusEx(&status))
+      return 0;
+   return status.ullTotalPhys;
+#else
+   long pages = sysconf(_SC_PHYS_PAGES);
+   long pageSize = sysconf(_SC_PAGESIZE);
+   if (pages <= 0 || pageSize <= 0)
+      return 0;
+   return static_cast<unsigned long long>(pages) * pageSize;
+#endif
+}
+
+bool FrameStore::Allocate(std::size_t slotCount, std::size_t slotBytes, bool hugePages)
+{
+   Release();
+   if (slotCount == 0 || slotBytes == 0)
+      return false;
+
+   std::size_t stride = RoundUpToAlignment(slotBytes);
+   if (stride > static_cast<std::size_t>(-1) / slotCount)
+      return false;
+   std::size_t size = RoundUp(stride * slotCount, pageSize_);
+
+   unsigned long long physicalBytes = GetPhysicalMemoryBytes();
+   if (physicalBytes > 0 && size > physicalBytes)
+      return false;
+
+   void* base = 0;
+   bool usingHugePages = false;
+#ifdef _WIN32
+   if (hugePages)
+   {
+      // Requires the "Lock pages in memory" privilege; fall back to normal
+      // pages if we don't have it.
+      std::size_t largePage = GetLargePageMinimum();
+      if (largePage > 0)
+      {
+         std::size_t largeSize = RoundUp(size, largePage);
+         base = VirtualAlloc(0, largeSize,
+               MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+         if (base)
+         {
+            size = largeSize;
+            usingHugePages = true;
+         }
+      }
+   }
+   if (!base)
+      base = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+   if (!base)
+      return false;
+#else
+   // The mapping is charged against the commit limit (no MAP_NORESERVE), so
+   // that a buffer the system cannot back fails here rather than when a
+   // frame is written to it.
+   if (hugePages)
+   {
+#ifdef MAP_HUGETLB
+      // Succeeds only if the administrator has reserved enough huge pages.
+      std::size_t hugeSize = RoundUp(size, hugePageSize);
+      base = mmap(0, hugeSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (base != MAP_FAILED)
+      {
+         size = hugeSize;
+         usingHugePages = true;
+      }
+      else
+         base = 0;
+#endif
+   }
+   if (!base)
+   {
+      base = mmap(0, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (base == MAP_FAILED)
+         return false;
+#ifdef MADV_HUGEPAGE
+      // Ask for transparent huge pages instead
+      if (hugePages && madvise(base, size, MADV_HUGEPAGE) == 0)
+         usingHugePages = true;
+#endif
+   }
+#endif
+
+   base_ = static_cast<unsigned char*>(base);
+   size_ = size;
+   slotCount_ = slotCount;
+   slotStride_ = stride;
+   usingHugePages_ = usingHugePages;
+   hugePagesRequested_ = hugePages;
+
+   StartPrefault();
+   return true;
+}
+
+void FrameStore::Release()
+{
+   StopPrefault();
+   if (base_)
+   {
+#ifdef _WIN32
+      VirtualFree(base_, 0, MEM_RELEASE);
+#else
+      munmap(base_, size_);
+#endif
+   }
+   base_ = 0;
+   size_ = 0;
+   slotCount_ = 0;
+   slotStride_ = 0;
+   usingHugePages_ = false;
+   hugePagesRequested_ = false;
+}
+
+/**
+ * Returns the number of bytes of the store that are backed by physical
+ * memory.
+ */
+std::size_t FrameStore::GetCommittedBytes() const
+{
+   if (!base_)
+      return 0;
+#ifdef _WIN32
+   // VirtualAlloc() with MEM_COMMIT charges the whole block against the
+   // commit limit up front.
+   return size_;
+#else
+   const std::size_t chunkPages = 4096;
+   std::vector<unsigned char> residency(chunkPages);
+   std::size_t committed = 0;
+   for (std::size_t offset = 0; offset < size_; offset += chunkPages * pageSize_)
+   {
+      std::size_t length = std::min(chunkPages * pageSize_, size_ - offset);
+      std::size_t pages = (length + pageSize_ - 1) / pageSize_;
+#ifdef __APPLE__
+      int err = mincore(base_ + offset, length, reinterpret_cast<char*>(&residency[0]));
+#else
+      int err = mincore(base_ + offset, length, &residency[0]);
+#endif
+      if (err != 0)
+         return size_; // Cannot tell; report the whole block
+      for (std::size_t i = 0; i < pages; ++i)
+      {
+         if (residency[i] & 1)
+            committed += pageSize_;
+      }
+   }
+   return std::min(committed, size_);
+#endif
+}
+
+/**
+ * Blocks until the background pre-faulting has finished.
+ */
+void FrameStore::WaitForPrefault()
+{
+   for (std::size_t i = 0; i < prefaultThreads_.size(); ++i)
+      prefaultThreads_[i]->join();
+   prefaultThreads_.clear();
+}
+
+void FrameStore::StartPrefault()
+{
+   stopPrefault_.store(false);
+   unsigned nThreads = boost::thread::hardware_concurrency();
+   nThreads = std::max(1u, std::min(nThreads, maxPrefaultThreads));
+
+   std::size_t pages = size_ / pageSize_;
+   std::size_t pagesPerThread = (pages + nThreads - 1) / nThreads;
+   for (unsigned i = 0; i < nThreads; ++i)
+   {
+      std::size_t begin = i * pagesPerThread * pageSize_;
+      std::size_t end = std::min(size_, (i + 1) * pagesPerThread * pageSize_);
+      if (begin >= end)
+         break;
+      prefaultThreads_.push_back(boost::make_shared<boost::thread>(
+               boost::bind(&FrameStore::PrefaultRange, this, begin, end)));
+   }
+}
+
+void FrameStore::StopPrefault()
+{
+   stopPrefault_.store(true);
+   WaitForPrefault();
+}
+
+void FrameStore::PrefaultRange(std::size_t begin, std::size_t end)
+{
+   for (std::size_t offset = begin; offset < end; offset += pageSize_)
+   {
+      if (stopPrefault_.load(boost::memory_order_relaxed))
+         return;
+      TouchPage(base_ + offset);
+   }
+}
+
+} // namespace mm
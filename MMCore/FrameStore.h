@@ -0,0 +1,93 @@
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//
+// DESCRIPTION:   Contiguous backing store for the circular buffer.
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <cstddef>
+#include <vector>
+
+namespace mm {
+
+/**
+ * A single contiguous block of memory holding the pixels of all frames of
+ * the circular buffer.
+ *
+ * The block is reserved from the operating system in one piece (mmap() or
+ * VirtualAlloc()) rather than with one heap allocation per image, so that
+ * allocating a large buffer is fast and the pages can be backed by huge
+ * pages. The whole block is charged against the system's commit limit when
+ * it is allocated, but its pages are backed lazily by the OS; afterwards,
+ * background threads touch every page so that the first pass of an
+ * acquisition does not pay for page faults. The pre-faulting does not modify the contents of the
+ * memory and can safely run while frames are being written.
+ *
+ * Each slot starts at a multiple of SlotAlignment bytes from the start of
+ * the block, which is itself page-aligned.
+ */
+class FrameStore
+{
+public:
+   static const std::size_t SlotAlignment = 64;
+
+   FrameStore();
+   ~FrameStore();
+
+   // Returns false if the memory could not be reserved, or if it exceeds the
+   // physical memory of the machine.
+   bool Allocate(std::size_t slotCount, std::size_t slotBytes, bool hugePages);
+   void Release();
+
+   unsigned char* GetSlot(std::size_t index) const
+   { return base_ + index * slotStride_; }
+   std::size_t GetSlotCount() const { return slotCount_; }
+   std::size_t GetSlotStride() const { return slotStride_; }
+   std::size_t GetReservedBytes() const { return size_; }
+   bool IsUsingHugePages() const { return usingHugePages_; }
+   bool WereHugePagesRequested() const { return hugePagesRequested_; }
+
+   std::size_t GetCommittedBytes() const;
+   void WaitForPrefault();
+
+   static std::size_t RoundUpToAlignment(std::size_t bytes);
+   static unsigned long long GetPhysicalMemoryBytes();
+
+private:
+   void StartPrefault();
+   void StopPrefault();
+   void PrefaultRange(std::size_t begin, std::size_t end);
+
+   unsigned char* base_;
+   std::size_t size_;
+   std::size_t slotCount_;
+   std::size_t slotStride_;
+   std::size_t pageSize_;
+   bool usingHugePages_;
+   bool hugePagesRequested_;
+
+   boost::atomic<bool> stopPrefault_;
+   std::vector< boost::shared_ptr<boost::thread> > prefaultThreads_;
+
+   FrameStore(const FrameStore&);
+   FrameStore& operator=(const FrameStore&);
+};
+
+} // namespace mm
@@ -0,0 +1,215 @@
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//
+// DESCRIPTION:   Mirrors and transposes camera images according to the
+//                camera's Transpose* properties.
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "GeometricCorrection.h"
+
+#include <boost/cstdint.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+namespace mm {
+
+namespace {
+
+// Side of the square blocks in which images are transposed
+const unsigned blockSize = 32;
+
+// Where the pixels of the source go in the destination: pixel (x, y) of the
+// source goes to element origin + x * xStep + y * yStep of the destination
+struct PixelMapping
+{
+   std::ptrdiff_t origin;
+   std::ptrdiff_t xStep;
+   std::ptrdiff_t yStep;
+};
+
+PixelMapping MakeMapping(bool swapXY, bool mirrorX, bool mirrorY,
+      unsigned width, unsigned height)
+{
+   const std::ptrdiff_t w = width;
+   const std::ptrdiff_t h = height;
+   PixelMapping m;
+   if (!swapXY)
+   {
+      m.xStep = mirrorX ? -1 : 1;
+      m.yStep = mirrorY ? -w : w;
+      m.origin = (mirrorY ? (h - 1) * w : 0) + (mirrorX ? w - 1 : 0);
+   }
+   else
+   {
+      m.xStep = mirrorX ? -h : h;
+      m.yStep = mirrorY ? -1 : 1;
+      m.origin = (mirrorX ? (w - 1) * h : 0) + (mirrorY ? h - 1 : 0);
+   }
+   return m;
+}
+
+template <typename T>
+void MirrorRows(const T* in, T* out, unsigned width, unsigned height,
+      const PixelMapping& m)
+{
+   for (unsigned y = 0; y < height; ++y)
+   {
+      const T* src = in + (std::size_t)y * width;
+      T* dest = out + m.origin + (std::ptrdiff_t)y * m.yStep;
+      if (m.xStep == 1)
+         memcpy(dest, src, width * sizeof(T));
+      else
+         for (unsigned x = 0; x < width; ++x)
+            *(dest - x) = src[x];
+   }
+}
+
+template <typename T>
+void TransposeBlocks(const T* in, T* out, unsigned width, unsigned height,
+      const PixelMapping& m)
+{
+   for (unsigned y0 = 0; y0 < height; y0 += blockSize)
+   {
+      const unsigned y1 = std::min(y0 + blockSize, height);
+      for (unsigned x0 = 0; x0 < width; x0 += blockSize)
+      {
+         const unsigned x1 = std::min(x0 + blockSize, width);
+         // Each source column of the block is a contiguous run in the
+         // destination
+         for (unsigned x = x0; x < x1; ++x)
+         {
+            T* dest = out + m.origin + (std::ptrdiff_t)x * m.xStep;
+            const T* src = in + x;
+            for (unsigned y = y0; y < y1; ++y)
+               dest[(std::ptrdiff_t)y * m.yStep] = src[(std::size_t)y * width];
+         }
+      }
+   }
+}
+
+template <typename T>
+void ApplyMapping(const unsigned char* in, unsigned char* out,
+      unsigned width, unsigned height, bool swapXY, const PixelMapping& m)
+{
+   if (swapXY)
+      TransposeBlocks(reinterpret_cast<const T*>(in),
+            reinterpret_cast<T*>(out), width, height, m);
+   else
+      MirrorRows(reinterpret_cast<const T*>(in),
+            reinterpret_cast<T*>(out), width, height, m);
+}
+
+void ApplyMappingBytewise(const unsigned char* in, unsigned char* out,
+      unsigned width, unsigned height, unsigned bytesPerPixel,
+      const PixelMapping& m)
+{
+   for (unsigned y = 0; y < height; ++y)
+   {
+      for (unsigned x = 0; x < width; ++x)
+      {
+         std::ptrdiff_t dest = m.origin + (std::ptrdiff_t)x * m.xStep +
+            (std::ptrdiff_t)y * m.yStep;
+         memcpy(out + dest * bytesPerPixel,
+               in + ((std::size_t)y * width + x) * bytesPerPixel,
+               bytesPerPixel);
+      }
+   }
+}
+
+} // anonymous namespace
+
+
+GeometricCorrection::GeometricCorrection() :
+   swapXY_(false),
+   mirrorX_(false),
+   mirrorY_(false)
+{
+}
+
+GeometricCorrection::GeometricCorrection(bool swapXY, bool mirrorX,
+      bool mirrorY) :
+   swapXY_(swapXY),
+   mirrorX_(mirrorX),
+   mirrorY_(mirrorY)
+{
+}
+
+void
+GeometricCorrection::GetOutputSize(unsigned width, unsigned height,
+      unsigned& outWidth, unsigned& outHeight) const
+{
+   outWidth = swapXY_ ? height : width;
+   outHeight = swapXY_ ? width : height;
+}
+
+void
+GeometricCorrection::Apply(const unsigned char* in, unsigned char* out,
+      unsigned width, unsigned height, unsigned bytesPerPixel) const
+{
+   if (width == 0 || height == 0)
+      return;
+   if (IsIdentity())
+   {
+      memcpy(out, in, (std::size_t)width * height * bytesPerPixel);
+      return;
+   }
+
+   const PixelMapping m = MakeMapping(swapXY_, mirrorX_, mirrorY_,
+         width, height);
+   switch (bytesPerPixel)
+   {
+      case 1:
+         ApplyMapping<boost::uint8_t>(in, out, width, height, swapXY_, m);
+         break;
+      case 2:
+         ApplyMapping<boost::uint16_t>(in, out, width, height, swapXY_, m);
+         break;
+      case 4:
+         ApplyMapping<boost::uint32_t>(in, out, width, height, swapXY_, m);
+         break;
+      case 8:
+         ApplyMapping<boost::uint64_t>(in, out, width, height, swapXY_, m);
+         break;
+      default:
+         ApplyMappingBytewise(in, out, width, height, bytesPerPixel, m);
+         break;
+   }
+}
+
+void
+GeometricCorrection::ApplyInPlace(unsigned char* pixels, unsigned& width,
+      unsigned& height, unsigned bytesPerPixel,
+      std::vector<unsigned char>& scratch) const
+{
+   if (IsIdentity())
+      return;
+
+   const std::size_t size = (std::size_t)width * height * bytesPerPixel;
+   if (scratch.size() < size)
+      scratch.resize(size);
+   if (size > 0)
+   {
+      memcpy(&scratch[0], pixels, size);
+      Apply(&scratch[0], pixels, width, height, bytesPerPixel);
+   }
+   unsigned outWidth, outHeight;
+   GetOutputSize(width, height, outWidth, outHeight);
+   width = outWidth;
+   height = outHeight;
+}
+
+} // namespace mm
@@ -0,0 +1,68 @@
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//
+// DESCRIPTION:   Mirrors and transposes camera images according to the
+//                camera's Transpose* properties.
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#pragma once
+
+#include <vector>
+
+namespace mm {
+
+/**
+ * A mirror and/or transpose of an image, as described by a camera's
+ * TransposeMirrorX, TransposeMirrorY and TransposeXY properties.
+ *
+ * The image is first mirrored, left to right (MirrorX) and top to bottom
+ * (MirrorY), then transposed (SwapXY), so that a width x height image becomes
+ * a height x width one.
+ *
+ * Apply() writes the corrected image straight into its destination (e.g. a
+ * circular buffer slot). Transposes are done in square blocks small enough
+ * for a block of the source and one of the destination to stay in the cache
+ * together, so that neither side is read or written one pixel per cache
+ * line; mirrors without a transpose work on whole rows.
+ */
+class GeometricCorrection
+{
+public:
+   GeometricCorrection();
+   GeometricCorrection(bool swapXY, bool mirrorX, bool mirrorY);
+
+   bool GetSwapXY() const { return swapXY_; }
+   bool GetMirrorX() const { return mirrorX_; }
+   bool GetMirrorY() const { return mirrorY_; }
+   bool IsIdentity() const { return !swapXY_ && !mirrorX_ && !mirrorY_; }
+
+   void GetOutputSize(unsigned width, unsigned height,
+         unsigned& outWidth, unsigned& outHeight) const;
+
+   // Writes the corrected image to out, which must not overlap in. Pixels of
+   // other than 1, 2, 4 or 8 bytes are moved with memcpy().
+   void Apply(const unsigned char* in, unsigned char* out, unsigned width,
+         unsigned height, unsigned bytesPerPixel) const;
+   // Corrects the image in place, through scratch; updates width and height
+   void ApplyInPlace(unsigned char* pixels, unsigned& width, unsigned& height,
+         unsigned bytesPerPixel, std::vector<unsigned char>& scratch) const;
+
+private:
+   bool swapXY_;
+   bool mirrorX_;
+   bool mirrorY_;
+};
+
+} // namespace mm
@@ -0,0 +1,472 @@
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//
+// DESCRIPTION:   Runs the image processor on worker threads, off the camera
+//                thread, and publishes the results in order.
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "ImageProcessingPipeline.h"
+
+#include "MonotonicClock.h"
+
+#include "../MMDevice/MMDeviceConstants.h"
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#include <algorithm>
+
+namespace mm {
+
+namespace {
+
+double NsToMs(long long ns)
+{
+   return ns / 1000000.0;
+}
+
+} // anonymous namespace
+
+
+ImageProcessingPipeline::ImageProcessingPipeline(ProcessFunction process,
+      PublishFunction publish) :
+   process_(process),
+   publish_(publish),
+   running_(false),
+   threadCount_(0),
+   queueDepth_(0),
+   reservedJobs_(0),
+   nextSequence_(0),
+   nextToPublish_(0),
+   publishing_(false),
+   publishError_(DEVICE_OK),
+   publishedCount_(0),
+   failedCount_(0)
+{
+}
+
+ImageProcessingPipeline::~ImageProcessingPipeline()
+{
+   Stop();
+}
+
+/**
+ * Starts (or restarts, with new settings) the worker threads. Frames that
+ * are in the pipeline are published first.
+ *
+ * queueDepth is the maximum number of frames in the pipeline, including the
+ * ones being processed; it is raised to threadCount if smaller.
+ */
+void ImageProcessingPipeline::Start(unsigned threadCount, unsigned queueDepth)
+{
+   boost::lock_guard<boost::mutex> startStopLock(startStopMutex_);
+   StopWorkers();
+
+   threadCount = std::max(1u, threadCount);
+   {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      running_ = true;
+      threadCount_ = threadCount;
+      queueDepth_ = std::max(threadCount, queueDepth);
+      // Drop jobs sized for another configuration
+      freeJobs_.clear();
+   }
+   for (unsigned i = 0; i < threadCount; ++i)
+   {
+      workers_.push_back(boost::make_shared<boost::thread>(
+               boost::bind(&ImageProcessingPipeline::WorkerLoop, this)));
+   }
+}
+
+/**
+ * Publishes the frames that are in the pipeline and stops the worker
+ * threads. Frames submitted afterwards are processed on the calling thread.
+ */
+void ImageProcessingPipeline::Stop()
+{
+   boost::lock_guard<boost::mutex> startStopLock(startStopMutex_);
+   StopWorkers();
+}
+
+// Must be called with startStopMutex_ held
+void ImageProcessingPipeline::StopWorkers()
+{
+   {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      running_ = false;
+      jobAvailable_.notify_all();
+      // Submit() may be waiting to fall back to synchronous processing
+      spaceAvailable_.notify_all();
+   }
+
+   // The workers exit once there are no more pending (or reserved) jobs,
+   // after publishing whatever they processed
+   for (std::size_t i = 0; i < workers_.size(); ++i)
+      workers_[i]->join();
+   workers_.clear();
+
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   threadCount_ = 0;
+}
+
+bool ImageProcessingPipeline::IsRunning() const
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   return running_;
+}
+
+unsigned ImageProcessingPipeline::GetThreadCount() const
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   return threadCount_;
+}
+
+unsigned ImageProcessingPipeline::GetQueueDepth() const
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   return queueDepth_;
+}
+
+/**
+ * Queues a frame for processing and publication, waiting if the pipeline is
+ * full. The pixels and metadata are copied.
+ *
+ * If an earlier frame from the camera failed to be published, the error is
+ * returned (once) and the frame is not queued. Otherwise, errors from
+ * publishing the frame are reported later (see TakePublishError()).
+ */
+int ImageProcessingPipeline::Submit(const MM::Device* camera,
+      const unsigned char* pixels, unsigned width, unsigned height,
+      unsigned byteDepth, unsigned nComponents, const Metadata& md)
+{
+   int error = TakePublishError(camera);
+   if (error != DEVICE_OK)
+      return error;
+
+   long long submittedNs = GetMonotonicTimeNs();
+   boost::shared_ptr<Job> job = ReserveJob();
+   if (!job)
+   {
+      // The image processor has always worked in place on the camera's
+      // buffer, so do the same when running synchronously
+      unsigned outWidth = width;
+      unsigned outHeight = height;
+      process_(camera, const_cast<unsigned char*>(pixels), outWidth, outHeight,
+            byteDepth);
+      int ret = publish_(camera, pixels, outWidth, outHeight, byteDepth,
+            nComponents, md);
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      if (ret == DEVICE_OK)
+         ++publishedCount_;
+      else
+         ++failedCount_;
+      return ret;
+   }
+
+   job->camera = camera;
+   job->pixels.assign(pixels, pixels + width * height * byteDepth);
+   job->width = width;
+   job->height = height;
+   job->byteDepth = byteDepth;
+   job->nComponents = nComponents;
+   job->md = md;
+   job->submittedNs = submittedNs;
+   job->process = true;
+   job->discard = false;
+   return QueueJob(job);
+}
+
+/**
+ * Reserves a job in the pipeline and returns its pixel buffer, for a camera
+ * to write a frame into (instead of into a circular buffer slot). The frame
+ * is queued by CommitBuffer() or dropped by AbortBuffer(); until then,
+ * later frames are held back.
+ *
+ * Returns null if the pipeline is not running.
+ */
+unsigned char* ImageProcessingPipeline::AcquireBuffer(const MM::Device* camera,
+      unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents)
+{
+   boost::shared_ptr<Job> job = ReserveJob();
+   if (!job)
+      return 0;
+
+   job->camera = camera;
+   job->pixels.resize(std::max(1u, width * height * byteDepth));
+   job->width = width;
+   job->height = height;
+   job->byteDepth = byteDepth;
+   job->nComponents = nComponents;
+   job->submittedNs = GetMonotonicTimeNs();
+
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   acquiredJobs_[camera] = job;
+   return &job->pixels[0];
+}
+
+bool ImageProcessingPipeline::HasAcquiredBuffer(const MM::Device* camera) const
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   return acquiredJobs_.count(camera) > 0;
+}
+
+/**
+ * Queues the frame written into the buffer returned by AcquireBuffer(). If
+ * process is false, the frame is published as is (in order).
+ *
+ * As for Submit(), an error from publishing an earlier frame of the camera
+ * is returned instead, and the frame is then dropped.
+ */
+int ImageProcessingPipeline::CommitBuffer(const MM::Device* camera,
+      const Metadata& md, bool process)
+{
+   boost::shared_ptr<Job> job = TakeAcquiredJob(camera);
+   if (!job)
+      return DEVICE_ERR;
+   int error = TakePublishError(camera);
+   if (error != DEVICE_OK)
+   {
+      job->discard = true;
+      QueueJob(job);
+      return error;
+   }
+   job->md = md;
+   job->process = process;
+   job->discard = false;
+   return QueueJob(job);
+}
+
+/**
+ * Gives up the buffer returned by AcquireBuffer() without publishing it.
+ */
+void ImageProcessingPipeline::AbortBuffer(const MM::Device* camera)
+{
+   boost::shared_ptr<Job> job = TakeAcquiredJob(camera);
+   if (!job)
+      return;
+   // The job still goes through the pipeline, so that the frames after it
+   // are not held back
+   job->discard = true;
+   QueueJob(job);
+}
+
+/**
+ * Waits for room in the pipeline and returns a job with the next sequence
+ * number, or null if the pipeline is not running (once it is empty).
+ */
+boost::shared_ptr<ImageProcessingPipeline::Job> ImageProcessingPipeline::ReserveJob()
+{
+   boost::unique_lock<boost::mutex> lock(mutex_);
+   // When stopped, wait for the pipeline to empty so as to keep the frames
+   // in order
+   for (;;)
+   {
+      long long inFlight = nextSequence_ - nextToPublish_;
+      if (running_ ? inFlight < queueDepth_ : inFlight == 0)
+         break;
+      spaceAvailable_.wait(lock);
+   }
+   if (!running_)
+      return boost::shared_ptr<Job>();
+
+   boost::shared_ptr<Job> job;
+   if (freeJobs_.empty())
+      job = boost::make_shared<Job>();
+   else
+   {
+      job = freeJobs_.back();
+      freeJobs_.pop_back();
+   }
+   // Reserve the place of the frame in the output order
+   job->sequence = nextSequence_++;
+   ++reservedJobs_;
+   return job;
+}
+
+/**
+ * Hands a reserved job to the workers.
+ */
+int ImageProcessingPipeline::QueueJob(boost::shared_ptr<Job> job)
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   // Jobs are reserved in sequence order, but may be queued out of order if
+   // several cameras submit concurrently; that only changes which worker
+   // gets which frame
+   pendingJobs_.push_back(job);
+   --reservedJobs_;
+   if (running_)
+      jobAvailable_.notify_one();
+   else // The workers may be waiting for the last reserved job to exit
+      jobAvailable_.notify_all();
+   return DEVICE_OK;
+}
+
+boost::shared_ptr<ImageProcessingPipeline::Job>
+ImageProcessingPipeline::TakeAcquiredJob(const MM::Device* camera)
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   std::map< const MM::Device*, boost::shared_ptr<Job> >::iterator it =
+      acquiredJobs_.find(camera);
+   if (it == acquiredJobs_.end())
+      return boost::shared_ptr<Job>();
+   boost::shared_ptr<Job> job = it->second;
+   acquiredJobs_.erase(it);
+   return job;
+}
+
+/**
+ * Returns the first error from publishing a frame of the given camera that
+ * has not yet been reported to it, and forgets it.
+ */
+int ImageProcessingPipeline::TakePublishError(const MM::Device* camera)
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   std::map<const MM::Device*, int>::iterator it =
+      cameraPublishErrors_.find(camera);
+   if (it == cameraPublishErrors_.end())
+      return DEVICE_OK;
+   int error = it->second;
+   cameraPublishErrors_.erase(it);
+   return error;
+}
+
+/**
+ * Blocks until every frame submitted so far has been published. Returns the
+ * first error from the publish function since the previous call, if any,
+ * and forgets the errors not yet reported to the cameras.
+ *
+ * If caller (a camera calling from its sequence thread) has acquired a
+ * buffer, only the frames queued before it are waited for: it is not
+ * published before it is committed, and neither are the frames after it.
+ */
+int ImageProcessingPipeline::Drain(const MM::Device* caller)
+{
+   boost::unique_lock<boost::mutex> lock(mutex_);
+   long long last = nextSequence_;
+   std::map< const MM::Device*, boost::shared_ptr<Job> >::const_iterator it =
+      acquiredJobs_.find(caller);
+   if (caller != 0 && it != acquiredJobs_.end())
+      last = std::min(last, it->second->sequence);
+   while (nextToPublish_ < last)
+      spaceAvailable_.wait(lock);
+
+   int error = publishError_;
+   publishError_ = DEVICE_OK;
+   cameraPublishErrors_.clear();
+   return error;
+}
+
+long long ImageProcessingPipeline::GetPublishedImageCount() const
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   return publishedCount_;
+}
+
+/**
+ * Returns the number of frames that the publish function failed to store.
+ */
+long long ImageProcessingPipeline::GetFailedImageCount() const
+{
+   boost::lock_guard<boost::mutex> lock(mutex_);
+   return failedCount_;
+}
+
+void ImageProcessingPipeline::WorkerLoop()
+{
+   for (;;)
+   {
+      boost::shared_ptr<Job> job;
+      {
+         boost::unique_lock<boost::mutex> lock(mutex_);
+         while (pendingJobs_.empty() && (running_ || reservedJobs_ > 0))
+            jobAvailable_.wait(lock);
+         if (pendingJobs_.empty())
+            return;
+         job = pendingJobs_.front();
+         pendingJobs_.pop_front();
+      }
+
+      job->startedNs = GetMonotonicTimeNs();
+      if (job->process && !job->discard && !job->pixels.empty())
+         process_(job->camera, &job->pixels[0], job->width, job->height,
+               job->byteDepth);
+      job->finishedNs = GetMonotonicTimeNs();
+
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      completedJobs_[job->sequence] = job;
+      PublishCompleted(lock);
+   }
+}
+
+/**
+ * Publishes the completed jobs that are next in order. Called with mutex_
+ * held (through lock), which is released while publishing.
+ */
+void ImageProcessingPipeline::PublishCompleted(boost::unique_lock<boost::mutex>& lock)
+{
+   // Only one worker publishes at a time. The publishing worker checks for
+   // newly completed jobs before giving up the role, so none are left behind.
+   if (publishing_)
+      return;
+   publishing_ = true;
+
+   for (;;)
+   {
+      std::map< long long, boost::shared_ptr<Job> >::iterator it =
+         completedJobs_.begin();
+      if (it == completedJobs_.end() || it->first != nextToPublish_)
+         break;
+      boost::shared_ptr<Job> job = it->second;
+      completedJobs_.erase(it);
+      if (job->discard)
+      {
+         ++nextToPublish_;
+         freeJobs_.push_back(job);
+         spaceAvailable_.notify_all();
+         continue;
+      }
+      lock.unlock();
+
+      long long publishNs = GetMonotonicTimeNs();
+      job->md.PutImageTag("ImageProcessingQueue-ms",
+            NsToMs(job->startedNs - job->submittedNs));
+      job->md.PutImageTag("ImageProcessing-ms",
+            NsToMs(job->finishedNs - job->startedNs));
+      job->md.PutImageTag("ImageProcessingLatency-ms",
+            NsToMs(publishNs - job->submittedNs));
+      const unsigned char* pixels = job->pixels.empty() ? 0 : &job->pixels[0];
+      int ret = publish_(job->camera, pixels, job->width,
+            job->height, job->byteDepth, job->nComponents, job->md);
+
+      lock.lock();
+      if (ret == DEVICE_OK)
+         ++publishedCount_;
+      else
+      {
+         ++failedCount_;
+         if (publishError_ == DEVICE_OK)
+            publishError_ = ret;
+         // Keeps the first error
+         cameraPublishErrors_.insert(std::make_pair(job->camera, ret));
+      }
+      ++nextToPublish_;
+      freeJobs_.push_back(job);
+      spaceAvailable_.notify_all();
+   }
+
+   publishing_ = false;
+}
+
+} // namespace mm
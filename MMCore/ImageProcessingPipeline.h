@@ -0,0 +1,174 @@
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//
+// DESCRIPTION:   Runs the image processor on worker threads, off the camera
+//                thread, and publishes the results in order.
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#pragma once
+
+#include "../MMDevice/ImageMetadata.h"
+#include "../MMDevice/MMDevice.h"
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace mm {
+
+/**
+ * Asynchronous image processing stage between the cameras and the circular
+ * buffer.
+ *
+ * Submit() copies a raw frame into a job and returns immediately, so that a
+ * slow image processor does not hold up the camera's sequence thread
+ * (cameras that write frames in place can instead write directly into a job,
+ * with AcquireBuffer() and CommitBuffer()). A pool
+ * of worker threads runs the processor on the jobs, and the processed frames
+ * are handed to the publish function (which inserts them into the circular
+ * buffer) strictly in the order in which they were submitted, however many
+ * workers there are.
+ *
+ * At most GetQueueDepth() frames can be in the pipeline at a time; when it is
+ * full, Submit() waits for the oldest frame to be published. A frame that
+ * fails to be published is counted, and the first such error is reported
+ * once to its camera, by its next Submit() or CommitBuffer() (see
+ * TakePublishError()), which then does not queue the frame it is given: a
+ * camera that handles the error by clearing the buffer and inserting that
+ * frame again (as for a synchronous overflow) inserts it only once. The
+ * error is also reported by the next Drain(). The memory for the jobs is
+ * reused, so that no allocation takes place in the steady state.
+ *
+ * Published frames get the following tags (in milliseconds):
+ * ImageProcessingQueue-ms (time spent waiting for a worker),
+ * ImageProcessing-ms (time spent in the processor), and
+ * ImageProcessingLatency-ms (time from submission to publication, including
+ * waiting for earlier frames).
+ *
+ * The process function is called concurrently from all workers; with more
+ * than one worker, it must serialize calls to processors that do not
+ * tolerate this.
+ */
+class ImageProcessingPipeline
+{
+public:
+   // Processes the pixels in place; updates width and height if the
+   // processor changes the dimensions of the image
+   typedef boost::function<void (const MM::Device* camera,
+         unsigned char* pixels, unsigned& width, unsigned& height,
+         unsigned byteDepth)> ProcessFunction;
+   // Returns a device error code (DEVICE_OK on success)
+   typedef boost::function<int (const MM::Device* camera,
+         const unsigned char* pixels, unsigned width, unsigned height,
+         unsigned byteDepth, unsigned nComponents,
+         const Metadata& md)> PublishFunction;
+
+   ImageProcessingPipeline(ProcessFunction process, PublishFunction publish);
+   ~ImageProcessingPipeline();
+
+   void Start(unsigned threadCount, unsigned queueDepth);
+   void Stop();
+   bool IsRunning() const;
+   unsigned GetThreadCount() const;
+   unsigned GetQueueDepth() const;
+
+   int Submit(const MM::Device* camera, const unsigned char* pixels,
+         unsigned width, unsigned height, unsigned byteDepth,
+         unsigned nComponents, const Metadata& md);
+   unsigned char* AcquireBuffer(const MM::Device* camera, unsigned width,
+         unsigned height, unsigned byteDepth, unsigned nComponents);
+   bool HasAcquiredBuffer(const MM::Device* camera) const;
+   int CommitBuffer(const MM::Device* camera, const Metadata& md,
+         bool process);
+   void AbortBuffer(const MM::Device* camera);
+
+   int TakePublishError(const MM::Device* camera);
+   int Drain(const MM::Device* caller = 0);
+
+   long long GetPublishedImageCount() const;
+   long long GetFailedImageCount() const;
+
+private:
+   struct Job
+   {
+      const MM::Device* camera;
+      std::vector<unsigned char> pixels;
+      unsigned width;
+      unsigned height;
+      unsigned byteDepth;
+      unsigned nComponents;
+      Metadata md;
+      bool process;
+      // Aborted; skipped when its turn to be published comes
+      bool discard;
+      long long sequence;
+      long long submittedNs;
+      long long startedNs;
+      long long finishedNs;
+   };
+
+   boost::shared_ptr<Job> ReserveJob();
+   int QueueJob(boost::shared_ptr<Job> job);
+   boost::shared_ptr<Job> TakeAcquiredJob(const MM::Device* camera);
+   void StopWorkers();
+   void WorkerLoop();
+   void PublishCompleted(boost::unique_lock<boost::mutex>& lock);
+
+   ProcessFunction process_;
+   PublishFunction publish_;
+
+   // Protects everything below, except workers_ (which only Start() and
+   // Stop() touch, under startStopMutex_)
+   mutable boost::mutex mutex_;
+   boost::condition_variable jobAvailable_;
+   boost::condition_variable spaceAvailable_;
+
+   // Whether the workers are running; when not, Submit() processes and
+   // publishes frames on the calling thread
+   bool running_;
+   unsigned threadCount_;
+   unsigned queueDepth_;
+   std::vector< boost::shared_ptr<Job> > freeJobs_;
+   std::deque< boost::shared_ptr<Job> > pendingJobs_;
+   // Given a sequence number by ReserveJob() but not yet in pendingJobs_
+   unsigned reservedJobs_;
+   // Handed out by AcquireBuffer(), by camera
+   std::map< const MM::Device*, boost::shared_ptr<Job> > acquiredJobs_;
+   // Processed, waiting for earlier frames to be published
+   std::map< long long, boost::shared_ptr<Job> > completedJobs_;
+   long long nextSequence_;
+   long long nextToPublish_;
+   // Set while a worker is publishing; publication is serialized
+   bool publishing_;
+   // First error from the publish function since the last Drain()
+   int publishError_;
+   // First error from the publish function for each camera, not yet
+   // reported to it; cleared by Drain()
+   std::map<const MM::Device*, int> cameraPublishErrors_;
+   long long publishedCount_;
+   long long failedCount_;
+
+   boost::mutex startStopMutex_;
+   std::vector< boost::shared_ptr<boost::thread> > workers_;
+
+   ImageProcessingPipeline(const ImageProcessingPipeline&);
+   ImageProcessingPipeline& operator=(const ImageProcessingPipeline&);
+};
+
+} // namespace mm
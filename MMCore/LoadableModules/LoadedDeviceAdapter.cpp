@@ -39,7 +39,8 @@ LoadedDeviceAdapter::LoadedDeviceAdapter(const std::string& name, const std::str
    GetNumberOfDevices_(0),
    GetDeviceName_(0),
    GetDeviceType_(0),
-   GetDeviceDescription_(0)
+   GetDeviceDescription_(0),
+   GetDeviceLockGranularity_(0)
 {
    try
    {
@@ -73,6 +74,21 @@ LoadedDeviceAdapter::GetLock()
 }
 
 
+MM::DeviceLockGranularity
+LoadedDeviceAdapter::GetLockGranularity() const
+{
+   switch (GetDeviceLockGranularity())
+   {
+      case MM::LockPerHub:
+         return MM::LockPerHub;
+      case MM::LockPerDevice:
+         return MM::LockPerDevice;
+      default:
+         return MM::LockPerModule;
+   }
+}
+
+
 std::vector<std::string>
 LoadedDeviceAdapter::GetAvailableDeviceNames() const
 {
@@ -318,3 +334,13 @@ LoadedDeviceAdapter::GetDeviceDescription(const char* deviceName, char* buf, uns
          (module_->GetFunction("GetDeviceDescription"));
    return GetDeviceDescription_(deviceName, buf, bufLen);
 }
+
+
+long
+LoadedDeviceAdapter::GetDeviceLockGranularity() const
+{
+   if (!GetDeviceLockGranularity_)
+      GetDeviceLockGranularity_ = reinterpret_cast<fnGetDeviceLockGranularity>
+         (module_->GetFunction("GetDeviceLockGranularity"));
+   return GetDeviceLockGranularity_();
+}
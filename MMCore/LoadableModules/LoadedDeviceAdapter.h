@@ -54,6 +54,10 @@ public:
    // adapter.
    MMThreadLock* GetLock();
 
+   // Whether the module allows its devices to be locked individually (see
+   // SetDeviceLockGranularity() in ModuleInterface.h)
+   MM::DeviceLockGranularity GetLockGranularity() const;
+
    std::vector<std::string> GetAvailableDeviceNames() const;
    std::string GetDeviceDescription(const std::string& deviceName) const;
    MM::DeviceType GetAdvertisedDeviceType(const std::string& deviceName) const;
@@ -101,6 +105,7 @@ private:
    bool GetDeviceDescription(const char* deviceName,
          char* buf, unsigned bufLen) const;
    bool GetDeviceType(const char* deviceName, int* type) const;
+   long GetDeviceLockGranularity() const;
    MM::Device* CreateDevice(const char* deviceName);
    void DeleteDevice(MM::Device* device);
 
@@ -119,4 +124,5 @@ private:
    mutable fnGetDeviceName GetDeviceName_;
    mutable fnGetDeviceType GetDeviceType_;
    mutable fnGetDeviceDescription GetDeviceDescription_;
+   mutable fnGetDeviceLockGranularity GetDeviceLockGranularity_;
 };
@@ -50,13 +50,17 @@
 #include "CoreUtils.h"
 #include "DeviceManager.h"
 #include "Devices/DeviceInstances.h"
+#include "GeometricCorrection.h"
 #include "Host.h"
+#include "ImageProcessingPipeline.h"
 #include "LogManager.h"
 #include "MMCore.h"
 #include "MMEventCallback.h"
 #include "PluginManager.h"
 
+#include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/make_shared.hpp>
 
 #include <algorithm>
 #include <assert.h>
@@ -106,7 +110,7 @@ using namespace std;
  * (Keep the 3 numbers on one line to make it easier to look at diffs when
  * merging/rebasing.)
  */
-const int MMCore_versionMajor = 10, MMCore_versionMinor = 1, MMCore_versionPatch = 0;
+const int MMCore_versionMajor = 10, MMCore_versionMinor = 9, MMCore_versionPatch = 0;
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -132,6 +136,9 @@ CMMCore::CMMCore() :
    externalCallback_(0),
    pixelSizeGroup_(0),
    cbuf_(0),
+   imageProcessingThreads_(1),
+   imageProcessingQueueDepth_(4),
+   geometricCorrection_(false),
    pluginManager_(new CPluginManager()),
    deviceManager_(new mm::DeviceManager()),
    pPostedErrorsLock_(NULL)
@@ -142,7 +149,13 @@ CMMCore::CMMCore() :
 
    InitializeErrorMessages();
 
-   callback_ = new CoreCallback(this);
+   CoreCallback* coreCallback = new CoreCallback(this);
+   callback_ = coreCallback;
+   imageProcessingPipeline_ = boost::make_shared<mm::ImageProcessingPipeline>(
+         boost::bind(&CoreCallback::ProcessImage, coreCallback,
+            _1, _2, _3, _4, _5),
+         boost::bind(&CoreCallback::PublishImage, coreCallback,
+            _1, _2, _3, _4, _5, _6, _7));
 
    const unsigned seqBufMegabytes = (sizeof(void*) > 4) ? 250 : 25;
    cbuf_ = new CircularBuffer(seqBufMegabytes);
@@ -172,6 +185,7 @@ CMMCore::~CMMCore()
       LOG_ERROR(coreLogger_) << "Exception caught in CMMCore destructor.";
    }
 
+   imageProcessingPipeline_->Stop();
    delete callback_;
    delete configGroups_;
    delete properties_;
@@ -776,10 +790,22 @@ void CMMCore::unloadDevice(const char* label///< the name of the device to unloa
 {
    boost::shared_ptr<DeviceInstance> pDevice = deviceManager_->GetDevice(label);
 
+   // Queued images may refer to the device
+   imageProcessingPipeline_->Drain();
+
    try {
       mm::DeviceModuleLockGuard guard(pDevice);
       LOG_DEBUG(coreLogger_) << "Will unload device " << label;
+      callback_->ForgetDevice(pDevice->GetRawPtr());
       deviceManager_->UnloadDevice(pDevice);
+      {
+         MMThreadGuard g(cameraBuffersLock_);
+         cameraBuffers_.erase(label);
+      }
+      {
+         MMThreadGuard g(correctedImagesLock_);
+         correctedImages_.erase(label);
+      }
       LOG_DEBUG(coreLogger_) << "Did unload device " << label;
    }
    catch (CMMError& err) {
@@ -812,7 +838,17 @@ void CMMCore::unloadAllDevices() throw (CMMError)
       }
 
       LOG_DEBUG(coreLogger_) << "Will unload all devices";
+      imageProcessingPipeline_->Drain();
+      callback_->ForgetAllDevices();
       deviceManager_->UnloadAllDevices();
+      {
+         MMThreadGuard g(cameraBuffersLock_);
+         cameraBuffers_.clear();
+      }
+      {
+         MMThreadGuard g(correctedImagesLock_);
+         correctedImages_.clear();
+      }
       LOG_INFO(coreLogger_) << "Did unload all devices";
 
 	   properties_->Refresh();
@@ -1055,6 +1091,9 @@ std::string CMMCore::getParentLabel(const char* label) throw (CMMError)
 
 /**
  * Sets parent device label
+ *
+ * Devices of modules that lock per hub take their hub's lock, once the
+ * calls in progress to the device have returned.
  */
 void CMMCore::setParentLabel(const char* label, const char* parentLabel) throw (CMMError)
 {
@@ -1071,8 +1110,11 @@ void CMMCore::setParentLabel(const char* label, const char* parentLabel) throw (
       CheckDeviceLabel(parentLabel);
    }
 
-   mm::DeviceModuleLockGuard guard(pDev);
-   pDev->SetParentID(parentLabel);
+   {
+      mm::DeviceModuleLockGuard guard(pDev);
+      pDev->SetParentID(parentLabel);
+   }
+   pDev->SetParentHubLock(deviceManager_->GetParentDevice(pDev));
 }
 
 
@@ -2627,6 +2669,7 @@ void* CMMCore::getImage() throw (CMMError)
 	      {
             imageProcessor->Process((unsigned char*)pBuf, camera->GetImageWidth(),  camera->GetImageHeight(), camera->GetImageBytesPerPixel() );
 	      }
+         pBuf = correctSnappedImage(camera, (unsigned char*)pBuf);
 		} catch( CMMError& e){
 			throw e;
 		} catch (...) {
@@ -2674,6 +2717,7 @@ void* CMMCore::getImage(unsigned channelNr) throw (CMMError)
 	      {
             imageProcessor->Process((unsigned char*)pBuf, camera->GetImageWidth(),  camera->GetImageHeight(), camera->GetImageBytesPerPixel() );
 	      }
+         pBuf = correctSnappedImage(camera, (unsigned char*)pBuf);
 		} catch( CMMError& e){
 			throw e;
 		} catch (...) {
@@ -2712,6 +2756,8 @@ long CMMCore::getImageBufferSize()
 /**
  * Starts streaming camera sequence acquisition.
  * This command does not block the calling thread for the duration of the acquisition.
+ * The circular buffer receiving the camera's images (its dedicated buffer,
+ * if it has one) is initialized first.
  *
  * @param numImages        Number of images requested from the camera
  * @param intervalMs       The interval between images, currently only supported by Andor cameras
@@ -2737,13 +2783,8 @@ void CMMCore::startSequenceAcquisition(long numImages, double intervalMs, bool s
 
 		try
 		{
-			if (!cbuf_->Initialize(camera->GetNumberOfChannels(), camera->GetImageWidth(), camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
-			{
-				logError(getDeviceName(camera).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-				throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-			}
-			cbuf_->Clear();
          mm::DeviceModuleLockGuard guard(camera);
+			initializeCameraCircularBuffer(camera);
 
          LOG_DEBUG(coreLogger_) << "Will start sequence acquisition from default camera";
 			int nRet = camera->StartSequenceAcquisition(numImages, intervalMs, stopOnOverflow);
@@ -2769,7 +2810,8 @@ void CMMCore::startSequenceAcquisition(long numImages, double intervalMs, bool s
  * Starts streaming camera sequence acquisition for a specified camera.
  * This command does not block the calling thread for the duration of the acquisition.
  * The difference between this method and the one with the same name but operating on the "default"
- * camera is that it does not automatically initialize the circular buffer.
+ * camera is that it does not automatically initialize the circular buffer (unless the camera has a
+ * dedicated circular buffer; see setCircularBufferMemoryFootprint(const char*, unsigned)).
  */
 void CMMCore::startSequenceAcquisition(const char* label, long numImages, double intervalMs, bool stopOnOverflow) throw (CMMError)
 {
@@ -2781,6 +2823,11 @@ void CMMCore::startSequenceAcquisition(const char* label, long numImages, double
       throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
                      MMERR_NotAllowedDuringSequenceAcquisition);
 
+   // A camera with a dedicated buffer gets it initialized for its current
+   // image size; the shared buffer is left alone, as documented.
+   if (findCameraCircularBuffer(label))
+      initializeCameraCircularBuffer(pCam);
+
    LOG_DEBUG(coreLogger_) <<
       "Will start sequence acquisition from camera " << label;
    int nRet = pCam->StartSequenceAcquisition(numImages, intervalMs, stopOnOverflow);
@@ -2818,6 +2865,9 @@ void CMMCore::prepareSequenceAcquisition(const char* label) throw (CMMError)
 
 /**
  * Initialize circular buffer based on the current camera settings.
+ * If the current camera has a dedicated circular buffer (see
+ * setCircularBufferMemoryFootprint(const char*, unsigned)), that buffer is
+ * initialized instead of the shared one.
  */
 void CMMCore::initializeCircularBuffer() throw (CMMError)
 {
@@ -2825,12 +2875,7 @@ void CMMCore::initializeCircularBuffer() throw (CMMError)
    if (camera)
    {
       mm::DeviceModuleLockGuard guard(camera);
-      if (!cbuf_->Initialize(camera->GetNumberOfChannels(), camera->GetImageWidth(), camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
-      {
-         logError(getDeviceName(camera).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-         throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-      }
-      cbuf_->Clear();
+      initializeCameraCircularBuffer(camera);
    }
    else
    {
@@ -2839,6 +2884,91 @@ void CMMCore::initializeCircularBuffer() throw (CMMError)
    LOG_DEBUG(coreLogger_) << "Circular buffer initialized based on current camera";
 }
 
+/**
+ * Initialize circular buffer based on the current camera settings, selecting
+ * whether it operates in lock-free mode.
+ *
+ * In lock-free mode, retrieving images from the buffer (popNextImage(),
+ * getLastImage(), getRemainingImageCount(), etc.) never blocks the camera
+ * thread inserting images, so that frequent polling does not reduce the
+ * achievable frame rate. The mode is retained until changed by another call
+ * to this function (including across setCircularBufferMemoryFootprint()).
+ *
+ * @param lockFree   whether to use the lock-free mode
+ */
+void CMMCore::initializeCircularBuffer(bool lockFree) throw (CMMError)
+{
+   cbuf_->SetLockFree(lockFree);
+   LOG_DEBUG(coreLogger_) << "Circular buffer lock-free mode " <<
+      (lockFree ? "enabled" : "disabled");
+   initializeCircularBuffer();
+}
+
+/**
+ * Returns whether the circular buffer is in lock-free mode.
+ */
+bool CMMCore::isCircularBufferLockFree()
+{
+   if (cbuf_)
+   {
+      return cbuf_->IsLockFree();
+   }
+   return false;
+}
+
+/**
+ * Selects whether the circular buffer memory is backed by huge pages, and
+ * reallocates the buffer based on the current camera settings if a camera
+ * is available.
+ *
+ * Huge pages reduce the cost of first touching the buffer memory and of TLB
+ * misses during fast acquisitions. They are used only if the operating
+ * system provides them (on Linux, reserved huge pages or transparent huge
+ * pages; on Windows, large pages, which require the "Lock pages in memory"
+ * privilege); otherwise normal pages are used. The setting is retained
+ * across setCircularBufferMemoryFootprint().
+ *
+ * @param enable   whether to request huge pages
+ */
+void CMMCore::setCircularBufferHugePages(bool enable) throw (CMMError)
+{
+   cbuf_->SetUseHugePages(enable);
+   LOG_DEBUG(coreLogger_) << "Circular buffer huge pages " <<
+      (enable ? "requested" : "disabled");
+   if (currentCameraDevice_.lock())
+      initializeCircularBuffer();
+}
+
+/**
+ * Returns whether the circular buffer memory is currently backed by huge
+ * pages.
+ */
+bool CMMCore::isCircularBufferUsingHugePages()
+{
+   if (cbuf_)
+   {
+      return cbuf_->IsUsingHugePages();
+   }
+   return false;
+}
+
+/**
+ * Returns the number of bytes of circular buffer memory that are actually
+ * backed by physical memory.
+ *
+ * The buffer memory is reserved when the buffer is initialized, and
+ * committed page by page in the background; this value grows to the full
+ * size of the buffer once that has completed.
+ */
+long long CMMCore::getCircularBufferCommittedBytes()
+{
+   if (cbuf_)
+   {
+      return (long long)cbuf_->GetCommittedBytes();
+   }
+   return 0;
+}
+
 /**
  * Stops streaming camera sequence acquisition for a specified camera.
  * @param label   The camera name
@@ -2858,6 +2988,9 @@ void CMMCore::stopSequenceAcquisition(const char* label) throw (CMMError)
    }
 
    LOG_DEBUG(coreLogger_) << "Did stop sequence acquisition from camera " << label;
+
+   // Images still being processed must reach the buffer before we return
+   imageProcessingPipeline_->Drain();
 }
 
 /**
@@ -2877,12 +3010,7 @@ void CMMCore::startContinuousSequenceAcquisition(double intervalMs) throw (CMMEr
             ,MMERR_NotAllowedDuringSequenceAcquisition);
       }
 
-      if (!cbuf_->Initialize(camera->GetNumberOfChannels(), camera->GetImageWidth(), camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
-      {
-         logError(getDeviceName(camera).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-         throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-      }
-      cbuf_->Clear();
+      initializeCameraCircularBuffer(camera);
       LOG_DEBUG(coreLogger_) << "Will start continuous sequence acquisition from current camera";
       int nRet = camera->StartSequenceAcquisition(intervalMs);
       if (nRet != DEVICE_OK)
@@ -2920,6 +3048,9 @@ void CMMCore::stopSequenceAcquisition() throw (CMMError)
    }
 
    LOG_DEBUG(coreLogger_) << "Did stop sequence acquisition from current camera";
+
+   // Images still being processed must reach the buffer before we return
+   imageProcessingPipeline_->Drain();
 }
 
 /**
@@ -2993,7 +3124,7 @@ void* CMMCore::getLastImageMD(unsigned channel, unsigned slice, Metadata& md) co
    const mm::ImgBuffer* pBuf = cbuf_->GetTopImageBuffer(channel);
    if (pBuf != 0)
    {
-      md = pBuf->GetMetadata();
+      pBuf->GetMetadata(md);
       return const_cast<unsigned char*>(pBuf->GetPixels());
    }
    else
@@ -3018,7 +3149,7 @@ void* CMMCore::getNBeforeLastImageMD(unsigned long n, Metadata& md) const throw
    const mm::ImgBuffer* pBuf = cbuf_->GetNthFromTopImageBuffer(n);
    if (pBuf != 0)
    {
-      md = pBuf->GetMetadata();
+      pBuf->GetMetadata(md);
       return const_cast<unsigned char*>(pBuf->GetPixels());
    }
    else
@@ -3052,7 +3183,7 @@ void* CMMCore::popNextImageMD(unsigned channel, unsigned slice, Metadata& md) th
    const mm::ImgBuffer* pBuf = cbuf_->GetNextImageBuffer(channel);
    if (pBuf != 0)
    {
-      md = pBuf->GetMetadata();
+      pBuf->GetMetadata(md);
       return const_cast<unsigned char*>(pBuf->GetPixels());
    }
    else
@@ -3067,6 +3198,79 @@ void* CMMCore::popNextImageMD(Metadata& md) throw (CMMError)
    return popNextImageMD(0, 0, md);
 }
 
+/**
+ * Gets and removes the next image from the circular buffer, keeping its
+ * storage from being overwritten until it is released.
+ *
+ * Unlike with popNextImage(), the pixels of a leased image remain valid after
+ * the call, because the camera cannot insert a new image into a leased slot
+ * (it overflows the buffer instead). This makes it safe to use the pixels
+ * without copying them, or to copy them at leisure. Every lease must be
+ * ended with releaseImage(). While images are leased, the buffer cannot be
+ * reinitialized for images of other dimensions (so a sequence acquisition
+ * with such images fails to start). Lease ids are never reused, so a lease
+ * id that has been released, or that predates the last reallocation of the
+ * buffer, is rejected.
+ *
+ * @param md   receives the metadata of the image
+ * @return the lease id, to be passed to getLeasedImage() and releaseImage()
+ */
+long long CMMCore::popNextImageLease(Metadata& md) throw (CMMError)
+{
+   long long leaseId = cbuf_->LeaseNextImage();
+   if (leaseId < 0)
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+
+   const mm::ImgBuffer* pBuf = cbuf_->GetLeasedImageBuffer(leaseId, 0);
+   if (pBuf != 0)
+      pBuf->GetMetadata(md);
+   return leaseId;
+}
+
+/**
+ * Returns the pixels of an image leased with popNextImageLease().
+ * The pointer remains valid until the lease is released.
+ */
+void* CMMCore::getLeasedImage(long long leaseId) throw (CMMError)
+{
+   return getLeasedImage(leaseId, 0);
+}
+
+/**
+ * Returns the pixels of the given camera channel of an image leased with
+ * popNextImageLease().
+ */
+void* CMMCore::getLeasedImage(long long leaseId, unsigned channel) throw (CMMError)
+{
+   const mm::ImgBuffer* pBuf = cbuf_->GetLeasedImageBuffer(leaseId, channel);
+   if (pBuf == 0)
+      throw CMMError(getCoreErrorText(MMERR_InvalidImageLease).c_str(), MMERR_InvalidImageLease);
+   return const_cast<unsigned char*>(pBuf->GetPixels());
+}
+
+/**
+ * Ends a lease obtained from popNextImageLease(), allowing the circular
+ * buffer to reuse the image's storage.
+ */
+void CMMCore::releaseImage(long long leaseId) throw (CMMError)
+{
+   if (!cbuf_->ReleaseImage(leaseId))
+      throw CMMError(getCoreErrorText(MMERR_InvalidImageLease).c_str(), MMERR_InvalidImageLease);
+}
+
+/**
+ * Returns the number of images leased from the circular buffer and not yet
+ * released.
+ */
+long CMMCore::getLeasedImageCount()
+{
+   if (cbuf_)
+   {
+      return cbuf_->GetLeaseCount();
+   }
+   return 0;
+}
+
 /**
  * Removes all images from the circular buffer.
  *
@@ -3078,18 +3282,139 @@ void CMMCore::clearCircularBuffer() throw (CMMError)
    cbuf_->Clear();
 }
 
+/**
+ * Enables or disables asynchronous image processing.
+ *
+ * By default, the image processor (see setImageProcessorDevice()) runs on
+ * the camera's thread before each image is inserted into the circular
+ * buffer, so that a slow processor limits the frame rate. When asynchronous
+ * processing is enabled, images that are to be processed are instead copied
+ * into a bounded queue (or written there directly by cameras that support
+ * it) and processed by worker threads (see
+ * setAsyncImageProcessingThreads()). The processed images are inserted into
+ * the circular buffer in the order in which the camera produced them, with
+ * the following tags, in milliseconds: ImageProcessingQueue-ms,
+ * ImageProcessing-ms and ImageProcessingLatency-ms.
+ *
+ * When the queue is full, the camera waits. Because insertion takes place
+ * later, an image that cannot be inserted (e.g. because the circular buffer
+ * overflowed) is reported to the camera by its next attempt to insert an
+ * image, which is then discarded; a camera that stops on overflow thus
+ * stops one image late, and one that clears the buffer and retries inserts
+ * the image once. isBufferOverflowed() reflects the overflow as soon as it
+ * happens.
+ *
+ * Disabling waits for the queued images to be processed.
+ */
+void CMMCore::enableAsyncImageProcessing(bool enable) throw (CMMError)
+{
+   if (enable)
+      imageProcessingPipeline_->Start(imageProcessingThreads_,
+            imageProcessingQueueDepth_);
+   else
+      imageProcessingPipeline_->Stop();
+   LOG_DEBUG(coreLogger_) << "Asynchronous image processing " <<
+      (enable ? "enabled" : "disabled");
+}
+
+/**
+ * Returns whether asynchronous image processing is enabled.
+ */
+bool CMMCore::isAsyncImageProcessingEnabled()
+{
+   return imageProcessingPipeline_->IsRunning();
+}
+
+/**
+ * Sets the number of worker threads and the maximum number of images
+ * queued (including those being processed) for asynchronous image
+ * processing. Takes effect immediately if asynchronous processing is
+ * enabled, once the queued images have been processed.
+ *
+ * With more than one thread, images are processed concurrently only by
+ * image processors that support it (see MM::ImageProcessor::IsBandSafe());
+ * calls to other processors are made one at a time.
+ *
+ * @param threadCount   number of worker threads (default 1)
+ * @param queueDepth    maximum number of images in the queue (default 4);
+ *                      raised to threadCount if smaller
+ */
+void CMMCore::setAsyncImageProcessingThreads(unsigned threadCount,
+      unsigned queueDepth) throw (CMMError)
+{
+   if (threadCount == 0)
+      throw CMMError("The number of image processing threads must be positive");
+   imageProcessingThreads_ = threadCount;
+   imageProcessingQueueDepth_ = std::max(threadCount, queueDepth);
+   if (imageProcessingPipeline_->IsRunning())
+      imageProcessingPipeline_->Start(imageProcessingThreads_,
+            imageProcessingQueueDepth_);
+}
+
+/**
+ * Enables or disables geometric correction of the images in the circular
+ * buffer.
+ *
+ * Cameras describe the orientation of their images with the TransposeXY,
+ * TransposeMirrorX and TransposeMirrorY properties, and set
+ * TransposeCorrection when they correct the images themselves. Otherwise
+ * each consumer has to flip the images. When geometric correction is
+ * enabled, the Core instead mirrors (left to right for TransposeMirrorX,
+ * top to bottom for TransposeMirrorY) and then transposes (TransposeXY) the
+ * images once, as they are written into the circular buffer, so that a
+ * transposed image has its width and height swapped. Corrected images get
+ * the tag GeometricCorrectionApplied with the value 1, which tells
+ * consumers not to flip them again.
+ *
+ * The properties are read when a camera starts a sequence acquisition, so
+ * that the setting and changes to the properties take effect with the next
+ * sequence. Images returned by getImage() are corrected too, according to the
+ * properties at the time of the call, and getImageWidth() and
+ * getImageHeight() give the corrected dimensions.
+ */
+void CMMCore::enableGeometricCorrection(bool enable)
+{
+   geometricCorrection_ = enable;
+   LOG_DEBUG(coreLogger_) << "Geometric correction " <<
+      (enable ? "enabled" : "disabled");
+}
+
+/**
+ * Returns whether geometric correction of images is enabled (see
+ * enableGeometricCorrection()).
+ */
+bool CMMCore::isGeometricCorrectionEnabled()
+{
+   return geometricCorrection_;
+}
+
 /**
  * Reserve memory for the circular buffer.
  */
 void CMMCore::setCircularBufferMemoryFootprint(unsigned sizeMB ///< n megabytes
                                                ) throw (CMMError)
 {
+   bool lockFree = cbuf_ ? cbuf_->IsLockFree() : false;
+   bool hugePages = cbuf_ ? cbuf_->GetUseHugePages() : false;
+   CircularBuffer::OverflowPolicy overflowPolicy = cbuf_ ?
+      cbuf_->GetOverflowPolicy() : CircularBuffer::OverflowStop;
+   bool popNextImageLossy = cbuf_ ? cbuf_->IsDefaultConsumerLossy() : false;
+   std::vector< std::pair<std::string, bool> > cursors;
+   if (cbuf_)
+      cursors = cbuf_->GetCursors();
+   imageProcessingPipeline_->Drain();
    delete cbuf_; // discard old buffer
    LOG_DEBUG(coreLogger_) << "Will set circular buffer size to " <<
       sizeMB << " MB";
 	try
 	{
 		cbuf_ = new CircularBuffer(sizeMB);
+		cbuf_->SetLockFree(lockFree);
+		cbuf_->SetUseHugePages(hugePages);
+		cbuf_->SetOverflowPolicy(overflowPolicy);
+		cbuf_->SetDefaultConsumerLossy(popNextImageLossy);
+		for (size_t i = 0; i < cursors.size(); ++i)
+			cbuf_->AddCursor(cursors[i].first, cursors[i].second);
 	}
 	catch(bad_alloc& ex)
 	{
@@ -3184,6 +3509,554 @@ bool CMMCore::isBufferOverflowed() const
    return cbuf_->Overflow();
 }
 
+namespace
+{
+   const char* const overflowPolicyNames[] =
+      { "Stop", "ClearAll", "DropOldest", "DropNewest" };
+
+   CircularBuffer::OverflowPolicy ParseOverflowPolicy(const char* policy)
+   {
+      if (!policy)
+         throw CMMError("Null circular buffer overflow policy",
+               MMERR_NullPointerException);
+      for (int i = 0; i < CircularBuffer::OverflowPolicyCount; ++i)
+      {
+         if (strcmp(policy, overflowPolicyNames[i]) == 0)
+            return static_cast<CircularBuffer::OverflowPolicy>(i);
+      }
+      throw CMMError("Invalid circular buffer overflow policy " +
+            ToQuotedString(policy), MMERR_InvalidOverflowPolicy);
+   }
+
+   void CheckReaderCursorName(const char* name)
+   {
+      if (!name)
+         throw CMMError("Null reader cursor name", MMERR_NullPointerException);
+   }
+
+   CMMError InvalidReaderCursorError(const char* name)
+   {
+      return CMMError("No circular buffer reader cursor named " +
+            ToQuotedString(name), MMERR_InvalidReaderCursor);
+   }
+} // anonymous namespace
+
+/**
+ * Selects what happens when a camera inserts an image while the circular
+ * buffer is full.
+ *
+ * - "Stop" (default): the image is rejected and the buffer is marked as
+ *   overflowed. The camera stops the sequence acquisition, or, if it was
+ *   started with stopOnOverflow = false, clears the buffer and continues.
+ * - "ClearAll": all images in the buffer are discarded to make room.
+ * - "DropOldest": the oldest image in the buffer is discarded to make room,
+ *   so that a slow consumer loses only the images it could not keep up with.
+ * - "DropNewest": the new image is discarded.
+ *
+ * The setting is retained across setCircularBufferMemoryFootprint(), and is
+ * inherited by camera circular buffers created afterwards.
+ *
+ * @param policy   one of the policy names above
+ */
+void CMMCore::setCircularBufferOverflowPolicy(const char* policy) throw (CMMError)
+{
+   cbuf_->SetOverflowPolicy(ParseOverflowPolicy(policy));
+   LOG_DEBUG(coreLogger_) << "Circular buffer overflow policy set to " << policy;
+}
+
+/**
+ * Returns the overflow policy of the circular buffer (see
+ * setCircularBufferOverflowPolicy()).
+ */
+std::string CMMCore::getCircularBufferOverflowPolicy()
+{
+   return overflowPolicyNames[cbuf_->GetOverflowPolicy()];
+}
+
+/**
+ * Returns the number of images lost under the given overflow policy since
+ * the circular buffer was last initialized. For "ClearAll", this includes
+ * images discarded by cameras clearing the buffer after an overflow; for
+ * "Stop", it is the number of rejected images. Images that could not be
+ * stored because their slot was leased (see popNextImageLease()) are counted
+ * under "DropNewest".
+ *
+ * @param policy   one of the policy names accepted by
+ *                 setCircularBufferOverflowPolicy()
+ */
+long long CMMCore::getCircularBufferDroppedImageCount(const char* policy) throw (CMMError)
+{
+   return cbuf_->GetDroppedImageCount(ParseOverflowPolicy(policy));
+}
+
+/**
+ * Creates a named reader cursor on the circular buffer.
+ *
+ * Each cursor reads the images inserted after it was created, independently
+ * of popNextImage() and of other cursors. A slot is reused only after
+ * every non-lossy cursor has read its image, so a slow non-lossy cursor
+ * (e.g. the one used for saving images) causes the buffer to fill up, which
+ * is then handled by the overflow policy. A lossy cursor (e.g. for display)
+ * never holds up the camera; when it falls behind by more than the buffer
+ * capacity, it skips to the newest image. popNextImage() keeps holding
+ * the images it has not read, as without cursors; an application that reads
+ * only through cursors can make it lossy with setPopNextImageLossy().
+ *
+ * Cursors persist across initializeCircularBuffer(),
+ * setCircularBufferMemoryFootprint() and sequence acquisitions, until
+ * removed with removeReaderCursor().
+ *
+ * @param name    a name for the cursor, unique among cursors
+ * @param lossy   whether the cursor may skip images
+ */
+void CMMCore::createReaderCursor(const char* name, bool lossy) throw (CMMError)
+{
+   CheckReaderCursorName(name);
+   if (!cbuf_->AddCursor(name, lossy))
+      throw CMMError("A reader cursor named " + ToQuotedString(name) +
+            " already exists");
+}
+
+/**
+ * Sets whether popNextImage() and the other consumers of the circular
+ * buffer that do not use a cursor may lose images.
+ *
+ * By default they hold every image they have not read, so that the buffer
+ * fills up if they do not keep up. When lossy, they do not hold up the
+ * camera: images they have not read are lost when their slots are reused,
+ * and popNextImage() returns the oldest image still in the buffer. The
+ * setting persists until changed, like the reader cursors.
+ */
+void CMMCore::setPopNextImageLossy(bool lossy)
+{
+   cbuf_->SetDefaultConsumerLossy(lossy);
+   LOG_DEBUG(coreLogger_) << "popNextImage() " <<
+      (lossy ? "may lose images" : "holds unread images");
+}
+
+/**
+ * Returns whether popNextImage() may lose images (see setPopNextImageLossy()).
+ */
+bool CMMCore::isPopNextImageLossy()
+{
+   return cbuf_->IsDefaultConsumerLossy();
+}
+
+/**
+ * Removes a reader cursor created with createReaderCursor(), releasing any
+ * slots it was holding.
+ */
+void CMMCore::removeReaderCursor(const char* name) throw (CMMError)
+{
+   CheckReaderCursorName(name);
+   if (!cbuf_->RemoveCursor(name))
+      throw InvalidReaderCursorError(name);
+}
+
+/**
+ * Gets the next image for the given reader cursor and advances the cursor.
+ *
+ * The image pixels remain valid until the slot is reused. For a lossy
+ * cursor, this can happen at any time, so the pixels should be copied
+ * promptly.
+ */
+void* CMMCore::popNextImageFromCursor(const char* name) throw (CMMError)
+{
+   Metadata md;
+   return popNextImageMDFromCursor(name, md);
+}
+
+/**
+ * Gets the next image (and metadata) for the given reader cursor and
+ * advances the cursor.
+ */
+void* CMMCore::popNextImageMDFromCursor(const char* name, Metadata& md) throw (CMMError)
+{
+   CheckReaderCursorName(name);
+   if (!cbuf_->HasCursor(name))
+      throw InvalidReaderCursorError(name);
+
+   const mm::ImgBuffer* pBuf = cbuf_->GetNextImageBuffer(std::string(name), 0);
+   if (pBuf != 0)
+   {
+      pBuf->GetMetadata(md);
+      return const_cast<unsigned char*>(pBuf->GetPixels());
+   }
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Returns the number of images inserted in the circular buffer but not yet
+ * read through the given cursor. For a lossy cursor, this may exceed the
+ * capacity of the buffer.
+ */
+long CMMCore::getReaderCursorLag(const char* name) throw (CMMError)
+{
+   CheckReaderCursorName(name);
+   long long lag = cbuf_->GetCursorLag(name);
+   if (lag < 0)
+      throw InvalidReaderCursorError(name);
+   return static_cast<long>(lag);
+}
+
+/**
+ * Returns the number of images that the given cursor has missed, either
+ * because it is lossy and fell behind, or because the overflow policy
+ * discarded them.
+ */
+long long CMMCore::getReaderCursorDroppedImageCount(const char* name) throw (CMMError)
+{
+   CheckReaderCursorName(name);
+   long long dropped = cbuf_->GetCursorDroppedImageCount(name);
+   if (dropped < 0)
+      throw InvalidReaderCursorError(name);
+   return dropped;
+}
+
+/**
+ * Creates (or replaces) a circular buffer dedicated to the given camera.
+ *
+ * Images inserted by a camera that has a dedicated buffer are stored there
+ * instead of in the shared circular buffer, and are retrieved with the
+ * versions of popNextImage(), getLastImageMD(), getRemainingImageCount(),
+ * etc. that take a camera label. Each dedicated buffer has its own size,
+ * image dimensions and overflow state, so that several cameras with
+ * different image sizes can run sequence acquisitions at the same time
+ * (started with startSequenceAcquisition(const char*, ...)).
+ *
+ * The buffer is initialized based on the current settings of the camera,
+ * and is reinitialized whenever a sequence acquisition is started on the
+ * camera. It inherits the lock-free and huge page settings of the shared
+ * buffer.
+ *
+ * @param cameraLabel   the camera
+ * @param sizeMB        size of the buffer in megabytes
+ */
+void CMMCore::setCircularBufferMemoryFootprint(const char* cameraLabel, unsigned sizeMB) throw (CMMError)
+{
+   boost::shared_ptr<CameraInstance> camera =
+      deviceManager_->GetDeviceOfType<CameraInstance>(cameraLabel);
+
+   mm::DeviceModuleLockGuard guard(camera);
+   if (camera->IsCapturing())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+
+   LOG_DEBUG(coreLogger_) << "Will set circular buffer size of camera " <<
+      cameraLabel << " to " << sizeMB << " MB";
+
+   boost::shared_ptr<CircularBuffer> buffer;
+   try
+   {
+      buffer.reset(new CircularBuffer(sizeMB));
+   }
+   catch (const bad_alloc& ex)
+   {
+      ostringstream messs;
+      messs << getCoreErrorText(MMERR_OutOfMemory).c_str() << " " << ex.what() << endl;
+      throw CMMError(messs.str().c_str() , MMERR_OutOfMemory);
+   }
+   buffer->SetLockFree(cbuf_->IsLockFree());
+   buffer->SetUseHugePages(cbuf_->GetUseHugePages());
+   buffer->SetOverflowPolicy(cbuf_->GetOverflowPolicy());
+   if (!buffer->Initialize(camera->GetNumberOfChannels(), camera->GetImageWidth(),
+            camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
+   {
+      logError(cameraLabel, getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
+   }
+
+   {
+      MMThreadGuard g(cameraBuffersLock_);
+      cameraBuffers_[cameraLabel] = buffer;
+   }
+
+   LOG_DEBUG(coreLogger_) << "Did set circular buffer size of camera " <<
+      cameraLabel << " to " << sizeMB << " MB";
+}
+
+/**
+ * Returns the size, in megabytes, of the circular buffer dedicated to the
+ * given camera.
+ */
+unsigned CMMCore::getCircularBufferMemoryFootprint(const char* cameraLabel) throw (CMMError)
+{
+   return getCameraCircularBuffer(cameraLabel)->GetMemorySizeMB();
+}
+
+/**
+ * Removes the circular buffer dedicated to the given camera. Subsequent
+ * images from the camera are stored in the shared circular buffer.
+ */
+void CMMCore::removeCircularBuffer(const char* cameraLabel) throw (CMMError)
+{
+   boost::shared_ptr<CameraInstance> camera =
+      deviceManager_->GetDeviceOfType<CameraInstance>(cameraLabel);
+
+   mm::DeviceModuleLockGuard guard(camera);
+   if (camera->IsCapturing())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+
+   MMThreadGuard g(cameraBuffersLock_);
+   cameraBuffers_.erase(cameraLabel);
+}
+
+/**
+ * Returns whether the given camera has a dedicated circular buffer.
+ */
+bool CMMCore::hasCircularBuffer(const char* cameraLabel)
+{
+   return findCameraCircularBuffer(cameraLabel) != 0;
+}
+
+/**
+ * Initializes the circular buffer dedicated to the given camera, based on
+ * the current camera settings.
+ */
+void CMMCore::initializeCircularBuffer(const char* cameraLabel) throw (CMMError)
+{
+   boost::shared_ptr<CircularBuffer> buffer = getCameraCircularBuffer(cameraLabel);
+   boost::shared_ptr<CameraInstance> camera =
+      deviceManager_->GetDeviceOfType<CameraInstance>(cameraLabel);
+
+   mm::DeviceModuleLockGuard guard(camera);
+   if (!buffer->Initialize(camera->GetNumberOfChannels(), camera->GetImageWidth(),
+            camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
+   {
+      logError(cameraLabel, getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
+   }
+   buffer->Clear();
+   LOG_DEBUG(coreLogger_) << "Circular buffer of camera " << cameraLabel <<
+      " initialized";
+}
+
+/**
+ * Removes all images from the circular buffer dedicated to the given camera.
+ */
+void CMMCore::clearCircularBuffer(const char* cameraLabel) throw (CMMError)
+{
+   getCameraCircularBuffer(cameraLabel)->Clear();
+}
+
+/**
+ * Returns the number of images available in the circular buffer dedicated
+ * to the given camera.
+ */
+long CMMCore::getRemainingImageCount(const char* cameraLabel) throw (CMMError)
+{
+   return getCameraCircularBuffer(cameraLabel)->GetRemainingImageCount();
+}
+
+/**
+ * Returns the total number of images that can be stored in the circular
+ * buffer dedicated to the given camera.
+ */
+long CMMCore::getBufferTotalCapacity(const char* cameraLabel) throw (CMMError)
+{
+   return getCameraCircularBuffer(cameraLabel)->GetSize();
+}
+
+/**
+ * Returns the number of images that can be added to the circular buffer
+ * dedicated to the given camera without overflowing.
+ */
+long CMMCore::getBufferFreeCapacity(const char* cameraLabel) throw (CMMError)
+{
+   return getCameraCircularBuffer(cameraLabel)->GetFreeSize();
+}
+
+/**
+ * Indicates whether the circular buffer dedicated to the given camera is
+ * overflowed.
+ */
+bool CMMCore::isBufferOverflowed(const char* cameraLabel) throw (CMMError)
+{
+   return getCameraCircularBuffer(cameraLabel)->Overflow();
+}
+
+/**
+ * Sets the overflow policy of the circular buffer dedicated to the given
+ * camera (see setCircularBufferOverflowPolicy(const char*)).
+ */
+void CMMCore::setCircularBufferOverflowPolicy(const char* cameraLabel,
+      const char* policy) throw (CMMError)
+{
+   getCameraCircularBuffer(cameraLabel)->SetOverflowPolicy(ParseOverflowPolicy(policy));
+}
+
+/**
+ * Returns the overflow policy of the circular buffer dedicated to the given
+ * camera.
+ */
+std::string CMMCore::getCircularBufferOverflowPolicy(const char* cameraLabel) throw (CMMError)
+{
+   return overflowPolicyNames[getCameraCircularBuffer(cameraLabel)->GetOverflowPolicy()];
+}
+
+/**
+ * Returns the number of images lost under the given overflow policy by the
+ * circular buffer dedicated to the given camera (see
+ * getCircularBufferDroppedImageCount(const char*)).
+ */
+long long CMMCore::getCircularBufferDroppedImageCount(const char* cameraLabel,
+      const char* policy) throw (CMMError)
+{
+   return getCameraCircularBuffer(cameraLabel)->GetDroppedImageCount(
+         ParseOverflowPolicy(policy));
+}
+
+/**
+ * Returns a pointer to the pixels of the image that was last inserted into
+ * the circular buffer dedicated to the given camera, and its metadata.
+ */
+void* CMMCore::getLastImageMD(const char* cameraLabel, Metadata& md) throw (CMMError)
+{
+   const mm::ImgBuffer* pBuf = getCameraCircularBuffer(cameraLabel)->GetTopImageBuffer(0);
+   if (pBuf != 0)
+   {
+      pBuf->GetMetadata(md);
+      return const_cast<unsigned char*>(pBuf->GetPixels());
+   }
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Gets and removes the next image from the circular buffer dedicated to the
+ * given camera.
+ */
+void* CMMCore::popNextImage(const char* cameraLabel) throw (CMMError)
+{
+   unsigned char* pBuf = const_cast<unsigned char*>(getCameraCircularBuffer(cameraLabel)->GetNextImage());
+   if (pBuf != 0)
+      return pBuf;
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Gets and removes the next image (and metadata) from the circular buffer
+ * dedicated to the given camera.
+ */
+void* CMMCore::popNextImageMD(const char* cameraLabel, Metadata& md) throw (CMMError)
+{
+   const mm::ImgBuffer* pBuf = getCameraCircularBuffer(cameraLabel)->GetNextImageBuffer(0);
+   if (pBuf != 0)
+   {
+      pBuf->GetMetadata(md);
+      return const_cast<unsigned char*>(pBuf->GetPixels());
+   }
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Returns the dimensions of an image returned by this class.
+ *
+ * For images stored in a circular buffer, these are the dimensions of the
+ * image as stored; otherwise they are those of the current camera's images.
+ * Used by the language bindings to convert pixel pointers to arrays.
+ */
+void CMMCore::getImageDimensions(const void* pixels, unsigned& width,
+      unsigned& height, unsigned& bytesPerPixel, unsigned& numComponents)
+{
+   std::string cameraLabel;
+   bool found = false;
+   {
+      MMThreadGuard g(cameraBuffersLock_);
+      for (std::map< std::string, boost::shared_ptr<CircularBuffer> >::const_iterator
+            it = cameraBuffers_.begin(), end = cameraBuffers_.end(); it != end; ++it)
+      {
+         if (it->second->GetImageDimensions(pixels, width, height,
+                  bytesPerPixel))
+         {
+            cameraLabel = it->first;
+            found = true;
+            break;
+         }
+      }
+   }
+
+   if (!found)
+   {
+      if (!cbuf_->GetImageDimensions(pixels, width, height, bytesPerPixel))
+      {
+         width = getImageWidth();
+         height = getImageHeight();
+         bytesPerPixel = getBytesPerPixel();
+      }
+      numComponents = getNumberOfComponents();
+      return;
+   }
+
+   numComponents = 1;
+   try
+   {
+      boost::shared_ptr<CameraInstance> camera =
+         deviceManager_->GetDeviceOfType<CameraInstance>(cameraLabel);
+      mm::DeviceModuleLockGuard guard(camera);
+      numComponents = camera->GetNumberOfComponents();
+   }
+   catch (const CMMError&)
+   {
+      // Camera has been unloaded; keep the default
+   }
+}
+
+boost::shared_ptr<CircularBuffer> CMMCore::findCameraCircularBuffer(const std::string& cameraLabel) const
+{
+   MMThreadGuard g(cameraBuffersLock_);
+   std::map< std::string, boost::shared_ptr<CircularBuffer> >::const_iterator it =
+      cameraBuffers_.find(cameraLabel);
+   if (it == cameraBuffers_.end())
+      return boost::shared_ptr<CircularBuffer>();
+   return it->second;
+}
+
+/**
+ * Returns the circular buffer receiving the images of the given camera: its
+ * dedicated buffer if it has one (kept alive by holder), otherwise the
+ * shared one.
+ */
+CircularBuffer* CMMCore::resolveCameraCircularBuffer(const std::string& cameraLabel,
+      boost::shared_ptr<CircularBuffer>& holder) const
+{
+   holder = findCameraCircularBuffer(cameraLabel);
+   return holder ? holder.get() : cbuf_;
+}
+
+/**
+ * Initializes the circular buffer receiving the images of the given camera
+ * (see resolveCameraCircularBuffer()) for the camera's current image format,
+ * and clears it. The caller must hold the camera's module lock.
+ */
+void CMMCore::initializeCameraCircularBuffer(boost::shared_ptr<CameraInstance> camera) throw (CMMError)
+{
+   boost::shared_ptr<CircularBuffer> holder;
+   CircularBuffer* buffer = resolveCameraCircularBuffer(camera->GetLabel(), holder);
+   if (!buffer->Initialize(camera->GetNumberOfChannels(), camera->GetImageWidth(),
+            camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
+   {
+      logError(getDeviceName(camera).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
+   }
+   buffer->Clear();
+}
+
+boost::shared_ptr<CircularBuffer> CMMCore::getCameraCircularBuffer(const char* cameraLabel) const throw (CMMError)
+{
+   CheckDeviceLabel(cameraLabel);
+   boost::shared_ptr<CircularBuffer> buffer = findCameraCircularBuffer(cameraLabel);
+   if (!buffer)
+      throw CMMError("Camera " + ToQuotedString(cameraLabel) + ": " +
+            getCoreErrorText(MMERR_NoCameraCircularBuffer),
+            MMERR_NoCameraCircularBuffer);
+   return buffer;
+}
+
 /**
  * Returns the label of the currently selected camera device.
  * @return camera name
@@ -4010,6 +4883,12 @@ MM::PropertyType CMMCore::getPropertyType(const char* label, const char* propNam
 
 /**
  * Horizontal dimension of the image buffer in pixels.
+ *
+ * This is the width of the images returned by getImage(): it accounts for
+ * the image processor and, when geometric correction is enabled (see
+ * enableGeometricCorrection()), for the camera's Transpose* properties, so
+ * that it can differ from the width of the camera's ROI.
+ *
  * @return   the width in pixels (an integer)
  */
 unsigned CMMCore::getImageWidth()
@@ -4020,12 +4899,26 @@ unsigned CMMCore::getImageWidth()
       return 0;
    }
 
-   mm::DeviceModuleLockGuard guard(camera);
-   return camera->GetImageWidth();
+   unsigned width, height, byteDepth;
+   mm::GeometricCorrection correction;
+   {
+      mm::DeviceModuleLockGuard guard(camera);
+      width = camera->GetImageWidth();
+      height = camera->GetImageHeight();
+      byteDepth = camera->GetImageBytesPerPixel();
+      correction = getGeometricCorrection(camera);
+   }
+   applyImageProcessorSize(width, height, byteDepth);
+   correction.GetOutputSize(width, height, width, height);
+   return width;
 }
 
 /**
  * Vertical dimension of the image buffer in pixels.
+ *
+ * As for getImageWidth(), this is the height of the (processed and
+ * corrected) images returned by getImage().
+ *
  * @return   the height in pixels (an integer)
  */
 unsigned CMMCore::getImageHeight()
@@ -4036,8 +4929,105 @@ unsigned CMMCore::getImageHeight()
       return 0;
    }
 
-   mm::DeviceModuleLockGuard guard(camera);
-   return camera->GetImageHeight();
+   unsigned width, height, byteDepth;
+   mm::GeometricCorrection correction;
+   {
+      mm::DeviceModuleLockGuard guard(camera);
+      width = camera->GetImageWidth();
+      height = camera->GetImageHeight();
+      byteDepth = camera->GetImageBytesPerPixel();
+      correction = getGeometricCorrection(camera);
+   }
+   applyImageProcessorSize(width, height, byteDepth);
+   correction.GetOutputSize(width, height, width, height);
+   return height;
+}
+
+/**
+ * Replaces width and height with the dimensions of the images produced by the
+ * current image processor, if it changes them (e.g. by transposing).
+ */
+void CMMCore::applyImageProcessorSize(unsigned& width, unsigned& height,
+      unsigned byteDepth)
+{
+   boost::shared_ptr<ImageProcessorInstance> imageProcessor =
+      currentImageProcessor_.lock();
+   if (!imageProcessor)
+      return;
+
+   unsigned outWidth = width;
+   unsigned outHeight = height;
+   try
+   {
+      mm::DeviceModuleLockGuard guard(imageProcessor);
+      if (imageProcessor->GetOutputImageSize(width, height, byteDepth,
+               outWidth, outHeight) != DEVICE_OK)
+         return;
+   }
+   catch (const CMMError&)
+   {
+      return;
+   }
+   if (outWidth * outHeight == width * height)
+   {
+      width = outWidth;
+      height = outHeight;
+   }
+}
+
+namespace
+{
+
+bool isPropertySet(boost::shared_ptr<DeviceInstance> device, const char* name)
+{
+   return device->HasProperty(name) && device->GetProperty(name) == "1";
+}
+
+} // anonymous namespace
+
+/**
+ * Returns the correction the Core applies to the camera's images, according
+ * to its Transpose* properties (see enableGeometricCorrection()). The caller
+ * must make sure that the camera's properties can be read.
+ */
+mm::GeometricCorrection CMMCore::getGeometricCorrection(
+      boost::shared_ptr<DeviceInstance> camera)
+{
+   if (!geometricCorrection_ ||
+         isPropertySet(camera, MM::g_Keyword_Transpose_Correction))
+      return mm::GeometricCorrection();
+   return mm::GeometricCorrection(
+         isPropertySet(camera, MM::g_Keyword_Transpose_SwapXY),
+         isPropertySet(camera, MM::g_Keyword_Transpose_MirrorX),
+         isPropertySet(camera, MM::g_Keyword_Transpose_MirrorY));
+}
+
+/**
+ * Returns the (processed) snapped image of the camera, corrected into the
+ * camera's entry of correctedImages_ if its images need a geometric
+ * correction. The camera's module lock must be held; it keeps other calls
+ * for the same camera from writing the entry, while different cameras
+ * (possibly in different modules) use different entries.
+ */
+void* CMMCore::correctSnappedImage(boost::shared_ptr<CameraInstance> camera,
+      const unsigned char* pixels)
+{
+   mm::GeometricCorrection correction = getGeometricCorrection(camera);
+   if (!pixels || correction.IsIdentity())
+      return const_cast<unsigned char*>(pixels);
+
+   unsigned width = camera->GetImageWidth();
+   unsigned height = camera->GetImageHeight();
+   unsigned byteDepth = camera->GetImageBytesPerPixel();
+   applyImageProcessorSize(width, height, byteDepth);
+   std::vector<unsigned char>* corrected;
+   {
+      MMThreadGuard g(correctedImagesLock_);
+      corrected = &correctedImages_[camera->GetLabel()];
+   }
+   corrected->resize((size_t)width * height * byteDepth);
+   correction.Apply(pixels, &(*corrected)[0], width, height, byteDepth);
+   return &(*corrected)[0];
 }
 
 /**
@@ -7180,6 +8170,10 @@ void CMMCore::InitializeErrorMessages()
    errorText_[MMERR_CircularBufferFailedToInitialize] =
       "Failed to initialize circular buffer - memory requirements not adequate.";
    errorText_[MMERR_CircularBufferEmpty] = "Circular buffer is empty.";
+   errorText_[MMERR_InvalidImageLease] = "Invalid or already released image lease.";
+   errorText_[MMERR_NoCameraCircularBuffer] = "No circular buffer has been created for the camera.";
+   errorText_[MMERR_InvalidOverflowPolicy] = "Invalid circular buffer overflow policy.";
+   errorText_[MMERR_InvalidReaderCursor] = "No circular buffer reader cursor with this name.";
    errorText_[MMERR_ContFocusNotAvailable] = "Auto-focus focus device not defined.";
    errorText_[MMERR_BadConfigName] = "Configuration name contains illegal characters (/\\*!')";
    errorText_[MMERR_NotAllowedDuringSequenceAcquisition] =
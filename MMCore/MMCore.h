@@ -109,6 +109,8 @@ class CMMCore;
 
 namespace mm {
    class DeviceManager;
+   class GeometricCorrection;
+   class ImageProcessingPipeline;
    class LogManager;
 } // namespace mm
 
@@ -419,14 +421,60 @@ public:
       const throw (CMMError);
    void* popNextImageMD(Metadata& md) throw (CMMError);
 
+   long long popNextImageLease(Metadata& md) throw (CMMError);
+   void* getLeasedImage(long long leaseId) throw (CMMError);
+   void* getLeasedImage(long long leaseId, unsigned channel) throw (CMMError);
+   void releaseImage(long long leaseId) throw (CMMError);
+   long getLeasedImageCount();
+
    long getRemainingImageCount();
    long getBufferTotalCapacity();
    long getBufferFreeCapacity();
    bool isBufferOverflowed() const;
+   void setCircularBufferOverflowPolicy(const char* policy) throw (CMMError);
+   std::string getCircularBufferOverflowPolicy();
+   long long getCircularBufferDroppedImageCount(const char* policy) throw (CMMError);
+   void createReaderCursor(const char* name, bool lossy) throw (CMMError);
+   void setPopNextImageLossy(bool lossy);
+   bool isPopNextImageLossy();
+   void removeReaderCursor(const char* name) throw (CMMError);
+   void* popNextImageFromCursor(const char* name) throw (CMMError);
+   void* popNextImageMDFromCursor(const char* name, Metadata& md) throw (CMMError);
+   long getReaderCursorLag(const char* name) throw (CMMError);
+   long long getReaderCursorDroppedImageCount(const char* name) throw (CMMError);
    void setCircularBufferMemoryFootprint(unsigned sizeMB) throw (CMMError);
    unsigned getCircularBufferMemoryFootprint();
    void initializeCircularBuffer() throw (CMMError);
+   void initializeCircularBuffer(bool lockFree) throw (CMMError);
+   bool isCircularBufferLockFree();
+   void setCircularBufferHugePages(bool enable) throw (CMMError);
+   bool isCircularBufferUsingHugePages();
+   long long getCircularBufferCommittedBytes();
    void clearCircularBuffer() throw (CMMError);
+   void enableAsyncImageProcessing(bool enable) throw (CMMError);
+   bool isAsyncImageProcessingEnabled();
+   void setAsyncImageProcessingThreads(unsigned threadCount, unsigned queueDepth) throw (CMMError);
+   void enableGeometricCorrection(bool enable);
+   bool isGeometricCorrectionEnabled();
+
+   void setCircularBufferMemoryFootprint(const char* cameraLabel, unsigned sizeMB) throw (CMMError);
+   unsigned getCircularBufferMemoryFootprint(const char* cameraLabel) throw (CMMError);
+   void removeCircularBuffer(const char* cameraLabel) throw (CMMError);
+   bool hasCircularBuffer(const char* cameraLabel);
+   void initializeCircularBuffer(const char* cameraLabel) throw (CMMError);
+   void clearCircularBuffer(const char* cameraLabel) throw (CMMError);
+   long getRemainingImageCount(const char* cameraLabel) throw (CMMError);
+   long getBufferTotalCapacity(const char* cameraLabel) throw (CMMError);
+   long getBufferFreeCapacity(const char* cameraLabel) throw (CMMError);
+   bool isBufferOverflowed(const char* cameraLabel) throw (CMMError);
+   void setCircularBufferOverflowPolicy(const char* cameraLabel, const char* policy) throw (CMMError);
+   std::string getCircularBufferOverflowPolicy(const char* cameraLabel) throw (CMMError);
+   long long getCircularBufferDroppedImageCount(const char* cameraLabel, const char* policy) throw (CMMError);
+   void* getLastImageMD(const char* cameraLabel, Metadata& md) throw (CMMError);
+   void* popNextImage(const char* cameraLabel) throw (CMMError);
+   void* popNextImageMD(const char* cameraLabel, Metadata& md) throw (CMMError);
+   void getImageDimensions(const void* pixels, unsigned& width, unsigned& height,
+         unsigned& bytesPerPixel, unsigned& numComponents);
 
    bool isExposureSequenceable(const char* cameraLabel) throw (CMMError);
    void startExposureSequence(const char* cameraLabel) throw (CMMError);
@@ -666,12 +714,25 @@ private:
    long timeoutMs_;
    bool autoShutter_;
    std::vector<double> *nullAffine_;
-   MM::Core* callback_;                 // core services for devices
+   CoreCallback* callback_;             // core services for devices
    ConfigGroupCollection* configGroups_;
    CorePropertyCollection* properties_;
    MMEventCallback* externalCallback_;  // notification hook to the higher layer (e.g. GUI)
    PixelSizeConfigGroup* pixelSizeGroup_;
    CircularBuffer* cbuf_;
+   // Dedicated buffers of cameras, by label. Cameras without one use cbuf_.
+   std::map< std::string, boost::shared_ptr<CircularBuffer> > cameraBuffers_;
+   mutable MMThreadLock cameraBuffersLock_;
+   // Runs the image processor off the camera threads, when enabled
+   boost::shared_ptr<mm::ImageProcessingPipeline> imageProcessingPipeline_;
+   unsigned imageProcessingThreads_;
+   unsigned imageProcessingQueueDepth_;
+   // Whether the Transpose* properties of cameras are applied to their images
+   bool geometricCorrection_;
+   // Corrected copy of the last image returned by getImage(), for each
+   // camera (by label); each is written with the camera's module lock held
+   std::map< std::string, std::vector<unsigned char> > correctedImages_;
+   MMThreadLock correctedImagesLock_;
 
    std::vector< boost::weak_ptr<DeviceInstance> > imageSynchroDevices_;
    boost::shared_ptr<CPluginManager> pluginManager_;
@@ -707,8 +768,19 @@ private:
    Configuration getConfigGroupState(const char* group, bool fromCache) throw (CMMError);
    std::string getDeviceErrorText(int deviceCode, boost::shared_ptr<DeviceInstance> pDevice);
    std::string getDeviceName(boost::shared_ptr<DeviceInstance> pDev);
+   boost::shared_ptr<CircularBuffer> findCameraCircularBuffer(const std::string& cameraLabel) const;
+   boost::shared_ptr<CircularBuffer> getCameraCircularBuffer(const char* cameraLabel) const throw (CMMError);
+   CircularBuffer* resolveCameraCircularBuffer(const std::string& cameraLabel,
+         boost::shared_ptr<CircularBuffer>& holder) const;
+   void initializeCameraCircularBuffer(boost::shared_ptr<CameraInstance> camera) throw (CMMError);
    void logError(const char* device, const char* msg);
    void updateAllowedChannelGroups();
+   void applyImageProcessorSize(unsigned& width, unsigned& height,
+         unsigned byteDepth);
+   mm::GeometricCorrection getGeometricCorrection(
+         boost::shared_ptr<DeviceInstance> camera);
+   void* correctSnappedImage(boost::shared_ptr<CameraInstance> camera,
+         const unsigned char* pixels);
    void assignDefaultRole(boost::shared_ptr<DeviceInstance> pDev);
    void updateCoreProperty(const char* propName, MM::DeviceType devType) throw (CMMError);
    void loadSystemConfigurationImpl(const char* fileName) throw (CMMError);
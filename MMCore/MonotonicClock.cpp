@@ -0,0 +1,135 @@
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//
+// DESCRIPTION:   Monotonic time source for image time stamps.
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "MonotonicClock.h"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#include <locale>
+#include <sstream>
+
+namespace mm {
+
+namespace {
+
+// The constants below are function-local statics, initialized on first use,
+// so that they are valid when called from other static initializers.
+
+const boost::posix_time::ptime& MMTimeEpoch()
+{
+   static const boost::posix_time::ptime epoch(boost::gregorian::date(2000, 1, 1));
+   return epoch;
+}
+
+#ifdef _WIN32
+long long QueryCounterFrequency()
+{
+   LARGE_INTEGER freq;
+   QueryPerformanceFrequency(&freq);
+   return freq.QuadPart;
+}
+
+long long CounterFrequency()
+{
+   static const long long frequency = QueryCounterFrequency();
+   return frequency;
+}
+#elif defined(__APPLE__)
+mach_timebase_info_data_t QueryTimebase()
+{
+   mach_timebase_info_data_t timebase;
+   mach_timebase_info(&timebase);
+   return timebase;
+}
+
+const mach_timebase_info_data_t& Timebase()
+{
+   static const mach_timebase_info_data_t timebase = QueryTimebase();
+   return timebase;
+}
+#endif
+
+double ComputeMMTimeOffsetUs()
+{
+   boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
+   long long nowNs = GetMonotonicTimeNs();
+   return static_cast<double>((now - MMTimeEpoch()).total_microseconds()) -
+      nowNs / 1000.0;
+}
+
+// Local time, in microseconds since MMTimeEpoch(), corresponding to
+// monotonic time 0. Set once, on first use.
+double MMTimeOffsetUs()
+{
+   static const double offset = ComputeMMTimeOffsetUs();
+   return offset;
+}
+
+} // anonymous namespace
+
+
+long long GetMonotonicTimeNs()
+{
+#ifdef _WIN32
+   const long long counterFrequency = CounterFrequency();
+   LARGE_INTEGER count;
+   QueryPerformanceCounter(&count);
+   // Split to avoid overflow of count * 1e9
+   long long seconds = count.QuadPart / counterFrequency;
+   long long remainder = count.QuadPart % counterFrequency;
+   return seconds * 1000000000LL + remainder * 1000000000LL / counterFrequency;
+#elif defined(__APPLE__)
+   const mach_timebase_info_data_t& timebase = Timebase();
+   return static_cast<long long>(mach_absolute_time() * timebase.numer / timebase.denom);
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+MM::MMTime MonotonicTimeToMMTime(long long ns)
+{
+   return MM::MMTime(MMTimeOffsetUs() + ns / 1000.0);
+}
+
+std::string FormatMonotonicTime(long long ns)
+{
+   long long us = static_cast<long long>(MonotonicTimeToMMTime(ns).getUsec());
+   boost::posix_time::ptime t = MMTimeEpoch() + boost::posix_time::microseconds(us);
+
+   std::ostringstream os;
+   // The locale takes ownership of the facet
+   os.imbue(std::locale(os.getloc(),
+            new boost::posix_time::time_facet("%Y-%m-%d %H:%M:%s")));
+   os << t;
+   return os.str();
+}
+
+} // namespace mm
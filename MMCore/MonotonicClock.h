@@ -0,0 +1,51 @@
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//
+// DESCRIPTION:   Monotonic time source for image time stamps.
+//
+// COPYRIGHT:     2017 Open Imaging, Inc.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#pragma once
+
+#include "../MMDevice/MMDevice.h"
+
+#include <string>
+
+namespace mm {
+
+/**
+ * Returns the time in nanoseconds since an arbitrary origin, from a clock
+ * that never goes backwards and is not affected by changes to the system
+ * time (e.g. NTP corrections). This is a cheap call, suitable for taking a
+ * time stamp for every image.
+ */
+long long GetMonotonicTimeNs();
+
+/**
+ * Converts a value returned by GetMonotonicTimeNs() to MMTime (microseconds
+ * since 2000-01-01, local time).
+ *
+ * The monotonic clock is tied to the local time once, on the first call;
+ * later changes to the system time are not reflected, so that differences
+ * between the returned times are always accurate.
+ */
+MM::MMTime MonotonicTimeToMMTime(long long ns);
+
+/**
+ * Formats a value returned by GetMonotonicTimeNs() as local date and time,
+ * in the format used for the TimeReceivedByCore image tag.
+ */
+std::string FormatMonotonicTime(long long ns);
+
+} // namespace mm
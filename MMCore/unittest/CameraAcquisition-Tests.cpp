@@ -0,0 +1,282 @@
+#include <gtest/gtest.h>
+
+#include "MMCore.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+
+// Sequence acquisitions through the public API, from the camera in
+// MockCamera.cpp (which inserts its images from StartSequenceAcquisition()).
+class CameraAcquisitionTest : public ::testing::Test
+{
+protected:
+   CMMCore core_;
+
+   void SetUp()
+   {
+      std::vector<std::string> paths;
+      paths.push_back(MOCK_ADAPTER_DIR);
+      core_.setDeviceAdapterSearchPaths(paths);
+      core_.loadDevice("Camera", "MockCamera", "MockCamera");
+      core_.initializeDevice("Camera");
+      core_.setCameraDevice("Camera");
+      core_.setCircularBufferMemoryFootprint(1);
+   }
+};
+
+
+TEST_F(CameraAcquisitionTest, StartInitializesTheSharedBuffer)
+{
+   core_.setROI(0, 0, 16, 8);
+   core_.startSequenceAcquisition(3, 0.0, true);
+   ASSERT_EQ(3, core_.getRemainingImageCount());
+   ASSERT_EQ(16u * 8u, core_.getImageBufferSize());
+   ASSERT_EQ(0, static_cast<unsigned char*>(core_.popNextImage())[0]);
+}
+
+
+TEST_F(CameraAcquisitionTest, StartInitializesTheDedicatedBuffer)
+{
+   // The dedicated buffer is allocated for 32x32 images
+   core_.setCircularBufferMemoryFootprint("Camera", 1);
+   core_.setROI(0, 0, 16, 8);
+
+   core_.startSequenceAcquisition(3, 0.0, true);
+   ASSERT_EQ(3, core_.getRemainingImageCount("Camera"));
+   ASSERT_EQ(0, core_.getRemainingImageCount());
+   Metadata md;
+   ASSERT_EQ(2, static_cast<unsigned char*>(core_.getLastImageMD("Camera", md))[0]);
+
+   core_.setROI(0, 0, 8, 8);
+   core_.startContinuousSequenceAcquisition(0.0);
+   ASSERT_EQ(0, core_.getRemainingImageCount());
+   ASSERT_EQ(1024 * 1024 / 64, core_.getBufferTotalCapacity("Camera"));
+
+   core_.setROI(0, 0, 16, 16);
+   core_.initializeCircularBuffer();
+   ASSERT_EQ(1024 * 1024 / 256, core_.getBufferTotalCapacity("Camera"));
+}
+
+
+TEST_F(CameraAcquisitionTest, CameraInitializesItsOwnBuffer)
+{
+   // A camera that initializes the buffer itself must not reallocate the
+   // shared buffer when it has a dedicated one
+   core_.initializeCircularBuffer();
+   const long sharedCapacity = core_.getBufferTotalCapacity();
+   core_.setCircularBufferMemoryFootprint("Camera", 1);
+   core_.setProperty("Camera", "InitializeImageBuffer", "Yes");
+   core_.setROI(0, 0, 16, 8);
+
+   core_.startSequenceAcquisition("Camera", 3, 0.0, true);
+   ASSERT_EQ(3, core_.getRemainingImageCount("Camera"));
+   ASSERT_EQ(sharedCapacity, core_.getBufferTotalCapacity());
+   ASSERT_EQ(1024 * 1024 / 128, core_.getBufferTotalCapacity("Camera"));
+}
+
+
+TEST_F(CameraAcquisitionTest, SnappedImagesAreCorrectedPerCamera)
+{
+   core_.loadDevice("Camera2", "MockCamera", "MockCamera");
+   core_.initializeDevice("Camera2");
+   core_.enableGeometricCorrection(true);
+   core_.setProperty("Camera", "TransposeXY", "1");
+   core_.setProperty("Camera2", "TransposeXY", "1");
+   core_.setROI(0, 0, 16, 8);
+   ASSERT_EQ(8u, core_.getImageWidth());
+   ASSERT_EQ(16u, core_.getImageHeight());
+
+   // Each camera's corrected image stays valid until its next snap
+   core_.snapImage();
+   unsigned char* first = static_cast<unsigned char*>(core_.getImage());
+   ASSERT_EQ(0, first[0]);
+   core_.setCameraDevice("Camera2");
+   core_.snapImage();
+   core_.snapImage();
+   unsigned char* second = static_cast<unsigned char*>(core_.getImage());
+   ASSERT_TRUE(first != second);
+   ASSERT_EQ(1, second[0]);
+   ASSERT_EQ(0, first[0]);
+}
+
+
+class ImageProcessorTest : public CameraAcquisitionTest
+{
+protected:
+   void SetUp()
+   {
+      CameraAcquisitionTest::SetUp();
+      core_.loadDevice("Processor", "MockCamera", "MockProcessor");
+      core_.initializeDevice("Processor");
+      core_.setImageProcessorDevice("Processor");
+   }
+};
+
+
+TEST_F(ImageProcessorTest, ImgBufferImagesAreProcessedOnce)
+{
+   core_.setProperty("Processor", "AddOne", "Yes");
+   core_.setProperty("Camera", "InsertWith", "ImgBuffer");
+   core_.startSequenceAcquisition(2, 0.0, true);
+   ASSERT_EQ(2, core_.getRemainingImageCount());
+   ASSERT_EQ(1, static_cast<unsigned char*>(core_.popNextImage())[0]);
+   ASSERT_EQ(2, static_cast<unsigned char*>(core_.popNextImage())[0]);
+}
+
+
+TEST_F(ImageProcessorTest, EveryChannelIsProcessed)
+{
+   core_.setProperty("Processor", "AddOne", "Yes");
+   core_.setProperty("Camera", "Channels", "2");
+   core_.startSequenceAcquisition(2, 0.0, true);
+   ASSERT_EQ(2, core_.getRemainingImageCount());
+   Metadata md;
+   ASSERT_EQ(2, static_cast<unsigned char*>(core_.getLastImageMD(0, 0, md))[0]);
+   ASSERT_EQ(12, static_cast<unsigned char*>(core_.getLastImageMD(1, 0, md))[0]);
+}
+
+
+TEST_F(ImageProcessorTest, ImagesReadIntoSlotsAreProcessedAndInserted)
+{
+   core_.setProperty("Processor", "AddOne", "Yes");
+   core_.setProperty("Camera", "InsertWith", "Slot");
+   core_.startSequenceAcquisition(3, 0.0, true);
+   ASSERT_EQ(3, core_.getRemainingImageCount());
+   for (int i = 0; i < 3; ++i)
+   {
+      Metadata md;
+      ASSERT_EQ(i + 1, static_cast<unsigned char*>(core_.popNextImageMD(md))[0]);
+      ASSERT_EQ("Camera", md.GetSingleTag("Camera").GetValue());
+   }
+}
+
+
+TEST_F(ImageProcessorTest, FailedProcessingKeepsTheImageSize)
+{
+   core_.setProperty("Processor", "FailTranspose", "Yes");
+   core_.setROI(0, 0, 16, 8);
+   core_.startSequenceAcquisition(1, 0.0, true);
+   ASSERT_EQ(1, core_.getRemainingImageCount());
+   Metadata md;
+   core_.popNextImageMD(md);
+   ASSERT_EQ("16", md.GetSingleTag("Width").GetValue());
+   ASSERT_EQ("8", md.GetSingleTag("Height").GetValue());
+}
+
+
+TEST_F(CameraAcquisitionTest, MultiChannelImagesAreNotReadIntoSlots)
+{
+   // Slots hold one channel, so the camera falls back to copying
+   core_.setProperty("Camera", "Channels", "2");
+   core_.setProperty("Camera", "InsertWith", "Slot");
+   core_.startSequenceAcquisition(3, 0.0, true);
+   ASSERT_EQ(3, core_.getRemainingImageCount());
+   ASSERT_EQ(0, static_cast<unsigned char*>(core_.popNextImage())[0]);
+}
+
+
+TEST_F(ImageProcessorTest, DeviceReadsTheSequenceItStartedThroughACursor)
+{
+   core_.setProperty("Processor", "Sequence", "Start");
+   ASSERT_EQ("0", core_.getProperty("Processor", "SequenceResult"));
+   ASSERT_EQ(3, core_.getReaderCursorLag("device:Processor"));
+   ASSERT_EQ(3, core_.getRemainingImageCount());
+   core_.setProperty("Processor", "Sequence", "Stop");
+   ASSERT_THROW(core_.getReaderCursorLag("device:Processor"), CMMError);
+   ASSERT_EQ(3, core_.getRemainingImageCount());
+}
+
+
+TEST_F(ImageProcessorTest, FailedDeviceStartLeavesNoCursor)
+{
+   core_.setProperty("Camera", "FailStart", "Yes");
+   core_.setProperty("Processor", "Sequence", "Start");
+   ASSERT_NE("0", core_.getProperty("Processor", "SequenceResult"));
+   ASSERT_THROW(core_.getReaderCursorLag("device:Processor"), CMMError);
+
+   // The application's acquisitions are not held back by it
+   core_.setProperty("Camera", "FailStart", "No");
+   core_.setImageProcessorDevice("");
+   const long capacity = core_.getBufferTotalCapacity();
+   for (int i = 0; i < 2; ++i)
+   {
+      core_.startSequenceAcquisition(capacity, 0.0, true);
+      ASSERT_FALSE(core_.isBufferOverflowed());
+      core_.clearCircularBuffer();
+   }
+}
+
+
+class AsyncProcessingTest : public ImageProcessorTest
+{
+protected:
+   void TearDown()
+   {
+      core_.enableAsyncImageProcessing(false);
+   }
+
+   long ImagesSnapped()
+   {
+      return atol(core_.getProperty("Camera", "ImagesSnapped").c_str());
+   }
+};
+
+
+TEST_F(AsyncProcessingTest, CameraStopsOnOverflow)
+{
+   core_.setAsyncImageProcessingThreads(1, 2);
+   core_.enableAsyncImageProcessing(true);
+   // Room for 4 images
+   core_.setROI(0, 0, 512, 512);
+
+   core_.startSequenceAcquisition(10, 0.0, true);
+   ASSERT_TRUE(core_.isBufferOverflowed());
+   ASSERT_EQ(4, core_.getRemainingImageCount());
+   // The overflow of the fifth image is reported to the camera by one of
+   // the images that follow it, within the depth of the queue
+   ASSERT_GT(ImagesSnapped(), 5);
+   ASSERT_LE(ImagesSnapped(), 5 + 2 + 1);
+   ASSERT_EQ(0, static_cast<unsigned char*>(core_.popNextImage())[0]);
+}
+
+
+TEST_F(AsyncProcessingTest, CameraClearsTheBufferOnOverflow)
+{
+   core_.setAsyncImageProcessingThreads(1, 2);
+   core_.enableAsyncImageProcessing(true);
+   core_.setROI(0, 0, 512, 512);
+
+   core_.startSequenceAcquisition(10, 0.0, false);
+   ASSERT_EQ(10, ImagesSnapped());
+   ASSERT_GT(core_.getRemainingImageCount(), 0);
+   ASSERT_LE(core_.getRemainingImageCount(), 4);
+   // Images retried after an overflow are inserted once (images published
+   // in the meantime may have been lost)
+   long previous = -1;
+   while (core_.getRemainingImageCount() > 0)
+   {
+      long image = static_cast<unsigned char*>(core_.popNextImage())[0];
+      ASSERT_GT(image, previous);
+      previous = image;
+   }
+}
+
+
+TEST_F(AsyncProcessingTest, ProcessorIsCalledOneAtATime)
+{
+   core_.setAsyncImageProcessingThreads(4, 8);
+   core_.enableAsyncImageProcessing(true);
+
+   core_.startSequenceAcquisition(20, 0.0, true);
+   ASSERT_EQ(20, core_.getRemainingImageCount());
+   ASSERT_EQ("0", core_.getProperty("Processor", "ConcurrentCalls"));
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
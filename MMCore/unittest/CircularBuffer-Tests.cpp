@@ -0,0 +1,1093 @@
+#include <gtest/gtest.h>
+
+#include "CircularBuffer.h"
+#include "MonotonicClock.h"
+
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+
+#include <iostream>
+#include <vector>
+
+
+namespace {
+
+const unsigned width = 64;
+const unsigned height = 64;
+
+Metadata CameraMetadata()
+{
+   Metadata md;
+   md.put("Camera", "TestCamera");
+   return md;
+}
+
+} // anonymous namespace
+
+
+class CircularBufferModeTest : public ::testing::TestWithParam<bool>
+{
+};
+
+
+TEST_P(CircularBufferModeTest, InsertAndPopPreservesOrder)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   ASSERT_EQ(GetParam(), cb.IsLockFree());
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (unsigned char i = 0; i < 10; ++i)
+   {
+      pixels[0] = i;
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   }
+   ASSERT_EQ(10u, cb.GetRemainingImageCount());
+   ASSERT_EQ(9, cb.GetTopImage()[0]);
+   ASSERT_EQ(8, cb.GetNthFromTopImageBuffer(1)->GetPixels()[0]);
+
+   for (unsigned char i = 0; i < 10; ++i)
+   {
+      const unsigned char* p = cb.GetNextImage();
+      ASSERT_TRUE(p != 0);
+      ASSERT_EQ(i, p[0]);
+   }
+   ASSERT_TRUE(cb.GetNextImage() == 0);
+   ASSERT_EQ(0u, cb.GetRemainingImageCount());
+}
+
+
+TEST_P(CircularBufferModeTest, OverflowAndClear)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long size = cb.GetSize();
+   ASSERT_GT(size, 0u);
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (unsigned long i = 0; i < size; ++i)
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(0u, cb.GetFreeSize());
+   ASSERT_FALSE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_TRUE(cb.Overflow());
+
+   cb.Clear();
+   ASSERT_FALSE(cb.Overflow());
+   ASSERT_EQ(0u, cb.GetRemainingImageCount());
+   ASSERT_EQ(size, cb.GetFreeSize());
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(1u, cb.GetRemainingImageCount());
+}
+
+
+TEST_P(CircularBufferModeTest, IncompatibleImageThrows)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+
+   std::vector<unsigned char> pixels(width * height * 2);
+   Metadata md = CameraMetadata();
+   ASSERT_THROW(cb.InsertImage(&pixels[0], width, height, 2, &md), CMMError);
+}
+
+
+TEST_P(CircularBufferModeTest, TransposedImagesAreAccepted)
+{
+   const unsigned w = 64;
+   const unsigned h = 32;
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, w, h, 1));
+
+   std::vector<unsigned char> pixels(w * h);
+   Metadata md = CameraMetadata();
+   pixels[0] = 1;
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], h, w, 1, &md));
+   pixels[0] = 2;
+   unsigned char* slot = cb.AcquireSlot(w, h, 1, 1);
+   ASSERT_TRUE(slot != 0);
+   slot[0] = 3;
+   ASSERT_TRUE(cb.CommitSlot(slot, &md, h, w));
+   ASSERT_THROW(cb.InsertImage(&pixels[0], w, h / 2, 1, &md), CMMError);
+   // Same size, but not a transpose
+   ASSERT_THROW(cb.InsertImage(&pixels[0], w * 2, h / 2, 1, &md), CMMError);
+
+   for (unsigned char i = 1; i <= 3; i += 2)
+   {
+      const mm::ImgBuffer* img = cb.GetNextImageBuffer(0);
+      ASSERT_TRUE(img != 0);
+      ASSERT_EQ(i, img->GetPixels()[0]);
+      ASSERT_EQ(h, img->Width());
+      ASSERT_EQ(w, img->Height());
+      unsigned width, height, depth;
+      ASSERT_TRUE(cb.GetImageDimensions(img->GetPixels(), width, height, depth));
+      ASSERT_EQ(h, width);
+      ASSERT_EQ(w, height);
+      ASSERT_EQ(1u, depth);
+      ASSERT_EQ("32", img->GetMetadata().GetSingleTag("Width").GetValue());
+      ASSERT_EQ("64", img->GetMetadata().GetSingleTag("Height").GetValue());
+   }
+
+   // The slots return to the camera's dimensions
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], w, h, 1, &md));
+   const mm::ImgBuffer* img = cb.GetNextImageBuffer(0);
+   ASSERT_TRUE(img != 0);
+   ASSERT_EQ(w, img->Width());
+   ASSERT_EQ(2, img->GetPixels()[0]);
+}
+
+
+TEST_P(CircularBufferModeTest, AcquireAndCommitSlot)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 2));
+
+   unsigned char* slot = cb.AcquireSlot(width, height, 2, 1);
+   ASSERT_TRUE(slot != 0);
+   unsigned w, h, d;
+   ASSERT_TRUE(cb.GetAcquiredSlot(slot, w, h, d));
+   ASSERT_EQ(width, w);
+   ASSERT_EQ(2u, d);
+   ASSERT_EQ(1u, cb.GetAcquiredSlotCount());
+   ASSERT_EQ(0u, cb.GetRemainingImageCount());
+   slot[0] = 42;
+   Metadata md = CameraMetadata();
+   ASSERT_TRUE(cb.CommitSlot(slot, &md));
+   ASSERT_FALSE(cb.GetAcquiredSlot(slot, w, h, d));
+   ASSERT_FALSE(cb.CommitSlot(slot, &md));
+   ASSERT_EQ(0u, cb.GetAcquiredSlotCount());
+   ASSERT_EQ(1u, cb.GetRemainingImageCount());
+
+   slot = cb.AcquireSlot(width, height, 2, 1);
+   ASSERT_TRUE(slot != 0);
+   cb.AbortSlot(slot);
+   ASSERT_EQ(0u, cb.GetAcquiredSlotCount());
+   ASSERT_EQ(1u, cb.GetRemainingImageCount());
+
+   const mm::ImgBuffer* img = cb.GetNextImageBuffer(0);
+   ASSERT_TRUE(img != 0);
+   ASSERT_EQ(42, img->GetPixels()[0]);
+   ASSERT_EQ("GRAY16", img->GetMetadata().GetSingleTag("PixelType").GetValue());
+
+   ASSERT_THROW(cb.AcquireSlot(width, height, 1, 1), CMMError);
+}
+
+
+namespace {
+
+void AcquireAndCommitAfterDelay(CircularBuffer* cb, boost::atomic<bool>* acquired,
+      boost::atomic<bool>* committing)
+{
+   unsigned char* slot = cb->AcquireSlot(width, height, 1, 1);
+   acquired->store(slot != 0);
+   boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+   Metadata md = CameraMetadata();
+   committing->store(true);
+   cb->CommitSlot(slot, &md);
+}
+
+void InsertByCopyAndBySlot(CircularBuffer* cb, boost::atomic<bool>* done)
+{
+   std::vector<unsigned char> pixels(width * height, 1);
+   Metadata md = CameraMetadata();
+   cb->InsertImage(&pixels[0], width, height, 1, &md);
+   unsigned char* slot = cb->AcquireSlot(width, height, 1, 1);
+   if (slot)
+   {
+      slot[0] = 2;
+      cb->CommitSlot(slot, &md);
+   }
+   done->store(true);
+}
+
+} // anonymous namespace
+
+
+TEST(CircularBufferSlotTests, DestructionWaitsForAcquiredSlot)
+{
+   CircularBuffer* cb = new CircularBuffer(1);
+   ASSERT_TRUE(cb->Initialize(1, width, height, 1));
+
+   boost::atomic<bool> acquired(false);
+   boost::atomic<bool> committing(false);
+   boost::thread t(AcquireAndCommitAfterDelay, cb, &acquired, &committing);
+   while (!acquired.load())
+      boost::this_thread::yield();
+   delete cb;
+   ASSERT_TRUE(committing.load());
+   t.join();
+}
+
+
+TEST_P(CircularBufferModeTest, AbandonedSlotDoesNotBlockOthers)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+
+   // A camera acquires a slot and never commits it
+   unsigned char* abandoned = cb.AcquireSlot(width, height, 1, 1);
+   ASSERT_TRUE(abandoned != 0);
+
+   // Another producer inserts, from another thread, by copy and by slot
+   boost::atomic<bool> done(false);
+   boost::thread t(InsertByCopyAndBySlot, &cb, &done);
+   for (int i = 0; i < 5000 && !done.load(); ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+   ASSERT_TRUE(done.load());
+   t.join();
+
+   // Consumers see the other producer's frames
+   std::vector<unsigned char> copy(width * height);
+   unsigned w, h, d;
+   long long number;
+   ASSERT_TRUE(cb.CopyNewestImage(&copy[0], (unsigned long)copy.size(), w, h, d, number));
+   ASSERT_EQ(2, copy[0]);
+   ASSERT_EQ(1, cb.GetNextImage()[0]);
+   ASSERT_EQ(2, cb.GetNextImage()[0]);
+
+   // The abandoned slot can still be committed, after the others
+   abandoned[0] = 3;
+   Metadata md = CameraMetadata();
+   ASSERT_TRUE(cb.CommitSlot(abandoned, &md));
+   ASSERT_EQ(3, cb.GetNextImage()[0]);
+}
+
+
+TEST(CircularBufferSlotTests, NoSlotsInMultiChannelBuffers)
+{
+   // A slot would hold only channel 0 of the frame
+   CircularBuffer cb(1);
+   ASSERT_TRUE(cb.Initialize(2, width, height, 1));
+   ASSERT_THROW(cb.AcquireSlot(width, height, 1, 1), CMMError);
+   ASSERT_EQ(0u, cb.GetRemainingImageCount());
+}
+
+
+TEST(CircularBufferSlotTests, SlotsCanBeAcquiredUpToSpareCount)
+{
+   CircularBuffer cb(1);
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+
+   std::vector<unsigned char*> slots;
+   for (unsigned long i = 0; i < cb.GetSpareFrameCount(); ++i)
+   {
+      slots.push_back(cb.AcquireSlot(width, height, 1, 1));
+      ASSERT_TRUE(slots.back() != 0);
+      slots.back()[0] = (unsigned char)i;
+   }
+   ASSERT_THROW(cb.AcquireSlot(width, height, 1, 1), CMMError);
+
+   // Committed in reverse order, the frames are queued in commit order
+   Metadata md = CameraMetadata();
+   for (size_t i = slots.size(); i > 0; --i)
+      ASSERT_TRUE(cb.CommitSlot(slots[i - 1], &md));
+   for (size_t i = slots.size(); i > 0; --i)
+      ASSERT_EQ((unsigned char)(i - 1), cb.GetNextImage()[0]);
+
+   // Resizing the buffer is refused while a slot is acquired
+   unsigned char* slot = cb.AcquireSlot(width, height, 1, 1);
+   ASSERT_FALSE(cb.Initialize(1, width * 2, height, 1));
+   cb.AbortSlot(slot);
+   ASSERT_TRUE(cb.Initialize(1, width * 2, height, 1));
+}
+
+
+TEST_P(CircularBufferModeTest, LeasedSlotIsNotOverwritten)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long size = cb.GetSize();
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   pixels[0] = 7;
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+
+   long long lease = cb.LeaseNextImage();
+   ASSERT_GE(lease, 0);
+   ASSERT_EQ(1u, cb.GetLeaseCount());
+   ASSERT_EQ(0u, cb.GetRemainingImageCount());
+   ASSERT_TRUE(cb.LeaseNextImage() < 0);
+
+   // Fill the rest of the buffer; the next insert would reuse the leased
+   // slot and must overflow instead.
+   pixels[0] = 1;
+   for (unsigned long i = 0; i < size - 1; ++i)
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   while (cb.GetNextImage() != 0)
+      ;
+   ASSERT_FALSE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_TRUE(cb.Overflow());
+
+   const mm::ImgBuffer* img = cb.GetLeasedImageBuffer(lease, 0);
+   ASSERT_TRUE(img != 0);
+   ASSERT_EQ(7, img->GetPixels()[0]);
+
+   ASSERT_TRUE(cb.ReleaseImage(lease));
+   ASSERT_FALSE(cb.ReleaseImage(lease));
+   ASSERT_TRUE(cb.GetLeasedImageBuffer(lease, 0) == 0);
+   ASSERT_EQ(0u, cb.GetLeaseCount());
+
+   cb.Clear();
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+}
+
+
+TEST_P(CircularBufferModeTest, InvalidLeaseIds)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+
+   ASSERT_TRUE(cb.LeaseNextImage() < 0);
+   ASSERT_FALSE(cb.ReleaseImage(-1));
+   ASSERT_FALSE(cb.ReleaseImage(0));
+   ASSERT_FALSE(cb.ReleaseImage((long long)cb.GetSize()));
+   ASSERT_TRUE(cb.GetLeasedImageBuffer(0, 0) == 0);
+   ASSERT_TRUE(cb.GetLeasedImageBuffer(-5, 0) == 0);
+}
+
+
+TEST_P(CircularBufferModeTest, StaleLeaseIdsAreRejected)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long size = cb.GetSize();
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   pixels[0] = 1;
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   long long first = cb.LeaseNextImage();
+   ASSERT_GE(first, 0);
+   ASSERT_TRUE(cb.ReleaseImage(first));
+
+   // Go once around the ring, so that the first image's slot is reused and
+   // leased again
+   long long second = -1;
+   for (unsigned long i = 0; i < size; ++i)
+   {
+      pixels[0] = (unsigned char)(i + 2);
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+      second = cb.LeaseNextImage();
+      ASSERT_GE(second, 0);
+      if (i + 1 < size)
+      {
+         ASSERT_TRUE(cb.ReleaseImage(second));
+      }
+   }
+   ASSERT_NE(first, second);
+   ASSERT_FALSE(cb.ReleaseImage(first));
+   ASSERT_TRUE(cb.GetLeasedImageBuffer(first, 0) == 0);
+   ASSERT_EQ((unsigned char)(size + 1), cb.GetLeasedImageBuffer(second, 0)->GetPixels()[0]);
+   ASSERT_EQ(1u, cb.GetLeaseCount());
+
+   // The buffer is not reallocated under a lease
+   ASSERT_FALSE(cb.Initialize(1, width * 2, height, 1));
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   ASSERT_TRUE(cb.GetLeasedImageBuffer(second, 0) != 0);
+   ASSERT_TRUE(cb.ReleaseImage(second));
+   ASSERT_TRUE(cb.Initialize(1, width * 2, height, 1));
+
+   // Nor are lease ids reused after it is reallocated
+   pixels.resize(2 * width * height);
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width * 2, height, 1, &md));
+   long long third = cb.LeaseNextImage();
+   ASSERT_GT(third, second);
+   ASSERT_FALSE(cb.ReleaseImage(second));
+   ASSERT_FALSE(cb.ReleaseImage(first));
+   ASSERT_TRUE(cb.ReleaseImage(third));
+}
+
+
+TEST_P(CircularBufferModeTest, TimestampsAreMonotonicAndFormattedOnRead)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+
+   const mm::ImgBuffer* first = cb.GetNextImageBuffer(0);
+   const mm::ImgBuffer* second = cb.GetNextImageBuffer(0);
+   ASSERT_GT(first->GetTimestamp(), 0);
+   ASSERT_GE(second->GetTimestamp(), first->GetTimestamp());
+   ASSERT_FALSE(first->GetMetadata().HasTag(MM::g_Keyword_Metadata_TimeInCore));
+
+   Metadata readMd;
+   first->GetMetadata(readMd);
+   ASSERT_EQ(mm::FormatMonotonicTime(first->GetTimestamp()),
+         readMd.GetSingleTag(MM::g_Keyword_Metadata_TimeInCore).GetValue());
+   ASSERT_EQ("0", readMd.GetSingleTag(MM::g_Keyword_Metadata_ImageNumber).GetValue());
+   ASSERT_TRUE(readMd.HasTag(MM::g_Keyword_Elapsed_Time_ms));
+}
+
+
+TEST_P(CircularBufferModeTest, OverflowPolicies)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long size = cb.GetSize();
+   ASSERT_EQ(CircularBuffer::OverflowStop, cb.GetOverflowPolicy());
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (unsigned long i = 0; i < size; ++i)
+   {
+      pixels[0] = (unsigned char)i;
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   }
+   ASSERT_FALSE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(1, cb.GetDroppedImageCount(CircularBuffer::OverflowStop));
+
+   // The oldest frame makes room; the consumer still sees every later frame
+   cb.SetOverflowPolicy(CircularBuffer::OverflowDropOldest);
+   pixels[0] = 200;
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(1, cb.GetDroppedImageCount(CircularBuffer::OverflowDropOldest));
+   ASSERT_EQ(size, cb.GetRemainingImageCount());
+   ASSERT_EQ(1, cb.GetNextImage()[0]);
+   ASSERT_EQ(200, cb.GetTopImage()[0]);
+
+   // The arriving frame is discarded
+   cb.SetOverflowPolicy(CircularBuffer::OverflowDropNewest);
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   pixels[0] = 201;
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(1, cb.GetDroppedImageCount(CircularBuffer::OverflowDropNewest));
+   ASSERT_EQ(200, cb.GetTopImage()[0]);
+
+   // Everything is discarded
+   cb.SetOverflowPolicy(CircularBuffer::OverflowClearAll);
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ((long long)size, cb.GetDroppedImageCount(CircularBuffer::OverflowClearAll));
+   ASSERT_EQ(1u, cb.GetRemainingImageCount());
+   ASSERT_FALSE(cb.Overflow());
+
+   // Legacy clearing by the camera is counted under ClearAll
+   cb.DropAll();
+   ASSERT_EQ((long long)size + 1, cb.GetDroppedImageCount(CircularBuffer::OverflowClearAll));
+
+   // A zero-copy slot is handed out even if its image will be discarded
+   cb.SetOverflowPolicy(CircularBuffer::OverflowDropNewest);
+   for (unsigned long i = 0; i < size; ++i)
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   unsigned char* slot = cb.AcquireSlot(width, height, 1, 1);
+   ASSERT_TRUE(slot != 0);
+   slot[0] = 202;
+   ASSERT_TRUE(cb.CommitSlot(slot, &md));
+   ASSERT_NE(202, cb.GetTopImage()[0]);
+   ASSERT_EQ(2, cb.GetDroppedImageCount(CircularBuffer::OverflowDropNewest));
+   ASSERT_EQ(size, cb.GetRemainingImageCount());
+
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   ASSERT_EQ(0, cb.GetDroppedImageCount(CircularBuffer::OverflowClearAll));
+}
+
+
+TEST_P(CircularBufferModeTest, ReaderCursors)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long size = cb.GetSize();
+   // Read only through cursors
+   cb.SetDefaultConsumerLossy(true);
+   ASSERT_TRUE(cb.AddCursor("save", false));
+   ASSERT_TRUE(cb.AddCursor("display", true));
+   ASSERT_FALSE(cb.AddCursor("save", true));
+   ASSERT_EQ(-1, cb.GetCursorLag("none"));
+   ASSERT_TRUE(cb.GetNextImageBuffer("save", 0) == 0);
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (unsigned long i = 0; i < size; ++i)
+   {
+      pixels[0] = (unsigned char)i;
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   }
+
+   // The non-lossy cursor holds every slot
+   ASSERT_EQ(0u, cb.GetFreeSize());
+   ASSERT_FALSE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(0, cb.GetNextImageBuffer("save", 0)->GetPixels()[0]);
+   pixels[0] = (unsigned char)size;
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ((long long)size, cb.GetCursorLag("save"));
+
+   // The lossy cursor has been overtaken and skips to the newest frame
+   ASSERT_EQ((long long)size + 1, cb.GetCursorLag("display"));
+   ASSERT_EQ((unsigned char)size, cb.GetNextImageBuffer("display", 0)->GetPixels()[0]);
+   ASSERT_EQ((long long)size, cb.GetCursorDroppedImageCount("display"));
+   ASSERT_EQ(0, cb.GetCursorLag("display"));
+
+   // The overflow policy moves the non-lossy cursor too
+   cb.SetOverflowPolicy(CircularBuffer::OverflowDropOldest);
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(1, cb.GetCursorDroppedImageCount("save"));
+   ASSERT_EQ(1, cb.GetDroppedImageCount(CircularBuffer::OverflowDropOldest));
+   ASSERT_EQ(2, cb.GetNextImageBuffer("save", 0)->GetPixels()[0]);
+
+   // Removing the cursor releases its slots; the lossy default consumer
+   // does not hold any
+   ASSERT_TRUE(cb.RemoveCursor("save"));
+   ASSERT_FALSE(cb.RemoveCursor("save"));
+   ASSERT_EQ(size, cb.GetFreeSize());
+
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   ASSERT_TRUE(cb.HasCursor("display"));
+   ASSERT_EQ(0, cb.GetCursorDroppedImageCount("display"));
+}
+
+
+TEST_P(CircularBufferModeTest, DefaultConsumerHoldsSlotsWithCursors)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long size = cb.GetSize();
+   ASSERT_FALSE(cb.IsDefaultConsumerLossy());
+   ASSERT_TRUE(cb.AddCursor("display", true));
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (unsigned long i = 0; i < size; ++i)
+   {
+      pixels[0] = (unsigned char)i;
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   }
+
+   // A cursor does not change what popNextImage sees: the frames it has not
+   // read stay in the buffer and the producer overflows
+   ASSERT_EQ(0u, cb.GetFreeSize());
+   ASSERT_FALSE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_TRUE(cb.Overflow());
+   ASSERT_EQ(size, cb.GetRemainingImageCount());
+   ASSERT_EQ(0, cb.GetNextImage()[0]);
+   ASSERT_EQ(1u, cb.GetFreeSize());
+}
+
+
+TEST_P(CircularBufferModeTest, CursorLeases)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long size = cb.GetSize();
+   ASSERT_TRUE(cb.AddCursor("autofocus", false));
+   ASSERT_TRUE(cb.AddCursor("display", true));
+   ASSERT_TRUE(cb.LeaseNextImage("autofocus") < 0);
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (unsigned long i = 0; i < 2; ++i)
+   {
+      pixels[0] = (unsigned char)(i + 5);
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   }
+
+   // Lossy cursors and unknown ones cannot lease
+   ASSERT_TRUE(cb.LeaseNextImage("display") < 0);
+   ASSERT_TRUE(cb.LeaseNextImage("none") < 0);
+
+   long long lease = cb.LeaseNextImage("autofocus");
+   ASSERT_GE(lease, 0);
+   ASSERT_EQ(5, cb.GetLeasedImageBuffer(lease, 0)->GetPixels()[0]);
+   ASSERT_EQ(1, cb.GetCursorLag("autofocus"));
+
+   // The default consumer still reads every frame, but the leased one is
+   // not overwritten
+   ASSERT_EQ(2u, cb.GetRemainingImageCount());
+   while (cb.GetNextImage() != 0)
+      ;
+   ASSERT_TRUE(cb.RemoveCursor("autofocus"));
+   for (unsigned long i = 0; i < size - 2; ++i)
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   while (cb.GetNextImage() != 0)
+      ;
+   ASSERT_FALSE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(5, cb.GetLeasedImageBuffer(lease, 0)->GetPixels()[0]);
+   ASSERT_TRUE(cb.ReleaseImage(lease));
+}
+
+
+namespace {
+
+void InsertAfterDelay(CircularBuffer* cb)
+{
+   boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   cb->InsertImage(&pixels[0], width, height, 1, &md);
+}
+
+} // anonymous namespace
+
+
+TEST_P(CircularBufferModeTest, WaitForImage)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   ASSERT_FALSE(cb.WaitForImage("none", 0));
+   ASSERT_TRUE(cb.AddCursor("autofocus", false));
+
+   // Times out with nothing to read
+   boost::posix_time::ptime start =
+      boost::posix_time::microsec_clock::universal_time();
+   ASSERT_FALSE(cb.WaitForImage("autofocus", 30));
+   ASSERT_GE((boost::posix_time::microsec_clock::universal_time() - start).
+         total_milliseconds(), 25);
+
+   // Wakes when a frame is inserted, long before the timeout
+   boost::thread t(InsertAfterDelay, &cb);
+   start = boost::posix_time::microsec_clock::universal_time();
+   ASSERT_TRUE(cb.WaitForImage("autofocus", 10000));
+   ASSERT_LT((boost::posix_time::microsec_clock::universal_time() - start).
+         total_milliseconds(), 5000);
+   t.join();
+
+   // Returns at once while there is a frame to read
+   ASSERT_TRUE(cb.WaitForImage("autofocus", 10000));
+   ASSERT_TRUE(cb.GetNextImageBuffer("autofocus", 0) != 0);
+   ASSERT_FALSE(cb.WaitForImage("autofocus", 0));
+}
+
+
+TEST_P(CircularBufferModeTest, LossyDefaultConsumer)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long size = cb.GetSize();
+   cb.SetDefaultConsumerLossy(true);
+   ASSERT_TRUE(cb.IsDefaultConsumerLossy());
+
+   // Nothing holds the slots, so the producer overwrites the oldest frames
+   // that the default consumer has not read
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (unsigned long i = 0; i < size + 2; ++i)
+   {
+      pixels[0] = (unsigned char)i;
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   }
+   ASSERT_FALSE(cb.Overflow());
+   ASSERT_EQ(size, cb.GetRemainingImageCount());
+   ASSERT_EQ(2, cb.GetNextImage()[0]);
+   ASSERT_EQ(size - 1, cb.GetRemainingImageCount());
+
+   // Made non-lossy again, it holds the frames it has not read
+   cb.SetDefaultConsumerLossy(false);
+   ASSERT_EQ(1u, cb.GetFreeSize());
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_FALSE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(3, cb.GetNextImage()[0]);
+}
+
+
+TEST_P(CircularBufferModeTest, CopyNewestImageDoesNotConsume)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+
+   std::vector<unsigned char> copy(width * height);
+   unsigned w, h, d;
+   long long number;
+   ASSERT_FALSE(cb.CopyNewestImage(&copy[0], (unsigned long)copy.size(), w, h, d, number));
+   ASSERT_EQ(-1, number);
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (unsigned char i = 0; i < 3; ++i)
+   {
+      pixels[0] = i;
+      ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   }
+   ASSERT_TRUE(cb.CopyNewestImage(&copy[0], (unsigned long)copy.size(), w, h, d, number));
+   ASSERT_EQ(2, number);
+   ASSERT_EQ(2, copy[0]);
+   ASSERT_EQ(width, w);
+   ASSERT_EQ(height, h);
+   ASSERT_EQ(1u, d);
+   ASSERT_EQ(3u, cb.GetRemainingImageCount());
+
+   ASSERT_FALSE(cb.CopyNewestImage(&copy[0], 16, w, h, d, number));
+   ASSERT_EQ(2, number);
+   ASSERT_EQ(width, w);
+}
+
+
+namespace {
+
+void HoldLock(MMThreadLock* lock, boost::atomic<bool>* held,
+      boost::atomic<bool>* release)
+{
+   MMThreadGuard guard(lock);
+   held->store(true);
+   while (!release->load())
+      boost::this_thread::yield();
+}
+
+void InsertUniformFrames(CircularBuffer* cb, unsigned size, unsigned long count)
+{
+   std::vector<unsigned char> pixels(size * size);
+   Metadata md = CameraMetadata();
+   for (unsigned long i = 0; i < count; ++i)
+   {
+      std::fill(pixels.begin(), pixels.end(), (unsigned char)i);
+      if (i % 2)
+      {
+         cb->InsertImage(&pixels[0], size, size, 1, &md);
+         continue;
+      }
+      unsigned char* slot = cb->AcquireSlot(size, size, 1, 1);
+      if (slot)
+      {
+         memcpy(slot, &pixels[0], pixels.size());
+         cb->CommitSlot(slot, &md);
+      }
+   }
+}
+
+} // anonymous namespace
+
+
+TEST_P(CircularBufferModeTest, CopyNewestImageDoesNotTakeInsertLock)
+{
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   std::vector<unsigned char> pixels(width * height, 7);
+   Metadata md = CameraMetadata();
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+
+   // A producer is in the middle of an insert
+   boost::atomic<bool> held(false), release(false);
+   boost::thread t(HoldLock, &cb.g_insertLock, &held, &release);
+   while (!held.load())
+      boost::this_thread::yield();
+
+   std::vector<unsigned char> copy(width * height);
+   unsigned w, h, d;
+   long long number;
+   bool copied = cb.CopyNewestImage(&copy[0], (unsigned long)copy.size(), w, h, d, number);
+   release.store(true);
+   t.join();
+   ASSERT_TRUE(copied);
+   ASSERT_EQ(0, number);
+   ASSERT_EQ(7, copy[0]);
+}
+
+
+TEST_P(CircularBufferModeTest, CopyNewestImageIsConsistentWhileInserting)
+{
+   // A ring of one frame, overwritten (in place and by slot) while the
+   // newest frame is copied
+   const unsigned size = 1024;
+   CircularBuffer cb(1);
+   cb.SetLockFree(GetParam());
+   cb.SetDefaultConsumerLossy(true);
+   ASSERT_TRUE(cb.Initialize(1, size, size, 1));
+   ASSERT_EQ(1u, cb.GetSize());
+
+   boost::thread t(InsertUniformFrames, &cb, size, 2000UL);
+   std::vector<unsigned char> copy(size * size);
+   unsigned w, h, d;
+   long long number;
+   bool done = false;
+   while (!done)
+   {
+      done = t.timed_join(boost::posix_time::milliseconds(0));
+      if (!cb.CopyNewestImage(&copy[0], (unsigned long)copy.size(), w, h, d, number))
+         continue;
+      ASSERT_EQ((unsigned char)number, copy[0]);
+      for (size_t i = 1; i < copy.size(); ++i)
+         ASSERT_EQ(copy[0], copy[i]) << "torn copy of image " << number;
+   }
+}
+
+
+INSTANTIATE_TEST_CASE_P(LockedAndLockFree, CircularBufferModeTest,
+      ::testing::Values(false, true));
+
+
+TEST(CircularBufferStorageTests, SlotsAreAlignedAndContiguous)
+{
+   CircularBuffer cb(1);
+   // Odd width, so that the image size is not a multiple of the alignment
+   ASSERT_TRUE(cb.Initialize(2, 61, 3, 1));
+   ASSERT_GT(cb.GetSize(), 1u);
+
+   std::vector<unsigned char> pixels(2 * 61 * 3);
+   Metadata md = CameraMetadata();
+   std::vector<const unsigned char*> addresses;
+   for (unsigned i = 0; i < 2; ++i)
+   {
+      ASSERT_TRUE(cb.InsertMultiChannel(&pixels[0], 2, 61, 3, 1, &md));
+      for (unsigned ch = 0; ch < 2; ++ch)
+      {
+         const unsigned char* p = cb.GetTopImageBuffer(ch)->GetPixels();
+         ASSERT_EQ(0u, reinterpret_cast<std::size_t>(p) % mm::FrameStore::SlotAlignment);
+         addresses.push_back(p);
+      }
+   }
+   // 183 bytes per image, padded to 192
+   ASSERT_EQ(addresses[0] + 192, addresses[1]);
+   ASSERT_EQ(addresses[0] + 2 * 192, addresses[2]);
+   ASSERT_EQ(addresses[0] + 3 * 192, addresses[3]);
+}
+
+
+TEST(CircularBufferStorageTests, StorageIsCommittedInBackground)
+{
+   CircularBuffer cb(8);
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   const unsigned long long reserved = cb.GetReservedBytes();
+   ASSERT_GE(reserved, (unsigned long long)cb.GetSize() * width * height);
+
+   cb.WaitForPrefault();
+   ASSERT_EQ(reserved, cb.GetCommittedBytes());
+}
+
+
+TEST(CircularBufferStorageTests, HugePagesCanBeRequested)
+{
+   // Whether huge pages are actually used depends on the system
+   CircularBuffer cb(8);
+   cb.SetUseHugePages(true);
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   ASSERT_GT(cb.GetSize(), 0u);
+
+   std::vector<unsigned char> pixels(width * height);
+   pixels[0] = 3;
+   Metadata md = CameraMetadata();
+   ASSERT_TRUE(cb.InsertImage(&pixels[0], width, height, 1, &md));
+   ASSERT_EQ(3, cb.GetNextImage()[0]);
+
+   cb.SetUseHugePages(false);
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+   ASSERT_FALSE(cb.IsUsingHugePages());
+}
+
+
+TEST(CircularBufferStorageTests, RefusesMoreThanPhysicalMemory)
+{
+   // 512 MB frames, limited to 100000 frames by the buffer
+   CircularBuffer cb(4000000000u);
+   ASSERT_FALSE(cb.Initialize(1, 8192, 8192, 8));
+   ASSERT_EQ(0u, cb.GetSize());
+   ASSERT_EQ(0u, cb.GetReservedBytes());
+}
+
+
+// Stress test: one producer inserting as fast as it can, while several
+// consumer threads pop and poll the buffer.
+
+class CircularBufferConsumer
+{
+   CircularBuffer& cb_;
+   bool pop_;
+   boost::atomic<bool>& stop_;
+   unsigned long popped_;
+
+public:
+   CircularBufferConsumer(CircularBuffer& cb, bool pop,
+         boost::atomic<bool>& stop) :
+      cb_(cb), pop_(pop), stop_(stop), popped_(0)
+   {}
+
+   unsigned long Popped() const { return popped_; }
+
+   void Run()
+   {
+      for (;;)
+      {
+         bool stopping = stop_.load();
+         if (pop_)
+         {
+            while (cb_.GetNextImageBuffer(0) != 0)
+               ++popped_;
+            if (stopping)
+               break;
+         }
+         else
+         {
+            if (stopping)
+               break;
+            cb_.GetRemainingImageCount();
+            cb_.GetTopImageBuffer(0);
+            cb_.GetFreeSize();
+         }
+      }
+   }
+};
+
+
+namespace {
+
+struct StressResult
+{
+   double insertsPerSecond;
+   unsigned long inserted;
+   unsigned long popped;
+};
+
+StressResult RunStress(bool lockFree, unsigned poppers, unsigned pollers,
+      unsigned long numFrames)
+{
+   CircularBuffer cb(16);
+   cb.SetLockFree(lockFree);
+   EXPECT_TRUE(cb.Initialize(1, width, height, 1));
+
+   boost::atomic<bool> stop(false);
+   std::vector< boost::shared_ptr<CircularBufferConsumer> > consumers;
+   std::vector< boost::shared_ptr<boost::thread> > threads;
+   for (unsigned i = 0; i < poppers + pollers; ++i)
+   {
+      consumers.push_back(boost::make_shared<CircularBufferConsumer>(
+               boost::ref(cb), i < poppers, boost::ref(stop)));
+      threads.push_back(boost::make_shared<boost::thread>(
+               &CircularBufferConsumer::Run, consumers[i].get()));
+   }
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   unsigned long inserted = 0;
+   boost::posix_time::ptime start =
+      boost::posix_time::microsec_clock::universal_time();
+   while (inserted < numFrames)
+   {
+      if (cb.InsertImage(&pixels[0], width, height, 1, &md))
+         ++inserted;
+      else
+         boost::this_thread::yield(); // Wait for consumers to catch up
+   }
+   boost::posix_time::time_duration elapsed =
+      boost::posix_time::microsec_clock::universal_time() - start;
+
+   stop.store(true);
+   StressResult result;
+   result.popped = 0;
+   for (unsigned i = 0; i < threads.size(); ++i)
+   {
+      threads[i]->join();
+      result.popped += consumers[i]->Popped();
+   }
+   result.inserted = inserted;
+   result.insertsPerSecond = inserted /
+      (elapsed.total_microseconds() / 1.0e6 + 1e-9);
+   return result;
+}
+
+} // anonymous namespace
+
+
+TEST(CircularBufferStressTests, EveryFramePoppedExactlyOnce)
+{
+   const unsigned long numFrames = 5000;
+   StressResult r = RunStress(true, 4, 0, numFrames);
+   ASSERT_EQ(numFrames, r.inserted);
+   ASSERT_EQ(numFrames, r.popped);
+
+   r = RunStress(false, 4, 0, numFrames);
+   ASSERT_EQ(numFrames, r.inserted);
+   ASSERT_EQ(numFrames, r.popped);
+}
+
+
+namespace {
+
+void InsertPopAndPoll(CircularBuffer* cb, boost::atomic<bool>* done)
+{
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md = CameraMetadata();
+   for (int i = 0; i < 100; ++i)
+   {
+      cb->InsertImage(&pixels[0], width, height, 1, &md);
+      cb->GetRemainingImageCount();
+      cb->GetTopImageBuffer(0);
+      cb->GetFreeSize();
+      cb->GetNextImageBuffer(0);
+   }
+   done->store(true);
+}
+
+} // anonymous namespace
+
+
+TEST(CircularBufferStressTests, PollersDoNotBlockInsertsInLockFreeMode)
+{
+   // In locked mode, a poller holds g_bufferLock for the duration of its
+   // call, during which the producer cannot publish a frame. In lock-free
+   // mode, producers and consumers must not need it at all.
+   CircularBuffer cb(1);
+   cb.SetLockFree(true);
+   ASSERT_TRUE(cb.Initialize(1, width, height, 1));
+
+   boost::atomic<bool> held(false), release(false);
+   boost::thread poller(HoldLock, &cb.g_bufferLock, &held, &release);
+   while (!held.load())
+      boost::this_thread::yield();
+
+   boost::atomic<bool> done(false);
+   boost::thread producer(InsertPopAndPoll, &cb, &done);
+   bool finished = producer.timed_join(boost::posix_time::seconds(10));
+   release.store(true);
+   poller.join();
+   if (!finished)
+      producer.join();
+   ASSERT_TRUE(finished);
+   ASSERT_TRUE(done.load());
+   ASSERT_EQ(0, cb.GetRemainingImageCount());
+   unsigned char pixel;
+   unsigned w, h, d;
+   long long number;
+   cb.CopyNewestImage(&pixel, 1, w, h, d, number);
+   ASSERT_EQ(99, number);
+}
+
+
+// Run with --gtest_also_run_disabled_tests; what is asserted is in
+// PollersDoNotBlockInsertsInLockFreeMode
+TEST(CircularBufferStressTests, DISABLED_InsertRateWithConcurrentPolling)
+{
+   const unsigned long numFrames = 5000;
+   const unsigned pollerCounts[] = { 0, 3 };
+   for (unsigned lockFree = 0; lockFree < 2; ++lockFree)
+   {
+      for (unsigned i = 0; i < 2; ++i)
+      {
+         StressResult r = RunStress(lockFree != 0, 1, pollerCounts[i],
+               numFrames);
+         ASSERT_EQ(numFrames, r.popped);
+         std::cout << (lockFree ? "lock-free" : "locked   ") <<
+            " mode, 1 popping and " << pollerCounts[i] <<
+            " polling threads: " << (long)r.insertsPerSecond <<
+            " inserts/s" << std::endl;
+      }
+   }
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
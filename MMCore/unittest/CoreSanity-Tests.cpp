@@ -24,6 +24,42 @@ TEST(CoreSanityTests, CreateAndReset)
    c.reset();
 }
 
+TEST(CoreSanityTests, CameraCircularBufferRequiresCamera)
+{
+   CMMCore c;
+   Metadata md;
+   ASSERT_FALSE(c.hasCircularBuffer("NoSuchCamera"));
+   ASSERT_THROW(c.setCircularBufferMemoryFootprint("NoSuchCamera", 1), CMMError);
+   ASSERT_THROW(c.popNextImageMD("NoSuchCamera", md), CMMError);
+   ASSERT_THROW(c.getRemainingImageCount("NoSuchCamera"), CMMError);
+}
+
+TEST(CoreSanityTests, CircularBufferOverflowPolicy)
+{
+   CMMCore c;
+   ASSERT_EQ("Stop", c.getCircularBufferOverflowPolicy());
+   c.setCircularBufferOverflowPolicy("DropOldest");
+   ASSERT_EQ("DropOldest", c.getCircularBufferOverflowPolicy());
+   c.setCircularBufferMemoryFootprint(1);
+   ASSERT_EQ("DropOldest", c.getCircularBufferOverflowPolicy());
+   ASSERT_EQ(0, c.getCircularBufferDroppedImageCount("DropOldest"));
+   ASSERT_THROW(c.setCircularBufferOverflowPolicy("Overwrite"), CMMError);
+   ASSERT_THROW(c.getCircularBufferDroppedImageCount("Overwrite"), CMMError);
+}
+
+TEST(CoreSanityTests, AsyncImageProcessing)
+{
+   CMMCore c;
+   ASSERT_FALSE(c.isAsyncImageProcessingEnabled());
+   c.setAsyncImageProcessingThreads(2, 8);
+   c.enableAsyncImageProcessing(true);
+   ASSERT_TRUE(c.isAsyncImageProcessingEnabled());
+   c.setCircularBufferMemoryFootprint(1);
+   c.enableAsyncImageProcessing(false);
+   ASSERT_FALSE(c.isAsyncImageProcessingEnabled());
+   ASSERT_THROW(c.setAsyncImageProcessingThreads(0, 1), CMMError);
+}
+
 int main(int argc, char **argv)
 {
    ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+
+#include "GeometricCorrection.h"
+
+#include <boost/cstdint.hpp>
+
+#include <vector>
+
+
+namespace {
+
+// Reference: pixel (x, y) of the corrected image, from the definition
+template <typename T>
+T CorrectedPixel(const std::vector<T>& in, unsigned width, unsigned height,
+      const mm::GeometricCorrection& c, unsigned x, unsigned y)
+{
+   // Undo the transpose, then the mirrors
+   unsigned sx = c.GetSwapXY() ? y : x;
+   unsigned sy = c.GetSwapXY() ? x : y;
+   if (c.GetMirrorX())
+      sx = width - 1 - sx;
+   if (c.GetMirrorY())
+      sy = height - 1 - sy;
+   return in[sy * width + sx];
+}
+
+template <typename T>
+void CheckAllCorrections(unsigned width, unsigned height)
+{
+   std::vector<T> in(width * height);
+   for (unsigned i = 0; i < in.size(); ++i)
+      in[i] = (T)(i * 2654435761u);
+
+   for (int flags = 0; flags < 8; ++flags)
+   {
+      mm::GeometricCorrection c((flags & 1) != 0, (flags & 2) != 0,
+            (flags & 4) != 0);
+      unsigned outWidth, outHeight;
+      c.GetOutputSize(width, height, outWidth, outHeight);
+      ASSERT_EQ(width * height, outWidth * outHeight);
+
+      std::vector<T> out(width * height);
+      c.Apply(reinterpret_cast<const unsigned char*>(&in[0]),
+            reinterpret_cast<unsigned char*>(&out[0]), width, height,
+            sizeof(T));
+      for (unsigned y = 0; y < outHeight; ++y)
+         for (unsigned x = 0; x < outWidth; ++x)
+            ASSERT_EQ(CorrectedPixel(in, width, height, c, x, y),
+                  out[y * outWidth + x]) << "flags " << flags <<
+               " at " << x << ", " << y;
+
+      std::vector<T> inPlace(in);
+      std::vector<unsigned char> scratch;
+      unsigned w = width;
+      unsigned h = height;
+      c.ApplyInPlace(reinterpret_cast<unsigned char*>(&inPlace[0]), w, h,
+            sizeof(T), scratch);
+      ASSERT_EQ(outWidth, w);
+      ASSERT_EQ(outHeight, h);
+      ASSERT_TRUE(inPlace == out);
+   }
+}
+
+} // anonymous namespace
+
+
+TEST(GeometricCorrectionTests, IdentityIsACopy)
+{
+   mm::GeometricCorrection c;
+   ASSERT_TRUE(c.IsIdentity());
+   unsigned w, h;
+   c.GetOutputSize(3, 2, w, h);
+   ASSERT_EQ(3u, w);
+   ASSERT_EQ(2u, h);
+   ASSERT_FALSE(mm::GeometricCorrection(false, false, true).IsIdentity());
+}
+
+TEST(GeometricCorrectionTests, SmallImages)
+{
+   CheckAllCorrections<boost::uint8_t>(1, 1);
+   CheckAllCorrections<boost::uint8_t>(5, 3);
+   CheckAllCorrections<boost::uint16_t>(3, 7);
+}
+
+TEST(GeometricCorrectionTests, ImagesSpanningSeveralBlocks)
+{
+   CheckAllCorrections<boost::uint8_t>(100, 37);
+   CheckAllCorrections<boost::uint16_t>(64, 64);
+   CheckAllCorrections<boost::uint32_t>(33, 70);
+   CheckAllCorrections<boost::uint64_t>(40, 41);
+}
+
+TEST(GeometricCorrectionTests, OddPixelSizesAreCopiedBytewise)
+{
+   // 3 bytes per pixel: compare with the 1-byte correction of each plane
+   const unsigned width = 37;
+   const unsigned height = 5;
+   std::vector<unsigned char> in(width * height * 3);
+   for (unsigned i = 0; i < in.size(); ++i)
+      in[i] = (unsigned char)(i * 7);
+
+   mm::GeometricCorrection c(true, true, false);
+   std::vector<unsigned char> out(in.size());
+   c.Apply(&in[0], &out[0], width, height, 3);
+
+   for (unsigned plane = 0; plane < 3; ++plane)
+   {
+      std::vector<unsigned char> planeIn(width * height);
+      for (unsigned i = 0; i < planeIn.size(); ++i)
+         planeIn[i] = in[i * 3 + plane];
+      std::vector<unsigned char> planeOut(planeIn.size());
+      c.Apply(&planeIn[0], &planeOut[0], width, height, 1);
+      for (unsigned i = 0; i < planeOut.size(); ++i)
+         ASSERT_EQ(planeOut[i], out[i * 3 + plane]);
+   }
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -0,0 +1,364 @@
+#include <gtest/gtest.h>
+
+#include "ImageProcessingPipeline.h"
+
+#include "../MMDevice/MMDeviceConstants.h"
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <cstdlib>
+#include <vector>
+
+
+namespace {
+
+const unsigned width = 16;
+const unsigned height = 8;
+
+// Records the frames published, each identified by its first pixel
+class PipelineRecorder
+{
+public:
+   PipelineRecorder() : gateOpen_(true), publishResult_(DEVICE_OK) {}
+
+   void Process(const MM::Device*, unsigned char* pixels, unsigned&, unsigned&,
+         unsigned)
+   {
+      {
+         boost::unique_lock<boost::mutex> lock(mutex_);
+         while (!gateOpen_)
+            gateChanged_.wait(lock);
+      }
+      // Later frames finish first, to exercise the reordering
+      boost::this_thread::sleep(boost::posix_time::microseconds(
+               100 * (8 - pixels[0] % 8)));
+      pixels[1] = 1;
+   }
+
+   int Publish(const MM::Device*, const unsigned char* pixels, unsigned,
+         unsigned, unsigned, unsigned, const Metadata& md)
+   {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      published_.push_back(pixels[0]);
+      processedFlags_.push_back(pixels[1]);
+      lastMetadata_ = md;
+      return publishResult_;
+   }
+
+   void SetPublishResult(int result)
+   {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      publishResult_ = result;
+   }
+
+   void SetGate(bool open)
+   {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      gateOpen_ = open;
+      gateChanged_.notify_all();
+   }
+
+   std::vector<unsigned char> Published()
+   {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      return published_;
+   }
+
+   std::vector<unsigned char> ProcessedFlags()
+   {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      return processedFlags_;
+   }
+
+   Metadata LastMetadata()
+   {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      return lastMetadata_;
+   }
+
+private:
+   boost::mutex mutex_;
+   boost::condition_variable gateChanged_;
+   bool gateOpen_;
+   int publishResult_;
+   std::vector<unsigned char> published_;
+   std::vector<unsigned char> processedFlags_;
+   Metadata lastMetadata_;
+};
+
+mm::ImageProcessingPipeline::ProcessFunction ProcessWith(PipelineRecorder& r)
+{
+   return boost::bind(&PipelineRecorder::Process, &r, _1, _2, _3, _4, _5);
+}
+
+mm::ImageProcessingPipeline::PublishFunction PublishWith(PipelineRecorder& r)
+{
+   return boost::bind(&PipelineRecorder::Publish, &r,
+         _1, _2, _3, _4, _5, _6, _7);
+}
+
+void SubmitFrames(mm::ImageProcessingPipeline* pipeline, unsigned count,
+      boost::atomic<unsigned>* submitted)
+{
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md;
+   for (unsigned i = 0; i < count; ++i)
+   {
+      pixels[0] = (unsigned char)i;
+      pipeline->Submit(0, &pixels[0], width, height, 1, 1, md);
+      ++*submitted;
+   }
+}
+
+} // anonymous namespace
+
+
+TEST(ImageProcessingPipelineTests, FramesArePublishedInOrder)
+{
+   PipelineRecorder recorder;
+   mm::ImageProcessingPipeline pipeline(ProcessWith(recorder),
+         PublishWith(recorder));
+   pipeline.Start(4, 8);
+
+   const unsigned count = 100;
+   boost::atomic<unsigned> submitted(0);
+   SubmitFrames(&pipeline, count, &submitted);
+   pipeline.Drain();
+
+   std::vector<unsigned char> published = recorder.Published();
+   ASSERT_EQ(count, published.size());
+   for (unsigned i = 0; i < count; ++i)
+   {
+      ASSERT_EQ((unsigned char)i, published[i]);
+      ASSERT_EQ(1, recorder.ProcessedFlags()[i]);
+   }
+   ASSERT_EQ((long long)count, pipeline.GetPublishedImageCount());
+
+   Metadata md = recorder.LastMetadata();
+   ASSERT_TRUE(md.HasTag("ImageProcessingQueue-ms"));
+   ASSERT_TRUE(md.HasTag("ImageProcessing-ms"));
+   ASSERT_TRUE(md.HasTag("ImageProcessingLatency-ms"));
+   ASSERT_GT(atof(md.GetSingleTag("ImageProcessing-ms").GetValue().c_str()), 0.0);
+}
+
+
+TEST(ImageProcessingPipelineTests, QueueDepthIsBounded)
+{
+   PipelineRecorder recorder;
+   mm::ImageProcessingPipeline pipeline(ProcessWith(recorder),
+         PublishWith(recorder));
+   const unsigned depth = 3;
+   pipeline.Start(2, depth);
+
+   recorder.SetGate(false);
+   boost::atomic<unsigned> submitted(0);
+   boost::thread camera(boost::bind(&SubmitFrames, &pipeline, depth + 2, &submitted));
+   boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+   ASSERT_EQ(depth, submitted.load());
+   ASSERT_TRUE(recorder.Published().empty());
+
+   recorder.SetGate(true);
+   camera.join();
+   pipeline.Drain();
+   ASSERT_EQ(depth + 2, recorder.Published().size());
+}
+
+
+TEST(ImageProcessingPipelineTests, AcquiredBuffersKeepTheirPlace)
+{
+   PipelineRecorder recorder;
+   mm::ImageProcessingPipeline pipeline(ProcessWith(recorder),
+         PublishWith(recorder));
+   pipeline.Start(2, 4);
+
+   const MM::Device* camera = 0;
+   Metadata md;
+   unsigned char* buffer = pipeline.AcquireBuffer(camera, width, height, 1, 1);
+   ASSERT_TRUE(buffer != 0);
+   ASSERT_TRUE(pipeline.HasAcquiredBuffer(camera));
+   buffer[0] = 10;
+   buffer[1] = 0;
+   ASSERT_EQ(DEVICE_OK, pipeline.CommitBuffer(camera, md, false));
+   ASSERT_FALSE(pipeline.HasAcquiredBuffer(camera));
+
+   buffer = pipeline.AcquireBuffer(camera, width, height, 1, 1);
+   ASSERT_TRUE(buffer != 0);
+   pipeline.AbortBuffer(camera);
+   ASSERT_EQ(DEVICE_ERR, pipeline.CommitBuffer(camera, md, true));
+
+   std::vector<unsigned char> pixels(width * height);
+   pixels[0] = 11;
+   pipeline.Submit(camera, &pixels[0], width, height, 1, 1, md);
+   pipeline.Drain();
+
+   std::vector<unsigned char> published = recorder.Published();
+   ASSERT_EQ(2u, published.size());
+   ASSERT_EQ(10, published[0]);
+   ASSERT_EQ(0, recorder.ProcessedFlags()[0]);
+   ASSERT_EQ(11, published[1]);
+   ASSERT_EQ(1, recorder.ProcessedFlags()[1]);
+}
+
+
+TEST(ImageProcessingPipelineTests, ProcessesSynchronouslyWhenStopped)
+{
+   PipelineRecorder recorder;
+   mm::ImageProcessingPipeline pipeline(ProcessWith(recorder),
+         PublishWith(recorder));
+   ASSERT_FALSE(pipeline.IsRunning());
+   ASSERT_TRUE(pipeline.AcquireBuffer(0, width, height, 1, 1) == 0);
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md;
+   ASSERT_EQ(DEVICE_OK, pipeline.Submit(0, &pixels[0], width, height, 1, 1, md));
+   // Processed in place, on this thread
+   ASSERT_EQ(1, pixels[1]);
+   ASSERT_EQ(1u, recorder.Published().size());
+   ASSERT_FALSE(recorder.LastMetadata().HasTag("ImageProcessing-ms"));
+
+   pipeline.Start(1, 1);
+   ASSERT_EQ(1u, pipeline.GetThreadCount());
+   pixels[1] = 0;
+   pipeline.Submit(0, &pixels[0], width, height, 1, 1, md);
+   pipeline.Stop();
+   ASSERT_EQ(2u, recorder.Published().size());
+   ASSERT_EQ(0, pixels[1]);
+}
+
+
+TEST(ImageProcessingPipelineTests, PublishErrorIsReportedByDrain)
+{
+   PipelineRecorder recorder;
+   mm::ImageProcessingPipeline pipeline(ProcessWith(recorder),
+         PublishWith(recorder));
+   pipeline.Start(2, 4);
+   recorder.SetPublishResult(DEVICE_BUFFER_OVERFLOW);
+
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md;
+   for (unsigned i = 0; i < 3; ++i)
+   {
+      pixels[0] = static_cast<unsigned char>(i);
+      ASSERT_EQ(DEVICE_OK, pipeline.Submit(0, &pixels[0], width, height, 1, 1, md));
+   }
+   ASSERT_EQ(DEVICE_BUFFER_OVERFLOW, pipeline.Drain());
+   ASSERT_EQ(3, pipeline.GetFailedImageCount());
+   ASSERT_EQ(3u, recorder.Published().size());
+
+   // The error is reported once, and no longer to the camera
+   recorder.SetPublishResult(DEVICE_OK);
+   ASSERT_EQ(DEVICE_OK, pipeline.Submit(0, &pixels[0], width, height, 1, 1, md));
+   ASSERT_EQ(DEVICE_OK, pipeline.Drain());
+   pipeline.Stop();
+}
+
+
+TEST(ImageProcessingPipelineTests, PublishErrorIsReportedToTheCamera)
+{
+   PipelineRecorder recorder;
+   mm::ImageProcessingPipeline pipeline(ProcessWith(recorder),
+         PublishWith(recorder));
+   pipeline.Start(2, 4);
+   recorder.SetPublishResult(DEVICE_BUFFER_OVERFLOW);
+
+   const MM::Device* camera = 0;
+   const MM::Device* otherCamera = reinterpret_cast<const MM::Device*>(&recorder);
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md;
+   pixels[0] = 0;
+   ASSERT_EQ(DEVICE_OK, pipeline.Submit(camera, &pixels[0], width, height, 1, 1, md));
+   for (int i = 0; i < 1000 && pipeline.GetFailedImageCount() == 0; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+   ASSERT_EQ(1, pipeline.GetFailedImageCount());
+   recorder.SetPublishResult(DEVICE_OK);
+
+   // Only to the camera of the frame, by its next frame, which is dropped
+   pixels[0] = 1;
+   ASSERT_EQ(DEVICE_OK, pipeline.Submit(otherCamera, &pixels[0], width, height, 1, 1, md));
+   pixels[0] = 2;
+   ASSERT_EQ(DEVICE_BUFFER_OVERFLOW, pipeline.Submit(camera, &pixels[0], width, height, 1, 1, md));
+   // Once: the camera inserts the frame again
+   ASSERT_EQ(DEVICE_OK, pipeline.Submit(camera, &pixels[0], width, height, 1, 1, md));
+
+   // Also for cameras that write into the pipeline. Drain() reports the
+   // errors of all cameras, whether or not they were reported to them
+   ASSERT_EQ(DEVICE_BUFFER_OVERFLOW, pipeline.Drain());
+   recorder.SetPublishResult(DEVICE_BUFFER_OVERFLOW);
+   pixels[0] = 3;
+   ASSERT_EQ(DEVICE_OK, pipeline.Submit(camera, &pixels[0], width, height, 1, 1, md));
+   for (int i = 0; i < 1000 && pipeline.GetFailedImageCount() == 1; ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+   ASSERT_EQ(2, pipeline.GetFailedImageCount());
+   recorder.SetPublishResult(DEVICE_OK);
+   unsigned char* buffer = pipeline.AcquireBuffer(camera, width, height, 1, 1);
+   ASSERT_TRUE(buffer != 0);
+   buffer[0] = 4;
+   ASSERT_EQ(DEVICE_BUFFER_OVERFLOW, pipeline.CommitBuffer(camera, md, false));
+   ASSERT_FALSE(pipeline.HasAcquiredBuffer(camera));
+   pixels[0] = 5;
+   ASSERT_EQ(DEVICE_OK, pipeline.Submit(camera, &pixels[0], width, height, 1, 1, md));
+
+   ASSERT_EQ(DEVICE_BUFFER_OVERFLOW, pipeline.Drain());
+   std::vector<unsigned char> published = recorder.Published();
+   ASSERT_EQ(5u, published.size());
+   ASSERT_EQ(0, published[0]);
+   ASSERT_EQ(1, published[1]);
+   ASSERT_EQ(2, published[2]);
+   ASSERT_EQ(3, published[3]);
+   ASSERT_EQ(5, published[4]);
+   pipeline.Stop();
+}
+
+
+namespace {
+
+void DrainFrom(mm::ImageProcessingPipeline* pipeline, const MM::Device* caller)
+{
+   pipeline->Drain(caller);
+}
+
+} // anonymous namespace
+
+TEST(ImageProcessingPipelineTests, DrainSkipsTheCallersAcquiredBuffer)
+{
+   PipelineRecorder recorder;
+   mm::ImageProcessingPipeline pipeline(ProcessWith(recorder),
+         PublishWith(recorder));
+   pipeline.Start(2, 4);
+
+   // A camera that clears the buffer while holding an acquired buffer (as
+   // CoreCallback::ClearImageBuffer() drains) must not wait for itself
+   const MM::Device* camera = reinterpret_cast<const MM::Device*>(&recorder);
+   std::vector<unsigned char> pixels(width * height);
+   Metadata md;
+   pixels[0] = 7;
+   pipeline.Submit(camera, &pixels[0], width, height, 1, 1, md);
+   unsigned char* buffer = pipeline.AcquireBuffer(camera, width, height, 1, 1);
+   ASSERT_TRUE(buffer != 0);
+   buffer[0] = 8;
+   // Frames queued after the acquired buffer (here from another camera)
+   // are not waited for either
+   boost::atomic<unsigned> submitted(0);
+   boost::thread other(boost::bind(&SubmitFrames, &pipeline, 1u, &submitted));
+
+   boost::thread drain(boost::bind(&DrainFrom, &pipeline, camera));
+   ASSERT_TRUE(drain.timed_join(boost::posix_time::seconds(10)));
+   ASSERT_EQ(1u, recorder.Published().size());
+   ASSERT_EQ(7, recorder.Published()[0]);
+
+   ASSERT_EQ(DEVICE_OK, pipeline.CommitBuffer(camera, md, false));
+   other.join();
+   pipeline.Drain();
+   ASSERT_EQ(3u, recorder.Published().size());
+   ASSERT_EQ(8, recorder.Published()[1]);
+   pipeline.Stop();
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -0,0 +1,361 @@
+// A minimal camera adapter, loaded by the tests that exercise the Core
+// through its public API (see Makefile.am).
+
+#include "../../MMDevice/DeviceBase.h"
+#include "../../MMDevice/ImgBuffer.h"
+#include "../../MMDevice/ModuleInterface.h"
+
+#include <boost/atomic.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+const char* const g_CameraName = "MockCamera";
+const char* const g_ProcessorName = "MockProcessor";
+const char* const g_InitializeImageBuffer = "InitializeImageBuffer";
+const char* const g_InsertWith = "InsertWith";
+const char* const g_Channels = "Channels";
+const char* const g_ImagesSnapped = "ImagesSnapped";
+const char* const g_ConcurrentCalls = "ConcurrentCalls";
+const char* const g_AddOne = "AddOne";
+const char* const g_FailStart = "FailStart";
+const char* const g_Sequence = "Sequence";
+const char* const g_SequenceResult = "SequenceResult";
+const char* const g_FailTranspose = "FailTranspose";
+
+} // anonymous namespace
+
+
+// Inserts the requested number of images synchronously, from within
+// StartSequenceAcquisition(), so that the tests need not wait for them.
+// Each image is filled with its index in the sequence (plus 10 times the
+// channel index, for multi-channel images, which are inserted with
+// InsertMultiChannel(), unless InsertWith is Slot). With InsertWith Slot,
+// images are read into a slot of the buffer, as by the default ThreadRun()
+// of a camera that can read images in place. Overflows are handled as
+// DemoCamera does: the acquisition stops, or the buffer is cleared and the
+// image inserted again.
+class MockCamera : public CCameraBase<MockCamera>
+{
+public:
+   MockCamera() : width_(32), height_(32), channels_(1), exposureMs_(1.0),
+      imageCount_(0)
+   {}
+
+   int Initialize()
+   {
+      CreateProperty(g_InitializeImageBuffer, "No", MM::String, false);
+      AddAllowedValue(g_InitializeImageBuffer, "No");
+      AddAllowedValue(g_InitializeImageBuffer, "Yes");
+      CreateProperty(g_InsertWith, "Pixels", MM::String, false);
+      AddAllowedValue(g_InsertWith, "Pixels");
+      AddAllowedValue(g_InsertWith, "ImgBuffer");
+      AddAllowedValue(g_InsertWith, "Slot");
+      CreateIntegerProperty(g_Channels, 1, false,
+            new CPropertyAction(this, &MockCamera::OnChannels));
+      AddAllowedValue(g_Channels, "1");
+      AddAllowedValue(g_Channels, "2");
+      CreateIntegerProperty(g_ImagesSnapped, 0, true,
+            new CPropertyAction(this, &MockCamera::OnImagesSnapped));
+      CreateProperty(g_FailStart, "No", MM::String, false);
+      AddAllowedValue(g_FailStart, "No");
+      AddAllowedValue(g_FailStart, "Yes");
+      pixels_.resize(channels_ * width_ * height_);
+      return DEVICE_OK;
+   }
+
+   int Shutdown() { return DEVICE_OK; }
+   void GetName(char* name) const { CDeviceUtils::CopyLimitedString(name, g_CameraName); }
+
+   int SnapImage()
+   {
+      const size_t channelSize = width_ * height_;
+      for (unsigned i = 0; i < channels_; ++i)
+         std::fill(pixels_.begin() + i * channelSize,
+               pixels_.begin() + (i + 1) * channelSize,
+               (unsigned char)(imageCount_ + 10 * i));
+      ++imageCount_;
+      return DEVICE_OK;
+   }
+
+   const unsigned char* GetImageBuffer() { return &pixels_[0]; }
+   const unsigned char* GetImageBuffer(unsigned channel)
+   {
+      return channel < channels_ ? &pixels_[channel * width_ * height_] : 0;
+   }
+   unsigned GetNumberOfChannels() const { return channels_; }
+   bool CanReadImageInto() { return true; }
+   int ReadImageInto(unsigned char* pixels)
+   {
+      std::copy(pixels_.begin(), pixels_.begin() + width_ * height_, pixels);
+      return DEVICE_OK;
+   }
+   unsigned GetImageWidth() const { return width_; }
+   unsigned GetImageHeight() const { return height_; }
+   unsigned GetImageBytesPerPixel() const { return 1; }
+   unsigned GetBitDepth() const { return 8; }
+   long GetImageBufferSize() const { return width_ * height_; }
+   double GetExposure() const { return exposureMs_; }
+   void SetExposure(double exposureMs) { exposureMs_ = exposureMs; }
+   int GetBinning() const { return 1; }
+   int SetBinning(int binning) { return binning == 1 ? DEVICE_OK : DEVICE_INVALID_PROPERTY_VALUE; }
+   int IsExposureSequenceable(bool& sequenceable) const { sequenceable = false; return DEVICE_OK; }
+
+   int SetROI(unsigned, unsigned, unsigned xSize, unsigned ySize)
+   {
+      width_ = xSize;
+      height_ = ySize;
+      pixels_.resize(channels_ * width_ * height_);
+      return DEVICE_OK;
+   }
+
+   int GetROI(unsigned& x, unsigned& y, unsigned& xSize, unsigned& ySize)
+   {
+      x = y = 0;
+      xSize = width_;
+      ySize = height_;
+      return DEVICE_OK;
+   }
+
+   int ClearROI() { return SetROI(0, 0, 32, 32); }
+
+   int StartSequenceAcquisition(long numImages, double, bool stopOnOverflow)
+   {
+      char value[MM::MaxStrLength];
+      GetProperty(g_FailStart, value);
+      if (std::string(value) == "Yes")
+         return DEVICE_ERR;
+      GetProperty(g_InitializeImageBuffer, value);
+      if (std::string(value) == "Yes" &&
+            !GetCoreCallback()->InitializeImageBuffer(channels_, 1, width_,
+               height_, 1))
+         return DEVICE_ERR;
+
+      imageCount_ = 0;
+      int ret = DEVICE_OK;
+      for (long i = 0; i < numImages && ret == DEVICE_OK; ++i)
+      {
+         SnapImage();
+         ret = Insert(true);
+         if (ret == DEVICE_BUFFER_OVERFLOW && !stopOnOverflow)
+         {
+            GetCoreCallback()->ClearImageBuffer(this);
+            ret = Insert(false);
+         }
+      }
+      // An acquisition that stopped early still started
+      GetCoreCallback()->AcqFinished(this, ret);
+      return DEVICE_OK;
+   }
+
+   // Continuous acquisitions insert no images
+   int StartSequenceAcquisition(double) { return DEVICE_OK; }
+   int StopSequenceAcquisition() { return DEVICE_OK; }
+   bool IsCapturing() { return false; }
+
+   int OnChannels(MM::PropertyBase* pProp, MM::ActionType eAct)
+   {
+      if (eAct == MM::BeforeGet)
+      {
+         pProp->Set((long)channels_);
+      }
+      else if (eAct == MM::AfterSet)
+      {
+         long channels;
+         pProp->Get(channels);
+         channels_ = (unsigned)channels;
+         pixels_.resize(channels_ * width_ * height_);
+      }
+      return DEVICE_OK;
+   }
+
+   int OnImagesSnapped(MM::PropertyBase* pProp, MM::ActionType eAct)
+   {
+      if (eAct == MM::BeforeGet)
+         pProp->Set(imageCount_);
+      return DEVICE_OK;
+   }
+
+private:
+   int Insert(bool process)
+   {
+      char value[MM::MaxStrLength];
+      GetProperty(g_InsertWith, value);
+      if (std::string(value) == "Slot")
+         return InsertImageInPlace();
+      if (channels_ > 1)
+         return GetCoreCallback()->InsertMultiChannel(this, &pixels_[0],
+               channels_, width_, height_, 1);
+
+      if (std::string(value) == "ImgBuffer")
+      {
+         // Always processed
+         ImgBuffer image(width_, height_, 1);
+         image.SetPixels(&pixels_[0]);
+         return GetCoreCallback()->InsertImage(this, image);
+      }
+      return GetCoreCallback()->InsertImage(this, &pixels_[0], width_,
+            height_, 1, (const Metadata*)0, process);
+   }
+
+   unsigned width_;
+   unsigned height_;
+   unsigned channels_;
+   double exposureMs_;
+   long imageCount_;
+   std::vector<unsigned char> pixels_;
+};
+
+
+// Adds one to each pixel if AddOne is Yes, and records whether it was ever
+// called concurrently (calls take long enough for this to show). Setting
+// Sequence to Start or Stop starts or stops a sequence acquisition of 3
+// images through the Core callback, as an autofocus device would; the
+// result is in SequenceResult.
+class MockProcessor : public CImageProcessorBase<MockProcessor>
+{
+public:
+   MockProcessor() : addOne_(false), failTranspose_(false), calls_(0),
+      concurrentCalls_(0), sequenceResult_(DEVICE_OK)
+   {}
+
+   int Initialize()
+   {
+      CreateProperty(g_AddOne, "No", MM::String, false,
+            new CPropertyAction(this, &MockProcessor::OnAddOne));
+      AddAllowedValue(g_AddOne, "No");
+      AddAllowedValue(g_AddOne, "Yes");
+      CreateProperty(g_FailTranspose, "No", MM::String, false,
+            new CPropertyAction(this, &MockProcessor::OnFailTranspose));
+      AddAllowedValue(g_FailTranspose, "No");
+      AddAllowedValue(g_FailTranspose, "Yes");
+      CreateIntegerProperty(g_ConcurrentCalls, 0, true,
+            new CPropertyAction(this, &MockProcessor::OnConcurrentCalls));
+      CreateProperty(g_Sequence, "Stop", MM::String, false,
+            new CPropertyAction(this, &MockProcessor::OnSequence));
+      AddAllowedValue(g_Sequence, "Start");
+      AddAllowedValue(g_Sequence, "Stop");
+      CreateIntegerProperty(g_SequenceResult, DEVICE_OK, true,
+            new CPropertyAction(this, &MockProcessor::OnSequenceResult));
+      return DEVICE_OK;
+   }
+
+   int Shutdown() { return DEVICE_OK; }
+   void GetName(char* name) const { CDeviceUtils::CopyLimitedString(name, g_ProcessorName); }
+   bool Busy() { return false; }
+
+   int Process(unsigned char* pixels, unsigned width, unsigned height,
+         unsigned byteDepth)
+   {
+      if (++calls_ > 1)
+         ++concurrentCalls_;
+      if (addOne_)
+         for (unsigned i = 0; i < width * height * byteDepth; ++i)
+            ++pixels[i];
+      CDeviceUtils::SleepMs(2);
+      --calls_;
+      return failTranspose_ ? DEVICE_ERR : DEVICE_OK;
+   }
+
+   // With FailTranspose, behaves as a transposing processor whose Process()
+   // fails before touching the image
+   int GetOutputImageSize(unsigned width, unsigned height, unsigned,
+         unsigned& outWidth, unsigned& outHeight)
+   {
+      outWidth = failTranspose_ ? height : width;
+      outHeight = failTranspose_ ? width : height;
+      return DEVICE_OK;
+   }
+
+   int OnConcurrentCalls(MM::PropertyBase* pProp, MM::ActionType eAct)
+   {
+      if (eAct == MM::BeforeGet)
+         pProp->Set(concurrentCalls_.load());
+      return DEVICE_OK;
+   }
+
+   int OnSequence(MM::PropertyBase* pProp, MM::ActionType eAct)
+   {
+      if (eAct == MM::AfterSet)
+      {
+         std::string value;
+         pProp->Get(value);
+         if (value == "Start")
+            sequenceResult_ = GetCoreCallback()->StartSequenceAcquisition(
+                  this, 3, 0.0);
+         else
+            sequenceResult_ = GetCoreCallback()->StopSequenceAcquisition(this);
+      }
+      return DEVICE_OK;
+   }
+
+   int OnSequenceResult(MM::PropertyBase* pProp, MM::ActionType eAct)
+   {
+      if (eAct == MM::BeforeGet)
+         pProp->Set((long)sequenceResult_);
+      return DEVICE_OK;
+   }
+
+   int OnAddOne(MM::PropertyBase* pProp, MM::ActionType eAct)
+   {
+      if (eAct == MM::BeforeGet)
+      {
+         pProp->Set(addOne_ ? "Yes" : "No");
+      }
+      else if (eAct == MM::AfterSet)
+      {
+         std::string value;
+         pProp->Get(value);
+         addOne_ = (value == "Yes");
+      }
+      return DEVICE_OK;
+   }
+
+   int OnFailTranspose(MM::PropertyBase* pProp, MM::ActionType eAct)
+   {
+      if (eAct == MM::BeforeGet)
+      {
+         pProp->Set(failTranspose_ ? "Yes" : "No");
+      }
+      else if (eAct == MM::AfterSet)
+      {
+         std::string value;
+         pProp->Get(value);
+         failTranspose_ = (value == "Yes");
+      }
+      return DEVICE_OK;
+   }
+
+private:
+   bool addOne_;
+   bool failTranspose_;
+   boost::atomic<long> calls_;
+   boost::atomic<long> concurrentCalls_;
+   int sequenceResult_;
+};
+
+
+MODULE_API void InitializeModuleData()
+{
+   RegisterDevice(g_CameraName, MM::CameraDevice, "Camera for the Core tests");
+   RegisterDevice(g_ProcessorName, MM::ImageProcessorDevice,
+         "Image processor for the Core tests");
+}
+
+MODULE_API MM::Device* CreateDevice(const char* deviceName)
+{
+   if (deviceName != 0 && std::string(deviceName) == g_CameraName)
+      return new MockCamera();
+   if (deviceName != 0 && std::string(deviceName) == g_ProcessorName)
+      return new MockProcessor();
+   return 0;
+}
+
+MODULE_API void DeleteDevice(MM::Device* pDevice)
+{
+   delete pDevice;
+}
@@ -387,9 +387,8 @@
 // change default SWIG mapping of void* return values
 // to return CObject containing array of pixel values
 //
-// Assumes that class has the following methods defined:
-// unsigned GetImageWidth()
-// unsigned GetImageHeight()
+// Assumes that class has the following method defined:
+// void getImageDimensions(const void*, unsigned&, unsigned&, unsigned&, unsigned&)
 
 %typemap(jni) void*        "jobject"
 %typemap(jtype) void*      "Object"
@@ -399,9 +398,11 @@
 }
 %typemap(out) void*
 {
-   long lSize = (arg1)->getImageWidth() * (arg1)->getImageHeight();
+   unsigned width, height, bytesPerPixel, numComponents;
+   (arg1)->getImageDimensions(result, width, height, bytesPerPixel, numComponents);
+   long lSize = width * height;
    
-   if ((arg1)->getBytesPerPixel() == 1)
+   if (bytesPerPixel == 1)
    {
       // create a new byte[] object in Java
       jbyteArray data = JCALL1(NewByteArray, jenv, lSize);
@@ -420,7 +421,7 @@
 
       $result = data;
    }
-   else if ((arg1)->getBytesPerPixel() == 2)
+   else if (bytesPerPixel == 2)
    {
       // create a new short[] object in Java
       jshortArray data = JCALL1(NewShortArray, jenv, lSize);
@@ -438,9 +439,9 @@
 
       $result = data;
    }
-   else if ((arg1)->getBytesPerPixel() == 4)
+   else if (bytesPerPixel == 4)
    {
-      if ((arg1)->getNumberOfComponents() == 1)
+      if (numComponents == 1)
       {
          // create a new float[] object in Java
          jfloatArray data = JCALL1(NewFloatArray, jenv, lSize);
@@ -479,7 +480,7 @@
          $result = data;
       }
    }
-   else if ((arg1)->getBytesPerPixel() == 8)
+   else if (bytesPerPixel == 8)
    {
       // create a new short[] object in Java
       jshortArray data = JCALL1(NewShortArray, jenv, lSize * 4);
@@ -628,6 +629,9 @@
 %ignore MetadataKeyError;
 %ignore MetadataIndexError;
 
+// Used by the void* typemap only
+%ignore CMMCore::getImageDimensions;
+
 
 %typemap(javaimports) CMMCore %{
    import mmcorej.org.json.JSONObject;
@@ -57,30 +57,32 @@ import_array();
 
 %typemap(out) void*
 {
+   unsigned width, height, bytesPerPixel, numComponents;
+   (arg1)->getImageDimensions(result, width, height, bytesPerPixel, numComponents);
    npy_intp dims[2];
-   dims[0] = (arg1)->getImageHeight();
-   dims[1] = (arg1)->getImageWidth();
+   dims[0] = height;
+   dims[1] = width;
    npy_intp pixelCount = dims[0] * dims[1];
 
-   if ((arg1)->getBytesPerPixel() == 1)
+   if (bytesPerPixel == 1)
    {
       PyObject * numpyArray = PyArray_SimpleNew(2, dims, NPY_UINT8);
       memcpy(PyArray_DATA((PyArrayObject *) numpyArray), result, pixelCount);
       $result = numpyArray;
    }
-   else if ((arg1)->getBytesPerPixel() == 2)
+   else if (bytesPerPixel == 2)
    {
       PyObject * numpyArray = PyArray_SimpleNew(2, dims, NPY_UINT16);
       memcpy(PyArray_DATA((PyArrayObject *) numpyArray), result, pixelCount * 2);
       $result = numpyArray;
    }
-   else if ((arg1)->getBytesPerPixel() == 4)
+   else if (bytesPerPixel == 4)
    {
       PyObject * numpyArray = PyArray_SimpleNew(2, dims, NPY_UINT32);
       memcpy(PyArray_DATA((PyArrayObject *) numpyArray), result, pixelCount * 4);
       $result = numpyArray;
    }
-   else if ((arg1)->getBytesPerPixel() == 8)
+   else if (bytesPerPixel == 8)
    {
       PyObject * numpyArray = PyArray_SimpleNew(2, dims, NPY_UINT64);
       memcpy(PyArray_DATA((PyArrayObject *) numpyArray), result, pixelCount * 8);
@@ -210,6 +212,9 @@ PyObject *setSLMImage_pywrap(const char* slmLabel, char *pixels, int receivedLen
 }
 %ignore setSLMImage;
 
+// Used by the void* typemap only
+%ignore CMMCore::getImageDimensions;
+
 %{
 #define SWIG_FILE_WITH_INIT
 #include "../MMDevice/MMDeviceConstants.h"
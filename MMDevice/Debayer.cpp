@@ -24,10 +24,260 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "Debayer.h"
+#include "RowBands.h"
 #include <math.h>
 #include <assert.h>
 using namespace std;
 
+namespace {
+
+// Sites of the 2x2 Bayer tile. "Red" is the colour stored in the third byte
+// of the RGB32 output pixel and "blue" the one stored in the first byte.
+enum BayerSite
+{
+   SiteRed,
+   SiteBlue,
+   SiteGreenInRedRow,
+   SiteGreenInBlueRow
+};
+
+// Returns the site of the pixel with the given coordinate parities, for the
+// row order index. The placement of the colours matches ReplicateDecode().
+BayerSite GetBayerSite(int xOdd, int yOdd, int rowOrder)
+{
+   // Position of the red site in the tile, by row order
+   static const int redX[4] = { 0, 1, 0, 1 };
+   static const int redY[4] = { 0, 1, 1, 0 };
+   bool redColumn = (xOdd == redX[rowOrder]);
+   bool redRow = (yOdd == redY[rowOrder]);
+   if (redRow)
+      return redColumn ? SiteRed : SiteGreenInRedRow;
+   return redColumn ? SiteGreenInBlueRow : SiteBlue;
+}
+
+// Mirrors a coordinate that falls outside 0..size-1 about the edge pixel,
+// which keeps the parity and therefore the colour of the site
+inline int Reflect(int i, int size)
+{
+   if (i < 0)
+      i = -i;
+   if (i >= size)
+      i = 2 * size - 2 - i;
+   return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+// Neighborhood access for pixels at least 2 pixels away from the edges
+template <typename T>
+class InteriorTaps
+{
+public:
+   InteriorTaps(const T* center, int width) : center_(center), width_(width) {}
+   int operator()(int dx, int dy) const { return center_[dy * width_ + dx]; }
+private:
+   const T* center_;
+   int width_;
+};
+
+// Neighborhood access for pixels near the edges
+template <typename T>
+class BorderTaps
+{
+public:
+   BorderTaps(const T* input, int x, int y, int width, int height) :
+      input_(input), x_(x), y_(y), width_(width), height_(height) {}
+   int operator()(int dx, int dy) const
+   {
+      return input_[Reflect(y_ + dy, height_) * width_ + Reflect(x_ + dx, width_)];
+   }
+private:
+   const T* input_;
+   int x_, y_, width_, height_;
+};
+
+// Bilinear interpolation of the two missing colours
+struct BilinearKernel
+{
+   template <class Taps>
+   static void Interpolate(const Taps& p, BayerSite site, int& red, int& green, int& blue)
+   {
+      int c = p(0, 0);
+      switch (site)
+      {
+         case SiteRed:
+         case SiteBlue:
+         {
+            int cross = (p(0, -1) + p(-1, 0) + p(1, 0) + p(0, 1) + 2) >> 2;
+            int diagonal = (p(-1, -1) + p(1, -1) + p(-1, 1) + p(1, 1) + 2) >> 2;
+            green = cross;
+            red = site == SiteRed ? c : diagonal;
+            blue = site == SiteRed ? diagonal : c;
+            break;
+         }
+         case SiteGreenInRedRow:
+         case SiteGreenInBlueRow:
+         default:
+         {
+            int horizontal = (p(-1, 0) + p(1, 0) + 1) >> 1;
+            int vertical = (p(0, -1) + p(0, 1) + 1) >> 1;
+            green = c;
+            red = site == SiteGreenInRedRow ? horizontal : vertical;
+            blue = site == SiteGreenInRedRow ? vertical : horizontal;
+            break;
+         }
+      }
+   }
+};
+
+// Gradient-corrected linear interpolation: H. S. Malvar, L. He and R. Cutler,
+// "High-quality linear interpolation for demosaicing of Bayer-patterned color
+// images", ICASSP 2004. The 5x5 filter coefficients are scaled by 16.
+struct MalvarKernel
+{
+   static int Scale(int v) { return v < 0 ? 0 : (v + 8) >> 4; }
+
+   template <class Taps>
+   static void Interpolate(const Taps& p, BayerSite site, int& red, int& green, int& blue)
+   {
+      int c = p(0, 0);
+      int diagonal = p(-1, -1) + p(1, -1) + p(-1, 1) + p(1, 1);
+      switch (site)
+      {
+         case SiteRed:
+         case SiteBlue:
+         {
+            int cross = p(0, -1) + p(-1, 0) + p(1, 0) + p(0, 1);
+            int outer = p(0, -2) + p(-2, 0) + p(2, 0) + p(0, 2);
+            green = Scale(8 * c + 4 * cross - 2 * outer);
+            int opposite = Scale(12 * c + 4 * diagonal - 3 * outer);
+            red = site == SiteRed ? c : opposite;
+            blue = site == SiteRed ? opposite : c;
+            break;
+         }
+         case SiteGreenInRedRow:
+         case SiteGreenInBlueRow:
+         default:
+         {
+            int outerH = p(-2, 0) + p(2, 0);
+            int outerV = p(0, -2) + p(0, 2);
+            int horizontal = Scale(10 * c + 8 * (p(-1, 0) + p(1, 0)) -
+                  2 * outerH - 2 * diagonal + outerV);
+            int vertical = Scale(10 * c + 8 * (p(0, -1) + p(0, 1)) -
+                  2 * outerV - 2 * diagonal + outerH);
+            green = c;
+            red = site == SiteGreenInRedRow ? horizontal : vertical;
+            blue = site == SiteGreenInRedRow ? vertical : horizontal;
+            break;
+         }
+      }
+   }
+};
+
+inline unsigned char ToByte(int v, int bitShift)
+{
+   v >>= bitShift;
+   return (unsigned char)(v > 255 ? 255 : v);
+}
+
+// Demosaics a band of rows; rows read from the whole input image
+template <typename T, class Kernel>
+class InterpolateTask : public RowBandTask
+{
+public:
+   InterpolateTask(const T* input, int* output, int width, int height,
+         int bitShift, int rowOrder) :
+      input_(input), output_(output), width_(width), height_(height),
+      bitShift_(bitShift), rowOrder_(rowOrder)
+   {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      for (int y = (int)beginRow; y < (int)endRow; ++y)
+      {
+         BayerSite evenSite = GetBayerSite(0, y & 1, rowOrder_);
+         BayerSite oddSite = GetBayerSite(1, y & 1, rowOrder_);
+         if (y < 2 || y >= height_ - 2 || width_ < 5)
+         {
+            for (int x = 0; x < width_; ++x)
+               Border(x, y, (x & 1) ? oddSite : evenSite);
+            continue;
+         }
+
+         Border(0, y, evenSite);
+         Border(1, y, oddSite);
+         const T* in = input_ + y * width_;
+         int* out = output_ + y * width_;
+         // Dispatch once per row, so that the site is known at compile time
+         // in the inner loop
+         switch (evenSite)
+         {
+            case SiteRed:
+               InteriorRow<SiteRed, SiteGreenInRedRow>(in, out);
+               break;
+            case SiteGreenInRedRow:
+               InteriorRow<SiteGreenInRedRow, SiteRed>(in, out);
+               break;
+            case SiteBlue:
+               InteriorRow<SiteBlue, SiteGreenInBlueRow>(in, out);
+               break;
+            case SiteGreenInBlueRow:
+               InteriorRow<SiteGreenInBlueRow, SiteBlue>(in, out);
+               break;
+         }
+         for (int x = width_ - 2; x < width_; ++x)
+            Border(x, y, (x & 1) ? oddSite : evenSite);
+      }
+   }
+
+private:
+   // Pixels 2 to width - 3 of a row that is not within 2 rows of the edges
+   template <BayerSite EvenSite, BayerSite OddSite>
+   void InteriorRow(const T* in, int* out)
+   {
+      int x = 2;
+      for (; x + 1 < width_ - 2; x += 2)
+      {
+         Interior(in, out, x, EvenSite);
+         Interior(in, out, x + 1, OddSite);
+      }
+      if (x < width_ - 2)
+         Interior(in, out, x, EvenSite);
+   }
+
+   void Interior(const T* in, int* out, int x, BayerSite site)
+   {
+      int red, green, blue;
+      Kernel::Interpolate(InteriorTaps<T>(in + x, width_), site, red, green, blue);
+      Store(out + x, red, green, blue);
+   }
+
+   void Border(int x, int y, BayerSite site)
+   {
+      int red, green, blue;
+      Kernel::Interpolate(BorderTaps<T>(input_, x, y, width_, height_), site,
+            red, green, blue);
+      Store(output_ + y * width_ + x, red, green, blue);
+   }
+
+   void Store(int* pixel, int red, int green, int blue)
+   {
+      unsigned char* bytePix = (unsigned char*)pixel;
+      bytePix[0] = ToByte(blue, bitShift_);
+      bytePix[1] = ToByte(green, bitShift_);
+      bytePix[2] = ToByte(red, bitShift_);
+      bytePix[3] = 0;
+   }
+
+   const T* input_;
+   int* output_;
+   int width_;
+   int height_;
+   int bitShift_;
+   int rowOrder_;
+};
+
+} // anonymous namespace
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Debayer class implementation
 ///////////////////////////////////////////////////////////////////////////////
@@ -43,11 +293,12 @@ Debayer::Debayer()
    algorithms.push_back("Replication");
    algorithms.push_back("Bilinear");
    algorithms.push_back("Smooth-Hue");
-   algorithms.push_back("Adaptive-Smooth-Hue");
+   algorithms.push_back("Malvar-He-Cutler");
 
    // default settings
    orderIndex = 0; // RGRG ordering
    algoIndex = 0;  // replication - faster
+   threadCount = 0;
 }
 
 Debayer::~Debayer()
@@ -102,11 +353,11 @@ int Debayer::Convert(const T* input, int* output, int width, int height, int bit
 	if (algorithm == 0)
       ReplicateDecode(input, output, width, height, bitDepth, rowOrder);
 	else if (algorithm == 1)
-      return DEVICE_NOT_SUPPORTED;
+      return InterpolateDecode(input, output, width, height, bitDepth, rowOrder, false);
 	else if (algorithm == 2)
       SmoothDecode(input, output, width, height, bitDepth, rowOrder);
 	else if (algorithm == 3)
-      return DEVICE_NOT_SUPPORTED;
+      return InterpolateDecode(input, output, width, height, bitDepth, rowOrder, true);
    else
       return DEVICE_NOT_SUPPORTED;
 
@@ -136,6 +387,28 @@ unsigned short Debayer::GetPixel(const unsigned char* v, int x, int y, int width
       return v[y*width + x];
 }
 
+// Bilinear and Malvar-He-Cutler algorithms. Unlike the other algorithms,
+// these need no scratch buffers and run in parallel on bands of rows.
+template <typename T>
+int Debayer::InterpolateDecode(const T* input, int* output, int width, int height, int bitDepth, int rowOrder, bool highQuality)
+{
+   if (rowOrder < 0 || rowOrder > 3)
+      return DEVICE_NOT_SUPPORTED;
+
+   int bitShift = bitDepth > 8 ? bitDepth - 8 : 0;
+   if (highQuality)
+   {
+      InterpolateTask<T, MalvarKernel> task(input, output, width, height, bitShift, rowOrder);
+      CRowBands::Run(task, height, threadCount);
+   }
+   else
+   {
+      InterpolateTask<T, BilinearKernel> task(input, output, width, height, bitShift, rowOrder);
+      CRowBands::Run(task, height, threadCount);
+   }
+   return DEVICE_OK;
+}
+
 // Replication algorithm
 template <typename T>
 void Debayer::ReplicateDecode(const T* input, int* output, int width, int height, int bitDepth, int rowOrder)
@@ -47,6 +47,9 @@ public:
 
    void SetOrderIndex(int idx) {orderIndex = idx;}
    void SetAlgorithmIndex(int idx) {algoIndex = idx;}
+   // Number of threads used by the bilinear and Malvar-He-Cutler
+   // algorithms; 0 (the default) for one per processor
+   void SetThreadCount(int count) {threadCount = count;}
 
 private:
    template <typename T>
@@ -55,6 +58,8 @@ private:
    void ReplicateDecode(const T* input, int* out, int width, int height, int bitDepth, int rowOrder);
    template <typename T>
    void SmoothDecode(const T* input, int* output, int width, int height, int bitDepth, int rowOrder);
+   template <typename T>
+   int InterpolateDecode(const T* input, int* output, int width, int height, int bitDepth, int rowOrder, bool highQuality);
    template<typename T>
    int Convert(const T* input, int* output, int width, int height, int bitDepth, int rowOrder, int algorithm);
    unsigned short GetPixel(const unsigned short* v, int x, int y, int width, int height);
@@ -70,6 +75,7 @@ private:
 
    int orderIndex;
    int algoIndex;
+   int threadCount;
 };
 
 #endif // !defined(_DEBAYER_)
@@ -1313,7 +1313,7 @@ public:
    virtual unsigned GetImageBytesPerPixel() const = 0;
    virtual int SnapImage() = 0;
 
-   CCameraBase() : busy_(false), stopWhenCBOverflows_(false), thd_(0)
+   CCameraBase() : busy_(false), stopWhenCBOverflows_(false), tagsRevision_(0), thd_(0)
    {
       // create and initialize common transpose properties
       std::vector<std::string> allowedValues;
@@ -1423,6 +1423,7 @@ public:
     */
    virtual void GetTags(char* serializedMetadata)
    {
+      MMThreadGuard g(tagsLock_);
       std::string data = metadata_.Serialize();
       data.copy(serializedMetadata, data.size(), 0);
    }
@@ -1480,13 +1481,23 @@ public:
 
    virtual void AddTag(const char* key, const char* deviceLabel, const char* value)
    {
+      MMThreadGuard g(tagsLock_);
       metadata_.PutTag(key, deviceLabel, value);
+      ++tagsRevision_;
    }
 
 
    virtual void RemoveTag(const char* key)
    {
+      MMThreadGuard g(tagsLock_);
       metadata_.RemoveTag(key);
+      ++tagsRevision_;
+   }
+
+   virtual long GetTagsRevision()
+   {
+      MMThreadGuard g(tagsLock_);
+      return tagsRevision_;
    }
 
    virtual bool SupportsMultiROI()
@@ -1524,14 +1535,31 @@ protected:
 
    virtual std::vector<std::string> GetTagKeys()
    {
+      MMThreadGuard g(tagsLock_);
       return metadata_.GetKeys();
    }
 
    virtual std::string GetTagValue(const char* key)
    {
+      MMThreadGuard g(tagsLock_);
       return metadata_.GetSingleTag(key).GetValue();
    }
 
+   /**
+    * Zero-copy support for sequence acquisition. Cameras that can read out
+    * (render, DMA-transfer) an image directly into a caller-supplied buffer
+    * override both functions. The default ThreadRun() then reads each image
+    * straight into the Core's circular buffer instead of having the Core
+    * copy the buffer returned by GetImageBuffer().
+    */
+   virtual bool CanReadImageInto() { return false; }
+
+   /**
+    * Writes the image exposed by the preceding SnapImage() into pixels, which
+    * has room for GetImageBufferSize() bytes.
+    */
+   virtual int ReadImageInto(unsigned char* /*pixels*/) { return DEVICE_UNSUPPORTED_COMMAND; }
+
    // Do actual capturing
    // Called from inside the thread
    virtual int ThreadRun (void)
@@ -1542,7 +1570,10 @@ protected:
       {
          return ret;
       }
-      ret = InsertImage();
+      if (CanReadImageInto())
+         ret = InsertImageInPlace();
+      else
+         ret = InsertImage();
       if (ret != DEVICE_OK)
       {
          return ret;
@@ -1557,19 +1588,55 @@ protected:
       Metadata md;
       md.put("Camera", label);
       int ret = GetCoreCallback()->InsertImage(this, GetImageBuffer(), GetImageWidth(),
-         GetImageHeight(), GetImageBytesPerPixel(),
-         md.Serialize().c_str());
+         GetImageHeight(), GetImageBytesPerPixel(), &md);
       if (!stopWhenCBOverflows_ && ret == DEVICE_BUFFER_OVERFLOW)
       {
          // do not stop on overflow - just reset the buffer
          GetCoreCallback()->ClearImageBuffer(this);
          return GetCoreCallback()->InsertImage(this, GetImageBuffer(), GetImageWidth(),
-            GetImageHeight(), GetImageBytesPerPixel(),
-            md.Serialize().c_str());
+            GetImageHeight(), GetImageBytesPerPixel(), &md);
       } else
          return ret;
    }
 
+   /**
+    * Inserts the current image by reading it out directly into a slot of the
+    * Core's circular buffer (see CanReadImageInto()).
+    */
+   virtual int InsertImageInPlace()
+   {
+      char label[MM::MaxStrLength];
+      this->GetLabel(label);
+      Metadata md;
+      md.put("Camera", label);
+
+      unsigned char* pixels = 0;
+      int ret = GetCoreCallback()->AcquireImageSlot(this, GetImageWidth(),
+         GetImageHeight(), GetImageBytesPerPixel(), GetNumberOfComponents(),
+         &pixels);
+      // The buffer holds multi-channel images; copy the image instead
+      if (ret == DEVICE_UNSUPPORTED_COMMAND)
+         return InsertImage();
+      if (!stopWhenCBOverflows_ && ret == DEVICE_BUFFER_OVERFLOW)
+      {
+         // do not stop on overflow - just reset the buffer
+         GetCoreCallback()->ClearImageBuffer(this);
+         ret = GetCoreCallback()->AcquireImageSlot(this, GetImageWidth(),
+            GetImageHeight(), GetImageBytesPerPixel(), GetNumberOfComponents(),
+            &pixels);
+      }
+      if (ret != DEVICE_OK)
+         return ret;
+
+      ret = ReadImageInto(pixels);
+      if (ret != DEVICE_OK)
+      {
+         GetCoreCallback()->AbortImageSlot(this);
+         return ret;
+      }
+      return GetCoreCallback()->CommitImageSlot(this, &md);
+   }
+
    virtual double GetIntervalMs() {return thd_->GetIntervalMs();}
    virtual long GetImageCounter() {return thd_->GetImageCounter();}
    virtual long GetNumberOfImages() {return thd_->GetNumberOfImages();}
@@ -1721,7 +1788,11 @@ private:
 
    bool busy_;
    bool stopWhenCBOverflows_;
+   // Tags are set by property handlers and read by the sequence thread;
+   // tagsLock_ guards metadata_ and tagsRevision_
    Metadata metadata_;
+   long tagsRevision_;
+   MMThreadLock tagsLock_;
 
    BaseSequenceThread * thd_;
    friend class BaseSequenceThread;
@@ -2077,6 +2148,22 @@ class CAutoFocusBase : public CDeviceBase<MM::AutoFocus, U>
 template <class U>
 class CImageProcessorBase : public CDeviceBase<MM::ImageProcessor, U>
 {
+public:
+   /**
+   * Default implementation: processors that need the whole image (e.g.
+   * neighborhood filters or flips across rows) are not band-safe.
+   */
+   virtual bool IsBandSafe() { return false; }
+
+   /**
+   * Default implementation: the image keeps its dimensions.
+   */
+   virtual int GetOutputImageSize(unsigned width, unsigned height, unsigned /*byteDepth*/, unsigned& outWidth, unsigned& outHeight)
+   {
+      outWidth = width;
+      outHeight = height;
+      return DEVICE_OK;
+   }
 };
 
 /**
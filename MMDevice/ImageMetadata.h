@@ -29,6 +29,7 @@
 #pragma warning( disable : 4290 )
 #endif
 
+#include "FixSnprintf.h"
 #include "MMDeviceConstants.h"
 
 #include <string>
@@ -37,6 +38,7 @@
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // MetadataError
@@ -262,77 +264,118 @@ private:
 
 /**
  * Container for all metadata associated with a single image.
+ *
+ * The tags are kept in a flat array sorted by qualified name, with all text
+ * (names, device labels and string values) stored in a single character
+ * arena. Copying a Metadata object therefore costs two allocations no
+ * matter how many tags it contains, and involves no virtual calls, so that
+ * it is safe to assign objects created in another module.
+ *
+ * The names of tags that the Core and most cameras add to every image (see
+ * KnownKey()) are not stored at all, but referred to by their index in a
+ * fixed table, and numeric values passed to PutTag() are stored as numbers
+ * and only formatted when read.
  */
 class Metadata
 {
 public:
 
-   Metadata() {} // empty constructor
+   Metadata() : garbage_(0) {} // empty constructor
 
-   ~Metadata() // destructor
-   {
-      Clear();
-   }
+   ~Metadata() {} // destructor
 
-   Metadata(const Metadata& original) // copy constructor
+   Metadata(const Metadata& original) : // copy constructor
+      entries_(original.entries_),
+      arena_(original.arena_),
+      garbage_(original.garbage_)
    {
-      for (TagIterator it = original.tags_.begin(); it != original.tags_.end(); it++)
-      {
-         SetTag(*it->second);
-      }
    }
 
    void Clear() {
-      for (TagIterator it=tags_.begin(); it != tags_.end(); it++)
-         delete it->second;
-      tags_.clear();
+      entries_.clear();
+      arena_.clear();
+      garbage_ = 0;
    }
 
    std::vector<std::string> GetKeys() const
    {
       std::vector<std::string> keyList;
-      for (TagIterator it = tags_.begin(), end = tags_.end(); it != end; ++it)
-         keyList.push_back(it->first);
+      keyList.reserve(entries_.size());
+      for (size_t i = 0; i < entries_.size(); ++i)
+      {
+         size_t len;
+         const char* key = KeyOf(entries_[i], len);
+         keyList.push_back(std::string(key, len));
+      }
       return keyList;
    }
 
-   bool HasTag(const char* key)
+   bool HasTag(const char* key) const
    {
-      TagIterator it = tags_.find(key);
-      if (it != tags_.end())
-         return true;
-      else
-         return false;
+      return Find(key, strlen(key)) >= 0;
    }
    
    MetadataSingleTag GetSingleTag(const char* key) const throw (MetadataKeyError)
    {
-      MetadataTag* tag = FindTag(key);
-      const MetadataSingleTag* stag = tag->ToSingleTag();
-      return *stag;
+      const Entry& e = GetEntry(key);
+      if (e.type == ArrayValue)
+         throw MetadataKeyError();
+      MetadataSingleTag tag(NameOf(e).c_str(), Text(e.device).c_str(), e.readOnly);
+      tag.SetValue(ValueOf(e).c_str());
+      return tag;
    }
 
    MetadataArrayTag GetArrayTag(const char* key) const throw (MetadataKeyError)
    {
-      MetadataTag* tag = FindTag(key);
-      const MetadataArrayTag* atag = tag->ToArrayTag();
-      return *atag;
+      const Entry& e = GetEntry(key);
+      if (e.type != ArrayValue)
+         throw MetadataKeyError();
+      MetadataArrayTag tag;
+      tag.SetName(NameOf(e).c_str());
+      tag.SetDevice(Text(e.device).c_str());
+      tag.SetReadOnly(e.readOnly);
+      const char* p = arena_.data() + e.value.offset;
+      for (unsigned i = 0; i < e.arraySize; ++i)
+      {
+         tag.AddValue(p);
+         p += strlen(p) + 1;
+      }
+      return tag;
    }
 
    void SetTag(MetadataTag& tag)
    {
-      MetadataTag* newTag = tag.Clone();
-      RemoveTag(tag.GetQualifiedName().c_str());
-      tags_.insert(std::make_pair(tag.GetQualifiedName(), newTag));
+      const MetadataSingleTag* stag = tag.ToSingleTag();
+      const MetadataArrayTag* atag = tag.ToArrayTag();
+      if (!stag && !atag)
+         return;
+
+      size_t index = Insert(tag.GetName(), tag.GetDevice(), tag.IsReadOnly());
+      if (stag)
+      {
+         AssignString(index, stag->GetValue().data(), stag->GetValue().size());
+      }
+      else
+      {
+         std::string values;
+         for (size_t i = 0; i < atag->GetSize(); ++i)
+         {
+            values += atag->GetValue(i);
+            values += '\0';
+         }
+         AssignString(index, values.data(), values.size());
+         entries_[index].type = ArrayValue;
+         entries_[index].arraySize = (unsigned) atag->GetSize();
+      }
    }
 
    void RemoveTag(const char* key)
    {
-      TagIterator it = tags_.find(key);
-      if (it != tags_.end())
+      int index = Find(key, strlen(key));
+      if (index >= 0)
       {
-         delete it->second;
-         tags_.erase(key);
+         Discard(entries_[index]);
+         entries_.erase(entries_.begin() + index);
       }
    }
 
@@ -342,11 +385,7 @@ public:
    template <class anytype>
    void PutTag(std::string key, std::string deviceLabel, anytype value)
    {
-      std::stringstream os;
-      os << value;
-      MetadataSingleTag tag = MetadataSingleTag(key.c_str(), deviceLabel.c_str(), true);
-      tag.SetValue(os.str().c_str());
-      SetTag(tag);
+      AssignValue(Insert(key, deviceLabel, true), value);
    }
 
    /*
@@ -370,22 +409,31 @@ public:
 #ifndef SWIG
    Metadata& operator=(const Metadata& rhs)
    {
-      Clear();
-      
-      for (TagIterator it=rhs.tags_.begin(); it != rhs.tags_.end(); it++)
-      {
-         SetTag(*it->second);
-      }
-
+      entries_ = rhs.entries_;
+      arena_ = rhs.arena_;
+      garbage_ = rhs.garbage_;
       return *this;
    }
 #endif
 
    void Merge(const Metadata& newTags)
    {     
-      for (TagIterator it=newTags.tags_.begin(); it != newTags.tags_.end(); it++)
+      if (&newTags == this)
+         return;
+      if (entries_.empty())
+      {
+         *this = newTags;
+         return;
+      }
+      for (size_t i = 0; i < newTags.entries_.size(); ++i)
       {
-         SetTag(*it->second);
+         const Entry& src = newTags.entries_[i];
+         size_t index = Insert(newTags.NameOf(src), newTags.Text(src.device), src.readOnly);
+         if (src.type == StringValue || src.type == ArrayValue)
+            AssignString(index, newTags.arena_.data() + src.value.offset, src.value.length);
+         entries_[index].type = src.type;
+         entries_[index].number = src.number;
+         entries_[index].arraySize = src.arraySize;
       }
    }
 
@@ -393,30 +441,29 @@ public:
    {
       std::ostringstream os;
 
-      os << tags_.size();
-      for (TagIterator it = tags_.begin(); it != tags_.end(); it++)
+      os << entries_.size();
+      for (size_t i = 0; i < entries_.size(); ++i)
       {
-         std::string id("s");
-         if (it->second->ToArrayTag())
-            id = "a";
+         const Entry& e = entries_[i];
+         const bool isArray = (e.type == ArrayValue);
 
-         os << id << std::endl;
-         os << it->second->GetName() << std::endl << it->second->GetDevice() << std::endl;
-         os << (it->second->IsReadOnly() ? 1 : 0) << std::endl;
+         os << (isArray ? "a" : "s") << std::endl;
+         os << NameOf(e) << std::endl << Text(e.device) << std::endl;
+         os << (e.readOnly ? 1 : 0) << std::endl;
 
-         if (id.compare("s") == 0)
+         if (!isArray)
          {
-            const MetadataSingleTag* st = it->second->ToSingleTag();
-				std::string  s1 = st->GetValue();
-            os << s1 << std::endl;
+            os << ValueOf(e) << std::endl;
          }
          else
          {
-            const MetadataArrayTag* at = it->second->ToArrayTag();
-
-            os << (long) at->GetSize() << std::endl;
-            for (size_t i=0; i<at->GetSize(); i++)
-               os << at->GetValue(i) << std::endl;
+            os << (long) e.arraySize << std::endl;
+            const char* p = arena_.data() + e.value.offset;
+            for (unsigned j = 0; j < e.arraySize; ++j)
+            {
+               os << p << std::endl;
+               p += strlen(p) + 1;
+            }
          }
       }
 
@@ -434,46 +481,44 @@ public:
    {
       Clear();
 
-      std::istringstream is(stream);
-      size_t sz;
-      is >> sz;
+      const char* p = stream;
+      size_t sz = (size_t) strtoul(p, const_cast<char**>(&p), 10);
+      entries_.reserve(sz);
 
       for (size_t i=0; i<sz; i++)
       {
-         std::string id;
-         is >> id;
+         // Tag type, followed by the rest of its line
+         while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            ++p;
+         const char type = *p;
+         SkipLine(p);
 
-         if (id.compare("s") == 0)
+         if (type == 's')
          {
-
-            MetadataSingleTag ms;
-
-            readLine(is); // Read away empty line feed
-
-            ms.SetName(readLine(is).c_str());
-            ms.SetDevice(readLine(is).c_str());
-            ms.SetReadOnly(atoi(readLine(is).c_str()) == 1 ? true : false);
-            ms.SetValue(readLine(is).c_str());
-
-            MetadataTag* newTag = ms.Clone();
-            tags_.insert(std::make_pair(ms.GetQualifiedName(), newTag));
+            std::string name = ParseLine(p);
+            std::string device = ParseLine(p);
+            bool readOnly = (atoi(ParseLine(p).c_str()) == 1);
+            size_t index = Insert(name, device, readOnly);
+            const char* value = p;
+            size_t len = SkipLine(p);
+            AssignString(index, value, len);
          }
-         else if (id.compare("a") == 0)
+         else if (type == 'a')
          {
-            MetadataArrayTag as;
-
-            as.SetName(readLine(is).c_str());
-            as.SetDevice(readLine(is).c_str());
-            as.SetReadOnly(atoi(readLine(is).c_str()) == 1 ? true : false);
-
-            long sizea = atol(readLine(is).c_str());
+            std::string name = ParseLine(p);
+            std::string device = ParseLine(p);
+            bool readOnly = (atoi(ParseLine(p).c_str()) == 1);
+            long sizea = atol(ParseLine(p).c_str());
+            std::string values;
             for (long j=0; j<sizea; j++)
             {
-               as.AddValue(readLine(is).c_str());
+               values += ParseLine(p);
+               values += '\0';
             }
-
-            MetadataTag* newTag = as.Clone();
-            tags_.insert(std::make_pair(as.GetQualifiedName(), newTag));
+            size_t index = Insert(name, device, readOnly);
+            AssignString(index, values.data(), values.size());
+            entries_[index].type = ArrayValue;
+            entries_[index].arraySize = (unsigned) sizea;
          }
          else
          {
@@ -487,31 +532,366 @@ public:
    {
       std::ostringstream os;
 
-      os << tags_.size();
-      for (TagIterator it = tags_.begin(); it != tags_.end(); it++)
+      os << entries_.size();
+      for (size_t i = 0; i < entries_.size(); ++i)
       {
-         std::string id("s");
-         if (it->second->ToArrayTag())
-            id = "a";
-         std::string ser = it->second->Serialize();
-         os << id << " : " << ser << std::endl;
+         size_t len;
+         const char* key = KeyOf(entries_[i], len);
+         if (entries_[i].type == ArrayValue)
+            os << "a" << " : " << GetArrayTag(std::string(key, len).c_str()).Serialize() << std::endl;
+         else
+            os << "s" << " : " << GetSingleTag(std::string(key, len).c_str()).Serialize() << std::endl;
       }
 
       return os.str();
    }
 
+#ifndef SWIG
 private:
-   MetadataTag* FindTag(const char* key) const
+   enum ValueType
    {
-      TagIterator it = tags_.find(key);
-      if (it != tags_.end())
-         return it->second;
-      else
+      StringValue,
+      IntValue,
+      UIntValue,
+      DoubleValue,
+      ArrayValue
+   };
+
+   struct TextRef
+   {
+      unsigned offset;
+      unsigned length;
+   };
+
+   struct Entry
+   {
+      int keyId;        // Index of the qualified name in KnownKey(), or -1
+      TextRef key;      // Qualified name, if keyId < 0
+      TextRef name;     // Unused if nameIsKey
+      TextRef device;
+      bool nameIsKey;
+      bool readOnly;
+      unsigned char type;
+      unsigned arraySize;
+      TextRef value;    // String value, or NUL-terminated array values
+      union
+      {
+         long long i;
+         unsigned long long u;
+         double d;
+      } number;
+   };
+
+   /*
+    * Qualified names of tags that are pre-registered, so that they are not
+    * stored in each object. Must be kept sorted.
+    */
+   static const char* KnownKey(int id, size_t& len)
+   {
+      static const char* const keys[] = {
+         "Binning",            // MM::g_Keyword_Binning
+         "BitDepth",
+         "Camera",
+         "CameraChannelIndex",
+         "ElapsedTime-ms",     // MM::g_Keyword_Elapsed_Time_ms
+         "Exposure-ms",        // MM::g_Keyword_Meatdata_Exposure
+         "Height",
+         "ImageNumber",        // MM::g_Keyword_Metadata_ImageNumber
+         "PixelSizeUm",
+         "PixelType",          // MM::g_Keyword_PixelType
+         "ROI",
+         "ROI-X-start",        // MM::g_Keyword_Metadata_ROI_X
+         "ROI-Y-start",        // MM::g_Keyword_Metadata_ROI_Y
+         "Score",              // MM::g_Keyword_Metadata_Score
+         "StartTime-ms",       // MM::g_Keyword_Metadata_StartTime
+         "TimeReceivedByCore", // MM::g_Keyword_Metadata_TimeInCore
+         "Width",
+         0
+      };
+      if (id < 0)
+      {
+         len = sizeof(keys) / sizeof(keys[0]) - 1;
+         return 0;
+      }
+      len = strlen(keys[id]);
+      return keys[id];
+   }
+
+   static int CompareKeys(const char* a, size_t aLen, const char* b, size_t bLen)
+   {
+      int cmp = memcmp(a, b, aLen < bLen ? aLen : bLen);
+      if (cmp != 0)
+         return cmp;
+      return aLen < bLen ? -1 : (aLen > bLen ? 1 : 0);
+   }
+
+   static int FindKnownKey(const char* key, size_t len)
+   {
+      size_t count;
+      KnownKey(-1, count);
+      int lo = 0, hi = (int) count - 1;
+      while (lo <= hi)
+      {
+         int mid = (lo + hi) / 2;
+         size_t midLen;
+         const char* midKey = KnownKey(mid, midLen);
+         int cmp = CompareKeys(midKey, midLen, key, len);
+         if (cmp == 0)
+            return mid;
+         if (cmp < 0)
+            lo = mid + 1;
+         else
+            hi = mid - 1;
+      }
+      return -1;
+   }
+
+   std::string Text(const TextRef& ref) const
+   {
+      return std::string(arena_.data() + ref.offset, ref.length);
+   }
+
+   const char* KeyOf(const Entry& e, size_t& len) const
+   {
+      if (e.keyId >= 0)
+         return KnownKey(e.keyId, len);
+      len = e.key.length;
+      return arena_.data() + e.key.offset;
+   }
+
+   std::string NameOf(const Entry& e) const
+   {
+      if (e.nameIsKey)
+      {
+         size_t len;
+         const char* key = KeyOf(e, len);
+         return std::string(key, len);
+      }
+      return Text(e.name);
+   }
+
+   std::string ValueOf(const Entry& e) const
+   {
+      char buf[32];
+      switch (e.type)
+      {
+         case IntValue:
+            snprintf(buf, sizeof(buf), "%lld", e.number.i);
+            return buf;
+         case UIntValue:
+            snprintf(buf, sizeof(buf), "%llu", e.number.u);
+            return buf;
+         case DoubleValue:
+         {
+            std::ostringstream os;
+            os << e.number.d;
+            return os.str();
+         }
+         default:
+            return Text(e.value);
+      }
+   }
+
+   // Returns the index of the entry with the given qualified name, or -1
+   int Find(const char* key, size_t len) const
+   {
+      size_t pos = LowerBound(key, len);
+      if (pos < entries_.size())
+      {
+         size_t entryLen;
+         const char* entryKey = KeyOf(entries_[pos], entryLen);
+         if (CompareKeys(entryKey, entryLen, key, len) == 0)
+            return (int) pos;
+      }
+      return -1;
+   }
+
+   size_t LowerBound(const char* key, size_t len) const
+   {
+      size_t lo = 0, hi = entries_.size();
+      while (lo < hi)
+      {
+         size_t mid = (lo + hi) / 2;
+         size_t midLen;
+         const char* midKey = KeyOf(entries_[mid], midLen);
+         if (CompareKeys(midKey, midLen, key, len) < 0)
+            lo = mid + 1;
+         else
+            hi = mid;
+      }
+      return lo;
+   }
+
+   const Entry& GetEntry(const char* key) const
+   {
+      int index = Find(key, strlen(key));
+      if (index < 0)
          throw MetadataKeyError();
+      return entries_[index];
+   }
+
+   TextRef Store(const char* text, size_t len)
+   {
+      TextRef ref;
+      ref.offset = (unsigned) arena_.size();
+      ref.length = (unsigned) len;
+      arena_.append(text, len);
+      return ref;
+   }
+
+   // Accounts for the arena space of an entry that is no longer used
+   void Discard(const Entry& e)
+   {
+      if (e.keyId < 0)
+         garbage_ += e.key.length;
+      if (!e.nameIsKey)
+         garbage_ += e.name.length;
+      garbage_ += e.device.length;
+      if (e.type == StringValue || e.type == ArrayValue)
+         garbage_ += e.value.length;
+   }
+
+   // Rebuilds the arena without the unused space, once it is mostly unused
+   void Compact()
+   {
+      if (garbage_ < 1024 || garbage_ < arena_.size() / 2)
+         return;
+      std::string old;
+      old.swap(arena_);
+      arena_.reserve(old.size() - garbage_);
+      garbage_ = 0;
+      for (size_t i = 0; i < entries_.size(); ++i)
+      {
+         Entry& e = entries_[i];
+         if (e.keyId < 0)
+            e.key = Store(old.data() + e.key.offset, e.key.length);
+         if (!e.nameIsKey)
+            e.name = Store(old.data() + e.name.offset, e.name.length);
+         e.device = Store(old.data() + e.device.offset, e.device.length);
+         if (e.type == StringValue || e.type == ArrayValue)
+            e.value = Store(old.data() + e.value.offset, e.value.length);
+      }
+   }
+
+   /*
+    * Returns the index of the entry for the given tag, creating it (or
+    * clearing its value) as needed. The value of the returned entry is an
+    * empty string.
+    */
+   size_t Insert(const std::string& name, const std::string& device, bool readOnly)
+   {
+      Compact();
+
+      const bool imageTag = (device.compare("_") == 0);
+      std::string qualified;
+      if (!imageTag)
+         qualified = device + "-" + name;
+      const std::string& key = imageTag ? name : qualified;
+
+      size_t pos = LowerBound(key.data(), key.size());
+      bool exists = false;
+      if (pos < entries_.size())
+      {
+         size_t entryLen;
+         const char* entryKey = KeyOf(entries_[pos], entryLen);
+         exists = (CompareKeys(entryKey, entryLen, key.data(), key.size()) == 0);
+      }
+
+      if (exists)
+      {
+         Discard(entries_[pos]);
+      }
+      else
+      {
+         entries_.insert(entries_.begin() + pos, Entry());
+      }
+
+      Entry& e = entries_[pos];
+      e.keyId = FindKnownKey(key.data(), key.size());
+      if (e.keyId < 0)
+         e.key = Store(key.data(), key.size());
+      e.nameIsKey = imageTag;
+      if (!imageTag)
+         e.name = Store(name.data(), name.size());
+      e.device = Store(device.data(), device.size());
+      e.readOnly = readOnly;
+      e.type = StringValue;
+      e.arraySize = 0;
+      e.value.offset = (unsigned) arena_.size();
+      e.value.length = 0;
+      e.number.u = 0;
+      return pos;
+   }
+
+   void AssignString(size_t index, const char* value, size_t len)
+   {
+      TextRef ref = Store(value, len);
+      Entry& e = entries_[index];
+      e.type = StringValue;
+      e.value = ref;
+   }
+
+   // Skips to the start of the next line; returns the length of the line
+   static size_t SkipLine(const char*& p)
+   {
+      const char* start = p;
+      while (*p != '\0' && *p != '\n')
+         ++p;
+      size_t len = p - start;
+      if (*p == '\n')
+         ++p;
+      return len;
+   }
+
+   static std::string ParseLine(const char*& p)
+   {
+      const char* start = p;
+      size_t len = SkipLine(p);
+      return std::string(start, len);
+   }
+
+   template <class anytype>
+   void AssignValue(size_t index, const anytype& value)
+   {
+      std::ostringstream os;
+      os << value;
+      const std::string s = os.str();
+      AssignString(index, s.data(), s.size());
+   }
+
+   void AssignValue(size_t index, const std::string& value)
+   { AssignString(index, value.data(), value.size()); }
+   void AssignValue(size_t index, const char* value)
+   { AssignString(index, value, strlen(value)); }
+   void AssignValue(size_t index, int value) { AssignInteger(index, value); }
+   void AssignValue(size_t index, long value) { AssignInteger(index, value); }
+   void AssignValue(size_t index, long long value) { AssignInteger(index, value); }
+   void AssignValue(size_t index, unsigned value) { AssignUnsigned(index, value); }
+   void AssignValue(size_t index, unsigned long value) { AssignUnsigned(index, value); }
+   void AssignValue(size_t index, unsigned long long value) { AssignUnsigned(index, value); }
+   void AssignValue(size_t index, float value) { AssignValue(index, (double) value); }
+   void AssignValue(size_t index, double value)
+   {
+      entries_[index].type = DoubleValue;
+      entries_[index].number.d = value;
+   }
+
+   void AssignInteger(size_t index, long long value)
+   {
+      entries_[index].type = IntValue;
+      entries_[index].number.i = value;
+   }
+
+   void AssignUnsigned(size_t index, unsigned long long value)
+   {
+      entries_[index].type = UIntValue;
+      entries_[index].number.u = value;
    }
 
-   std::map<std::string, MetadataTag*> tags_;
-   typedef std::map<std::string, MetadataTag*>::const_iterator TagIterator;
+   std::vector<Entry> entries_; // Sorted by qualified name
+   std::string arena_;          // Text referred to by entries_
+   size_t garbage_;             // Bytes of arena_ no longer referred to
+#endif // SWIG
 };
 
 #endif //_IMAGE_METADATA_H_
@@ -158,9 +158,8 @@ ImgBuffer& ImgBuffer::operator=(const ImgBuffer& img)
 
 void ImgBuffer::SetMetadata(const Metadata& md)
 {
-   //metadata_ = md;
-   // Serialize/Restore instead of =operator used to avoid object new/delete
-   // issues across the DLL boundary (on Windows)
-   // TODO: this is inefficient and should be revised
-    metadata_.Restore(md.Serialize().c_str());
+   // Assignment copies the tags without calling into the module that
+   // created md, so it is safe across the DLL boundary, and reuses the
+   // storage of metadata_.
+   metadata_ = md;
 }
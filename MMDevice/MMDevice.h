@@ -27,7 +27,7 @@
 // Header version
 // If any of the class definitions changes, the interface version
 // must be incremented
-#define DEVICE_INTERFACE_VERSION 69
+#define DEVICE_INTERFACE_VERSION 77
 ///////////////////////////////////////////////////////////////////////////////
 
 
@@ -553,6 +553,14 @@ namespace MM {
        */
       virtual void RemoveTag(const char* key) = 0;
 
+      /**
+       * Returns a number that changes whenever the tags returned by GetTags()
+       * change. The Core keeps the tags of each camera in parsed form and
+       * calls GetTags() again only when this number has changed, so that
+       * the tags need not be parsed for every image.
+       */
+      virtual long GetTagsRevision() = 0;
+
       /**
        * Returns whether a camera's exposure time can be sequenced.
        * If returning true, then a Camera adapter class should also inherit
@@ -878,6 +886,23 @@ namespace MM {
       // image processor API
       virtual int Process(unsigned char* buffer, unsigned width, unsigned height, unsigned byteDepth) = 0;
 
+      /**
+       * Returns true if each row of the image can be processed on its own.
+       * A band-safe processor may have Process() called concurrently on
+       * disjoint bands of rows of the same image, each band passed as an
+       * image of its own (buffer pointing to the first row of the band,
+       * height the number of rows in the band), and the result must be the
+       * same as when the whole image is processed at once.
+       */
+      virtual bool IsBandSafe() = 0;
+
+      /**
+       * Returns the dimensions of the image that Process() leaves in the
+       * buffer for an input image of the given dimensions, e.g. swapped for
+       * a transpose. The buffer is not resized, so outWidth * outHeight must
+       * equal width * height.
+       */
+      virtual int GetOutputImageSize(unsigned width, unsigned height, unsigned byteDepth, unsigned& outWidth, unsigned& outHeight) = 0;
 
    };
 
@@ -1314,7 +1339,17 @@ namespace MM {
       virtual int AcqFinished(const Device* caller, int statusCode) = 0;
       virtual int PrepareForAcq(const Device* caller) = 0;
       virtual int InsertImage(const Device* caller, const ImgBuffer& buf) = 0;
+      /**
+       * Insert an image with metadata in serialized form (see
+       * Metadata::Serialize()). The metadata must be parsed again by the
+       * Core; the overloads taking a Metadata pointer avoid this.
+       */
       virtual int InsertImage(const Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, const char* serializedMetadata, const bool doProcess = true) = 0;
+      /**
+       * Insert an image with metadata. The metadata is copied by the Core
+       * and may be reused by the caller for the next image.
+       */
+      virtual int InsertImage(const Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, const Metadata* md, const bool doProcess = true) = 0;
       virtual int InsertImage(const Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* md = 0, const bool doProcess = true) = 0;
       /// \deprecated Use the other forms instead.
       virtual int InsertImage(const Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const char* serializedMetadata, const bool doProcess = true) = 0;
@@ -1323,6 +1358,37 @@ namespace MM {
       /// \deprecated Use the other forms instead.
       virtual int InsertMultiChannel(const Device* caller, const unsigned char* buf, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, Metadata* md = 0) = 0;
 
+      /// Reserve a slot of the image buffer for writing an image in place.
+      /**
+       * This is the zero-copy alternative to InsertImage(): the camera
+       * renders or transfers the image directly into the returned buffer,
+       * then calls CommitImageSlot() (or AbortImageSlot()). Other cameras can
+       * insert images in the meantime; images are queued in the order they
+       * are committed. A camera holds at most one slot: acquiring another,
+       * or finishing the acquisition (AcqFinished()), gives up the slot it
+       * holds.
+       *
+       * \param[out] pixels - set to the slot's pixel buffer, which has room
+       *        for width * height * byteDepth bytes; null on error
+       * \return DEVICE_OK, DEVICE_BUFFER_OVERFLOW if the buffer is full,
+       *         DEVICE_INCOMPATIBLE_IMAGE if the buffer was not initialized
+       *         for the given dimensions, or DEVICE_UNSUPPORTED_COMMAND if
+       *         the buffer holds multi-channel images, which must be
+       *         inserted with InsertImage() or InsertMultiChannel()
+       */
+      virtual int AcquireImageSlot(const Device* caller, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, unsigned char** pixels) = 0;
+      /// Insert the image written into the slot reserved by AcquireImageSlot().
+      /**
+       * The image processor, if any, is applied in place when doProcess is
+       * true, as with InsertImage(). Returns DEVICE_BUFFER_OVERFLOW if the
+       * buffer filled up after the slot was acquired.
+       */
+      virtual int CommitImageSlot(const Device* caller, const Metadata* md, const bool doProcess = true) = 0;
+      /// Same as above, with metadata in serialized form.
+      virtual int CommitImageSlot(const Device* caller, const char* serializedMetadata, const bool doProcess = true) = 0;
+      /// Release the slot reserved by AcquireImageSlot() without inserting an image.
+      virtual void AbortImageSlot(const Device* caller) = 0;
+
       // autofocus
       // TODO This interface needs improvement: the caller pointer should be
       // passed, and it should be clarified whether the use of these methods is
@@ -1341,6 +1407,45 @@ namespace MM {
       virtual int GetCurrentConfig(const char* group, int bufLen, char* name) = 0;
       virtual int GetChannelConfig(char* channelConfigName, const unsigned int channelConfigIterator) = 0;
 
+      // sequence acquisition by the current camera, e.g. for an autofocus
+      // scoring the frames of a hardware-sequenced Z sweep as they arrive
+      /// Start a sequence acquisition of numImages images by the current camera.
+      /**
+       * The circular buffer is initialized and cleared first, as with
+       * CMMCore::startSequenceAcquisition(). The caller reads the images
+       * with LeaseNextImage(), through a reader cursor of its own: they also
+       * stay in the buffer for the application.
+       */
+      virtual int StartSequenceAcquisition(const Device* caller, long numImages, double intervalMs) = 0;
+      /// Stop the sequence acquisition, and the caller's reading of it.
+      virtual int StopSequenceAcquisition(const Device* caller) = 0;
+      /// Take the next image of the sequence acquisition started by the caller.
+      /**
+       * Waits up to timeoutMs for the image to arrive. The image is leased:
+       * its pixels stay valid, and the camera cannot overwrite them, until
+       * it is returned with ReleaseImage().
+       *
+       * \param[out] pixels - set to the image's pixels; null if no image
+       *        arrived in time
+       * \return the lease id, or -1 if no image arrived in time or the
+       *        caller has not started a sequence acquisition
+       */
+      virtual long long LeaseNextImage(const Device* caller, const unsigned char** pixels, unsigned& width, unsigned& height, unsigned& byteDepth, long timeoutMs) = 0;
+      virtual int ReleaseImage(const Device* caller, long long leaseId) = 0;
+      /// Copy the newest image of the current camera, without taking it out of the circular buffer.
+      /**
+       * Unlike LeaseNextImage(), this does not need a sequence acquisition
+       * started by the caller, so it can be used to sample a running
+       * acquisition (e.g. for focus tracking) without reading every frame.
+       *
+       * \param[out] imageNumber - set to the number of the image in the
+       *        stream inserted since the buffer was initialized; -1 if there
+       *        is no image in the buffer yet
+       * \return DEVICE_BUFFER_OVERFLOW if bufferSize is too small, in which
+       *        case width, height and byteDepth are set to those of the image
+       */
+      virtual int CopyNewestImage(const Device* caller, unsigned char* buffer, unsigned long bufferSize, unsigned& width, unsigned& height, unsigned& byteDepth, long long& imageNumber) = 0;
+
       // direct access to specific device types
       // TODO With the exception of GetParentHub(), these should be removed in
       // favor of methods providing indirect access to the required
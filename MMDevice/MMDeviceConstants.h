@@ -249,6 +249,13 @@ namespace MM {
       FocusDirectionAwayFromSample,
    };
 
+   // How finely the Core locks the devices of an adapter module
+   enum DeviceLockGranularity {
+      LockPerModule, // one lock for all devices of the module
+      LockPerHub,    // one lock for each hub with its peripherals; other devices share the module's
+      LockPerDevice  // one lock for each device
+   };
+
    //////////////////////////////////////////////////////////////////////////////
    // Notification constants
    //
@@ -58,6 +58,9 @@ public:
 // Registered devices in this module (device adapter library)
 static std::vector<DeviceInfo> g_registeredDevices;
 
+// Set by the module in InitializeModuleData()
+static MM::DeviceLockGranularity g_deviceLockGranularity = MM::LockPerModule;
+
 
 MODULE_API long GetModuleVersion()
 {
@@ -119,6 +122,12 @@ MODULE_API bool GetDeviceDescription(const char* deviceName, char* description,
    return true;
 }
 
+MODULE_API long GetDeviceLockGranularity()
+{
+   // Prefer long over enum across DLL boundary (see GetDeviceType())
+   return static_cast<long>(g_deviceLockGranularity);
+}
+
 void RegisterDevice(const char* deviceName, MM::DeviceType deviceType, const char* deviceDescription)
 {
    if (!deviceName)
@@ -135,3 +144,8 @@ void RegisterDevice(const char* deviceName, MM::DeviceType deviceType, const cha
 
    g_registeredDevices.push_back(DeviceInfo(deviceName, deviceType, deviceDescription));
 }
+
+void SetDeviceLockGranularity(MM::DeviceLockGranularity granularity)
+{
+   g_deviceLockGranularity = granularity;
+}
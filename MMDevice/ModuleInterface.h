@@ -49,7 +49,7 @@
 // If any of the exported module API calls (below) changes, the interface
 // version must be incremented. Note that the signature and name of
 // GetModuleVersion() must never change.
-#define MODULE_INTERFACE_VERSION 10
+#define MODULE_INTERFACE_VERSION 11
 
 
 /*
@@ -104,6 +104,7 @@ extern "C" {
    MODULE_API bool GetDeviceName(unsigned deviceIndex, char* name, unsigned bufferLength);
    MODULE_API bool GetDeviceType(const char* deviceName, int* type);
    MODULE_API bool GetDeviceDescription(const char* deviceName, char* name, unsigned bufferLength);
+   MODULE_API long GetDeviceLockGranularity();
 
    // Function pointer types for module interface functions
    // (Not for use by device adapters)
@@ -117,6 +118,7 @@ extern "C" {
    typedef bool (*fnGetDeviceName)(unsigned, char*, unsigned);
    typedef bool (*fnGetDeviceType)(const char*, int*);
    typedef bool (*fnGetDeviceDescription)(const char*, char*, unsigned);
+   typedef long (*fnGetDeviceLockGranularity)();
 #endif
 }
 
@@ -137,5 +139,31 @@ extern "C" {
  */
 void RegisterDevice(const char* deviceName, MM::DeviceType deviceType, const char* description);
 
+/// Allow the Core to lock the devices of this module individually.
+/**
+ * To be called in the device adapter module's implementation of
+ * InitializeModuleData().
+ *
+ * By default (MM::LockPerModule), the Core holds one lock for the whole
+ * module while it calls into any of its devices, so that e.g. moving a
+ * filter wheel blocks snapping an image from a camera of the same module.
+ * A module whose devices do not share unsynchronized state can choose
+ * MM::LockPerDevice. With MM::LockPerHub, each hub shares a lock with its
+ * peripherals (once their parent label is set), and devices without a hub
+ * keep the module lock; this suits hubs whose peripherals share the hub's
+ * communication state.
+ *
+ * Devices calling each other directly must still do their own locking.
+ *
+ * When a sequence acquisition ends, the Core closes the auto-shutter from
+ * the camera's thread. If the shutter shares the camera's lock (the same
+ * module locking per module, or the same hub), it does so without taking the
+ * lock, which could otherwise deadlock with the thread stopping the
+ * acquisition. A shutter with a lock of its own is closed under that lock.
+ *
+ * \see InitializeModuleData()
+ */
+void SetDeviceLockGranularity(MM::DeviceLockGranularity granularity);
+
 
 #endif //_MODULE_INTERFACE_H_
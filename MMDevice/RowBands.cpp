@@ -0,0 +1,130 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          RowBands.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Runs image processing on bands of rows in parallel
+// COPYRIGHT:     2017 Open Imaging, Inc.
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "RowBands.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <vector>
+
+namespace {
+
+struct Band
+{
+   RowBandTask* task;
+   unsigned beginRow;
+   unsigned endRow;
+#ifdef _WIN32
+   HANDLE thread;
+#else
+   pthread_t thread;
+#endif
+   bool started;
+};
+
+#ifdef _WIN32
+DWORD WINAPI BandThreadProc(void* param)
+#else
+void* BandThreadProc(void* param)
+#endif
+{
+   Band* band = static_cast<Band*>(param);
+   band->task->ProcessRows(band->beginRow, band->endRow);
+   return 0;
+}
+
+} // anonymous namespace
+
+
+void CRowBands::Run(RowBandTask& task, unsigned rowCount,
+      unsigned threadCount, unsigned minRowsPerBand)
+{
+   if (threadCount == 0)
+      threadCount = GetProcessorCount();
+   if (minRowsPerBand == 0)
+      minRowsPerBand = 1;
+   unsigned bandCount = rowCount / minRowsPerBand;
+   if (bandCount > threadCount)
+      bandCount = threadCount;
+   if (bandCount <= 1)
+   {
+      task.ProcessRows(0, rowCount);
+      return;
+   }
+
+   const unsigned rowsPerBand = (rowCount + bandCount - 1) / bandCount;
+   // Rounding up may leave fewer bands than threads: 513 rows in 32 bands of
+   // 17 rows make 31 bands
+   bandCount = (rowCount + rowsPerBand - 1) / rowsPerBand;
+   std::vector<Band> bands(bandCount);
+   for (unsigned i = 0; i < bandCount; ++i)
+   {
+      bands[i].task = &task;
+      bands[i].beginRow = i * rowsPerBand;
+      bands[i].endRow = (i + 1) * rowsPerBand < rowCount ?
+         (i + 1) * rowsPerBand : rowCount;
+      bands[i].started = false;
+   }
+
+   // If a thread cannot be started, its band is processed on this thread
+   for (unsigned i = 1; i < bandCount; ++i)
+   {
+#ifdef _WIN32
+      bands[i].thread = CreateThread(NULL, 0, BandThreadProc, &bands[i], 0, NULL);
+      bands[i].started = (bands[i].thread != NULL);
+#else
+      bands[i].started = (pthread_create(&bands[i].thread, NULL,
+               BandThreadProc, &bands[i]) == 0);
+#endif
+   }
+
+   task.ProcessRows(bands[0].beginRow, bands[0].endRow);
+
+   for (unsigned i = 1; i < bandCount; ++i)
+   {
+      if (!bands[i].started)
+      {
+         task.ProcessRows(bands[i].beginRow, bands[i].endRow);
+         continue;
+      }
+#ifdef _WIN32
+      WaitForSingleObject(bands[i].thread, INFINITE);
+      CloseHandle(bands[i].thread);
+#else
+      pthread_join(bands[i].thread, NULL);
+#endif
+   }
+}
+
+unsigned CRowBands::GetProcessorCount()
+{
+#ifdef _WIN32
+   SYSTEM_INFO info;
+   GetSystemInfo(&info);
+   return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+   long count = sysconf(_SC_NPROCESSORS_ONLN);
+   return count > 0 ? static_cast<unsigned>(count) : 1;
+#endif
+}
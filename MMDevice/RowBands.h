@@ -0,0 +1,63 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          RowBands.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Runs image processing on bands of rows in parallel
+// COPYRIGHT:     2017 Open Imaging, Inc.
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _ROWBANDS_H_
+#define _ROWBANDS_H_
+
+/**
+ * Work on a range of image rows, to be run by CRowBands::Run().
+ */
+class RowBandTask
+{
+public:
+   virtual ~RowBandTask() {}
+
+   /**
+    * Processes rows beginRow to endRow - 1. Called concurrently for
+    * disjoint ranges; must not throw.
+    */
+   virtual void ProcessRows(unsigned beginRow, unsigned endRow) = 0;
+};
+
+/**
+ * Splits image processing into contiguous bands of rows, run concurrently.
+ *
+ * Threads are started for each call and joined before it returns, so this
+ * is suited to work that takes at least a few hundred microseconds per
+ * frame. The calling thread processes the first band.
+ */
+class CRowBands
+{
+public:
+   /**
+    * Calls task.ProcessRows() for bands covering rows 0 to rowCount - 1,
+    * on up to threadCount threads (0 for one per processor), and waits
+    * for all of them. Bands have at least minRowsPerBand rows, so that
+    * small images are processed on the calling thread only.
+    */
+   static void Run(RowBandTask& task, unsigned rowCount,
+         unsigned threadCount = 0, unsigned minRowsPerBand = 16);
+
+   /**
+    * Returns the number of processors available, or 1 if it cannot be
+    * determined.
+    */
+   static unsigned GetProcessorCount();
+};
+
+#endif // _ROWBANDS_H_
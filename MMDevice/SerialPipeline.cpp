@@ -0,0 +1,160 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SerialPipeline.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Sends a batch of serial commands back to back and matches
+//                the answers to them in order
+// COPYRIGHT:     2017 Open Imaging, Inc.
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#include "SerialPipeline.h"
+
+namespace {
+
+// Same limit as CDeviceBase::GetSerialAnswer()
+const unsigned MAX_ANSWER_LENGTH = 2000;
+
+const std::string EMPTY_ANSWER;
+
+} // anonymous namespace
+
+
+CSerialPipeline::CSerialPipeline(const MM::Device* caller, MM::Core* core,
+      const char* portName) :
+   caller_(caller),
+   core_(core),
+   portName_(portName),
+   port_(0),
+   maxInFlight_(0),
+   executed_(0)
+{
+}
+
+CSerialPipeline::CSerialPipeline(MM::Serial* port) :
+   caller_(0),
+   core_(0),
+   port_(port),
+   maxInFlight_(0),
+   executed_(0)
+{
+}
+
+unsigned CSerialPipeline::Queue(const char* command, const char* sendTerm,
+      const char* answerTerm)
+{
+   Entry entry;
+   entry.command = command;
+   entry.sendTerm = sendTerm;
+   entry.answerTerm = answerTerm;
+   entry.status = DEVICE_ERR;
+   entries_.push_back(entry);
+   return (unsigned)(entries_.size() - 1);
+}
+
+int CSerialPipeline::Execute()
+{
+   size_t end = entries_.size();
+   size_t sent = executed_;
+   size_t received = executed_;
+   int result = DEVICE_OK;
+
+   while (received < end)
+   {
+      while (sent < end &&
+            (maxInFlight_ == 0 || sent - received < maxInFlight_))
+      {
+         int ret = Send(entries_[sent]);
+         if (ret != DEVICE_OK)
+         {
+            // Answers to the commands already sent are still read
+            Fail(sent, end, ret);
+            if (result == DEVICE_OK)
+               result = ret;
+            end = sent;
+            break;
+         }
+         ++sent;
+      }
+      if (received == sent)
+         break;
+
+      int ret = Receive(entries_[received]);
+      if (ret != DEVICE_OK)
+      {
+         Fail(received, end, ret);
+         result = ret;
+         break;
+      }
+      ++received;
+   }
+
+   executed_ = entries_.size();
+   return result;
+}
+
+int CSerialPipeline::GetStatus(unsigned tag) const
+{
+   if (tag >= entries_.size())
+      return DEVICE_INVALID_INPUT_PARAM;
+   return entries_[tag].status;
+}
+
+const std::string& CSerialPipeline::GetAnswer(unsigned tag) const
+{
+   if (tag >= entries_.size())
+      return EMPTY_ANSWER;
+   return entries_[tag].answer;
+}
+
+void CSerialPipeline::Clear()
+{
+   entries_.clear();
+   executed_ = 0;
+}
+
+int CSerialPipeline::Send(const Entry& entry)
+{
+   if (port_)
+      return port_->SetCommand(entry.command.c_str(), entry.sendTerm.c_str());
+   if (!core_)
+      return DEVICE_NO_CALLBACK_REGISTERED;
+   return core_->SetSerialCommand(caller_, portName_.c_str(),
+         entry.command.c_str(), entry.sendTerm.c_str());
+}
+
+int CSerialPipeline::Receive(Entry& entry)
+{
+   char buf[MAX_ANSWER_LENGTH];
+   int ret;
+   if (port_)
+      ret = port_->GetAnswer(buf, MAX_ANSWER_LENGTH, entry.answerTerm.c_str());
+   else if (core_)
+      ret = core_->GetSerialAnswer(caller_, portName_.c_str(),
+            MAX_ANSWER_LENGTH, buf, entry.answerTerm.c_str());
+   else
+      ret = DEVICE_NO_CALLBACK_REGISTERED;
+
+   entry.status = ret;
+   if (ret == DEVICE_OK)
+      entry.answer = buf;
+   return ret;
+}
+
+void CSerialPipeline::Fail(size_t begin, size_t end, int status)
+{
+   for (size_t i = begin; i < end; ++i)
+   {
+      entries_[i].status = status;
+      entries_[i].answer.clear();
+   }
+}
@@ -0,0 +1,128 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SerialPipeline.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Sends a batch of serial commands back to back and matches
+//                the answers to them in order
+// COPYRIGHT:     2017 Open Imaging, Inc.
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+
+#ifndef _SERIALPIPELINE_H_
+#define _SERIALPIPELINE_H_
+
+#include "MMDevice.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Queue of commands for a controller that answers each command, in the
+ * order received, with one terminated reply.
+ *
+ * Instead of writing a command and waiting for its answer before writing
+ * the next, Execute() writes the queued commands back to back and then
+ * reads the answers first in, first out, so that a batch of queries costs
+ * about one round trip to the controller. Each queued command gets a tag
+ * with which its answer and status are looked up afterwards.
+ *
+ * Answers are matched by position only, so a command the controller does
+ * not answer shifts the answers to the commands queued after it; pipeline
+ * only commands that are always answered, or use SetMaxInFlight(1).
+ *
+ * Not thread safe; callers serialize access to the port as they would
+ * for single queries.
+ */
+class CSerialPipeline
+{
+public:
+   /**
+    * Pipeline for the port portName, reached through the core on behalf
+    * of the device caller.
+    */
+   CSerialPipeline(const MM::Device* caller, MM::Core* core,
+         const char* portName);
+
+   /**
+    * Pipeline writing to a port directly, for use without a core.
+    */
+   explicit CSerialPipeline(MM::Serial* port);
+
+   /**
+    * Limits the number of commands written ahead of the answer being
+    * read, for controllers with small input buffers (0, the default,
+    * for no limit).
+    */
+   void SetMaxInFlight(unsigned count) { maxInFlight_ = count; }
+
+   /**
+    * Queues command, to be sent followed by sendTerm, whose answer ends
+    * with answerTerm. Returns the tag of the command.
+    */
+   unsigned Queue(const char* command, const char* sendTerm,
+         const char* answerTerm);
+
+   /**
+    * Sends the commands queued since the last call and reads their
+    * answers. Returns DEVICE_OK, or the first error encountered; once
+    * an answer cannot be read, the commands after it fail with the same
+    * error, since later answers can no longer be matched to them, and
+    * the caller should purge the port.
+    */
+   int Execute();
+
+   /**
+    * Returns the number of commands queued since the last Clear().
+    */
+   unsigned GetCount() const { return (unsigned)entries_.size(); }
+
+   /**
+    * Returns DEVICE_OK if the answer to the command tagged tag was read,
+    * or the error that prevented it (DEVICE_ERR before Execute()).
+    */
+   int GetStatus(unsigned tag) const;
+
+   /**
+    * Returns the answer to the command tagged tag, without the
+    * terminator, or an empty string if it was not read.
+    */
+   const std::string& GetAnswer(unsigned tag) const;
+
+   /**
+    * Removes all commands; tags start at 0 again.
+    */
+   void Clear();
+
+private:
+   struct Entry
+   {
+      std::string command;
+      std::string sendTerm;
+      std::string answerTerm;
+      std::string answer;
+      int status;
+   };
+
+   int Send(const Entry& entry);
+   int Receive(Entry& entry);
+   void Fail(size_t begin, size_t end, int status);
+
+   const MM::Device* caller_;
+   MM::Core* core_;
+   std::string portName_;
+   MM::Serial* port_;
+   unsigned maxInFlight_;
+   std::vector<Entry> entries_;
+   size_t executed_;
+};
+
+#endif // _SERIALPIPELINE_H_
@@ -0,0 +1,167 @@
+#include <gtest/gtest.h>
+
+#include "Debayer.h"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+
+namespace {
+
+const int replication = 0;
+const int bilinear = 1;
+const int malvar = 3;
+
+// Mosaic with constant red, green and blue values, laid out like the
+// replication algorithm expects for the given row order
+std::vector<unsigned short> MakeMosaic(int width, int height, int rowOrder,
+      unsigned short red, unsigned short green, unsigned short blue)
+{
+   // Position of the site stored as red (third byte of RGB32)
+   static const int redX[4] = { 0, 1, 0, 1 };
+   static const int redY[4] = { 0, 1, 1, 0 };
+   std::vector<unsigned short> mosaic(width * height);
+   for (int y = 0; y < height; ++y)
+   {
+      for (int x = 0; x < width; ++x)
+      {
+         bool redColumn = ((x & 1) == redX[rowOrder]);
+         bool redRow = ((y & 1) == redY[rowOrder]);
+         unsigned short v = green;
+         if (redRow && redColumn)
+            v = red;
+         else if (!redRow && !redColumn)
+            v = blue;
+         mosaic[y * width + x] = v;
+      }
+   }
+   return mosaic;
+}
+
+void ExpectPixel(const ImgBuffer& out, int x, int y, unsigned char red,
+      unsigned char green, unsigned char blue)
+{
+   const unsigned char* p = out.GetPixels() + 4 * (y * out.Width() + x);
+   ASSERT_EQ(blue, p[0]) << "at " << x << ", " << y;
+   ASSERT_EQ(green, p[1]) << "at " << x << ", " << y;
+   ASSERT_EQ(red, p[2]) << "at " << x << ", " << y;
+}
+
+} // anonymous namespace
+
+
+TEST(DebayerTests, InterpolationIsExactForUniformColor)
+{
+   const int width = 17;
+   const int height = 12;
+   for (int rowOrder = 0; rowOrder < 4; ++rowOrder)
+   {
+      std::vector<unsigned short> mosaic =
+         MakeMosaic(width, height, rowOrder, 200 << 4, 100 << 4, 50 << 4);
+      const int algorithms[] = { replication, bilinear, malvar };
+      for (int a = 0; a < 3; ++a)
+      {
+         Debayer debayer;
+         debayer.SetOrderIndex(rowOrder);
+         debayer.SetAlgorithmIndex(algorithms[a]);
+         ImgBuffer out;
+         ASSERT_EQ(DEVICE_OK, debayer.Process(out, &mosaic[0], width, height, 12));
+         // Replication does not fill the edges
+         int margin = algorithms[a] == replication ? 1 : 0;
+         for (int y = margin; y < height - margin; ++y)
+            for (int x = margin; x < width - margin; ++x)
+               ExpectPixel(out, x, y, 200, 100, 50);
+      }
+   }
+}
+
+
+TEST(DebayerTests, EightBitInput)
+{
+   const int width = 8;
+   const int height = 8;
+   std::vector<unsigned char> mosaic(width * height, 77);
+   Debayer debayer;
+   debayer.SetAlgorithmIndex(malvar);
+   ImgBuffer out;
+   ASSERT_EQ(DEVICE_OK, debayer.Process(out, &mosaic[0], width, height, 8));
+   for (int y = 0; y < height; ++y)
+      for (int x = 0; x < width; ++x)
+         ExpectPixel(out, x, y, 77, 77, 77);
+}
+
+
+TEST(DebayerTests, ThreadingDoesNotChangeTheResult)
+{
+   const int width = 64;
+   const int height = 100;
+   std::vector<unsigned short> mosaic(width * height);
+   srand(1);
+   for (size_t i = 0; i < mosaic.size(); ++i)
+      mosaic[i] = (unsigned short)(rand() % 4096);
+
+   const int algorithms[] = { bilinear, malvar };
+   for (int a = 0; a < 2; ++a)
+   {
+      Debayer debayer;
+      debayer.SetAlgorithmIndex(algorithms[a]);
+      ImgBuffer single, banded;
+      debayer.SetThreadCount(1);
+      ASSERT_EQ(DEVICE_OK, debayer.Process(single, &mosaic[0], width, height, 12));
+      debayer.SetThreadCount(4);
+      ASSERT_EQ(DEVICE_OK, debayer.Process(banded, &mosaic[0], width, height, 12));
+      ASSERT_EQ(0, memcmp(single.GetPixels(), banded.GetPixels(),
+               width * height * 4));
+   }
+}
+
+
+// Throughput in megapixels per second; run with
+// --gtest_also_run_disabled_tests
+TEST(DebayerTests, DISABLED_Benchmark)
+{
+   const int width = 2048;
+   const int height = 2048;
+   const int repeats = 5;
+   std::vector<unsigned short> mosaic(width * height);
+   for (size_t i = 0; i < mosaic.size(); ++i)
+      mosaic[i] = (unsigned short)(i % 4096);
+
+   const int algorithms[] = { replication, bilinear, malvar };
+   const int threadCounts[] = { 1, 0 };
+   for (int a = 0; a < 3; ++a)
+   {
+      for (int t = 0; t < 2; ++t)
+      {
+         if (algorithms[a] == replication && threadCounts[t] != 1)
+            continue;
+         Debayer debayer;
+         debayer.SetAlgorithmIndex(algorithms[a]);
+         debayer.SetThreadCount(threadCounts[t]);
+         ImgBuffer out;
+         debayer.Process(out, &mosaic[0], width, height, 12);
+
+         boost::posix_time::ptime start =
+            boost::posix_time::microsec_clock::universal_time();
+         for (int i = 0; i < repeats; ++i)
+            debayer.Process(out, &mosaic[0], width, height, 12);
+         double seconds = (boost::posix_time::microsec_clock::universal_time() -
+               start).total_microseconds() / 1e6;
+         std::cout << debayer.GetAlgorithms()[algorithms[a]] << " (" <<
+            (threadCounts[t] == 0 ? "all processors" : "1 thread") << "): " <<
+            repeats * (double)width * height / 1e6 / seconds << " MP/s" <<
+            std::endl;
+      }
+   }
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
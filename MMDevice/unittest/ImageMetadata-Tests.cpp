@@ -0,0 +1,204 @@
+#include <gtest/gtest.h>
+
+#include "ImageMetadata.h"
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+TEST(ImageMetadataTests, PutAndGetImageTags)
+{
+   Metadata md;
+   md.PutImageTag("Camera", "Cam");
+   md.PutImageTag("Width", 512u);
+   md.PutImageTag("ElapsedTime-ms", 12.5);
+   md.PutImageTag("SomeCustomTag", -3L);
+
+   ASSERT_TRUE(md.HasTag("Camera"));
+   ASSERT_FALSE(md.HasTag("Height"));
+   ASSERT_EQ("Cam", md.GetSingleTag("Camera").GetValue());
+   ASSERT_EQ("512", md.GetSingleTag("Width").GetValue());
+   ASSERT_EQ("12.5", md.GetSingleTag("ElapsedTime-ms").GetValue());
+   ASSERT_EQ("-3", md.GetSingleTag("SomeCustomTag").GetValue());
+   ASSERT_EQ("_", md.GetSingleTag("Width").GetDevice());
+   ASSERT_EQ("Width", md.GetSingleTag("Width").GetName());
+   ASSERT_THROW(md.GetSingleTag("Height"), MetadataKeyError);
+}
+
+
+TEST(ImageMetadataTests, NumbersAreFormattedLikeStreams)
+{
+   const double doubles[] = { 0.1, 1.0 / 3.0, 1e-7, 123456789.0, -0.0 };
+   for (unsigned i = 0; i < sizeof(doubles) / sizeof(doubles[0]); ++i)
+   {
+      Metadata md;
+      md.PutImageTag("Value", doubles[i]);
+      std::ostringstream os;
+      os << doubles[i];
+      ASSERT_EQ(os.str(), md.GetSingleTag("Value").GetValue());
+   }
+
+   Metadata md;
+   md.PutImageTag("Float", 0.1f);
+   md.PutImageTag("Bool", true);
+   md.PutImageTag("Char", 'x');
+   md.PutImageTag("ULL", 18446744073709551615ULL);
+   ASSERT_EQ("0.1", md.GetSingleTag("Float").GetValue());
+   ASSERT_EQ("1", md.GetSingleTag("Bool").GetValue());
+   ASSERT_EQ("x", md.GetSingleTag("Char").GetValue());
+   ASSERT_EQ("18446744073709551615", md.GetSingleTag("ULL").GetValue());
+}
+
+
+TEST(ImageMetadataTests, KeysAreSortedLikeStdMap)
+{
+   const char* keys[] = { "Width", "Camera-Binning", "ZZZ", "Binning", "aaa",
+      "ROI-X-start", "Camera", "ROI", "ImageNumber", "Camera-Exposure" };
+   const unsigned n = sizeof(keys) / sizeof(keys[0]);
+
+   Metadata md;
+   for (unsigned i = 0; i < n; ++i)
+      md.PutImageTag(keys[i], i);
+
+   std::vector<std::string> expected(keys, keys + n);
+   std::sort(expected.begin(), expected.end());
+   ASSERT_EQ(expected, md.GetKeys());
+}
+
+
+TEST(ImageMetadataTests, DeviceTagsUseQualifiedNames)
+{
+   Metadata md;
+   md.PutTag("Binning", "Camera", 2);
+   md.PutImageTag("Binning", 4);
+   ASSERT_EQ(2u, md.GetKeys().size());
+
+   MetadataSingleTag tag = md.GetSingleTag("Camera-Binning");
+   ASSERT_EQ("Binning", tag.GetName());
+   ASSERT_EQ("Camera", tag.GetDevice());
+   ASSERT_EQ("2", tag.GetValue());
+   ASSERT_EQ("4", md.GetSingleTag("Binning").GetValue());
+}
+
+
+TEST(ImageMetadataTests, SetTagReplacesAndRemoveTagRemoves)
+{
+   Metadata md;
+   MetadataSingleTag tag("Exposure", "Camera", false);
+   tag.SetValue("10");
+   md.SetTag(tag);
+   tag.SetValue("20");
+   md.SetTag(tag);
+   ASSERT_EQ(1u, md.GetKeys().size());
+   ASSERT_EQ("20", md.GetSingleTag("Camera-Exposure").GetValue());
+   ASSERT_FALSE(md.GetSingleTag("Camera-Exposure").IsReadOnly());
+
+   md.RemoveTag("Camera-Exposure");
+   ASSERT_FALSE(md.HasTag("Camera-Exposure"));
+   md.RemoveTag("NoSuchTag");
+   ASSERT_TRUE(md.GetKeys().empty());
+}
+
+
+TEST(ImageMetadataTests, SerializeAndRestoreRoundTrip)
+{
+   Metadata md;
+   md.PutImageTag("Camera", "Cam 1");
+   md.PutImageTag("Height", 256);
+   md.PutTag("Gain", "Cam 1", 1.5);
+   MetadataArrayTag array;
+   array.SetName("Positions");
+   array.SetDevice("_");
+   array.AddValue("1.0");
+   array.AddValue("2.0");
+   md.SetTag(array);
+
+   Metadata restored;
+   ASSERT_TRUE(restored.Restore(md.Serialize().c_str()));
+   ASSERT_EQ(md.GetKeys(), restored.GetKeys());
+   ASSERT_EQ("Cam 1", restored.GetSingleTag("Camera").GetValue());
+   ASSERT_EQ("256", restored.GetSingleTag("Height").GetValue());
+   ASSERT_EQ("1.5", restored.GetSingleTag("Cam 1-Gain").GetValue());
+   MetadataArrayTag restoredArray = restored.GetArrayTag("Positions");
+   ASSERT_EQ(2u, restoredArray.GetSize());
+   ASSERT_EQ("2.0", restoredArray.GetValue(1));
+   ASSERT_THROW(restored.GetSingleTag("Positions"), MetadataKeyError);
+   ASSERT_EQ(md.Serialize(), restored.Serialize());
+}
+
+
+TEST(ImageMetadataTests, SerializedFormatIsUnchanged)
+{
+   Metadata md;
+   md.PutImageTag("Camera", "Cam");
+   md.PutTag("Binning", "Cam", 2);
+   ASSERT_EQ("2s\nBinning\nCam\n1\n2\ns\nCamera\n_\n1\nCam\n",
+         md.Serialize());
+
+   Metadata restored;
+   ASSERT_TRUE(restored.Restore("1s\nExposure\nCam\n0\n10.5\n"));
+   ASSERT_EQ("10.5", restored.GetSingleTag("Cam-Exposure").GetValue());
+   ASSERT_FALSE(restored.Restore("1x\n"));
+}
+
+
+TEST(ImageMetadataTests, CopiesAreIndependent)
+{
+   Metadata md;
+   md.PutImageTag("Camera", "A");
+   Metadata copy(md);
+   Metadata assigned;
+   assigned.PutImageTag("Other", 1);
+   assigned = md;
+   md.PutImageTag("Camera", "B");
+
+   ASSERT_EQ("A", copy.GetSingleTag("Camera").GetValue());
+   ASSERT_EQ("A", assigned.GetSingleTag("Camera").GetValue());
+   ASSERT_FALSE(assigned.HasTag("Other"));
+   ASSERT_EQ("B", md.GetSingleTag("Camera").GetValue());
+}
+
+
+TEST(ImageMetadataTests, MergeOverwritesExistingTags)
+{
+   Metadata md;
+   md.PutImageTag("Camera", "A");
+   md.PutImageTag("Width", 10);
+
+   Metadata other;
+   other.PutImageTag("Width", 20);
+   other.PutTag("Gain", "A", 3.5);
+   md.Merge(other);
+   md.Merge(md);
+
+   ASSERT_EQ(3u, md.GetKeys().size());
+   ASSERT_EQ("A", md.GetSingleTag("Camera").GetValue());
+   ASSERT_EQ("20", md.GetSingleTag("Width").GetValue());
+   ASSERT_EQ("3.5", md.GetSingleTag("A-Gain").GetValue());
+}
+
+
+TEST(ImageMetadataTests, RepeatedUpdatesDoNotLoseTags)
+{
+   // Enough updates to trigger compaction of the text storage
+   Metadata md;
+   md.PutImageTag("Camera", "Cam");
+   md.PutTag("Label", "Cam", "constant");
+   for (int i = 0; i < 10000; ++i)
+      md.PutImageTag("Comment", std::string(20, 'a' + (i % 26)));
+
+   ASSERT_EQ(3u, md.GetKeys().size());
+   ASSERT_EQ("Cam", md.GetSingleTag("Camera").GetValue());
+   ASSERT_EQ("constant", md.GetSingleTag("Cam-Label").GetValue());
+   ASSERT_EQ(std::string(20, 'a' + (9999 % 26)),
+         md.GetSingleTag("Comment").GetValue());
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}
@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+
+#include "DeviceThreads.h"
+#include "RowBands.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+
+namespace {
+
+// Counts how many times each row is processed
+class RowCounter : public RowBandTask
+{
+public:
+   RowCounter(unsigned rowCount) : counts_(rowCount, 0) {}
+
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      for (unsigned row = beginRow; row < endRow; ++row)
+         ++counts_[row];
+   }
+
+   const std::vector<int>& Counts() const { return counts_; }
+
+private:
+   std::vector<int> counts_;
+};
+
+// Records the bands it is given
+class BandRecorder : public RowBandTask
+{
+public:
+   void ProcessRows(unsigned beginRow, unsigned endRow)
+   {
+      MMThreadGuard g(lock_);
+      bands_.push_back(std::make_pair(beginRow, endRow));
+   }
+
+   std::vector< std::pair<unsigned, unsigned> > SortedBands()
+   {
+      MMThreadGuard g(lock_);
+      std::vector< std::pair<unsigned, unsigned> > bands(bands_);
+      std::sort(bands.begin(), bands.end());
+      return bands;
+   }
+
+private:
+   MMThreadLock lock_;
+   std::vector< std::pair<unsigned, unsigned> > bands_;
+};
+
+} // anonymous namespace
+
+
+TEST(RowBandsTests, EveryRowIsProcessedOnce)
+{
+   const unsigned rowCounts[] = { 0, 1, 15, 16, 17, 100, 1023 };
+   const unsigned threadCounts[] = { 0, 1, 2, 3, 8 };
+   for (unsigned i = 0; i < sizeof(rowCounts) / sizeof(rowCounts[0]); ++i)
+   {
+      for (unsigned j = 0; j < sizeof(threadCounts) / sizeof(threadCounts[0]); ++j)
+      {
+         RowCounter counter(rowCounts[i]);
+         CRowBands::Run(counter, rowCounts[i], threadCounts[j], 4);
+         for (unsigned row = 0; row < rowCounts[i]; ++row)
+            ASSERT_EQ(1, counter.Counts()[row]) << "row " << row << " of " <<
+               rowCounts[i] << " with " << threadCounts[j] << " threads";
+      }
+   }
+}
+
+
+TEST(RowBandsTests, BandsAreNonEmptyAndTileTheImage)
+{
+   // Sizes for which rounding the band height up leaves threads without rows
+   const unsigned sizes[][2] = {
+      { 513, 32 }, { 1100, 64 }, { 100, 48 }, { 65, 64 }, { 1023, 7 },
+   };
+   for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+   {
+      const unsigned rowCount = sizes[i][0];
+      BandRecorder recorder;
+      CRowBands::Run(recorder, rowCount, sizes[i][1], 1);
+      std::vector< std::pair<unsigned, unsigned> > bands = recorder.SortedBands();
+      ASSERT_FALSE(bands.empty());
+      unsigned nextRow = 0;
+      for (unsigned b = 0; b < bands.size(); ++b)
+      {
+         ASSERT_EQ(nextRow, bands[b].first) << rowCount << " rows, " <<
+            sizes[i][1] << " threads";
+         ASSERT_LT(bands[b].first, bands[b].second) << rowCount << " rows, " <<
+            sizes[i][1] << " threads";
+         ASSERT_LE(bands[b].second, rowCount);
+         nextRow = bands[b].second;
+      }
+      ASSERT_EQ(rowCount, nextRow);
+   }
+}
+
+
+TEST(RowBandsTests, ProcessorCountIsPositive)
+{
+   ASSERT_GE(CRowBands::GetProcessorCount(), 1u);
+}
+
+
+int main(int argc, char **argv)
+{
+   ::testing::InitGoogleTest(&argc, argv);
+   return RUN_ALL_TESTS();
+}